@@ -0,0 +1,714 @@
+#include <iostream>
+#include "vfs/VirtualFileSystem.h"
+#include "vfs/native/NativeFileSystem.h"
+#include "vfs/memory/MemoryFileSystem.h"
+#include "vfs/pack/PackFileSystem.h"
+#include "vfs/io/ThreadPoolIOEngine.h"
+#include "vfs/io/UringIOEngine.h"
+
+#include <assert.h>
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <string.h>
+
+USING_NS_VFS;
+
+class Timer
+{
+public:
+	Timer() : m_begin(std::chrono::steady_clock::now()) {}
+
+	double seconds() const { return std::chrono::duration<double>(std::chrono::steady_clock::now() - m_begin).count(); }
+
+private:
+	std::chrono::steady_clock::time_point m_begin;
+};
+
+void createBenchFile(const std::string& path, uint64_t size)
+{
+	if (std::filesystem::exists(path) && std::filesystem::file_size(path) == size)
+		return;
+
+	std::filesystem::create_directories(std::filesystem::path(path).parent_path());
+	std::ofstream file(path, std::ios::binary | std::ios::trunc);
+	std::vector<char> block(1024 * 1024);
+	std::mt19937 rng(1);
+	for (auto& c : block)
+		c = (char)rng();
+	for (uint64_t written = 0; written < size; written += block.size())
+		file.write(block.data(), block.size());
+}
+
+// Writes a pack with every entry stored or every entry gzipped, a blockSize makes it a version 1 pack
+// compressing gzipped entries in blocks
+void writePackFile(const std::string& path, const std::vector<std::pair<std::string, std::vector<uint8_t>>>& files, bool gzip = false, uint32_t dataSecret = 0,
+	uint32_t blockSize = 0)
+{
+	auto putBigEndian = [](std::string& out, uint64_t value, int bytes) {
+		for (int i = bytes - 1; i >= 0; --i)
+			out.push_back(char(value >> (i * 8)));
+	};
+
+	std::string data, index;
+	uint64_t offset = 28;
+	auto compress = [](const char* data, size_t len) {
+		uint64_t compressedLen = 0;
+		char* compressed = pack::compressData(data, len, compressedLen);
+		std::string content(compressed, compressedLen);
+		free(compressed);
+		return content;
+	};
+
+	for (auto& file : files)
+	{
+		std::string content(reinterpret_cast<const char*>(file.second.data()), file.second.size());
+		std::vector<uint64_t> blocks;
+		if (gzip && blockSize > 0)
+		{
+			// blocks that do not shrink are stored
+			std::string compressed;
+			for (size_t pos = 0; pos < content.size(); pos += blockSize)
+			{
+				size_t len = std::min<size_t>(blockSize, content.size() - pos);
+				auto block = compress(content.data() + pos, len);
+				compressed.append(block.size() < len ? block : content.substr(pos, len));
+				blocks.push_back(std::min(block.size(), len));
+			}
+			content.swap(compressed);
+		}
+		else if (gzip)
+		{
+			content = compress(content.data(), content.size());
+		}
+		pack::xorContent(dataSecret, content.data(), content.size());
+		data.append(content);
+		putBigEndian(index, offset, 8);
+		if (blockSize > 0)
+		{
+			putBigEndian(index, content.size(), 8);
+			putBigEndian(index, file.second.size(), 8);
+			putBigEndian(index, gzip ? PackFileCompressionType::Gzip : PackFileCompressionType::None, 1);
+			putBigEndian(index, gzip ? blockSize : 0, 4);
+			putBigEndian(index, file.first.size(), 2);
+			index.append(file.first);
+			for (auto length : blocks)
+				putBigEndian(index, length, 4);
+		}
+		else
+		{
+			putBigEndian(index, content.size(), 4);
+			putBigEndian(index, file.first.size(), 1);
+			putBigEndian(index, gzip ? PackFileCompressionType::Gzip : PackFileCompressionType::None, 1);
+			index.append(file.first);
+		}
+		offset += content.size();
+	}
+
+	std::string header = "PACK";
+	putBigEndian(header, blockSize > 0 ? 1 : 0, 4);
+	putBigEndian(header, 0, 4);
+	putBigEndian(header, dataSecret, 4);
+	putBigEndian(header, offset, 8);
+	putBigEndian(header, 0, 4);
+
+	std::ofstream file(path, std::ios::binary | std::ios::trunc);
+	file << header << data << index;
+}
+
+std::vector<uint64_t> randomOffsets(size_t count, uint64_t fileSize, uint64_t blockSize)
+{
+	std::mt19937_64 rng(42);
+	std::vector<uint64_t> offsets(count);
+	for (auto& offset : offsets)
+		offset = (rng() % (fileSize / blockSize)) * blockSize;
+	return offsets;
+}
+
+//////////////////////////////////////////////////////////////////////////
+// io engine: random 4KB reads at queue depths 1-256
+void ioEngineBench()
+{
+	const uint64_t fileSize = 64 * 1024 * 1024;
+	const uint64_t blockSize = 4096;
+	const size_t readCount = 32768;
+
+	createBenchFile("./bench-data/random.bin", fileSize);
+	auto offsets = randomOffsets(readCount, fileSize, blockSize);
+
+	printf("\nio engine: %zu random %llu byte reads\n", readCount, (unsigned long long)blockSize);
+	printf("%-24s %8s %12s\n", "engine", "depth", "kiops");
+
+	// blocking path: one synchronous stream read after another
+	{
+		VirtualFileSystem virtualFileSystem;
+		virtualFileSystem.mount(new NativeFileSystem("./bench-data", "/bench"));
+		auto stream = virtualFileSystem.openFileStream("/bench/random.bin", FileStream::Mode::READ);
+		std::vector<uint8_t> buf(blockSize);
+
+		Timer timer;
+		for (auto offset : offsets)
+		{
+			stream->seek(offset, FileStream::SeekOrigin::SET);
+			stream->read(buf.data(), blockSize);
+		}
+		printf("%-24s %8d %12.1f\n", "blocking", 1, readCount / timer.seconds() / 1000.0);
+	}
+
+	// "vfs" rows go through VirtualFileSystem::readAsync and include path resolution,
+	// the others submit straight to the engine
+	std::vector<std::pair<std::string, std::shared_ptr<IOEngine>>> engines;
+	engines.push_back(std::make_pair("threadpool vfs", std::make_shared<ThreadPoolIOEngine>(8)));
+	engines.push_back(std::make_pair("threadpool", std::make_shared<ThreadPoolIOEngine>(8)));
+#if VFS_HAS_IO_URING
+	if (auto uring = UringIOEngine::create(256))
+		engines.push_back(std::make_pair("io_uring vfs", uring));
+	if (auto uring = UringIOEngine::create(256))
+		engines.push_back(std::make_pair("io_uring", uring));
+	if (auto uring = UringIOEngine::create(256))
+		engines.push_back(std::make_pair("io_uring fixed buffers", uring));
+#endif
+
+	for (auto& it : engines)
+	{
+		auto& engine = it.second;
+		bool throughVfs = it.first.find("vfs") != std::string::npos;
+		bool fixedBuffers = it.first.find("fixed") != std::string::npos;
+
+		VirtualFileSystem virtualFileSystem;
+		virtualFileSystem.setIOEngine(engine);
+		virtualFileSystem.mount(new NativeFileSystem("./bench-data", "/bench"));
+
+		std::vector<uint8_t> buffers(256 * blockSize);
+		if (fixedBuffers)
+			engine->registerBuffers({ IOBuffer{ buffers.data(), buffers.size() } });
+
+		int file = engine->openFile("./bench-data/random.bin");
+		for (uint32_t depth = 1; depth <= 256; depth *= 2)
+		{
+			std::vector<IORequest> ioRequests;
+			std::vector<AsyncReadRequest> requests;
+
+			Timer timer;
+			for (size_t i = 0; i < readCount; i += depth)
+			{
+				// keep `depth` reads in flight, submitted as one batch
+				size_t batch = std::min<size_t>(depth, readCount - i);
+				for (size_t j = 0; j < batch; ++j)
+				{
+					if (!throughVfs)
+					{
+						IORequest request;
+						request.file = file;
+						request.offset = offsets[i + j];
+						request.buf = buffers.data() + j * blockSize;
+						request.len = (uint32_t)blockSize;
+						request.bufIndex = fixedBuffers ? 0 : -1;
+						ioRequests.push_back(std::move(request));
+					}
+					else
+					{
+						AsyncReadRequest request;
+						request.filePath = "/bench/random.bin";
+						request.offset = offsets[i + j];
+						request.buf = buffers.data() + j * blockSize;
+						request.len = blockSize;
+						requests.push_back(std::move(request));
+					}
+				}
+
+				if (!throughVfs)
+					engine->submit(ioRequests);
+				else
+					virtualFileSystem.readAsync(requests);
+				requests.clear();
+				engine->drain();
+			}
+			printf("%-24s %8u %12.1f\n", it.first.c_str(), depth, readCount / timer.seconds() / 1000.0);
+		}
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////
+// memory file: random 4KB reads from 1-16 threads, lock free reads against a global mutex
+void memoryReadScalingBench()
+{
+	const uint64_t fileSize = 64 * 1024 * 1024;
+	const uint64_t blockSize = 4096;
+	const size_t readsPerThread = 200000;
+
+	VirtualFileSystem virtualFileSystem;
+	virtualFileSystem.mount(new MemoryFileSystem("", "/mem"));
+	{
+		auto stream = virtualFileSystem.openFileStream("/mem/random.bin", FileStream::Mode::WRITE);
+		std::vector<uint8_t> block(1024 * 1024);
+		std::mt19937 rng(1);
+		for (auto& c : block)
+			c = (uint8_t)rng();
+		for (uint64_t written = 0; written < fileSize; written += block.size())
+			stream->write(block.data(), block.size());
+	}
+	auto offsets = randomOffsets(readsPerThread, fileSize, blockSize);
+
+	printf("\nmemory read scaling: %zu random %llu byte reads per thread\n", readsPerThread, (unsigned long long)blockSize);
+	printf("%-24s %8s %12s\n", "mode", "threads", "mops");
+
+	const char* modes[] = { "lock free", "global mutex", "lock free + writer" };
+	for (auto mode : modes)
+	{
+		bool locked = strcmp(mode, "global mutex") == 0;
+		bool withWriter = strcmp(mode, "lock free + writer") == 0;
+		for (int threads = 1; threads <= 16; threads *= 2)
+		{
+			std::mutex mutex;
+			std::atomic<bool> stop(false);
+			std::thread writer;
+			if (withWriter)
+			{
+				// keeps overwriting random blocks, readers overlapping them retry
+				writer = std::thread([&]() {
+					auto stream = virtualFileSystem.openFileStream("/mem/random.bin", FileStream::Mode::WRITE);
+					std::vector<uint8_t> block(blockSize, 0x5A);
+					size_t i = 0;
+					while (!stop.load(std::memory_order_relaxed))
+					{
+						stream->seek(offsets[i++ % offsets.size()], FileStream::SeekOrigin::SET);
+						stream->write(block.data(), block.size());
+					}
+				});
+			}
+
+			std::vector<std::thread> workers;
+			Timer timer;
+			for (int t = 0; t < threads; ++t)
+			{
+				workers.emplace_back([&, t]() {
+					auto stream = virtualFileSystem.openFileStream("/mem/random.bin", FileStream::Mode::READ);
+					std::vector<uint8_t> buf(blockSize);
+					for (size_t i = 0; i < readsPerThread; ++i)
+					{
+						stream->seek(offsets[(i + t * 7919) % offsets.size()], FileStream::SeekOrigin::SET);
+						if (locked)
+						{
+							std::lock_guard<std::mutex> lock(mutex);
+							stream->read(buf.data(), blockSize);
+						}
+						else
+						{
+							stream->read(buf.data(), blockSize);
+						}
+					}
+				});
+			}
+			for (auto& worker : workers)
+				worker.join();
+			double seconds = timer.seconds();
+
+			stop = true;
+			if (writer.joinable())
+				writer.join();
+			printf("%-24s %8d %12.2f\n", mode, threads, threads * readsPerThread / seconds / 1000000.0);
+		}
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////
+// memory compression: resident memory saved by deflating cold files against the open latency it adds
+void memoryCompressionBench()
+{
+	const int fileCount = 16;
+	const size_t fileSize = 4 * 1024 * 1024;
+
+	VirtualFileSystem virtualFileSystem;
+	auto memFs = new MemoryFileSystem("", "/mem");
+	virtualFileSystem.mount(memFs);
+
+	std::string json;
+	std::mt19937 rng(7);
+	while (json.size() < fileSize)
+		json += "{\"id\": " + std::to_string(rng() % 100000) + ", \"score\": " + std::to_string(rng() % 1000) + ", \"tag\": \"generated\"},\n";
+	for (int i = 0; i < fileCount; ++i)
+	{
+		auto stream = virtualFileSystem.openFileStream("/mem/file" + std::to_string(i) + ".json", FileStream::Mode::WRITE);
+		stream->write(json.data(), json.size());
+	}
+
+	// first byte of every file, the open pays for the inflate
+	auto openAll = [&]() {
+		Timer timer;
+		char c;
+		for (int i = 0; i < fileCount; ++i)
+			virtualFileSystem.openFileStream("/mem/file" + std::to_string(i) + ".json", FileStream::Mode::READ)->read(&c, 1);
+		return timer.seconds() * 1000000.0 / fileCount;
+	};
+
+	printf("\nmemory compression: %d json files of %zu bytes\n", fileCount, json.size());
+	printf("%-12s %16s %16s\n", "state", "resident bytes", "open us");
+
+	uint64_t resident = memFs->usage().residentBytes;
+	double residentOpen = openAll();
+	printf("%-12s %16llu %16.1f\n", "resident", (unsigned long long)resident, residentOpen);
+
+	memFs->setCompression(1, 0);
+	Timer timer;
+	memFs->compressCold();
+	double compressSeconds = timer.seconds();
+	memFs->setCompression(0, 0);
+	uint64_t compressed = memFs->usage().residentBytes;
+	double compressedOpen = openAll();
+	printf("%-12s %16llu %16.1f\n", "compressed", (unsigned long long)compressed, compressedOpen);
+	printf("saved %.1f%% of resident memory for %.1f us per open, compressing took %.1f ms\n",
+		100.0 * (resident - compressed) / resident, compressedOpen - residentOpen, compressSeconds * 1000.0);
+}
+
+//////////////////////////////////////////////////////////////////////////
+// memory lookups: isFile / open / enumerate from 1-16 threads, sharded reader lock against a global mutex
+void memoryLookupContentionBench()
+{
+	const int dirCount = 64;
+	const int filesPerDir = 256;
+	const size_t opsPerThread = 200000;
+
+	VirtualFileSystem virtualFileSystem;
+	virtualFileSystem.mount(new MemoryFileSystem("", "/mem"));
+	std::vector<std::string> paths;
+	for (int d = 0; d < dirCount; ++d)
+	{
+		std::string dir = "/mem/dir" + std::to_string(d) + "/";
+		virtualFileSystem.createDir(dir);
+		for (int f = 0; f < filesPerDir; ++f)
+		{
+			paths.push_back(dir + "file" + std::to_string(f) + ".txt");
+			virtualFileSystem.openFileStream(paths.back(), FileStream::Mode::WRITE)->write("content", 7);
+		}
+	}
+	// settles the closed writers so the readers find nothing left to do
+	virtualFileSystem.openFileStream(paths[0], FileStream::Mode::READ);
+
+	printf("\nmemory lookup contention: %zu isFile/open/enumerate per thread over %zu files\n", opsPerThread, paths.size());
+	printf("%-24s %8s %12s\n", "mode", "threads", "mops");
+
+	const char* modes[] = { "sharded", "global mutex", "sharded + writer" };
+	for (auto mode : modes)
+	{
+		bool locked = strcmp(mode, "global mutex") == 0;
+		bool withWriter = strcmp(mode, "sharded + writer") == 0;
+		for (int threads = 1; threads <= 16; threads *= 2)
+		{
+			std::mutex mutex;
+			std::atomic<bool> stop(false);
+			std::thread writer;
+			if (withWriter)
+			{
+				// keeps creating files in a directory of its own
+				writer = std::thread([&]() {
+					virtualFileSystem.createDir("/mem/writer/");
+					for (size_t i = 0; !stop.load(std::memory_order_relaxed); ++i)
+						virtualFileSystem.openFileStream("/mem/writer/file" + std::to_string(i % 1024), FileStream::Mode::WRITE);
+				});
+			}
+
+			std::vector<std::thread> workers;
+			Timer timer;
+			for (int t = 0; t < threads; ++t)
+			{
+				workers.emplace_back([&, t]() {
+					size_t found = 0;
+					for (size_t i = 0; i < opsPerThread; ++i)
+					{
+						const auto& path = paths[(i * 7919 + t * 104729) % paths.size()];
+						std::unique_lock<std::mutex> lock(mutex, std::defer_lock);
+						if (locked)
+							lock.lock();
+						switch (i % 8)
+						{
+						case 0:
+							virtualFileSystem.enumerate(path.substr(0, path.rfind('/') + 1), [&found](const FileInfo&) { return ++found > 4; });
+							break;
+						case 1:
+						case 2:
+							found += virtualFileSystem.openFileStream(path, FileStream::Mode::READ) != nullptr;
+							break;
+						default:
+							found += virtualFileSystem.isFile(path);
+							break;
+						}
+					}
+					assert(found > 0);
+				});
+			}
+			for (auto& worker : workers)
+				worker.join();
+			double seconds = timer.seconds();
+
+			stop = true;
+			if (writer.joinable())
+				writer.join();
+			printf("%-24s %8d %12.2f\n", mode, threads, threads * opsPerThread / seconds / 1000000.0);
+		}
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////
+// memory ingest: files produced in vectors, written through a stream, adopted one by one and in bulk
+void memoryIngestBench()
+{
+	const int fileCount = 256;
+	const size_t fileSize = 1024 * 1024;
+
+	auto produce = [&]() {
+		std::vector<std::pair<std::string, std::vector<uint8_t>>> files;
+		for (int i = 0; i < fileCount; ++i)
+			files.emplace_back("/dir" + std::to_string(i % 16) + "/file" + std::to_string(i) + ".bin", std::vector<uint8_t>(fileSize, uint8_t(i)));
+		return files;
+	};
+
+	printf("\nmemory ingest: %d files of %zu bytes\n", fileCount, fileSize);
+	printf("%-12s %12s\n", "mode", "GB/s");
+	for (const char* mode : { "stream", "writeFile", "writeFiles" })
+	{
+		MemoryFileSystem memFs("", "/mem");
+		for (int d = 0; d < 16; ++d)
+			memFs.createDir("/dir" + std::to_string(d));
+		auto files = produce();
+
+		Timer timer;
+		if (strcmp(mode, "stream") == 0)
+		{
+			for (auto& file : files)
+				memFs.openFileStream(file.first, FileStream::Mode::WRITE)->write(file.second.data(), file.second.size());
+		}
+		else if (strcmp(mode, "writeFile") == 0)
+		{
+			for (auto& file : files)
+				memFs.writeFile(file.first, std::move(file.second));
+		}
+		else
+		{
+			memFs.writeFiles(std::move(files));
+		}
+		double seconds = timer.seconds();
+		printf("%-12s %12.2f\n", mode, double(fileCount) * fileSize / seconds / 1e9);
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////
+// pack reads: stored entries through a stream per open on the archive against the shared mapping
+void packMmapBench()
+{
+	const std::string packPath = "./bench-data/stored.pak";
+	const int fileCount = 64;
+	const size_t fileSize = 256 * 1024;
+
+	std::filesystem::create_directories("./bench-data");
+	std::vector<std::pair<std::string, std::vector<uint8_t>>> files;
+	std::mt19937 rng(3);
+	for (int i = 0; i < fileCount; ++i)
+	{
+		std::vector<uint8_t> content(fileSize);
+		for (auto& byte : content)
+			byte = uint8_t(rng());
+		files.emplace_back("file" + std::to_string(i) + ".bin", std::move(content));
+	}
+	writePackFile(packPath, files);
+
+	printf("\npack reads: %d stored entries of %zu bytes\n", fileCount, fileSize);
+	printf("%-10s %14s %16s %16s\n", "mode", "open us", "whole file GB/s", "4KB reads M/s");
+	for (bool mapped : { false, true })
+	{
+		VirtualFileSystem virtualFileSystem;
+		auto packFs = new PackFileSystem(packPath, "/pak");
+		if (!mapped)
+			packFs->setMmapLimit(0);
+		virtualFileSystem.mount(packFs);
+
+		const int rounds = 20;
+		std::vector<uint8_t> buf(fileSize);
+		Timer openTimer;
+		for (int r = 0; r < rounds; ++r)
+			for (int i = 0; i < fileCount; ++i)
+				virtualFileSystem.openFileStream("/pak/file" + std::to_string(i) + ".bin", FileStream::Mode::READ);
+		double openUs = openTimer.seconds() * 1000000.0 / (rounds * fileCount);
+
+		Timer readTimer;
+		for (int r = 0; r < rounds; ++r)
+			for (int i = 0; i < fileCount; ++i)
+				virtualFileSystem.openFileStream("/pak/file" + std::to_string(i) + ".bin", FileStream::Mode::READ)->read(buf.data(), buf.size());
+		double wholeGBs = double(rounds) * fileCount * fileSize / readTimer.seconds() / 1e9;
+
+		// small reads on one open stream, each is a seek and a copy on the fstream path
+		auto stream = virtualFileSystem.openFileStream("/pak/file0.bin", FileStream::Mode::READ);
+		auto offsets = randomOffsets(200000, fileSize, 4096);
+		Timer smallTimer;
+		for (auto offset : offsets)
+		{
+			stream->seek(offset, FileStream::SeekOrigin::SET);
+			stream->read(buf.data(), 4096);
+		}
+		double smallReads = offsets.size() / smallTimer.seconds() / 1e6;
+		printf("%-10s %14.2f %16.2f %16.2f\n", mapped ? "mmap" : "fstream", openUs, wholeGBs, smallReads);
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////
+// gzip pack entries: inflating the whole entry on open against inflating as read() advances
+void packInflateBench()
+{
+	const std::string packPath = "./bench-data/gzip.pak";
+	const size_t fileSize = 64 * 1024 * 1024;
+
+	std::filesystem::create_directories("./bench-data");
+	std::vector<std::pair<std::string, std::vector<uint8_t>>> files(1);
+	files[0].first = "big.bin";
+	files[0].second.resize(fileSize);
+	std::mt19937 rng(5);
+	for (size_t i = 0; i < fileSize; ++i)
+		files[0].second[i] = uint8_t((i / 64) * 13 + rng() % 16);
+	writePackFile(packPath, files, true, 0x5a17c3e9);
+
+	printf("\ngzip pack entry of %zu MB, encrypted\n", fileSize >> 20);
+	printf("%-22s %16s %14s\n", "mode", "first 4KB ms", "whole MB/s");
+	struct Mode { const char* name; bool mapped; bool streaming; };
+	for (auto mode : { Mode{ "eager", true, false }, Mode{ "streaming mmap", true, true }, Mode{ "streaming pipeline", false, true } })
+	{
+		VirtualFileSystem virtualFileSystem;
+		auto packFs = new PackFileSystem(packPath, "/pak");
+		if (!mode.mapped)
+			packFs->setMmapLimit(0);
+		if (!mode.streaming)
+			packFs->setInflateThreshold(UINT64_MAX);
+		virtualFileSystem.mount(packFs);
+
+		std::vector<uint8_t> buf(1024 * 1024);
+		Timer headTimer;
+		{
+			auto stream = virtualFileSystem.openFileStream("/pak/big.bin", FileStream::Mode::READ);
+			stream->read(buf.data(), 4096);
+		}
+		double headMs = headTimer.seconds() * 1000.0;
+
+		Timer wholeTimer;
+		auto stream = virtualFileSystem.openFileStream("/pak/big.bin", FileStream::Mode::READ);
+		uint64_t total = 0;
+		for (uint64_t n; (n = stream->read(buf.data(), buf.size())) > 0;)
+			total += n;
+		assert(total == fileSize);
+		printf("%-22s %16.2f %14.0f\n", mode.name, headMs, total / wholeTimer.seconds() / 1e6);
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////
+// random 4KB reads in a large gzip pack entry, inflating from the start against resuming at checkpoints
+void packInflateIndexBench()
+{
+	const std::string packPath = "./bench-data/gzip.pak";
+	const std::string indexPath = "./bench-data/gzip.pak.idx";
+	const size_t fileSize = 64 * 1024 * 1024;
+
+	std::filesystem::create_directories("./bench-data");
+	std::vector<std::pair<std::string, std::vector<uint8_t>>> files(1);
+	files[0].first = "big.bin";
+	files[0].second.resize(fileSize);
+	std::mt19937 rng(5);
+	for (size_t i = 0; i < fileSize; ++i)
+		files[0].second[i] = uint8_t((i / 64) * 13 + rng() % 16);
+	writePackFile(packPath, files, true, 0x5a17c3e9);
+
+	printf("\nrandom 4KB reads in a %zu MB gzip pack entry\n", fileSize >> 20);
+	printf("%-24s %12s %14s\n", "mode", "reads/s", "index build ms");
+	for (uint64_t spacing : { uint64_t(0), uint64_t(4 * 1024 * 1024), uint64_t(1024 * 1024) })
+	{
+		VirtualFileSystem virtualFileSystem;
+		auto packFs = new PackFileSystem(packPath, "/pak");
+		packFs->setCheckpointSpacing(spacing);
+		virtualFileSystem.mount(packFs);
+
+		// the first full pass lays down the checkpoints
+		std::vector<uint8_t> buf(1024 * 1024);
+		auto stream = virtualFileSystem.openFileStream("/pak/big.bin", FileStream::Mode::READ);
+		Timer buildTimer;
+		while (stream->read(buf.data(), buf.size()) > 0)
+			;
+		double buildMs = buildTimer.seconds() * 1000.0;
+
+		auto offsets = randomOffsets(spacing ? 500 : 20, fileSize, 4096);
+		Timer timer;
+		for (auto offset : offsets)
+		{
+			stream->seek(offset, FileStream::SeekOrigin::SET);
+			stream->read(buf.data(), 4096);
+		}
+		double readsPerSecond = offsets.size() / timer.seconds();
+
+		char name[32];
+		snprintf(name, sizeof(name), spacing ? "checkpoints every %llu MB" : "no checkpoints", (unsigned long long)(spacing >> 20));
+		printf("%-24s %12.0f %14.1f\n", name, readsPerSecond, buildMs);
+		if (spacing)
+			packFs->saveInflateIndex(indexPath);
+	}
+}
+
+//////////////////////////////////////////////////////////////////////////
+// version 0 single gzip stream against version 1 blocks for the same 64MB entry
+void packBlocksBench()
+{
+	const size_t fileSize = 64 * 1024 * 1024;
+
+	std::filesystem::create_directories("./bench-data");
+	std::vector<std::pair<std::string, std::vector<uint8_t>>> files(1);
+	files[0].first = "big.bin";
+	files[0].second.resize(fileSize);
+	std::mt19937 rng(5);
+	for (size_t i = 0; i < fileSize; ++i)
+		files[0].second[i] = uint8_t('a' + rng() % 16);
+
+	printf("\n%zu MB gzip pack entry by format, %u hardware threads\n", fileSize >> 20, std::thread::hardware_concurrency());
+	printf("%-26s %12s %14s %14s\n", "format", "stored MB", "whole MB/s", "4KB reads/s");
+	for (uint32_t blockSize : { 0u, 64u * 1024, 256u * 1024 })
+	{
+		const std::string packPath = "./bench-data/blocks.pak";
+		writePackFile(packPath, files, true, 0x5a17c3e9, blockSize);
+
+		VirtualFileSystem virtualFileSystem;
+		virtualFileSystem.mount(new PackFileSystem(packPath, "/pak"));
+
+		std::vector<uint8_t> buf(fileSize);
+		Timer wholeTimer;
+		auto stream = virtualFileSystem.openFileStream("/pak/big.bin", FileStream::Mode::READ);
+		uint64_t total = stream->read(buf.data(), buf.size());
+		assert(total == fileSize);
+		double wholeMBs = total / wholeTimer.seconds() / 1e6;
+
+		// the version 0 stream has laid down its checkpoints during the whole read
+		auto offsets = randomOffsets(500, fileSize, 4096);
+		Timer timer;
+		for (auto offset : offsets)
+		{
+			stream->seek(offset, FileStream::SeekOrigin::SET);
+			stream->read(buf.data(), 4096);
+		}
+		double readsPerSecond = offsets.size() / timer.seconds();
+
+		char name[32];
+		snprintf(name, sizeof(name), blockSize ? "v1 %u KB blocks" : "v0 stream, 1 MB checkpoints", blockSize >> 10);
+		printf("%-26s %12.1f %14.0f %14.0f\n", name, std::filesystem::file_size(packPath) / 1e6, wholeMBs, readsPerSecond);
+	}
+}
+
+int main()
+{
+	ioEngineBench();
+	memoryReadScalingBench();
+	memoryCompressionBench();
+	memoryLookupContentionBench();
+	memoryIngestBench();
+	packMmapBench();
+	packInflateBench();
+	packInflateIndexBench();
+	packBlocksBench();
+	return 0;
+}
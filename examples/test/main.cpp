@@ -4,11 +4,29 @@
 #include "vfs/VirtualFileSystem.h"
 #include "vfs/native/NativeFileSystem.h"
 #include "vfs/memory/MemoryFileSystem.h"
+#include "vfs/memory/MemoryPool.h"
 #include "vfs/pack/PackFileSystem.h"
+#include "vfs/embedded/EmbeddedFileSystem.h"
+#include "vfs/native/MappedFile.h"
+#include "vfs/io/ThreadPoolIOEngine.h"
 
 #include "md5/md5.h"
 #include <assert.h>
 #include <fstream>
+#include <string.h>
+#include <filesystem>
+#include <set>
+#include <atomic>
+#include <thread>
+#include <random>
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/sendfile.h>
+#include <sys/resource.h>
+#include <signal.h>
+#endif
 
 USING_NS_VFS;
 
@@ -36,6 +54,82 @@ std::vector<uint8_t> readFileToVector(const std::string& filename) {
 }
 
 
+// Writes a pack with every entry stored or every entry gzipped, a blockSize makes it a version 1 pack
+// compressing gzipped entries in blocks
+void writePackFile(const std::string& path, const std::vector<std::pair<std::string, std::vector<uint8_t>>>& files, bool gzip = false, uint32_t dataSecret = 0,
+	uint32_t blockSize = 0)
+{
+	auto putBigEndian = [](std::string& out, uint64_t value, int bytes) {
+		for (int i = bytes - 1; i >= 0; --i)
+			out.push_back(char(value >> (i * 8)));
+	};
+
+	std::string data, index;
+	uint64_t offset = 28;
+	auto compress = [](const char* data, size_t len) {
+		uint64_t compressedLen = 0;
+		char* compressed = pack::compressData(data, len, compressedLen);
+		std::string content(compressed, compressedLen);
+		free(compressed);
+		return content;
+	};
+
+	for (auto& file : files)
+	{
+		std::string content(reinterpret_cast<const char*>(file.second.data()), file.second.size());
+		std::vector<uint64_t> blocks;
+		if (gzip && blockSize > 0)
+		{
+			// blocks that do not shrink are stored
+			std::string compressed;
+			for (size_t pos = 0; pos < content.size(); pos += blockSize)
+			{
+				size_t len = std::min<size_t>(blockSize, content.size() - pos);
+				auto block = compress(content.data() + pos, len);
+				compressed.append(block.size() < len ? block : content.substr(pos, len));
+				blocks.push_back(std::min(block.size(), len));
+			}
+			content.swap(compressed);
+		}
+		else if (gzip)
+		{
+			content = compress(content.data(), content.size());
+		}
+		pack::xorContent(dataSecret, content.data(), content.size());
+		data.append(content);
+		putBigEndian(index, offset, 8);
+		if (blockSize > 0)
+		{
+			putBigEndian(index, content.size(), 8);
+			putBigEndian(index, file.second.size(), 8);
+			putBigEndian(index, gzip ? PackFileCompressionType::Gzip : PackFileCompressionType::None, 1);
+			putBigEndian(index, gzip ? blockSize : 0, 4);
+			putBigEndian(index, file.first.size(), 2);
+			index.append(file.first);
+			for (auto length : blocks)
+				putBigEndian(index, length, 4);
+		}
+		else
+		{
+			putBigEndian(index, content.size(), 4);
+			putBigEndian(index, file.first.size(), 1);
+			putBigEndian(index, gzip ? PackFileCompressionType::Gzip : PackFileCompressionType::None, 1);
+			index.append(file.first);
+		}
+		offset += content.size();
+	}
+
+	std::string header = "PACK";
+	putBigEndian(header, blockSize > 0 ? 1 : 0, 4);
+	putBigEndian(header, 0, 4);
+	putBigEndian(header, dataSecret, 4);
+	putBigEndian(header, offset, 8);
+	putBigEndian(header, 0, 4);
+
+	std::ofstream file(path, std::ios::binary | std::ios::trunc);
+	file << header << data << index;
+}
+
 bool readFile(VirtualFileSystem& virtualFileSystem, const std::string& fileName, bool printContent)
 {
 	bool ok = false;
@@ -189,6 +283,1700 @@ void packTest()
 	readFile(virtualFileSystem, "/root/packroot/packdir1/pack_empty_file.data", false);
 }
 
+void embeddedTest()
+{
+	static const uint8_t hello[] = { 'h', 'e', 'l', 'l', 'o' };
+	static const uint8_t config[] = { '{', '}' };
+	static const EmbeddedFile files[] = {
+		{ "hello.txt", hello, sizeof(hello) },
+		{ "/conf/app/config.json", config, sizeof(config) },
+		{ "conf/empty.bin", nullptr, 0 },
+		// a file can not be a directory too
+		{ "hello.txt/inner.txt", hello, sizeof(hello) },
+	};
+
+	VirtualFileSystem virtualFileSystem;
+	assert(virtualFileSystem.mount(new EmbeddedFileSystem(files, sizeof(files) / sizeof(files[0]), "/emb")) == true);
+	assert(virtualFileSystem.isFile("/emb/hello.txt") == true);
+	assert(virtualFileSystem.isFile("/emb/hello.txt/inner.txt") == false);
+	assert(virtualFileSystem.isFile("/emb/conf/empty.bin") == true);
+	assert(virtualFileSystem.isDir("/emb/conf/app/") == true);
+	assert(virtualFileSystem.isDir("/emb/missing") == false);
+	assert(virtualFileSystem.openFileStream("/emb/hello.txt", FileStream::Mode::WRITE) == nullptr);
+
+	std::set<std::string> names;
+	virtualFileSystem.enumerate("/emb/conf/", [&](const FileInfo& info) -> bool {
+		names.insert(info.filePath);
+		return false;
+	});
+	assert(names == std::set<std::string>({ "/emb/conf/app", "/emb/conf/empty.bin" }));
+
+	// streams read the static bytes in place
+	auto stream = virtualFileSystem.openFileStream("/emb/conf/app/config.json", FileStream::Mode::READ);
+	assert(stream != nullptr && stream->size() == sizeof(config) && stream->view() == config);
+	char buf[8] = {};
+	assert(stream->read(buf, sizeof(buf)) == sizeof(config) && memcmp(buf, config, sizeof(config)) == 0);
+	assert(virtualFileSystem.openFileStream("/emb/conf/empty.bin", FileStream::Mode::READ)->size() == 0);
+
+	// a pack image in memory serves the same content as the pack file
+	auto image = readFileToVector("./test-data/test.pak");
+	VirtualFileSystem packFileSystem;
+	assert(packFileSystem.mount(new PackFileSystem("./test-data/test.pak", "/pak")) == true);
+	assert(packFileSystem.mount(new EmbeddedFileSystem(image.data(), image.size(), "/img")) == true);
+	assert(packFileSystem.isDir("/img/packroot/packdir1") == true);
+	for (auto path : { "packroot/packfile1.txt", "packroot/packdir1/pack_img.jpg", "packroot/packdir1/pack_empty_file.data" })
+	{
+		auto expected = packFileSystem.openFileStream(std::string("/pak/") + path, FileStream::Mode::READ);
+		auto actual = packFileSystem.openFileStream(std::string("/img/") + path, FileStream::Mode::READ);
+		assert(expected != nullptr && actual != nullptr && expected->size() == actual->size());
+
+		std::vector<uint8_t> a(expected->size()), b(actual->size());
+		assert(expected->read(a.data(), a.size()) == a.size());
+		assert(actual->read(b.data(), b.size()) == b.size());
+		assert(a == b);
+	}
+
+	// version 1 images with entries compressed in blocks, one of them incompressible so its blocks are stored
+	std::vector<std::pair<std::string, std::vector<uint8_t>>> blockFiles;
+	std::mt19937 rng(7);
+	for (size_t size : { size_t(200001), size_t(70000), size_t(0) })
+	{
+		std::vector<uint8_t> content(size);
+		for (size_t i = 0; i < size; ++i)
+			content[i] = size == 70000 ? uint8_t(rng()) : uint8_t((i / 64) * 13 + rng() % 16);
+		blockFiles.emplace_back("v1/file" + std::to_string(size) + ".bin", std::move(content));
+	}
+	for (uint32_t dataSecret : { 0u, 0x3c6ef372u })
+	{
+		writePackFile("./test-data/embedded-v1.pak", blockFiles, true, dataSecret, 64 * 1024);
+		auto v1Image = readFileToVector("./test-data/embedded-v1.pak");
+		VirtualFileSystem v1FileSystem;
+		assert(v1FileSystem.mount(new EmbeddedFileSystem(v1Image.data(), v1Image.size(), "/v1")) == true);
+		for (auto& file : blockFiles)
+		{
+			auto actual = v1FileSystem.openFileStream("/v1/" + file.first, FileStream::Mode::READ);
+			assert(actual != nullptr && actual->size() == file.second.size());
+			std::vector<uint8_t> content(file.second.size());
+			assert(actual->read(content.data(), content.size()) == content.size() && content == file.second);
+		}
+	}
+	std::filesystem::remove("./test-data/embedded-v1.pak");
+
+	std::vector<uint8_t> truncated(image.begin(), image.begin() + 10);
+	VirtualFileSystem brokenFileSystem;
+	assert(brokenFileSystem.mount(new EmbeddedFileSystem(truncated.data(), truncated.size(), "/bad")) == false);
+}
+
+void packMmapTest()
+{
+	const std::string packPath = "./test-data/stored.pak";
+	std::vector<std::pair<std::string, std::vector<uint8_t>>> files;
+	for (int i = 0; i < 8; ++i)
+	{
+		std::vector<uint8_t> content(i * 1000 + 1);
+		for (size_t j = 0; j < content.size(); ++j)
+			content[j] = uint8_t(j * 7 + i);
+		files.emplace_back("stored/file" + std::to_string(i) + ".bin", std::move(content));
+	}
+	files.emplace_back("stored/empty.bin", std::vector<uint8_t>());
+	writePackFile(packPath, files);
+
+	VirtualFileSystem virtualFileSystem;
+	assert(virtualFileSystem.mount(new PackFileSystem(packPath, "/mapped")) == true);
+	auto unmapped = new PackFileSystem(packPath, "/unmapped");
+	unmapped->setMmapLimit(0);
+	assert(virtualFileSystem.mount(unmapped) == true);
+
+	for (auto& file : files)
+	{
+		// stored entries of the mapped archive are views of the mapping
+		auto mapped = virtualFileSystem.openFileStream("/mapped/" + file.first, FileStream::Mode::READ);
+		assert(mapped != nullptr && mapped->size() == file.second.size());
+		assert(file.second.empty() || memcmp(mapped->view(), file.second.data(), file.second.size()) == 0);
+
+		auto stream = virtualFileSystem.openFileStream("/unmapped/" + file.first, FileStream::Mode::READ);
+		assert(stream != nullptr && stream->view() == nullptr);
+		std::vector<uint8_t> content(stream->size());
+		assert(stream->read(content.data(), content.size()) == content.size());
+		assert(content == file.second);
+
+		mapped->seek(file.second.size() / 2, FileStream::SeekOrigin::SET);
+		std::vector<uint8_t> tail(file.second.size());
+		tail.resize(mapped->read(tail.data(), tail.size()));
+		assert(std::equal(tail.begin(), tail.end(), file.second.begin() + file.second.size() / 2));
+	}
+
+	// encrypted entries are still decoded
+	assert(virtualFileSystem.mount(new PackFileSystem("./test-data/test.pak", "/encrypted")) == true);
+	auto stream = virtualFileSystem.openFileStream("/encrypted/packroot/packfile1.txt", FileStream::Mode::READ);
+	assert(stream != nullptr && stream->view() == nullptr && stream->size() == 10);
+}
+
+void packInflateTest()
+{
+	// small entries are inflated on open, the larger ones as they are read, the 6MB one with a reader thread
+	std::vector<std::pair<std::string, std::vector<uint8_t>>> files;
+	std::mt19937 rng(7);
+	for (size_t size : { size_t(5000), size_t(1500000), size_t(6000000) })
+	{
+		std::vector<uint8_t> content(size);
+		for (size_t i = 0; i < size; ++i)
+			content[i] = size > 5000000 ? uint8_t(rng()) : uint8_t((i / 64) * 13 + rng() % 4);
+		files.emplace_back("gzip/file" + std::to_string(size) + ".bin", std::move(content));
+	}
+
+	for (uint32_t dataSecret : { 0u, 0x5a17c3e9u })
+	{
+		const std::string packPath = "./test-data/gzip.pak";
+		writePackFile(packPath, files, true, dataSecret);
+
+		for (bool mapped : { true, false })
+		{
+			VirtualFileSystem virtualFileSystem;
+			auto packFs = new PackFileSystem(packPath, "/gz");
+			if (!mapped)
+				packFs->setMmapLimit(0);
+			assert(virtualFileSystem.mount(packFs) == true);
+
+			for (auto& file : files)
+			{
+				auto& expected = file.second;
+				auto stream = virtualFileSystem.openFileStream("/gz/" + file.first, FileStream::Mode::READ);
+				assert(stream != nullptr && stream->size() == expected.size());
+
+				// odd read sizes cross window boundaries
+				std::vector<uint8_t> content(expected.size() + 100);
+				uint64_t total = 0;
+				for (uint64_t n; (n = stream->read(content.data() + total, std::min<uint64_t>(10007, content.size() - total))) > 0;)
+					total += n;
+				content.resize(total);
+				assert(content == expected);
+
+				// forward seek skips ahead, backward seek inflates again from the start
+				uint8_t buf[256];
+				for (uint64_t offset : { expected.size() * 3 / 4, expected.size() / 3, uint64_t(0), expected.size() - 10 })
+				{
+					assert(stream->seek(offset, FileStream::SeekOrigin::SET) == offset);
+					uint64_t n = stream->read(buf, sizeof(buf));
+					assert(n == std::min<uint64_t>(sizeof(buf), expected.size() - offset));
+					assert(memcmp(buf, expected.data() + offset, n) == 0);
+				}
+				assert(stream->read(buf, sizeof(buf)) == 0);
+			}
+		}
+	}
+}
+
+void packInflateIndexTest()
+{
+	std::vector<std::pair<std::string, std::vector<uint8_t>>> files(1);
+	files[0].first = "gzip/indexed.bin";
+	files[0].second.resize(8000000);
+	std::mt19937 rng(11);
+	for (size_t i = 0; i < files[0].second.size(); ++i)
+		files[0].second[i] = uint8_t((i / 64) * 13 + rng() % 16);
+	const auto& expected = files[0].second;
+
+	const std::string packPath = "./test-data/indexed.pak";
+	const std::string indexPath = "./test-data/indexed.pak.idx";
+	writePackFile(packPath, files, true, 0x2b7e1516);
+
+	auto checkSeeks = [&](FileStream* stream, uint32_t seed) {
+		std::mt19937 seekRng(seed);
+		uint8_t buf[300];
+		for (int i = 0; i < 40; ++i)
+		{
+			uint64_t offset = seekRng() % expected.size();
+			assert(stream->seek(offset, FileStream::SeekOrigin::SET) == offset);
+			uint64_t n = stream->read(buf, sizeof(buf));
+			assert(n == std::min<uint64_t>(sizeof(buf), expected.size() - offset));
+			assert(memcmp(buf, expected.data() + offset, n) == 0);
+		}
+	};
+
+	{
+		// unmapped, so the entry is read by the reader thread
+		VirtualFileSystem virtualFileSystem;
+		auto packFs = new PackFileSystem(packPath, "/gz");
+		packFs->setMmapLimit(0);
+		packFs->setCheckpointSpacing(512 * 1024);
+		assert(virtualFileSystem.mount(packFs) == true);
+
+		// checkpoints are taken on the way to a random seek as well as on a full read. The entry is too large
+		// to trust the trailer size, which only holds it modulo 4GB, so size() inflates it to its end.
+		auto stream = virtualFileSystem.openFileStream("/gz/gzip/indexed.bin", FileStream::Mode::READ);
+		assert(stream->size() == expected.size());
+		checkSeeks(stream.get(), 1);
+		stream->seek(0, FileStream::SeekOrigin::SET);
+		std::vector<uint8_t> content(expected.size());
+		assert(stream->read(content.data(), content.size()) == expected.size());
+		assert(content == expected);
+
+		auto index = packFs->inflateIndex("gzip/indexed.bin");
+		assert(index != nullptr && index->isComplete() && index->inflatedSize() == expected.size());
+		assert(index->size() >= expected.size() / (512 * 1024) - 1 && index->size() <= expected.size() / (512 * 1024));
+		checkSeeks(stream.get(), 2);
+		assert(packFs->saveInflateIndex(indexPath) == true);
+	}
+
+	{
+		// a fresh mount seeks with the persisted checkpoints before anything was inflated
+		VirtualFileSystem virtualFileSystem;
+		auto packFs = new PackFileSystem(packPath, "/gz");
+		assert(virtualFileSystem.mount(packFs) == true);
+		assert(packFs->loadInflateIndex(indexPath) == true);
+		auto index = packFs->inflateIndex("gzip/indexed.bin");
+		assert(index != nullptr && index->isComplete() && index->size() > 10 && index->inflatedSize() == expected.size());
+
+		auto stream = virtualFileSystem.openFileStream("/gz/gzip/indexed.bin", FileStream::Mode::READ);
+		assert(stream->size() == expected.size());
+		checkSeeks(stream.get(), 3);
+		assert(packFs->inflateIndex("gzip/indexed.bin") == index);
+	}
+
+	// the index of one archive is refused by another
+	auto otherFs = std::make_unique<PackFileSystem>("./test-data/test.pak", "/other");
+	assert(otherFs->init() == true);
+	assert(otherFs->loadInflateIndex(indexPath) == false);
+}
+
+void packBlocksTest()
+{
+	// version 1 entries compressed in 64KB blocks, one of them incompressible so its blocks are stored
+	std::vector<std::pair<std::string, std::vector<uint8_t>>> files;
+	std::mt19937 rng(13);
+	for (size_t size : { size_t(3000000), size_t(300000), size_t(200001), size_t(0) })
+	{
+		std::vector<uint8_t> content(size);
+		for (size_t i = 0; i < size; ++i)
+			content[i] = size == 300000 ? uint8_t(rng()) : uint8_t((i / 64) * 13 + rng() % 16);
+		files.emplace_back("blocks/file" + std::to_string(size) + ".bin", std::move(content));
+	}
+
+	for (uint32_t dataSecret : { 0u, 0x3c6ef372u })
+	{
+		const std::string packPath = "./test-data/blocks.pak";
+		writePackFile(packPath, files, true, dataSecret, 64 * 1024);
+
+		for (bool mapped : { true, false })
+		{
+			VirtualFileSystem virtualFileSystem;
+			auto packFs = new PackFileSystem(packPath, "/v1");
+			if (!mapped)
+				packFs->setMmapLimit(0);
+			// large reads are split over several threads whatever the machine has
+			packFs->setDecodeThreads(4);
+			assert(virtualFileSystem.mount(packFs) == true);
+			assert(virtualFileSystem.isFile("/v1/blocks/file3000000.bin"));
+
+			for (auto& file : files)
+			{
+				auto& expected = file.second;
+				auto stream = virtualFileSystem.openFileStream("/v1/" + file.first, FileStream::Mode::READ);
+				assert(stream != nullptr && stream->size() == expected.size());
+
+				// one read of everything decodes the whole blocks straight into the buffer
+				std::vector<uint8_t> content(expected.size() + 10);
+				assert(stream->read(content.data(), content.size()) == expected.size());
+				content.resize(expected.size());
+				assert(content == expected);
+				if (expected.empty())
+					continue;
+
+				// reads starting and ending inside blocks
+				std::mt19937 seekRng(dataSecret);
+				std::vector<uint8_t> buf(200000);
+				for (int i = 0; i < 30; ++i)
+				{
+					uint64_t offset = seekRng() % expected.size();
+					uint64_t len = 1 + seekRng() % buf.size();
+					assert(stream->seek(offset, FileStream::SeekOrigin::SET) == offset);
+					uint64_t n = stream->read(buf.data(), len);
+					assert(n == std::min<uint64_t>(len, expected.size() - offset));
+					assert(memcmp(buf.data(), expected.data() + offset, n) == 0);
+				}
+
+				// small sequential reads are served from the cached block
+				stream->seek(0, FileStream::SeekOrigin::SET);
+				content.assign(expected.size(), 0);
+				uint64_t total = 0;
+				for (uint64_t n; (n = stream->read(content.data() + total, std::min<uint64_t>(777, expected.size() - total))) > 0;)
+					total += n;
+				assert(total == expected.size() && content == expected);
+			}
+		}
+	}
+}
+
+void memoryChunkTest()
+{
+	MemoryData tiny;
+	uint8_t hello[] = { 'h', 'e', 'l', 'l', 'o' };
+	assert(tiny.write(hello, sizeof(hello), 0) == sizeof(hello));
+	assert(tiny.len() == sizeof(hello) && tiny.capacity() == MemoryPool::MIN_BLOCK_SIZE);
+
+	// grow through the small size classes into pages with appends of odd sizes
+	MemoryData data;
+	std::vector<uint8_t> expected;
+	uint32_t seed = 1;
+	for (uint64_t step = 1; expected.size() < 5 * MemoryPool::PAGE_SIZE + 123; step = step * 3 + 7)
+	{
+		std::vector<uint8_t> piece(step % 20000 + 1);
+		for (auto& byte : piece)
+			byte = uint8_t(seed = seed * 1103515245 + 12345);
+		assert(data.write(piece.data(), piece.size(), expected.size()) == piece.size());
+		expected.insert(expected.end(), piece.begin(), piece.end());
+	}
+	assert(data.len() == expected.size());
+	assert(data.capacity() >= expected.size() && data.capacity() - expected.size() < MemoryPool::PAGE_SIZE);
+
+	std::vector<uint8_t> buf(expected.size());
+	assert(data.read(buf.data(), buf.size(), 0) == expected.size());
+	assert(buf == expected);
+
+	// reads crossing chunk boundaries
+	for (uint64_t offset = 0; offset < expected.size(); offset += 4093)
+	{
+		uint64_t len = std::min<uint64_t>(MemoryPool::PAGE_SIZE + 17, expected.size() - offset);
+		assert(data.read(buf.data(), MemoryPool::PAGE_SIZE + 17, offset) == len);
+		assert(memcmp(buf.data(), expected.data() + offset, len) == 0);
+	}
+
+	// overwrite across a boundary and write past the end, the gap reads as zeros
+	std::vector<uint8_t> patch(MemoryPool::PAGE_SIZE, 0xAB);
+	assert(data.write(patch.data(), patch.size(), MemoryPool::PAGE_SIZE - 100) == patch.size());
+	std::copy(patch.begin(), patch.end(), expected.begin() + MemoryPool::PAGE_SIZE - 100);
+	uint64_t end = expected.size() + 2 * MemoryPool::PAGE_SIZE + 5;
+	assert(data.write(hello, sizeof(hello), end) == sizeof(hello));
+	expected.resize(end, 0);
+	expected.insert(expected.end(), hello, hello + sizeof(hello));
+
+	buf.assign(expected.size() + 10, 0xFF);
+	assert(data.read(buf.data(), buf.size(), 0) == expected.size());
+	buf.resize(expected.size());
+	assert(buf == expected);
+	assert(data.read(buf.data(), 1, expected.size()) == 0);
+}
+
+void memoryConcurrentReadTest()
+{
+	VirtualFileSystem virtualFileSystem;
+	virtualFileSystem.mount(new MemoryFileSystem("", "/mem"));
+
+	// the writer rewrites the whole file with one byte value per generation while growing it,
+	// readers must always see a single generation
+	const int generations = 300;
+	std::atomic<bool> done(false);
+	std::atomic<uint64_t> reads(0);
+
+	auto writer = virtualFileSystem.openFileStream("/mem/stress.bin", FileStream::Mode::WRITE);
+	assert(writer != nullptr);
+	std::vector<uint8_t> initial(1000, 0);
+	writer->write(initial.data(), initial.size());
+
+	std::vector<std::thread> readers;
+	for (int i = 0; i < 4; ++i)
+	{
+		readers.emplace_back([&]() {
+			std::vector<uint8_t> buf;
+			while (!done.load())
+			{
+				auto stream = virtualFileSystem.openFileStream("/mem/stress.bin", FileStream::Mode::READ);
+				assert(stream != nullptr);
+				buf.resize(stream->size() + MemoryPool::PAGE_SIZE);
+				uint64_t n = stream->read(buf.data(), buf.size());
+				assert(n >= initial.size());
+				for (uint64_t j = 1; j < n; ++j)
+					assert(buf[j] == buf[0]);
+				++reads;
+			}
+		});
+	}
+
+	std::vector<uint8_t> content;
+	for (int generation = 1; generation <= generations; ++generation)
+	{
+		content.assign(initial.size() + generation * 7001, uint8_t(generation));
+		writer->seek(0, FileStream::SeekOrigin::SET);
+		assert(writer->write(content.data(), content.size()) == content.size());
+	}
+	done = true;
+	for (auto& reader : readers)
+		reader.join();
+	writer = nullptr;
+
+	assert(reads > 0);
+	auto stream = virtualFileSystem.openFileStream("/mem/stress.bin", FileStream::Mode::READ);
+	assert(stream->size() == content.size());
+	std::vector<uint8_t> buf(content.size());
+	assert(stream->read(buf.data(), buf.size()) == content.size() && buf == content);
+}
+
+void memorySnapshotTest()
+{
+	auto readAll = [](VirtualFileSystem& vfs, const std::string& path) {
+		std::vector<uint8_t> data;
+		auto stream = vfs.openFileStream(path, FileStream::Mode::READ);
+		if (stream)
+		{
+			data.resize(stream->size());
+			stream->read(data.data(), data.size());
+		}
+		return data;
+	};
+
+	VirtualFileSystem virtualFileSystem;
+	auto memFs = new MemoryFileSystem("", "/mem");
+	virtualFileSystem.mount(memFs);
+	assert(virtualFileSystem.createDir("/mem/dir") == true);
+
+	std::vector<uint8_t> small = { 's', 'm', 'a', 'l', 'l' };
+	std::vector<uint8_t> big(3 * MemoryPool::PAGE_SIZE + 100, 'b');
+	assert(writeFile(virtualFileSystem, "/mem/dir/small.txt", small) == true);
+	assert(writeFile(virtualFileSystem, "/mem/big.bin", big) == true);
+
+	// a stream open for writing across the snapshot must not leak into it
+	auto writer = virtualFileSystem.openFileStream("/mem/big.bin", FileStream::Mode::WRITE);
+	assert(writer != nullptr);
+
+	assert(virtualFileSystem.mount(memFs->snapshot("/snap")) == true);
+	assert(virtualFileSystem.mount(memFs->fork("/fork")) == true);
+
+	writer->seek(MemoryPool::PAGE_SIZE + 10, FileStream::SeekOrigin::SET);
+	writer->write("XYZ", 3);
+	writer = nullptr;
+
+	std::vector<uint8_t> changed = { 'c', 'h', 'a', 'n', 'g', 'e', 'd' };
+	assert(writeFile(virtualFileSystem, "/mem/dir/small.txt", changed) == true);
+	assert(virtualFileSystem.createDir("/mem/newdir") == true);
+
+	auto bigChanged = big;
+	memcpy(bigChanged.data() + MemoryPool::PAGE_SIZE + 10, "XYZ", 3);
+	assert(readAll(virtualFileSystem, "/mem/big.bin") == bigChanged);
+	assert(readAll(virtualFileSystem, "/snap/big.bin") == big);
+	assert(readAll(virtualFileSystem, "/fork/big.bin") == big);
+	assert(readAll(virtualFileSystem, "/snap/dir/small.txt") == small);
+	assert(virtualFileSystem.isDir("/mem/newdir") == true);
+	assert(virtualFileSystem.isDir("/snap/newdir") == false);
+	assert(virtualFileSystem.isDir("/snap/dir") == true);
+
+	// the snapshot is read-only, the fork diverges on its own
+	assert(virtualFileSystem.openFileStream("/snap/dir/small.txt", FileStream::Mode::WRITE) == nullptr);
+	std::vector<uint8_t> forked = { 'f', 'o', 'r', 'k' };
+	assert(writeFile(virtualFileSystem, "/fork/big.bin", forked) == true);
+	assert(writeFile(virtualFileSystem, "/fork/dir/new.txt", forked) == true);
+	assert(readAll(virtualFileSystem, "/mem/big.bin") == bigChanged);
+	assert(readAll(virtualFileSystem, "/snap/big.bin") == big);
+	assert(virtualFileSystem.isFile("/mem/dir/new.txt") == false);
+
+	assert(virtualFileSystem.removeFile("/mem/dir/small.txt") == true);
+	assert(virtualFileSystem.isFile("/mem/dir/small.txt") == false);
+	assert(readAll(virtualFileSystem, "/snap/dir/small.txt") == small);
+
+	// copies outlive the file system they were made from
+	virtualFileSystem.unmount(memFs);
+	std::vector<uint8_t> forkSmall = readAll(virtualFileSystem, "/fork/dir/small.txt");
+	assert(forkSmall == small);
+}
+
+void memoryTreeTest()
+{
+	VirtualFileSystem virtualFileSystem;
+	virtualFileSystem.mount(new MemoryFileSystem("", "/mem"));
+
+	std::vector<uint8_t> bin = { 't', 'r', 'e', 'e' };
+	assert(writeFile(virtualFileSystem, "/mem/a/b/c/file.txt", bin) == false);
+	assert(virtualFileSystem.createDir("/mem/a/b/c") == true);
+	assert(virtualFileSystem.createDir("/mem/a/b") == false);
+	assert(virtualFileSystem.isDir("/mem/a") == true);
+	assert(virtualFileSystem.isDir("/mem/a/b/c/") == true);
+
+	for (int i = 0; i < 100; ++i)
+	{
+		assert(virtualFileSystem.createDir("/mem/a/dir" + std::to_string(i)) == true);
+		assert(writeFile(virtualFileSystem, "/mem/a/b/file" + std::to_string(i) + ".txt", bin) == true);
+	}
+	assert(writeFile(virtualFileSystem, "/mem/a/b/c/file.txt", bin) == true);
+
+	assert(virtualFileSystem.isFile("/mem/a/b/file7.txt") == true);
+	assert(virtualFileSystem.isFile("/mem/a/b/c") == false);
+	assert(virtualFileSystem.isDir("/mem/a/b/file7.txt") == false);
+	assert(virtualFileSystem.isFile("/mem/a/x/file7.txt") == false);
+
+	// listing one directory only visits its children and reports full virtual paths
+	std::set<std::string> entries;
+	virtualFileSystem.enumerate("/mem/a/b/", [&entries](const FileInfo& info) -> bool {
+		entries.insert(std::string((info.flags & FileFlags::Dir) ? "dir:" : "file:") + info.filePath);
+		return false;
+	});
+	assert(entries.size() == 101);
+	assert(entries.count("dir:/mem/a/b/c") == 1);
+	assert(entries.count("file:/mem/a/b/file42.txt") == 1);
+
+	size_t dirs = 0;
+	virtualFileSystem.enumerate("/mem/a/", [&dirs](const FileInfo& info) -> bool {
+		dirs += (info.flags & FileFlags::Dir) ? 1 : 0;
+		return false;
+	});
+	assert(dirs == 101);
+
+	assert(virtualFileSystem.removeFile("/mem/a/b/file42.txt") == true);
+	assert(virtualFileSystem.isFile("/mem/a/b/file42.txt") == false);
+	assert(virtualFileSystem.removeFile("/mem/a/b/file42.txt") == false);
+
+	// callbacks may use the file system they are enumerating
+	size_t removed = 0;
+	virtualFileSystem.enumerate("/mem/a/b/", [&](const FileInfo& info) -> bool {
+		if (info.flags & FileFlags::Dir)
+			return false;
+		auto stream = virtualFileSystem.openFileStream(info.filePath, FileStream::Mode::READ);
+		assert(stream != nullptr && stream->size() == bin.size());
+		stream = nullptr;
+		assert(virtualFileSystem.createDir("/mem/a/b/c/d" + std::to_string(removed)) == true);
+		assert(virtualFileSystem.removeFile(info.filePath) == true);
+		++removed;
+		return false;
+	});
+	assert(removed == 99);
+	assert(virtualFileSystem.isFile("/mem/a/b/file7.txt") == false);
+	assert(virtualFileSystem.isDir("/mem/a/b/c/d98") == true);
+}
+
+void memoryInlineTest()
+{
+	VirtualFileSystem virtualFileSystem;
+	auto memFs = new MemoryFileSystem("", "/mem");
+	memFs->setInlineThreshold(64);
+	virtualFileSystem.mount(memFs);
+	assert(virtualFileSystem.createDir("/mem/dir") == true);
+
+	std::vector<uint8_t> small = { 'i', 'n', 'l', 'i', 'n', 'e' };
+	for (int i = 0; i < 1000; ++i)
+		assert(writeFile(virtualFileSystem, "/mem/dir/file" + std::to_string(i) + ".txt", small) == true);
+	memFs->compact();
+
+	// a thousand small files and their names fit in a few arena pages
+	assert(memFs->arenaBytes() < 4 * MemoryPool::PAGE_SIZE);
+
+	auto stream = virtualFileSystem.openFileStream("/mem/dir/file7.txt", FileStream::Mode::READ);
+	assert(stream != nullptr && stream->size() == small.size() && stream->view() != nullptr);
+	assert(memcmp(stream->view(), small.data(), small.size()) == 0);
+	auto appender = virtualFileSystem.openFileStream("/mem/dir/file6.txt", FileStream::Mode::APPEND);
+	assert(appender != nullptr && appender->write(small.data(), small.size()) == small.size());
+	appender = nullptr;
+	auto appended = virtualFileSystem.openFileStream("/mem/dir/file6.txt", FileStream::Mode::READ);
+	assert(appended != nullptr && appended->size() == 2 * small.size());
+	appended = nullptr;
+
+	// growing an inline file past the threshold moves it back into a MemoryData
+	std::vector<uint8_t> big(1000, 'x');
+	assert(writeFile(virtualFileSystem, "/mem/dir/file8.txt", big) == true);
+	memFs->compact();
+	auto bigStream = virtualFileSystem.openFileStream("/mem/dir/file8.txt", FileStream::Mode::READ);
+	assert(bigStream != nullptr && bigStream->size() == big.size() && bigStream->view() == nullptr);
+
+	// inline files are shared with snapshots like any other file
+	assert(virtualFileSystem.mount(memFs->snapshot("/snap")) == true);
+	std::vector<uint8_t> changed = { 'c', 'h', 'a', 'n', 'g', 'e', 'd' };
+	assert(writeFile(virtualFileSystem, "/mem/dir/file9.txt", changed) == true);
+	auto snapStream = virtualFileSystem.openFileStream("/snap/dir/file9.txt", FileStream::Mode::READ);
+	assert(snapStream != nullptr && snapStream->size() == small.size());
+	assert(memcmp(snapStream->view(), small.data(), small.size()) == 0);
+
+	// reset drops everything at once, streams that are still open keep their bytes
+	memFs->reset();
+	assert(virtualFileSystem.isDir("/mem/dir") == false);
+	assert(virtualFileSystem.isFile("/mem/dir/file7.txt") == false);
+	assert(virtualFileSystem.isFile("/snap/dir/file7.txt") == true);
+	assert(memcmp(stream->view(), small.data(), small.size()) == 0);
+	std::vector<uint8_t> buf(big.size());
+	assert(bigStream->read(buf.data(), buf.size()) == big.size() && buf == big);
+	assert(memFs->arenaBytes() < MemoryPool::PAGE_SIZE);
+}
+
+void memoryForkReleaseTest()
+{
+	VirtualFileSystem virtualFileSystem;
+	auto memFs = new MemoryFileSystem("", "/mem");
+	virtualFileSystem.mount(memFs);
+	assert(virtualFileSystem.createDir("/mem/dir") == true);
+	uint64_t emptyBytes = memFs->arenaBytes();
+
+	// adopted buffers, inline files and files written through streams
+	const int count = 32;
+	std::vector<uint8_t> big(16 * 1024, 'b');
+	std::vector<uint8_t> small(100, 's');
+	for (int i = 0; i < count; ++i)
+	{
+		assert(virtualFileSystem.writeFile("/mem/dir/big" + std::to_string(i), std::vector<uint8_t>(big)) == true);
+		assert(virtualFileSystem.writeFile("/mem/dir/small" + std::to_string(i), std::vector<uint8_t>(small)) == true);
+		auto stream = virtualFileSystem.openFileStream("/mem/dir/stream" + std::to_string(i), FileStream::Mode::WRITE);
+		assert(stream != nullptr && stream->write(big.data(), big.size()) == big.size());
+	}
+	memFs->compact();
+	assert(memFs->arenaBytes() >= emptyBytes + count * big.size());
+
+	// files from before the fork are released once neither side references them
+	auto forkFs = memFs->fork("/fork");
+	assert(virtualFileSystem.mount(forkFs) == true);
+	for (auto& root : { std::string("/mem/dir/"), std::string("/fork/dir/") })
+	{
+		for (int i = 0; i < count; ++i)
+		{
+			assert(virtualFileSystem.removeFile(root + "big" + std::to_string(i)) == true);
+			assert(virtualFileSystem.removeFile(root + "small" + std::to_string(i)) == true);
+			assert(virtualFileSystem.removeFile(root + "stream" + std::to_string(i)) == true);
+		}
+		if (root == "/mem/dir/")
+			assert(forkFs->arenaBytes() >= count * big.size() && forkFs->usage().residentBytes >= 2 * count * big.size());
+	}
+	assert(memFs->arenaBytes() < emptyBytes + big.size());
+	assert(forkFs->arenaBytes() < emptyBytes + big.size());
+	assert(memFs->usage().residentBytes < emptyBytes + big.size());
+	assert(forkFs->usage().residentBytes < emptyBytes + big.size());
+
+	// the same once the copy is gone
+	assert(virtualFileSystem.writeFile("/mem/dir/big", std::vector<uint8_t>(big)) == true);
+	delete memFs->snapshot("/snap");
+	uint64_t withSnapshot = memFs->arenaBytes();
+	assert(virtualFileSystem.removeFile("/mem/dir/big") == true);
+	assert(memFs->arenaBytes() + big.size() <= withSnapshot);
+}
+
+void memoryBudgetTest()
+{
+	const std::string spillDir = "./test-data/spill";
+	std::filesystem::remove_all(spillDir);
+
+	VirtualFileSystem virtualFileSystem;
+	auto memFs = new MemoryFileSystem("", "/mem");
+	memFs->setBudget(4 * MemoryPool::PAGE_SIZE, spillDir);
+	virtualFileSystem.mount(memFs);
+
+	std::vector<std::vector<uint8_t>> contents;
+	for (int i = 0; i < 8; ++i)
+	{
+		contents.emplace_back(MemoryPool::PAGE_SIZE + 100, uint8_t('a' + i));
+		assert(writeFile(virtualFileSystem, "/mem/file" + std::to_string(i) + ".bin", contents.back()) == true);
+	}
+
+	// the first files written are the coldest
+	memFs->enforceBudget();
+	auto usage = memFs->usage();
+	assert(usage.residentBytes <= 4 * MemoryPool::PAGE_SIZE);
+	assert(usage.spilledFiles > 0 && usage.spilledBytes == usage.spilledFiles * contents[0].size());
+	assert(usage.totalBytes == usage.residentBytes + usage.spilledBytes);
+	assert(std::distance(std::filesystem::directory_iterator(spillDir), std::filesystem::directory_iterator()) == usage.spilledFiles);
+
+	// opening a spilled file reads it back transparently
+	for (int i = 0; i < 8; ++i)
+	{
+		auto stream = virtualFileSystem.openFileStream("/mem/file" + std::to_string(i) + ".bin", FileStream::Mode::READ);
+		assert(stream != nullptr && stream->size() == contents[i].size());
+		std::vector<uint8_t> buf(contents[i].size());
+		assert(stream->read(buf.data(), buf.size()) == buf.size() && buf == contents[i]);
+	}
+	assert(memFs->usage().residentBytes <= 5 * MemoryPool::PAGE_SIZE);
+
+	// a spill file that can not be read fails the open and keeps the content for the next one
+	memFs->enforceBudget();
+	std::vector<std::filesystem::path> moved;
+	for (auto& entry : std::filesystem::directory_iterator(spillDir))
+		moved.push_back(entry.path());
+	for (auto& path : moved)
+		std::filesystem::rename(path, path.string() + ".bak");
+	size_t failed = 0;
+	for (int i = 0; i < 8; ++i)
+	{
+		if (virtualFileSystem.openFileStream("/mem/file" + std::to_string(i) + ".bin", FileStream::Mode::READ) == nullptr)
+			++failed;
+	}
+	assert(!moved.empty() && failed == moved.size());
+	for (auto& path : moved)
+		std::filesystem::rename(path.string() + ".bak", path);
+	for (int i = 0; i < 8; ++i)
+	{
+		auto stream = virtualFileSystem.openFileStream("/mem/file" + std::to_string(i) + ".bin", FileStream::Mode::READ);
+		std::vector<uint8_t> buf(contents[i].size());
+		assert(stream != nullptr && stream->read(buf.data(), buf.size()) == buf.size() && buf == contents[i]);
+	}
+
+	// files open in a stream stay resident, the search is not repeated until one of them is closed
+	{
+		std::vector<std::unique_ptr<FileStream>> pinned;
+		for (int i = 0; i < 8; ++i)
+			pinned.push_back(virtualFileSystem.openFileStream("/mem/file" + std::to_string(i) + ".bin", FileStream::Mode::READ));
+		memFs->enforceBudget();
+		memFs->enforceBudget();
+		assert(memFs->usage().spilledFiles == 0 && memFs->usage().residentBytes > 8 * MemoryPool::PAGE_SIZE);
+	}
+	memFs->enforceBudget();
+	assert(memFs->usage().spilledFiles > 0 && memFs->usage().residentBytes <= 4 * MemoryPool::PAGE_SIZE);
+
+	// chunks shared with a fork stay resident, spilling either side would free nothing
+	memFs->setBudget(0);
+	for (int i = 0; i < 8; ++i)
+		virtualFileSystem.openFileStream("/mem/file" + std::to_string(i) + ".bin", FileStream::Mode::READ);
+	auto fork = memFs->fork("/fork");
+	virtualFileSystem.mount(fork);
+	for (int i = 0; i < 8; ++i)
+		assert(virtualFileSystem.openFileStream("/fork/file" + std::to_string(i) + ".bin", FileStream::Mode::APPEND) != nullptr);
+	memFs->setBudget(4 * MemoryPool::PAGE_SIZE, spillDir);
+	memFs->enforceBudget();
+	assert(memFs->usage().spilledFiles == 0 && fork->usage().spilledFiles == 0);
+	virtualFileSystem.unmount(fork);
+	memFs->enforceBudget();
+	assert(memFs->usage().spilledFiles > 0 && memFs->usage().residentBytes <= 4 * MemoryPool::PAGE_SIZE);
+
+	// spill files go away with the file system
+	virtualFileSystem.unmount(memFs);
+	assert(std::filesystem::is_empty(spillDir));
+	std::filesystem::remove_all(spillDir);
+}
+
+void memoryCompressionTest()
+{
+	VirtualFileSystem virtualFileSystem;
+	auto memFs = new MemoryFileSystem("", "/mem");
+	virtualFileSystem.mount(memFs);
+
+	std::string json;
+	for (int i = 0; json.size() < 200 * 1024; ++i)
+		json += "{\"id\": " + std::to_string(i) + ", \"name\": \"item\", \"tags\": [\"a\", \"b\"]},\n";
+	std::vector<uint8_t> text(json.begin(), json.end());
+	std::vector<uint8_t> noise(100 * 1024);
+	uint32_t seed = 1;
+	for (auto& c : noise)
+		c = uint8_t((seed = seed * 1103515245 + 12345) >> 16);
+	assert(writeFile(virtualFileSystem, "/mem/data.json", text) == true);
+	assert(writeFile(virtualFileSystem, "/mem/noise.bin", noise) == true);
+
+	auto readAll = [&virtualFileSystem](const std::string& path) {
+		auto stream = virtualFileSystem.openFileStream(path, FileStream::Mode::READ);
+		std::vector<uint8_t> data(stream->size());
+		stream->read(data.data(), data.size());
+		return data;
+	};
+
+	memFs->setCompression(64 * 1024, 0);
+	memFs->compressCold();
+	auto usage = memFs->usage();
+#ifdef VFS_HAS_ZLIB
+	// random bytes do not compress and stay as they are
+	assert(usage.compressedFiles == 1 && usage.uncompressedBytes == text.size());
+	assert(usage.compressedBytes < text.size() / 4);
+#else
+	assert(usage.compressedFiles == 0);
+#endif
+	assert(readAll("/mem/data.json") == text);
+	assert(readAll("/mem/noise.bin") == noise);
+
+	// idle files are picked up by the background thread
+	memFs->setCompression(0, 20);
+	for (int i = 0; i < 200 && memFs->usage().compressedFiles == 0; ++i)
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+#ifdef VFS_HAS_ZLIB
+	assert(memFs->usage().compressedFiles == 1);
+#endif
+
+	// writing to a compressed file inflates it first
+	auto stream = virtualFileSystem.openFileStream("/mem/data.json", FileStream::Mode::APPEND);
+	assert(stream->size() == text.size() && stream->write("]", 1) == 1);
+	stream = nullptr;
+	memFs->setCompression(0, 0);
+	text.push_back(']');
+	assert(readAll("/mem/data.json") == text);
+}
+
+void memoryDedupTest()
+{
+	VirtualFileSystem virtualFileSystem;
+	auto memFs = new MemoryFileSystem("", "/mem");
+	memFs->setDedup(true);
+	virtualFileSystem.mount(memFs);
+
+	std::vector<uint8_t> asset(5 * MemoryPool::PAGE_SIZE + 1234);
+	uint32_t seed = 7;
+	for (auto& c : asset)
+		c = uint8_t((seed = seed * 1103515245 + 12345) >> 16);
+	for (int i = 0; i < 10; ++i)
+		assert(writeFile(virtualFileSystem, "/mem/copy" + std::to_string(i) + ".bin", asset) == true);
+	memFs->dedupe();
+
+	// ten files, the chunks of one
+	auto usage = memFs->usage();
+	assert(usage.dedupRatio > 9.0);
+	assert(usage.residentBytes < 2 * asset.size());
+
+	auto readAll = [&virtualFileSystem](const std::string& path) {
+		auto stream = virtualFileSystem.openFileStream(path, FileStream::Mode::READ);
+		std::vector<uint8_t> data(stream->size());
+		stream->read(data.data(), data.size());
+		return data;
+	};
+
+	// writing copies only the chunk written to
+	auto stream = virtualFileSystem.openFileStream("/mem/copy3.bin", FileStream::Mode::WRITE);
+	stream->seek(2 * MemoryPool::PAGE_SIZE + 5, FileStream::SeekOrigin::SET);
+	assert(stream->write("modified", 8) == 8);
+	stream = nullptr;
+	auto modified = asset;
+	memcpy(modified.data() + 2 * MemoryPool::PAGE_SIZE + 5, "modified", 8);
+	assert(readAll("/mem/copy3.bin") == modified);
+	assert(readAll("/mem/copy4.bin") == asset);
+	assert(memFs->usage().residentBytes < 2 * asset.size() + MemoryPool::PAGE_SIZE);
+
+	// files written one after another dedupe as their writers close
+	assert(writeFile(virtualFileSystem, "/mem/late.bin", asset) == true);
+	assert(readAll("/mem/late.bin") == asset);
+	assert(memFs->usage().dedupRatio > 9.0);
+
+	for (int i = 0; i < 10; ++i)
+		assert(virtualFileSystem.removeFile("/mem/copy" + std::to_string(i) + ".bin") == true);
+	assert(virtualFileSystem.removeFile("/mem/late.bin") == true);
+
+	// the index lets go of chunks with their last file, no dedupe() pass needed
+	usage = memFs->usage();
+	assert(usage.indexBytes == 0 && usage.residentBytes < MemoryPool::PAGE_SIZE);
+
+	// a file that is the only user of its chunks is written in place and taken off the index
+	assert(writeFile(virtualFileSystem, "/mem/single.bin", asset) == true);
+	assert(readAll("/mem/single.bin") == asset);
+	uint64_t indexed = memFs->usage().indexBytes;
+	assert(indexed > 0);
+	stream = virtualFileSystem.openFileStream("/mem/single.bin", FileStream::Mode::WRITE);
+	stream->seek(5, FileStream::SeekOrigin::SET);
+	assert(stream->write("modified", 8) == 8);
+	assert(memFs->usage().indexBytes < indexed);
+	stream = nullptr;
+	modified = asset;
+	memcpy(modified.data() + 5, "modified", 8);
+	assert(readAll("/mem/single.bin") == modified);
+	assert(virtualFileSystem.removeFile("/mem/single.bin") == true);
+	assert(memFs->usage().indexBytes == 0);
+}
+
+void memoryConcurrentLookupTest()
+{
+	VirtualFileSystem virtualFileSystem;
+	virtualFileSystem.mount(new MemoryFileSystem("", "/mem"));
+	std::vector<uint8_t> content = { 'l', 'o', 'o', 'k', 'u', 'p' };
+	for (int i = 0; i < 100; ++i)
+		assert(writeFile(virtualFileSystem, "/mem/file" + std::to_string(i) + ".txt", content) == true);
+	assert(virtualFileSystem.createDir("/mem/other") == true);
+
+	// readers look up and open files while a writer keeps adding files next to them
+	std::atomic<bool> done(false);
+	std::thread writer([&]() {
+		for (int i = 0; i < 500; ++i)
+			writeFile(virtualFileSystem, "/mem/other/new" + std::to_string(i) + ".txt", content);
+		done = true;
+	});
+
+	std::vector<std::thread> readers;
+	for (int t = 0; t < 4; ++t)
+	{
+		readers.emplace_back([&, t]() {
+			for (int i = t; !done || i < 400; ++i)
+			{
+				std::string path = "/mem/file" + std::to_string(i % 100) + ".txt";
+				assert(virtualFileSystem.isFile(path) == true);
+				auto stream = virtualFileSystem.openFileStream(path, FileStream::Mode::READ);
+				uint8_t buf[6];
+				assert(stream != nullptr && stream->read(buf, sizeof(buf)) == sizeof(buf) && memcmp(buf, content.data(), sizeof(buf)) == 0);
+			}
+		});
+	}
+	writer.join();
+	for (auto& reader : readers)
+		reader.join();
+
+	size_t files = 0;
+	virtualFileSystem.enumerate("/mem/other/", [&files](const FileInfo&) { ++files; return false; });
+	assert(files == 500);
+}
+
+void memoryImageTest()
+{
+	const std::string imagePath = "./test-data/memory.img";
+
+	auto readAll = [](VirtualFileSystem& vfs, const std::string& path) {
+		auto stream = vfs.openFileStream(path, FileStream::Mode::READ);
+		std::vector<uint8_t> data(stream ? stream->size() : 0);
+		if (stream)
+			stream->read(data.data(), data.size());
+		return data;
+	};
+
+	std::vector<uint8_t> small = { 'i', 'm', 'a', 'g', 'e' };
+	std::vector<uint8_t> big(3 * MemoryPool::PAGE_SIZE + 17);
+	for (size_t i = 0; i < big.size(); ++i)
+		big[i] = uint8_t(i % 251);
+
+	for (bool compress : { false, true })
+	{
+		VirtualFileSystem virtualFileSystem;
+		auto source = new MemoryFileSystem("", "/src");
+		virtualFileSystem.mount(source);
+		assert(virtualFileSystem.createDir("/src/a/b") == true);
+		assert(virtualFileSystem.createDir("/src/empty") == true);
+		assert(writeFile(virtualFileSystem, "/src/a/small.txt", small) == true);
+		assert(writeFile(virtualFileSystem, "/src/a/b/big.bin", big) == true);
+		virtualFileSystem.openFileStream("/src/zero.txt", FileStream::Mode::WRITE);
+		assert(source->save(imagePath, compress) == true);
+
+		auto loaded = new MemoryFileSystem("", "/img");
+		assert(loaded->load(imagePath) == true);
+		virtualFileSystem.mount(loaded);
+		assert(virtualFileSystem.isDir("/img/empty") == true);
+		assert(virtualFileSystem.isFile("/img/zero.txt") == true);
+		assert(readAll(virtualFileSystem, "/img/zero.txt").empty());
+		assert(readAll(virtualFileSystem, "/img/a/small.txt") == small);
+		assert(readAll(virtualFileSystem, "/img/a/b/big.bin") == big);
+
+		// uncompressed content is read from the mapped image in place
+		auto stream = virtualFileSystem.openFileStream("/img/a/b/big.bin", FileStream::Mode::READ);
+		assert((stream->view() != nullptr) == !compress);
+
+		// the first write gives the file its own copy, the image stays as it is
+		auto writer = virtualFileSystem.openFileStream("/img/a/b/big.bin", FileStream::Mode::WRITE);
+		assert(writer->write("changed", 7) == 7);
+		writer = nullptr;
+		auto changed = big;
+		memcpy(changed.data(), "changed", 7);
+		assert(readAll(virtualFileSystem, "/img/a/b/big.bin") == changed);
+		if (!compress)
+			assert(memcmp(stream->view(), big.data(), big.size()) == 0);
+		stream = nullptr;
+
+		auto reloaded = new MemoryFileSystem("", "/again");
+		assert(reloaded->load(imagePath) == true);
+		virtualFileSystem.mount(reloaded);
+		assert(readAll(virtualFileSystem, "/again/a/b/big.bin") == big);
+	}
+
+	// a damaged image is rejected and the content kept
+	std::filesystem::resize_file(imagePath, std::filesystem::file_size(imagePath) - 1);
+	MemoryFileSystem memFs("", "/mem");
+	assert(memFs.createDir("/keep") == true);
+	assert(memFs.load(imagePath) == false);
+	assert(memFs.load("./test-data/missing.img") == false);
+	assert(memFs.isDir("/keep") == true);
+
+	// names that could not be looked up or that shadow another entry are rejected too
+	for (auto& rename : std::vector<std::pair<std::string, std::string>>{ { "dup_2.txt", "dup_1.txt" }, { "dir_name", "dir/name" } })
+	{
+		MemoryFileSystem source("", "/src");
+		assert(source.writeFile("/dup_1.txt", std::vector<uint8_t>(small)) == true);
+		assert(source.writeFile("/dup_2.txt", std::vector<uint8_t>(small)) == true);
+		assert(source.writeFile("/dir_name", std::vector<uint8_t>(small)) == true);
+		assert(source.save(imagePath, false) == true);
+
+		std::vector<uint8_t> image(std::filesystem::file_size(imagePath));
+		FILE* file = fopen(imagePath.c_str(), "rb+");
+		assert(file != nullptr && fread(image.data(), 1, image.size(), file) == image.size());
+		auto it = std::search(image.begin(), image.end(), rename.first.begin(), rename.first.end());
+		assert(it != image.end());
+		memcpy(&*it, rename.second.data(), rename.second.size());
+		fseek(file, 0, SEEK_SET);
+		assert(fwrite(image.data(), 1, image.size(), file) == image.size());
+		fclose(file);
+
+		assert(memFs.load(imagePath) == false);
+		assert(memFs.isDir("/keep") == true);
+	}
+	std::filesystem::remove(imagePath);
+}
+
+void memoryWriteFileTest()
+{
+	VirtualFileSystem virtualFileSystem;
+	auto memFs = new MemoryFileSystem("", "/mem");
+	virtualFileSystem.mount(memFs);
+	assert(virtualFileSystem.createDir("/mem/d") == true);
+
+	auto readAll = [&](const std::string& path) {
+		auto stream = virtualFileSystem.openFileStream(path, FileStream::Mode::READ);
+		std::vector<uint8_t> data(stream ? stream->size() : 0);
+		if (stream)
+			stream->read(data.data(), data.size());
+		return data;
+	};
+
+	// the buffer is taken over, reads see the very same bytes
+	std::vector<uint8_t> big(MemoryPool::PAGE_SIZE + 3, 'b');
+	const uint8_t* bigBytes = big.data();
+	uint64_t arenaBefore = memFs->arenaBytes();
+	assert(virtualFileSystem.writeFile("/mem/d/big.bin", std::move(big)) == true);
+	assert(memFs->arenaBytes() - arenaBefore >= MemoryPool::PAGE_SIZE + 3);
+	auto reader = virtualFileSystem.openFileStream("/mem/d/big.bin", FileStream::Mode::READ);
+	assert(reader->view() == bigBytes && reader->size() == MemoryPool::PAGE_SIZE + 3);
+
+	// replacing the file, even with less data, leaves open readers on the old content
+	std::vector<uint8_t> small = { 's', 'm', 'a', 'l', 'l' };
+	assert(virtualFileSystem.writeFile("/mem/d/big.bin", std::vector<uint8_t>(small)) == true);
+	assert(readAll("/mem/d/big.bin") == small);
+	assert(reader->view()[MemoryPool::PAGE_SIZE + 2] == 'b');
+	reader = nullptr;
+
+	// a missing directory or an open file fails and keeps the buffer
+	std::vector<uint8_t> kept(4096, 'k');
+	assert(virtualFileSystem.writeFile("/mem/missing/file.bin", std::move(kept)) == false);
+	assert(kept.size() == 4096);
+	auto writer = virtualFileSystem.openFileStream("/mem/d/open.bin", FileStream::Mode::WRITE);
+	assert(virtualFileSystem.writeFile("/mem/d/open.bin", std::move(kept)) == false);
+	assert(kept.size() == 4096);
+	writer = nullptr;
+	assert(virtualFileSystem.writeFile("/mem/d/open.bin", std::move(kept)) == true);
+
+	// adopted content is written on like any other file
+	writer = virtualFileSystem.openFileStream("/mem/d/open.bin", FileStream::Mode::WRITE);
+	assert(writer->write("new", 3) == 3);
+	writer = nullptr;
+	auto expected = std::vector<uint8_t>(4096, 'k');
+	memcpy(expected.data(), "new", 3);
+	assert(readAll("/mem/d/open.bin") == expected);
+
+	// a fork keeps the content the source drops
+	std::unique_ptr<MemoryFileSystem> fork(memFs->fork("/fork"));
+	assert(virtualFileSystem.writeFile("/mem/d/shared.bin", std::vector<uint8_t>(8192, 's')) == true);
+	std::unique_ptr<MemoryFileSystem> later(memFs->fork("/later"));
+	assert(memFs->removeFile("/d/shared.bin") == true);
+	auto stream = later->openFileStream("/d/shared.bin", FileStream::Mode::READ);
+	assert(stream && stream->size() == 8192 && stream->view()[8191] == 's');
+
+	// bulk ingest creates the directories it needs
+	std::vector<std::pair<std::string, std::vector<uint8_t>>> files;
+	for (int i = 0; i < 50; ++i)
+		files.emplace_back("/bulk/" + std::to_string(i % 5) + "/file" + std::to_string(i) + ".bin", std::vector<uint8_t>(i * 100, uint8_t(i)));
+	files.emplace_back("/bulk/0/", std::vector<uint8_t>(10));
+	assert(memFs->writeFiles(std::move(files)) == 50);
+	assert(readAll("/mem/bulk/4/file49.bin") == std::vector<uint8_t>(4900, 49));
+	assert(readAll("/mem/bulk/0/file0.bin").empty());
+	int count = 0;
+	virtualFileSystem.enumerate("/mem/bulk/3/", [&](const FileInfo& info) -> bool {
+		++count;
+		return false;
+	});
+	assert(count == 10);
+}
+
+void nativeWriteFileTest()
+{
+	const std::string root = "./test-data/writefile";
+	std::filesystem::remove_all(root);
+
+	// a mount resolving through its root fd, one with write back, and one whose root did not exist at init()
+	// so it opens by path
+	std::vector<std::string> mounts = { "/fd", "/wb", "/path" };
+	VirtualFileSystem virtualFileSystem;
+	std::filesystem::create_directories(root + "/fd");
+	std::filesystem::create_directories(root + "/wb");
+	assert(virtualFileSystem.mount(new NativeFileSystem(root + "/fd", "/fd")) == true);
+	auto writeBackFs = new NativeFileSystem(root + "/wb", "/wb");
+	writeBackFs->setWriteBack(WriteBackPolicy());
+	assert(virtualFileSystem.mount(writeBackFs) == true);
+	assert(virtualFileSystem.mount(new NativeFileSystem(root + "/path", "/path")) == true);
+	std::filesystem::create_directories(root + "/path");
+
+	for (auto& mount : mounts)
+	{
+		// a shorter buffer replaces the whole content, nothing of the old tail is left
+		std::vector<uint8_t> small = { 's', 'm', 'a', 'l', 'l' };
+		assert(virtualFileSystem.writeFile(mount + "/file.bin", std::vector<uint8_t>(10000, 'b')) == true);
+		assert(virtualFileSystem.writeFile(mount + "/file.bin", std::vector<uint8_t>(small)) == true);
+		assert(virtualFileSystem.sync() == true);
+		assert(std::filesystem::file_size(root + mount + "/file.bin") == small.size());
+
+		auto stream = virtualFileSystem.openFileStream(mount + "/file.bin", FileStream::Mode::READ);
+		std::vector<uint8_t> data(20);
+		assert(stream != nullptr && stream->size() == small.size());
+		data.resize(stream->read(data.data(), data.size()));
+		assert(data == small);
+	}
+
+	std::filesystem::remove_all(root);
+}
+
+#ifdef __linux__
+void memorySharedTest()
+{
+	std::vector<uint8_t> small = { 's', 'h', 'a', 'r', 'e', 'd' };
+	std::vector<uint8_t> big(2 * MemoryPool::PAGE_SIZE + 9);
+	for (size_t i = 0; i < big.size(); ++i)
+		big[i] = uint8_t(i % 241);
+
+	MemoryFileSystem source("", "/src");
+	assert(source.createDir("/a") == true);
+	assert(source.writeFile("/a/small.txt", std::vector<uint8_t>(small)) == true);
+	assert(source.writeFile("/a/big.bin", std::vector<uint8_t>(big)) == true);
+
+	int fd = source.share();
+	assert(fd >= 0);
+
+	// sealed, nobody can change the pages under an attached mapping
+	assert(::pwrite(fd, "x", 1, 0) < 0);
+
+	VirtualFileSystem virtualFileSystem;
+	auto attached = new MemoryFileSystem("", "/shared");
+	assert(attached->attach(fd) == true);
+	::close(fd);
+	assert(virtualFileSystem.mount(attached) == true);
+	assert(attached->isReadonly() == true);
+	assert(virtualFileSystem.openFileStream("/shared/a/new.txt", FileStream::Mode::WRITE) == nullptr);
+
+	auto stream = virtualFileSystem.openFileStream("/shared/a/big.bin", FileStream::Mode::READ);
+	assert(stream->view() != nullptr && memcmp(stream->view(), big.data(), big.size()) == 0);
+	stream = virtualFileSystem.openFileStream("/shared/a/small.txt", FileStream::Mode::READ);
+	std::vector<uint8_t> buf(small.size());
+	assert(stream->read(buf.data(), buf.size()) == small.size() && buf == small);
+
+	// the shared fd serves the file to sendfile without going through the process
+	int sharedFd = -1;
+	uint64_t offset = 0, length = 0;
+	assert(attached->sharedExtent("/a/big.bin", sharedFd, offset, length) == true);
+	assert(length == big.size());
+	assert(attached->sharedExtent("/a/missing.bin", sharedFd, offset, length) == false);
+
+	const std::string outPath = "./test-data/sendfile.bin";
+	int out = ::open(outPath.c_str(), O_CREAT | O_RDWR | O_TRUNC | O_CLOEXEC, 0644);
+	off_t sendOffset = (off_t)offset;
+	assert(::sendfile(out, sharedFd, &sendOffset, length) == (ssize_t)length);
+	::close(out);
+	assert(readFileToVector(outPath) == big);
+	std::filesystem::remove(outPath);
+
+	// the attached content no longer depends on the source
+	assert(source.removeFile("/a/big.bin") == true);
+	assert(attached->isFile("/a/big.bin") == true);
+}
+#endif
+
+void memoryJournalTest()
+{
+	const std::string journalDir = "./test-data/journal";
+	const std::string logPath = journalDir + "/memory.log";
+	std::filesystem::remove_all(journalDir);
+	std::filesystem::create_directories(journalDir);
+
+	auto readAll = [](VirtualFileSystem& vfs, const std::string& path) {
+		auto stream = vfs.openFileStream(path, FileStream::Mode::READ);
+		std::vector<uint8_t> data(stream ? stream->size() : 0);
+		if (stream)
+			stream->read(data.data(), data.size());
+		return data;
+	};
+
+	auto mountJournaled = [&](VirtualFileSystem& vfs, const JournalPolicy& policy) {
+		auto memFs = new MemoryFileSystem("", "/mem");
+		memFs->setJournal(logPath, policy);
+		assert(vfs.mount(memFs) == true);
+		return memFs;
+	};
+
+	std::vector<uint8_t> small = { 'j', 'o', 'u', 'r', 'n', 'a', 'l' };
+	std::vector<uint8_t> big(2 * MemoryPool::PAGE_SIZE + 5);
+	for (size_t i = 0; i < big.size(); ++i)
+		big[i] = uint8_t(i % 253);
+	auto patched = big;
+	memcpy(patched.data() + 100, "patch", 5);
+
+	{
+		VirtualFileSystem virtualFileSystem;
+		mountJournaled(virtualFileSystem, JournalPolicy());
+		assert(virtualFileSystem.createDir("/mem/a/b") == true);
+		assert(virtualFileSystem.writeFile("/mem/a/adopted.bin", std::vector<uint8_t>(5000, 'x')) == true);
+		assert(virtualFileSystem.writeFile("/mem/a/adopted.bin", std::vector<uint8_t>(small)) == true);
+		assert(writeFile(virtualFileSystem, "/mem/a/small.txt", small) == true);
+		assert(writeFile(virtualFileSystem, "/mem/a/b/big.bin", big) == true);
+		assert(writeFile(virtualFileSystem, "/mem/gone.txt", small) == true);
+		assert(virtualFileSystem.removeFile("/mem/gone.txt") == true);
+
+		auto writer = virtualFileSystem.openFileStream("/mem/a/b/big.bin", FileStream::Mode::WRITE);
+		writer->seek(100, FileStream::SeekOrigin::SET);
+		assert(writer->write("patch", 5) == 5);
+	}
+
+	// everything comes back from the log alone
+	{
+		VirtualFileSystem virtualFileSystem;
+		mountJournaled(virtualFileSystem, JournalPolicy());
+		assert(virtualFileSystem.isDir("/mem/a/b") == true);
+		assert(virtualFileSystem.isFile("/mem/gone.txt") == false);
+		assert(readAll(virtualFileSystem, "/mem/a/small.txt") == small);
+		assert(readAll(virtualFileSystem, "/mem/a/adopted.bin") == small);
+		assert(readAll(virtualFileSystem, "/mem/a/b/big.bin") == patched);
+	}
+
+	// a log past the policy is compacted into a snapshot by the background thread
+	{
+		JournalPolicy policy;
+		policy.durability = JournalDurability::Async;
+		policy.commitInterval = std::chrono::milliseconds(1);
+		policy.compactRatio = 0.5;
+		policy.compactMinBytes = big.size();
+
+		VirtualFileSystem virtualFileSystem;
+		auto memFs = mountJournaled(virtualFileSystem, policy);
+		assert(writeFile(virtualFileSystem, "/mem/c/copy.bin", big) == false);
+		assert(virtualFileSystem.createDir("/mem/c") == true);
+		assert(writeFile(virtualFileSystem, "/mem/c/copy.bin", big) == true);
+		memFs->sync();
+
+		// .old is missing before the compaction starts too, only a snapshot without it marks the end
+		for (int i = 0; i < 2000 && (!std::filesystem::exists(MemoryJournal::snapshotPath(logPath)) || std::filesystem::exists(logPath + ".old")); ++i)
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		for (int i = 0; i < 2000 && std::filesystem::file_size(logPath) > big.size(); ++i)
+			std::this_thread::sleep_for(std::chrono::milliseconds(1));
+		assert(std::filesystem::exists(MemoryJournal::snapshotPath(logPath)) == true);
+		assert(std::filesystem::file_size(logPath) < big.size());
+	}
+
+	// a torn record at the end of the log is dropped, the records before it are kept
+	{
+		std::ofstream log(logPath, std::ios::binary | std::ios::app);
+		log.write("\x40\x00\x00\x00torn", 8);
+	}
+	{
+		VirtualFileSystem virtualFileSystem;
+		mountJournaled(virtualFileSystem, JournalPolicy());
+		assert(readAll(virtualFileSystem, "/mem/a/b/big.bin") == patched);
+		assert(readAll(virtualFileSystem, "/mem/c/copy.bin") == big);
+		assert(writeFile(virtualFileSystem, "/mem/after.txt", small) == true);
+	}
+	{
+		VirtualFileSystem virtualFileSystem;
+		auto memFs = mountJournaled(virtualFileSystem, JournalPolicy());
+		assert(readAll(virtualFileSystem, "/mem/after.txt") == small);
+
+		// a reset is journaled like any other change
+		memFs->reset();
+	}
+	{
+		VirtualFileSystem virtualFileSystem;
+		mountJournaled(virtualFileSystem, JournalPolicy());
+		assert(virtualFileSystem.isFile("/mem/a/small.txt") == false);
+		assert(virtualFileSystem.isDir("/mem/a") == false);
+	}
+
+#ifdef __linux__
+	// a failed append is latched and reported, the log keeps every record committed before it
+	{
+		VirtualFileSystem virtualFileSystem;
+		auto memFs = mountJournaled(virtualFileSystem, JournalPolicy());
+		assert(virtualFileSystem.writeFile("/mem/before.txt", std::vector<uint8_t>(small)) == true);
+		assert(memFs->sync() == true);
+
+		// writes past the file size limit fail with EFBIG instead of raising SIGXFSZ. The limit applies to
+		// redirected output too, which is flushed first.
+		fflush(stdout);
+		struct rlimit limit;
+		getrlimit(RLIMIT_FSIZE, &limit);
+		auto handler = signal(SIGXFSZ, SIG_IGN);
+		struct rlimit capped = limit;
+		capped.rlim_cur = std::filesystem::file_size(logPath) + 64;
+		setrlimit(RLIMIT_FSIZE, &capped);
+		assert(virtualFileSystem.writeFile("/mem/lost.bin", std::vector<uint8_t>(big)) == true);
+		bool synced = memFs->sync();
+		setrlimit(RLIMIT_FSIZE, &limit);
+		signal(SIGXFSZ, handler);
+		assert(synced == false && memFs->flush() == false);
+	}
+	{
+		VirtualFileSystem virtualFileSystem;
+		mountJournaled(virtualFileSystem, JournalPolicy());
+		assert(readAll(virtualFileSystem, "/mem/before.txt") == small);
+		assert(readAll(virtualFileSystem, "/mem/lost.bin").empty());
+	}
+#endif
+	std::filesystem::remove_all(journalDir);
+}
+
+void mmapTest()
+{
+	auto data = readFileToVector("./test-data/template.zip");
+
+	auto nativeFs = new NativeFileSystem("./test-data", "/root");
+	nativeFs->setMmapThreshold(1024);
+	nativeFs->setMmapAdvice(MmapAdvice::Sequential | MmapAdvice::WillNeed);
+	nativeFs->setMmapHint("dlc1/file.txt", MmapAdvice::Normal);
+
+	VirtualFileSystem virtualFileSystem;
+	assert(virtualFileSystem.mount(nativeFs) == true);
+
+	auto stream1 = virtualFileSystem.openFileStream("/root/template.zip", FileStream::Mode::READ);
+	auto stream2 = virtualFileSystem.openFileStream("/root/template.zip", FileStream::Mode::READ);
+	assert(stream1 != nullptr && stream2 != nullptr);
+	assert(stream1->view() != nullptr);
+	assert(stream1->view() == stream2->view());
+	assert(stream1->size() == data.size());
+	assert(memcmp(stream1->view(), data.data(), data.size()) == 0);
+
+	std::vector<uint8_t> buf(data.size());
+	stream2->seek(10, FileStream::SeekOrigin::SET);
+	assert(stream2->read(buf.data(), buf.size()) == data.size() - 10);
+	assert(memcmp(buf.data(), data.data() + 10, data.size() - 10) == 0);
+
+	// small file selected by hint
+	auto stream3 = virtualFileSystem.openFileStream("/root/dlc1/file.txt", FileStream::Mode::READ);
+	assert(stream3 != nullptr && stream3->view() != nullptr);
+
+	// writes never use a mapping
+	assert(virtualFileSystem.openFileStream("/root/template.zip", FileStream::Mode::APPEND)->view() == nullptr);
+}
+
+void statCacheTest()
+{
+	std::vector<uint8_t> bin = { 'H', 'E', 'L', 'L', 'O' };
+
+	auto nativeFs = new NativeFileSystem("./test-data/dlc1", "/root");
+	nativeFs->setStatCacheTTL(std::chrono::seconds(60));
+
+	VirtualFileSystem virtualFileSystem;
+	assert(virtualFileSystem.mount(nativeFs) == true);
+
+	// writes, removes and createDir through the mount keep the cache coherent
+	assert(virtualFileSystem.isFile("/root/stat_cache.txt") == false);
+	assert(writeFile(virtualFileSystem, "/root/stat_cache.txt", bin) == true);
+	assert(virtualFileSystem.isFile("/root/stat_cache.txt") == true);
+	assert(virtualFileSystem.removeFile("/root/stat_cache.txt") == true);
+	assert(virtualFileSystem.isFile("/root/stat_cache.txt") == false);
+
+	assert(virtualFileSystem.isDir("/root/stat_cache_dir/sub") == false);
+	assert(virtualFileSystem.isDir("/root/stat_cache_dir") == false);
+	assert(virtualFileSystem.createDir("/root/stat_cache_dir/sub") == true);
+	assert(virtualFileSystem.isDir("/root/stat_cache_dir/sub") == true);
+	assert(virtualFileSystem.isDir("/root/stat_cache_dir") == true);
+
+	// changes made behind the mount's back need an explicit invalidate
+	assert(virtualFileSystem.isFile("/root/stat_cache_dir/sub/outside.txt") == false);
+	std::ofstream("./test-data/dlc1/stat_cache_dir/sub/outside.txt") << "outside";
+	assert(virtualFileSystem.isFile("/root/stat_cache_dir/sub/outside.txt") == false);
+	nativeFs->invalidate("/root/stat_cache_dir/sub/outside.txt");
+	assert(virtualFileSystem.isFile("/root/stat_cache_dir/sub/outside.txt") == true);
+	assert(virtualFileSystem.removeFile("/root/stat_cache_dir/sub/outside.txt") == true);
+
+	// paths relative to the mount root name the same entry
+	assert(virtualFileSystem.isFile("/root/stat_cache_dir/sub/outside.txt") == false);
+	std::ofstream("./test-data/dlc1/stat_cache_dir/sub/outside.txt") << "outside";
+	assert(virtualFileSystem.isFile("/root/stat_cache_dir/sub/outside.txt") == false);
+	nativeFs->invalidate("stat_cache_dir/sub/outside.txt");
+	assert(virtualFileSystem.isFile("/root/stat_cache_dir/sub/outside.txt") == true);
+	assert(virtualFileSystem.removeFile("/root/stat_cache_dir/sub/outside.txt") == true);
+}
+
+void nativeEnumerateTest()
+{
+	VirtualFileSystem virtualFileSystem;
+	assert(virtualFileSystem.mount(new NativeFileSystem("./test-data/dlc2", "/root")) == true);
+
+	std::set<std::string> expected;
+	for (const auto& entry : std::filesystem::directory_iterator("./test-data/dlc2/files"))
+	{
+		expected.insert(std::string(entry.is_directory() ? "dir:" : "file:") + "/root/files/" + entry.path().filename().string());
+	}
+
+	std::set<std::string> actual;
+	virtualFileSystem.enumerate("/root/files/", [&actual](const FileInfo& info) -> bool {
+		actual.insert(std::string((info.flags & FileFlags::Dir) ? "dir:" : "file:") + info.filePath);
+		return false;
+	});
+	assert(actual == expected);
+
+	size_t count = 0;
+	virtualFileSystem.enumerate("/root/", [&count](const FileInfo& info) -> bool {
+		return ++count == 2;
+	});
+	assert(count == 2);
+}
+
+void rootFdTest()
+{
+	std::filesystem::remove_all("./test-data/rootfd");
+	std::filesystem::remove_all("./test-data/rootfd-moved");
+	std::filesystem::create_directories("./test-data/rootfd");
+
+	VirtualFileSystem virtualFileSystem;
+	assert(virtualFileSystem.mount(new NativeFileSystem("./test-data/rootfd", "/root")) == true);
+
+	std::vector<uint8_t> bin = { 'r', 'o', 'o', 't', 'f', 'd' };
+	assert(virtualFileSystem.createDir("/root/a/b") == true);
+	assert(writeFile(virtualFileSystem, "/root/a/b/file.bin", bin) == true);
+
+	// everything keeps resolving through the root fd after the mount root is renamed
+	std::filesystem::rename("./test-data/rootfd", "./test-data/rootfd-moved");
+	assert(!std::filesystem::exists("./test-data/rootfd"));
+
+	assert(virtualFileSystem.isDir("/root/a/b") == true);
+	assert(virtualFileSystem.isFile("/root/a/b/file.bin") == true);
+
+	auto stream = virtualFileSystem.openFileStream("/root/a/b/file.bin", FileStream::Mode::READ);
+	assert(stream != nullptr && stream->size() == bin.size());
+	std::vector<uint8_t> data(bin.size());
+	assert(stream->read(data.data(), data.size()) == bin.size());
+	assert(data == bin);
+	stream = nullptr;
+
+	// write streams are served by the descriptor opened through the root fd too
+	stream = virtualFileSystem.openFileStream("/root/a/b/file.bin", FileStream::Mode::APPEND);
+	assert(stream != nullptr && stream->write("!", 1) == 1 && stream->size() == bin.size() + 1);
+	stream = nullptr;
+	assert(std::filesystem::file_size("./test-data/rootfd-moved/a/b/file.bin") == bin.size() + 1);
+
+	size_t count = 0;
+	virtualFileSystem.enumerate("/root/a/b/", [&count](const FileInfo& info) -> bool {
+		assert(info.filePath == "/root/a/b/file.bin");
+		++count;
+		return false;
+	});
+	assert(count == 1);
+
+	assert(virtualFileSystem.createDir("/root/c") == true);
+	assert(std::filesystem::is_directory("./test-data/rootfd-moved/c"));
+	assert(virtualFileSystem.removeFile("/root/a/b/file.bin") == true);
+	assert(!std::filesystem::exists("./test-data/rootfd-moved/a/b/file.bin"));
+
+	std::filesystem::remove_all("./test-data/rootfd-moved");
+}
+
+void nativeIndexTest()
+{
+	const std::string root = "./test-data/indexed";
+	const std::string manifest = "./test-data/indexed.vfsindex";
+	std::filesystem::remove_all(root);
+	std::filesystem::remove(manifest);
+	std::filesystem::create_directories(root + "/a/b");
+	std::filesystem::create_directories(root + "/c");
+	for (auto file : { "/top.txt", "/a/one.txt", "/a/b/two.txt" })
+		std::ofstream(root + file) << file;
+
+	auto listDir = [](VirtualFileSystem& vfs, const std::string& dir) {
+		std::set<std::string> entries;
+		vfs.enumerate(dir, [&entries](const FileInfo& info) -> bool {
+			entries.insert(std::string((info.flags & FileFlags::Dir) ? "dir:" : "file:") + info.filePath);
+			return false;
+		});
+		return entries;
+	};
+
+	{
+		auto nativeFs = new NativeFileSystem(root, "/idx");
+		nativeFs->setIndexed(true);
+		VirtualFileSystem virtualFileSystem;
+		assert(virtualFileSystem.mount(nativeFs) == true);
+		assert(std::filesystem::exists(manifest));
+
+		VirtualFileSystem plainFileSystem;
+		plainFileSystem.mount(new NativeFileSystem(root, "/idx"));
+		for (auto dir : { "/idx/", "/idx/a/", "/idx/a/b/", "/idx/c/", "/idx/missing/" })
+			assert(listDir(virtualFileSystem, dir) == listDir(plainFileSystem, dir));
+
+		assert(virtualFileSystem.isFile("/idx/a/b/two.txt") == true);
+		assert(virtualFileSystem.isDir("/idx/a/b") == true);
+		assert(virtualFileSystem.isFile("/idx/a/b") == false);
+		assert(virtualFileSystem.isFile("/idx/a/three.txt") == false);
+
+		// answered from memory, the external change is not seen
+		std::ofstream(root + "/a/three.txt") << "three";
+		assert(virtualFileSystem.isFile("/idx/a/three.txt") == false);
+		assert(plainFileSystem.isFile("/idx/a/three.txt") == true);
+	}
+
+	// the manifest is stale now and gets rebuilt
+	assert(NativeIndex::load(root + "/", manifest) == nullptr);
+	{
+		auto nativeFs = new NativeFileSystem(root, "/idx");
+		nativeFs->setIndexed(true, manifest);
+		VirtualFileSystem virtualFileSystem;
+		assert(virtualFileSystem.mount(nativeFs) == true);
+		assert(virtualFileSystem.isFile("/idx/a/three.txt") == true);
+	}
+
+	auto index = NativeIndex::load(root + "/", manifest);
+	assert(index != nullptr && index->size() == 8);
+	assert(index->type("a/three.txt") == NativeFileType::File);
+	assert(index->type("/a/b/") == NativeFileType::Dir);
+
+	// writes creating a file through the mount drop the index, writes over a known file keep it
+	{
+		auto nativeFs = new NativeFileSystem(root, "/idx");
+		nativeFs->setIndexed(true, manifest);
+		VirtualFileSystem virtualFileSystem;
+		assert(virtualFileSystem.mount(nativeFs) == true);
+		std::ofstream(root + "/c/external.txt") << "external";
+		std::vector<uint8_t> bin = { 'f', 'o', 'u', 'r' };
+		assert(writeFile(virtualFileSystem, "/idx/top.txt", bin) == true);
+		assert(virtualFileSystem.isFile("/idx/c/external.txt") == false);
+
+		assert(writeFile(virtualFileSystem, "/idx/c/four.txt", bin) == true);
+		assert(virtualFileSystem.isFile("/idx/c/four.txt") == true);
+		assert(virtualFileSystem.isFile("/idx/c/external.txt") == true);
+	}
+
+	std::filesystem::remove_all(root);
+	std::filesystem::remove(manifest);
+}
+
+void asyncReadTest(std::shared_ptr<IOEngine> engine)
+{
+	printf("\n\nasync read with engine: %s\n", engine->name());
+
+	VirtualFileSystem virtualFileSystem;
+	virtualFileSystem.setIOEngine(engine);
+	virtualFileSystem.mount(new NativeFileSystem("./test-data", "/root"));
+	virtualFileSystem.mount(new PackFileSystem("./test-data/test.pak", "/root"));
+	virtualFileSystem.mount(new MemoryFileSystem("", "/mem"));
+
+	std::vector<uint8_t> bin = { 'H', 'E', 'L', 'L', 'O', '^', 'v', '^' };
+	assert(writeFile(virtualFileSystem, "/mem/async.txt", bin) == true);
+
+	const char* files[] = { "/root/template.zip", "/root/packroot/packfile1.txt", "/root/packroot/packdir1/pack_img.jpg", "/mem/async.txt" };
+	for (auto file : files)
+	{
+		auto stream = virtualFileSystem.openFileStream(file, FileStream::Mode::READ);
+		assert(stream != nullptr);
+		std::vector<uint8_t> expected(stream->size());
+		stream->read(expected.data(), expected.size());
+
+		// read the file in 4KB pieces submitted as one batch
+		const uint64_t blockSize = 4096;
+		std::vector<uint8_t> actual(expected.size());
+		std::vector<AsyncReadRequest> requests;
+		std::atomic<uint64_t> total(0);
+		for (uint64_t offset = 0; offset < actual.size(); offset += blockSize)
+		{
+			AsyncReadRequest request;
+			request.filePath = file;
+			request.offset = offset;
+			request.buf = actual.data() + offset;
+			request.len = std::min<uint64_t>(blockSize, actual.size() - offset);
+			request.callback = [&total](int64_t result) {
+				assert(result >= 0);
+				total += result;
+			};
+			requests.push_back(std::move(request));
+		}
+		virtualFileSystem.readAsync(requests);
+		engine->drain();
+
+		assert(total == expected.size());
+		assert(actual == expected);
+	}
+
+	int64_t missing = 0;
+	virtualFileSystem.readAsync("/root/no_such_file", 0, nullptr, 16, [&missing](int64_t result) { missing = result; });
+	engine->drain();
+	assert(missing < 0);
+
+	// a file replaced by rename is read through a new handle, the old one is closed
+#ifdef __linux__
+	auto openFds = []() { return std::distance(std::filesystem::directory_iterator("/proc/self/fd"), std::filesystem::directory_iterator()); };
+	auto fdsBefore = openFds();
+#endif
+	for (int i = 0; i < 20; ++i)
+	{
+		std::string content = "async replace " + std::to_string(i % 10);
+		{
+			std::ofstream out("./test-data/async_replace.tmp", std::ios::binary);
+			out << content;
+		}
+		std::filesystem::rename("./test-data/async_replace.tmp", "./test-data/async_replace.txt");
+
+		char buf[64] = {};
+		int64_t result = 0;
+		virtualFileSystem.readAsync("/root/async_replace.txt", 0, buf, content.size(), [&result](int64_t r) { result = r; });
+		engine->drain();
+		assert(result == (int64_t)content.size());
+		assert(content == buf);
+	}
+#ifdef __linux__
+	assert(openFds() <= fdsBefore + 1);
+#endif
+	std::filesystem::remove("./test-data/async_replace.txt");
+}
+
+void writeBackTest(WriteBackDurability durability)
+{
+	auto data = readFileToVector("./test-data/template.zip");
+
+	WriteBackPolicy policy;
+	policy.durability = durability;
+	policy.flushInterval = std::chrono::milliseconds(10);
+
+	auto nativeFs = new NativeFileSystem("./test-data/dlc1", "/root");
+	nativeFs->setWriteBack(policy);
+
+	VirtualFileSystem virtualFileSystem;
+	assert(virtualFileSystem.mount(nativeFs) == true);
+
+	virtualFileSystem.removeFile("/root/write_back.zip");
+	{
+		// many small writes, visible to readers before they are written back
+		auto stream = virtualFileSystem.openFileStream("/root/write_back.zip", FileStream::Mode::WRITE);
+		assert(stream != nullptr);
+		for (size_t i = 0; i < data.size(); i += 100)
+		{
+			auto len = std::min<size_t>(100, data.size() - i);
+			assert(stream->write(&data[i], len) == len);
+		}
+		assert(virtualFileSystem.isFile("/root/write_back.zip") == true);
+
+		auto reader = virtualFileSystem.openFileStream("/root/write_back.zip", FileStream::Mode::READ);
+		std::vector<uint8_t> buf(data.size());
+		assert(reader->size() == data.size());
+		assert(reader->read(buf.data(), buf.size()) == data.size());
+		assert(buf == data);
+
+		// overwrite in the middle
+		stream->seek(1000, FileStream::SeekOrigin::SET);
+		assert(stream->write("XYZ", 3) == 3);
+		memcpy(&data[1000], "XYZ", 3);
+	}
+
+	auto appendStream = virtualFileSystem.openFileStream("/root/write_back.zip", FileStream::Mode::APPEND);
+	assert(appendStream->write("END", 3) == 3);
+	appendStream = nullptr;
+	data.insert(data.end(), { 'E', 'N', 'D' });
+
+	assert(virtualFileSystem.sync() == true);
+	assert(readFileToVector("./test-data/dlc1/write_back.zip") == data);
+	assert(readFile(virtualFileSystem, "/root/write_back.zip", false) == true);
+	assert(virtualFileSystem.removeFile("/root/write_back.zip") == true);
+	assert(virtualFileSystem.isFile("/root/write_back.zip") == false);
+}
+
+void writeBackPressureTest()
+{
+	// the flusher would not run on its own during this test, only blocked writers can wake it
+	WriteBackPolicy policy;
+	policy.flushInterval = std::chrono::milliseconds(60000);
+	policy.blockDirtyBytes = 64 * 1024;
+
+	auto nativeFs = new NativeFileSystem("./test-data/dlc1", "/root");
+	nativeFs->setWriteBack(policy);
+
+	VirtualFileSystem virtualFileSystem;
+	assert(virtualFileSystem.mount(nativeFs) == true);
+
+	virtualFileSystem.removeFile("/root/write_back_pressure.bin");
+	std::vector<uint8_t> block(4096, 'p');
+	{
+		auto stream = virtualFileSystem.openFileStream("/root/write_back_pressure.bin", FileStream::Mode::WRITE);
+		assert(stream != nullptr);
+		for (int i = 0; i < 256; ++i)
+		{
+			assert(stream->write(block.data(), block.size()) == block.size());
+		}
+
+		// most of the 1MB reached the disk while it was still being written
+		assert(std::filesystem::file_size("./test-data/dlc1/write_back_pressure.bin") + policy.blockDirtyBytes + block.size() >= 256 * block.size());
+	}
+
+	assert(virtualFileSystem.flush() == true);
+	assert(std::filesystem::file_size("./test-data/dlc1/write_back_pressure.bin") == 256 * block.size());
+	assert(virtualFileSystem.removeFile("/root/write_back_pressure.bin") == true);
+}
+
 void mixTest()
 {
 	VirtualFileSystem virtualFileSystem;
@@ -237,6 +2025,39 @@ int main()
 	readWriteTest<NativeFileSystem>(false);
 	readWriteTest<MemoryFileSystem>(true);
 	packTest();
+	packMmapTest();
+	packInflateTest();
+	packInflateIndexTest();
+	packBlocksTest();
+	embeddedTest();
+	memoryChunkTest();
+	memoryConcurrentReadTest();
+	memorySnapshotTest();
+	memoryTreeTest();
+	memoryInlineTest();
+	memoryForkReleaseTest();
+	memoryBudgetTest();
+	memoryCompressionTest();
+	memoryDedupTest();
+	memoryConcurrentLookupTest();
+	memoryImageTest();
+	memoryJournalTest();
+	memoryWriteFileTest();
+	nativeWriteFileTest();
+#ifdef __linux__
+	memorySharedTest();
+#endif
+	mmapTest();
+	statCacheTest();
+	nativeEnumerateTest();
+	rootFdTest();
+	nativeIndexTest();
+	asyncReadTest(IOEngine::create());
+	asyncReadTest(std::make_shared<ThreadPoolIOEngine>(2));
+	writeBackTest(WriteBackDurability::None);
+	writeBackTest(WriteBackDurability::FsyncOnClose);
+	writeBackTest(WriteBackDurability::GroupCommit);
+	writeBackPressureTest();
 	mixTest();
 	return 0;
 }
\ No newline at end of file
@@ -39,8 +39,15 @@ public:
 
     virtual uint64_t size() = 0;
 
+    // Cuts the stream to size or extends it with zeros, the position is left where it is.
+    // False if it failed or the stream can not be resized.
+    virtual bool truncate(uint64_t /*size*/) { return false; }
+
     virtual bool isOpen() const = 0;
 
+    // Whole stream content without copying, nullptr if the stream can not expose it
+    virtual const uint8_t* view() const { return nullptr; }
+
     virtual operator bool() const { return isOpen(); }
 
 protected:
@@ -2,6 +2,7 @@
 
 #include "FileStream.h"
 #include "Utils.h"
+#include <vector>
 
 NS_VFS_BEGIN
 
@@ -26,7 +27,8 @@ enum FileSystemType : uint8_t
 {
 	Native,
 	Memory,
-	PackFile
+	PackFile,
+	Embedded
 };
 
 class FileSystem
@@ -54,10 +56,30 @@ public:
 
 	virtual bool createDir(const std::string& dirPath) = 0;
 
+	// Writes data as the content of filePath. File systems that can take the buffer over without copying
+	// override this, the others write it through a WRITE stream. data is left as it was if false is returned.
+	virtual bool writeFile(const std::string& filePath, std::vector<uint8_t>&& data)
+	{
+		// WRITE streams write over the file in place, the old content is cut first so none of it is left past the new end
+		auto stream = openFileStream(filePath, FileStream::Mode::WRITE);
+		if (!stream || (stream->size() > 0 && !stream->truncate(0)))
+			return false;
+		return stream->write(data.data(), data.size()) == data.size();
+	}
+
 	virtual bool init() = 0;
 
 	virtual const std::string& basePath() const = 0;
 
+	// Native file and byte range holding the file content verbatim, used by asynchronous reads
+	virtual bool getRawExtent(const std::string& /*filePath*/, std::string& /*nativePath*/, uint64_t& /*offset*/, uint64_t& /*length*/) const { return false; }
+
+	// Writes back data buffered by the file system, false if some of it could not be written
+	virtual bool flush() { return true; }
+
+	// flush() and make the written data durable
+	virtual bool sync() { return true; }
+
 	const std::string& archiveLocation() { return m_archiveLocation; }
 
 	const std::string& mntpoint() { return m_mntpoint; }
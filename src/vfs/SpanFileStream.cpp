@@ -0,0 +1,74 @@
+#include "SpanFileStream.h"
+#include <algorithm>
+#include <string.h>
+
+NS_VFS_BEGIN
+
+SpanFileStream::SpanFileStream()
+	: m_data(nullptr)
+	, m_length(0)
+	, m_offset(0)
+{}
+
+void SpanFileStream::setSpan(const uint8_t* data, uint64_t length)
+{
+	m_data = data;
+	m_length = length;
+	m_offset = 0;
+}
+
+uint64_t SpanFileStream::seek(uint64_t offset, SeekOrigin origin)
+{
+	if (origin == SeekOrigin::CUR)
+	{
+		m_offset += offset;
+	}
+	else if (origin == SeekOrigin::END)
+	{
+		if (m_length < offset)
+			return 0;
+
+		m_offset = m_length - offset;
+	}
+	else if (origin == SeekOrigin::SET)
+	{
+		m_offset = offset;
+	}
+
+	return m_offset;
+}
+
+uint64_t SpanFileStream::read(void* buf, uint64_t size)
+{
+	if (size == 0 || m_offset >= static_cast<int64_t>(m_length))
+		return 0;
+
+	uint64_t readLen = std::min(size, m_length - m_offset);
+	::memcpy(buf, m_data + m_offset, readLen);
+	m_offset += readLen;
+	return readLen;
+}
+
+uint64_t SpanFileStream::write(const void* /*buf*/, uint64_t /*size*/)
+{
+	return 0;
+}
+
+uint64_t SpanFileStream::tell()
+{
+	if (m_offset >= static_cast<int64_t>(m_length))
+		return uint64_t(-1);
+	return m_offset;
+}
+
+uint64_t SpanFileStream::size()
+{
+	return m_length;
+}
+
+const uint8_t* SpanFileStream::view() const
+{
+	return m_data;
+}
+
+NS_VFS_END
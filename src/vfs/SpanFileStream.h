@@ -0,0 +1,37 @@
+#pragma once
+
+#include "FileStream.h"
+
+NS_VFS_BEGIN
+
+// Read-only stream over bytes in memory. Subclasses keep the bytes alive and hand them over with setSpan.
+class SpanFileStream : public FileStream
+{
+public:
+
+    SpanFileStream();
+
+    virtual uint64_t seek(uint64_t offset, SeekOrigin origin) override;
+
+    virtual uint64_t read(void* buf, uint64_t size) override;
+
+    virtual uint64_t write(const void* buf, uint64_t size) override;
+
+    virtual uint64_t tell() override;
+
+    virtual uint64_t size() override;
+
+    virtual const uint8_t* view() const override;
+
+protected:
+
+    // Serves [data, data + length) from its start, nullptr and 0 once closed
+    void setSpan(const uint8_t* data, uint64_t length);
+
+protected:
+    const uint8_t* m_data;
+    uint64_t m_length;
+    int64_t m_offset;
+};
+
+NS_VFS_END
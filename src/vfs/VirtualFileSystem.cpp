@@ -1,5 +1,7 @@
 #include "VirtualFileSystem.h"
 #include <set>
+#include <algorithm>
+#include <errno.h>
 
 #if 1
 #define LOCL_FILE_SYSTEMS_LIST void(0)
@@ -286,6 +288,50 @@ bool VirtualFileSystem::createDir(const std::string& dir) const
 	return false;
 }
 
+bool VirtualFileSystem::writeFile(const std::string& path, std::vector<uint8_t>&& data) const
+{
+	std::string filePath = simplifyPath(convertPathFormatToUnixStyle(path));
+	if (filePath.empty() || filePath.back() == '/')
+		return false;
+
+	LOCL_FILE_SYSTEMS_LIST;
+
+	std::vector<FileSystem*> fileSystems;
+	fileSystems.reserve(m_fileSystems.size());
+
+	std::string fullFilePath;
+
+	for (auto& it : m_fileSystems)
+	{
+		if (filePath.starts_with(it->mntpoint()))
+		{
+			fullFilePath = it->basePath() + filePath.substr(it->mntpoint().size());
+			if (it->isFile(fullFilePath))
+			{
+				if (it->isReadonly())
+					return false;
+
+				return it->writeFile(fullFilePath, std::move(data));
+			}
+
+			if (!it->isReadonly())
+			{
+				fileSystems.push_back(it);
+			}
+		}
+	}
+
+	for (auto it : fileSystems)
+	{
+		fullFilePath = it->basePath() + filePath.substr(it->mntpoint().size());
+		if (it->writeFile(fullFilePath, std::move(data)))
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
 bool VirtualFileSystem::copyFile(const std::string& srcFile, const std::string& dstFile) const
 {
 	auto srcFs = openFileStream(srcFile, FileStream::Mode::READ);
@@ -325,4 +371,134 @@ bool VirtualFileSystem::copyFile(const std::string& srcFile, const std::string&
 	return true;
 }
 
+bool VirtualFileSystem::flush() const
+{
+	LOCL_FILE_SYSTEMS_LIST;
+	bool result = true;
+	for (auto& it : m_fileSystems)
+	{
+		if (!it->flush())
+			result = false;
+	}
+	return result;
+}
+
+bool VirtualFileSystem::sync() const
+{
+	LOCL_FILE_SYSTEMS_LIST;
+	bool result = true;
+	for (auto& it : m_fileSystems)
+	{
+		if (!it->sync())
+			result = false;
+	}
+	return result;
+}
+
+FileSystem* VirtualFileSystem::findFile(const std::string& path, std::string& fullFilePath) const
+{
+	auto filePath = simplifyPath(convertPathFormatToUnixStyle(path));
+
+	if (filePath.empty() || filePath.back() == '/')
+		return nullptr;
+
+	LOCL_FILE_SYSTEMS_LIST;
+	for (auto& it : m_fileSystems)
+	{
+		auto& mntpoint = it->mntpoint();
+		if (filePath.starts_with(mntpoint))
+		{
+			fullFilePath = it->basePath() + filePath.substr(mntpoint.size());
+			if (it->isFile(fullFilePath))
+			{
+				return it;
+			}
+		}
+	}
+	return nullptr;
+}
+
+void VirtualFileSystem::readAsync(std::vector<AsyncReadRequest>& requests) const
+{
+	std::vector<IORequest> ioRequests;
+	ioRequests.reserve(requests.size());
+
+	std::string fullFilePath;
+	std::string nativePath;
+	uint64_t extentOffset = 0;
+	uint64_t extentLength = 0;
+
+	for (auto& request : requests)
+	{
+		auto fileSystem = findFile(request.filePath, fullFilePath);
+		if (fileSystem == nullptr)
+		{
+			if (request.callback)
+				request.callback(-ENOENT);
+			continue;
+		}
+
+		if (m_ioEngine && fileSystem->getRawExtent(fullFilePath, nativePath, extentOffset, extentLength))
+		{
+			int file = m_ioEngine->openFile(nativePath);
+			if (file >= 0)
+			{
+				if (request.offset >= extentLength)
+				{
+					m_ioEngine->closeFile(file);
+					if (request.callback)
+						request.callback(0);
+					continue;
+				}
+
+				// the engine outlives its requests, it drains them before it is destroyed
+				IOEngine* engine = m_ioEngine.get();
+				IORequest ioRequest;
+				ioRequest.file = file;
+				ioRequest.offset = extentOffset + request.offset;
+				ioRequest.buf = request.buf;
+				ioRequest.len = (uint32_t)std::min<uint64_t>({ request.len, extentLength - request.offset, UINT32_MAX });
+				ioRequest.bufIndex = -1;
+				ioRequest.callback = [engine, file, callback = std::move(request.callback)](int64_t result)
+				{
+					engine->closeFile(file);
+					if (callback)
+						callback(result);
+				};
+				ioRequests.push_back(std::move(ioRequest));
+				continue;
+			}
+		}
+
+		int64_t result = -EIO;
+		auto stream = fileSystem->openFileStream(fullFilePath, FileStream::Mode::READ);
+		if (stream)
+		{
+			result = 0;
+			if (request.offset < stream->size())
+			{
+				stream->seek(request.offset, FileStream::SeekOrigin::SET);
+				result = (int64_t)stream->read(request.buf, request.len);
+			}
+		}
+
+		if (request.callback)
+			request.callback(result);
+	}
+
+	if (!ioRequests.empty())
+		m_ioEngine->submit(ioRequests);
+}
+
+void VirtualFileSystem::readAsync(const std::string& filePath, uint64_t offset, void* buf, uint64_t len, const std::function<void(int64_t result)>& callback) const
+{
+	std::vector<AsyncReadRequest> requests(1);
+	requests[0].filePath = filePath;
+	requests[0].offset = offset;
+	requests[0].buf = buf;
+	requests[0].len = len;
+	requests[0].callback = callback;
+	readAsync(requests);
+}
+
 NS_VFS_END
@@ -2,10 +2,21 @@
 
 #include "Common.h"
 #include "FileSystem.h"
+#include "io/IOEngine.h"
 #include <mutex>
 
 NS_VFS_BEGIN
 
+struct AsyncReadRequest
+{
+	std::string filePath;
+	uint64_t offset;
+	void* buf;
+	uint64_t len;
+	// bytes read or a negative errno
+	std::function<void(int64_t result)> callback;
+};
+
 class VirtualFileSystem
 {
 public:
@@ -34,12 +45,35 @@ public:
 
 	bool copyFile(const std::string& srcFile, const std::string& dstFile) const;
 
+	// Same file system choice as openFileStream with FileStream::Mode::WRITE, memory file systems take the
+	// buffer over instead of copying it. data is left as it was if false is returned.
+	bool writeFile(const std::string& filePath, std::vector<uint8_t>&& data) const;
+
+	// Barrier for file systems that buffer writes, see NativeFileSystem::setWriteBack.
+	// Returns false if any mounted file system failed to write back.
+	bool flush() const;
+
+	bool sync() const;
+
+	void setIOEngine(std::shared_ptr<IOEngine> engine) { m_ioEngine = engine; }
+
+	std::shared_ptr<IOEngine> getIOEngine() const { return m_ioEngine; }
+
+	// Files stored verbatim in a native file are read through the IO engine as one batch,
+	// everything else (memory, compressed or encrypted pack entries) is read on the calling thread
+	void readAsync(std::vector<AsyncReadRequest>& requests) const;
+
+	void readAsync(const std::string& filePath, uint64_t offset, void* buf, uint64_t len, const std::function<void(int64_t result)>& callback) const;
+
 private:
 
 	bool isDir(FileSystem* fileSystem, const std::string& dirPath) const;
 
+	FileSystem* findFile(const std::string& filePath, std::string& fullFilePath) const;
+
 private:
 
+	std::shared_ptr<IOEngine> m_ioEngine;
 	std::vector<FileSystem*> m_fileSystems;
 	std::mutex m_mutex;
 };
@@ -0,0 +1,259 @@
+#include "EmbeddedFileSystem.h"
+#include "../memory/ViewFileStream.h"
+#include <string.h>
+
+NS_VFS_BEGIN
+
+static std::string_view trimPath(std::string_view path)
+{
+	auto begin = path.find_first_not_of('/');
+	if (begin == std::string_view::npos)
+		return std::string_view();
+	auto end = path.find_last_not_of('/');
+	return path.substr(begin, end - begin + 1);
+}
+
+EmbeddedFileSystem::EmbeddedFileSystem(const EmbeddedFile* files, size_t count, const std::string& mntpoint)
+	: FileSystem("", mntpoint)
+	, m_table(files)
+	, m_tableSize(count)
+	, m_packImage(nullptr)
+	, m_packSize(0)
+	, m_dataSecret(0)
+{
+	m_fileSystemType = FileSystemType::Embedded;
+	setReadonly(true);
+}
+
+EmbeddedFileSystem::EmbeddedFileSystem(const uint8_t* packImage, uint64_t size, const std::string& mntpoint)
+	: FileSystem("", mntpoint)
+	, m_table(nullptr)
+	, m_tableSize(0)
+	, m_packImage(packImage)
+	, m_packSize(size)
+	, m_dataSecret(0)
+{
+	m_fileSystemType = FileSystemType::Embedded;
+	setReadonly(true);
+}
+
+EmbeddedFileSystem::~EmbeddedFileSystem()
+{}
+
+bool EmbeddedFileSystem::init()
+{
+	if (m_mntpoint.empty())
+		return false;
+
+	m_files.clear();
+	m_dirs.clear();
+	m_dirs.emplace(std::string(), Dir());
+
+	if (m_packImage)
+		return readPackImage();
+
+	m_files.reserve(m_tableSize);
+	for (size_t i = 0; i < m_tableSize; ++i)
+	{
+		const auto& file = m_table[i];
+		if (file.path == nullptr || (file.data == nullptr && file.size > 0) || !addFile(file.path, Entry{ file.data, file.size, PackFileCompressionType::None, 0, 0, nullptr }))
+			std::cerr << "EmbeddedFileSystem: skipping entry " << (file.path ? file.path : "(null)") << std::endl;
+	}
+	return true;
+}
+
+bool EmbeddedFileSystem::readPackImage()
+{
+	PackHeader header;
+	if (!pack::readHeader(reinterpret_cast<const char*>(m_packImage), m_packSize, header))
+		return false;
+
+	if (header.version > pack::MAX_VERSION || header.indexOffset > m_packSize)
+	{
+		printf("mount error: unsupported version %d or index out of bounds\n", header.version);
+		return false;
+	}
+	m_dataSecret = header.dataSecret;
+
+	// names are decrypted in place, the image itself is never written to
+	std::vector<char> index(m_packImage + header.indexOffset, m_packImage + m_packSize);
+	return pack::readIndex(index.data(), index.size(), header.version, header.indexSecret, [this](const std::string& name, const PackFileInfo& info) {
+		if (info.offset > m_packSize || info.length > m_packSize - info.offset
+			|| !addFile(name, Entry{ m_packImage + info.offset, info.length, info.compressionType, info.size, info.blockSize, info.blocks }))
+			std::cerr << "EmbeddedFileSystem: skipping entry " << name << std::endl;
+	});
+}
+
+bool EmbeddedFileSystem::addFile(std::string_view path, const Entry& entry)
+{
+	path = trimPath(path);
+	if (path.empty() || m_dirs.find(path) != m_dirs.end() || m_files.find(path) != m_files.end())
+		return false;
+
+	// a file can not also be a directory on the way to another file
+	for (auto pos = path.find('/'); pos != std::string_view::npos; pos = path.find('/', pos + 1))
+	{
+		if (m_files.find(path.substr(0, pos)) != m_files.end())
+			return false;
+	}
+
+	auto file = m_files.emplace(std::string(path), entry).first;
+
+	// links the file to its directory and adds the missing directories above it, names point into the
+	// map keys, which keep their address once inserted
+	std::string_view child = file->first;
+	bool isFile = true;
+	while (true)
+	{
+		auto pos = child.rfind('/');
+		std::string_view dirPath = pos == std::string_view::npos ? std::string_view() : child.substr(0, pos);
+		std::string_view name = pos == std::string_view::npos ? child : child.substr(pos + 1);
+
+		auto it = m_dirs.find(dirPath);
+		bool created = it == m_dirs.end();
+		if (created)
+			it = m_dirs.emplace(std::string(dirPath), Dir()).first;
+
+		if (isFile)
+			it->second.files.emplace_back(name, &file->second);
+		else
+			it->second.dirs.emplace_back(name);
+
+		if (!created)
+			return true;
+
+		child = it->first;
+		isFile = false;
+	}
+}
+
+void EmbeddedFileSystem::enumerate(const std::string& dirPath, const std::function<bool(const FileInfo&)>& call)
+{
+	auto it = m_dirs.find(trimPath(dirPath));
+	if (it == m_dirs.end())
+		return;
+
+	FileInfo info;
+	info.filePath = m_mntpoint;
+	info.filePath.append(it->first);
+	if (!it->first.empty())
+		info.filePath.push_back('/');
+	const size_t prefixLen = info.filePath.size();
+
+	for (auto name : it->second.dirs)
+	{
+		info.flags = FileFlags::Read | FileFlags::Dir;
+		info.filePath.resize(prefixLen);
+		info.filePath.append(name);
+		if (call(info))
+			return;
+	}
+
+	for (auto& file : it->second.files)
+	{
+		info.flags = FileFlags::Read | FileFlags::File;
+		info.filePath.resize(prefixLen);
+		info.filePath.append(file.first);
+		if (call(info))
+			return;
+	}
+}
+
+std::unique_ptr<FileStream> EmbeddedFileSystem::openFileStream(const std::string& filePath, FileStream::Mode mode)
+{
+	if (mode != FileStream::Mode::READ)
+		return nullptr;
+
+	auto it = m_files.find(trimPath(filePath));
+	if (it == m_files.end())
+		return nullptr;
+
+	const auto& entry = it->second;
+	auto fs = std::make_unique<ViewFileStream>();
+	if (entry.compressionType == PackFileCompressionType::None && m_dataSecret == 0)
+		return fs->open(nullptr, entry.data, entry.size) ? std::move(fs) : nullptr;
+
+	// decoded content is owned by the stream
+	std::unique_ptr<char[]> stored(new char[std::max<uint64_t>(entry.size, 1)]);
+	memcpy(stored.get(), entry.data, entry.size);
+	pack::xorContent(m_dataSecret, stored.get(), entry.size);
+	if (entry.compressionType == PackFileCompressionType::None)
+	{
+		auto data = reinterpret_cast<const uint8_t*>(stored.get());
+		return fs->open(std::shared_ptr<char[]>(std::move(stored)), data, entry.size) ? std::move(fs) : nullptr;
+	}
+
+	if (entry.compressionType != PackFileCompressionType::Gzip)
+		return nullptr;
+
+	if (entry.blockSize > 0)
+	{
+		// blocks are inflated one after another into the whole content, those compression did not shrink are stored
+		std::shared_ptr<char[]> content(new char[std::max<uint64_t>(entry.contentSize, 1)]);
+		uint64_t storedBegin = 0;
+		for (size_t block = 0; block < entry.blocks->size(); ++block)
+		{
+			uint64_t storedLen = (*entry.blocks)[block] - storedBegin;
+			uint64_t outLen = std::min<uint64_t>(entry.blockSize, entry.contentSize - block * entry.blockSize);
+			char* out = content.get() + block * entry.blockSize;
+			if (storedLen == outLen)
+				memcpy(out, stored.get() + storedBegin, outLen);
+			else if (!pack::decompressBlock(stored.get() + storedBegin, storedLen, out, outLen))
+				return nullptr;
+			storedBegin += storedLen;
+		}
+
+		auto data = reinterpret_cast<const uint8_t*>(content.get());
+		return fs->open(std::move(content), data, entry.contentSize) ? std::move(fs) : nullptr;
+	}
+
+	int errCode = 0;
+	uint64_t length = 0;
+	auto decompressed = pack::decompressData(stored.get(), entry.size, length, &errCode);
+	if (decompressed == nullptr)
+	{
+		printf("unzip error code: %d\n", errCode);
+		return nullptr;
+	}
+
+	std::shared_ptr<char> owner(decompressed, free);
+	return fs->open(owner, reinterpret_cast<const uint8_t*>(decompressed), length) ? std::move(fs) : nullptr;
+}
+
+bool EmbeddedFileSystem::removeFile(const std::string& /*filePath*/)
+{
+	return false;
+}
+
+bool EmbeddedFileSystem::isFile(const std::string& filePath) const
+{
+	return m_files.find(trimPath(filePath)) != m_files.end();
+}
+
+bool EmbeddedFileSystem::isDir(const std::string& dirPath) const
+{
+	return m_dirs.find(trimPath(dirPath)) != m_dirs.end();
+}
+
+bool EmbeddedFileSystem::createDir(const std::string& /*dirPath*/)
+{
+	return false;
+}
+
+const std::string& EmbeddedFileSystem::basePath() const
+{
+	static std::string basePath("");
+	return basePath;
+}
+
+const uint8_t* EmbeddedFileSystem::view(const std::string& filePath, uint64_t& size) const
+{
+	auto it = m_files.find(trimPath(filePath));
+	if (it == m_files.end() || it->second.compressionType != PackFileCompressionType::None || m_dataSecret != 0)
+		return nullptr;
+
+	size = it->second.size;
+	return it->second.data;
+}
+
+NS_VFS_END
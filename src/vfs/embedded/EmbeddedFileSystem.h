@@ -0,0 +1,99 @@
+#pragma once
+
+#include "../FileSystem.h"
+#include "../pack/PackUtils.h"
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+NS_VFS_BEGIN
+
+// A file linked into the executable, data must stay valid while the file system is mounted
+struct EmbeddedFile
+{
+    const char* path;
+    const uint8_t* data;
+    uint64_t size;
+};
+
+// Read-only file system over memory that outlives it, such as resources linked into the executable.
+// Files are never copied: streams read from and view() the embedded bytes directly. Entries of a pack
+// image that are compressed or encrypted are decoded when opened.
+class EmbeddedFileSystem : public FileSystem
+{
+public:
+
+    // count files from a table, paths use '/' and are relative to mntpoint
+    EmbeddedFileSystem(const EmbeddedFile* files, size_t count, const std::string& mntpoint);
+
+    // A pack file image of size bytes
+    EmbeddedFileSystem(const uint8_t* packImage, uint64_t size, const std::string& mntpoint);
+
+    virtual ~EmbeddedFileSystem();
+
+    virtual bool init() override;
+
+    virtual void enumerate(const std::string& dir, const std::function<bool(const FileInfo&)>& call) override;
+
+    virtual std::unique_ptr<FileStream> openFileStream(const std::string& filePath, FileStream::Mode mode) override;
+
+    virtual bool removeFile(const std::string& filePath) override;
+
+    virtual bool isFile(const std::string& filePath) const override;
+
+    virtual bool isDir(const std::string& dirPath) const override;
+
+    virtual bool createDir(const std::string& dirPath) override;
+
+    virtual const std::string& basePath() const override;
+
+    // The embedded bytes of a stored file, nullptr if it does not exist or must be decoded first
+    const uint8_t* view(const std::string& filePath, uint64_t& size) const;
+
+private:
+
+    struct Entry
+    {
+        const uint8_t* data;
+        // stored size, which differs from the content size for compressed entries
+        uint64_t size;
+        uint8_t compressionType;
+        // version 1 entries compressed in blocks: the content size and the end of each stored block
+        uint64_t contentSize = 0;
+        uint32_t blockSize = 0;
+        std::shared_ptr<const std::vector<uint64_t>> blocks;
+    };
+
+    bool addFile(std::string_view path, const Entry& entry);
+
+    bool readPackImage();
+
+private:
+
+    // lets the maps be searched with a string_view of a path
+    struct PathHash
+    {
+        using is_transparent = void;
+
+        size_t operator()(std::string_view path) const { return std::hash<std::string_view>()(path); }
+    };
+
+    struct Dir
+    {
+        // names of the child directories and files, files point into m_files
+        std::vector<std::string_view> dirs;
+        std::vector<std::pair<std::string_view, const Entry*>> files;
+    };
+
+    const EmbeddedFile* m_table;
+    size_t m_tableSize;
+    const uint8_t* m_packImage;
+    uint64_t m_packSize;
+    uint32_t m_dataSecret;
+
+    // keyed by the path without leading or trailing '/', the root directory is ""
+    std::unordered_map<std::string, Entry, PathHash, std::equal_to<>> m_files;
+    std::unordered_map<std::string, Dir, PathHash, std::equal_to<>> m_dirs;
+};
+
+NS_VFS_END
@@ -0,0 +1,171 @@
+#include "IOEngine.h"
+#include "ThreadPoolIOEngine.h"
+#include "UringIOEngine.h"
+#include <algorithm>
+
+NS_VFS_BEGIN
+
+// unreferenced files kept open for the next reads of the same path
+static const size_t MAX_IDLE_FILES = 64;
+
+std::shared_ptr<IOEngine> IOEngine::create(uint32_t queueDepth, uint32_t threads)
+{
+#if VFS_HAS_IO_URING
+	auto engine = UringIOEngine::create(queueDepth);
+	if (engine)
+		return engine;
+#endif
+	return std::make_shared<ThreadPoolIOEngine>(threads);
+}
+
+IOEngine::IOEngine()
+	: m_inflight(0)
+{}
+
+IOEngine::~IOEngine()
+{
+	closeAllFiles();
+}
+
+int IOEngine::openFile(const std::string& path)
+{
+	// a replaced file has a new identity, the cached handle would still read the old one
+	NativeStat st;
+	bool exists = native::statPath(path, st);
+
+	std::lock_guard<std::mutex> lock(m_fileMutex);
+
+	auto it = m_fileIndex.find(path);
+	if (it != m_fileIndex.end())
+	{
+		int file = it->second;
+		auto& openFile = m_files[file];
+		if (exists && openFile.dev == st.dev && openFile.ino == st.ino)
+		{
+			if (openFile.refs++ == 0)
+				m_idleFiles.erase(std::find(m_idleFiles.begin(), m_idleFiles.end(), file));
+			return file;
+		}
+
+		m_fileIndex.erase(it);
+		openFile.path.clear();
+		if (openFile.refs == 0)
+		{
+			m_idleFiles.erase(std::find(m_idleFiles.begin(), m_idleFiles.end(), file));
+			releaseFile(file);
+		}
+	}
+
+	NativeHandle handle = native::openHandle(path, false);
+	if (handle == native::invalidHandle())
+		return -1;
+
+	OpenFile openFile{ handle, path, 1, 0, 0 };
+	native::handleIdentity(handle, openFile.dev, openFile.ino);
+
+	int file;
+	if (m_freeFiles.empty())
+	{
+		file = (int)m_files.size();
+		m_files.push_back(std::move(openFile));
+	}
+	else
+	{
+		file = m_freeFiles.back();
+		m_freeFiles.pop_back();
+		m_files[file] = std::move(openFile);
+	}
+
+	m_fileIndex.insert(std::make_pair(path, file));
+	onFileOpened(file, handle);
+	return file;
+}
+
+void IOEngine::closeFile(int file)
+{
+	std::lock_guard<std::mutex> lock(m_fileMutex);
+
+	if (file < 0 || file >= (int)m_files.size() || m_files[file].handle == native::invalidHandle() || m_files[file].refs == 0)
+		return;
+
+	auto& openFile = m_files[file];
+	if (--openFile.refs > 0)
+		return;
+
+	if (openFile.path.empty())
+	{
+		releaseFile(file);
+		return;
+	}
+
+	m_idleFiles.push_back(file);
+	if (m_idleFiles.size() > MAX_IDLE_FILES)
+	{
+		int oldest = m_idleFiles.front();
+		m_idleFiles.pop_front();
+		m_fileIndex.erase(m_files[oldest].path);
+		releaseFile(oldest);
+	}
+}
+
+void IOEngine::releaseFile(int file)
+{
+	auto& openFile = m_files[file];
+	onFileClosed(file, openFile.handle);
+	native::closeHandle(openFile.handle);
+	openFile.handle = native::invalidHandle();
+	openFile.path.clear();
+	m_freeFiles.push_back(file);
+}
+
+void IOEngine::closeAllFiles()
+{
+	std::lock_guard<std::mutex> lock(m_fileMutex);
+
+	for (auto& openFile : m_files)
+	{
+		if (openFile.handle != native::invalidHandle())
+			native::closeHandle(openFile.handle);
+	}
+	m_files.clear();
+	m_freeFiles.clear();
+	m_idleFiles.clear();
+	m_fileIndex.clear();
+}
+
+NativeHandle IOEngine::nativeHandle(int file)
+{
+	std::lock_guard<std::mutex> lock(m_fileMutex);
+
+	if (file < 0 || file >= (int)m_files.size())
+		return native::invalidHandle();
+	return m_files[file].handle;
+}
+
+void IOEngine::submit(IORequest request)
+{
+	std::vector<IORequest> requests;
+	requests.push_back(std::move(request));
+	submit(requests);
+}
+
+void IOEngine::drain()
+{
+	std::unique_lock<std::mutex> lock(m_inflightMutex);
+	m_inflightCond.wait(lock, [this]() { return m_inflight == 0; });
+}
+
+void IOEngine::beginRequests(size_t count)
+{
+	std::lock_guard<std::mutex> lock(m_inflightMutex);
+	m_inflight += count;
+}
+
+void IOEngine::endRequests(size_t count)
+{
+	std::lock_guard<std::mutex> lock(m_inflightMutex);
+	m_inflight -= count;
+	m_inflightCond.notify_all();
+}
+
+NS_VFS_END
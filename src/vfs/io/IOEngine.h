@@ -0,0 +1,104 @@
+#pragma once
+
+#include "../Common.h"
+#include "../native/NativeUtils.h"
+#include <stdint.h>
+#include <vector>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <unordered_map>
+
+NS_VFS_BEGIN
+
+struct IOBuffer
+{
+    void* data;
+    size_t size;
+};
+
+struct IORequest
+{
+    // handle returned by IOEngine::openFile
+    int file;
+    uint64_t offset;
+    void* buf;
+    uint32_t len;
+    // index of the registered buffer containing buf, -1 if buf is not registered
+    int bufIndex;
+    // bytes read or a negative errno, called on an engine thread
+    std::function<void(int64_t result)> callback;
+};
+
+// Asynchronous positional reads of native files
+class IOEngine
+{
+public:
+
+    // Creates the io_uring engine when the kernel supports it, a thread pool engine otherwise
+    static std::shared_ptr<IOEngine> create(uint32_t queueDepth = 256, uint32_t threads = 4);
+
+    virtual ~IOEngine();
+
+    virtual const char* name() const = 0;
+
+    // Opens a native file for reading and takes a reference on it. Opening a path again returns the same
+    // handle while the path still names the same file, a replaced file gets a new one.
+    int openFile(const std::string& path);
+
+    // Drops a reference, files nobody references are kept open for reuse up to a limit
+    void closeFile(int file);
+
+    // Pins buffers for IORequest::bufIndex, returns false if the engine has no use for them
+    virtual bool registerBuffers(const std::vector<IOBuffer>& /*buffers*/) { return false; }
+
+    virtual void submit(std::vector<IORequest>& requests) = 0;
+
+    void submit(IORequest request);
+
+    // Blocks until every submitted request has completed
+    void drain();
+
+protected:
+
+    IOEngine();
+
+    virtual void onFileOpened(int /*file*/, NativeHandle /*handle*/) {}
+
+    virtual void onFileClosed(int /*file*/, NativeHandle /*handle*/) {}
+
+    NativeHandle nativeHandle(int file);
+
+    void beginRequests(size_t count);
+
+    void endRequests(size_t count);
+
+    void closeAllFiles();
+
+    // m_fileMutex held
+    void releaseFile(int file);
+
+protected:
+    struct OpenFile
+    {
+        NativeHandle handle;
+        // empty once the path names another file, the handle is closed with its last reference
+        std::string path;
+        uint32_t refs;
+        uint64_t dev;
+        uint64_t ino;
+    };
+
+    std::mutex m_fileMutex;
+    std::unordered_map<std::string, int> m_fileIndex;
+    std::vector<OpenFile> m_files;
+    std::vector<int> m_freeFiles;
+    // unreferenced files, least recently used first
+    std::deque<int> m_idleFiles;
+
+    std::mutex m_inflightMutex;
+    std::condition_variable m_inflightCond;
+    size_t m_inflight;
+};
+
+NS_VFS_END
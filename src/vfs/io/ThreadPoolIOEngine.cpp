@@ -0,0 +1,73 @@
+#include "ThreadPoolIOEngine.h"
+
+NS_VFS_BEGIN
+
+ThreadPoolIOEngine::ThreadPoolIOEngine(uint32_t threads)
+	: m_stop(false)
+{
+	if (threads == 0)
+		threads = 1;
+
+	for (uint32_t i = 0; i < threads; ++i)
+	{
+		m_workers.emplace_back(&ThreadPoolIOEngine::workerLoop, this);
+	}
+}
+
+ThreadPoolIOEngine::~ThreadPoolIOEngine()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_queueMutex);
+		m_stop = true;
+	}
+	m_queueCond.notify_all();
+
+	for (auto& worker : m_workers)
+	{
+		worker.join();
+	}
+	closeAllFiles();
+}
+
+void ThreadPoolIOEngine::submit(std::vector<IORequest>& requests)
+{
+	if (requests.empty())
+		return;
+
+	beginRequests(requests.size());
+	{
+		std::lock_guard<std::mutex> lock(m_queueMutex);
+		for (auto& request : requests)
+		{
+			m_queue.push_back(std::move(request));
+		}
+	}
+	requests.clear();
+	m_queueCond.notify_all();
+}
+
+void ThreadPoolIOEngine::workerLoop()
+{
+	while (true)
+	{
+		IORequest request;
+		{
+			std::unique_lock<std::mutex> lock(m_queueMutex);
+			m_queueCond.wait(lock, [this]() { return m_stop || !m_queue.empty(); });
+
+			// pending requests are still completed on shutdown
+			if (m_queue.empty())
+				break;
+
+			request = std::move(m_queue.front());
+			m_queue.pop_front();
+		}
+
+		int64_t result = native::readAt(nativeHandle(request.file), request.buf, request.len, request.offset);
+		if (request.callback)
+			request.callback(result);
+		endRequests(1);
+	}
+}
+
+NS_VFS_END
@@ -0,0 +1,34 @@
+#pragma once
+
+#include "IOEngine.h"
+#include <deque>
+#include <thread>
+
+NS_VFS_BEGIN
+
+// Blocking positional reads spread over a pool of worker threads
+class ThreadPoolIOEngine : public IOEngine
+{
+public:
+
+    ThreadPoolIOEngine(uint32_t threads);
+
+    virtual ~ThreadPoolIOEngine();
+
+    virtual const char* name() const override { return "threadpool"; }
+
+    virtual void submit(std::vector<IORequest>& requests) override;
+
+private:
+
+    void workerLoop();
+
+private:
+    std::mutex m_queueMutex;
+    std::condition_variable m_queueCond;
+    std::deque<IORequest> m_queue;
+    std::vector<std::thread> m_workers;
+    bool m_stop;
+};
+
+NS_VFS_END
@@ -0,0 +1,409 @@
+#include "UringIOEngine.h"
+
+#if VFS_HAS_IO_URING
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <algorithm>
+
+NS_VFS_BEGIN
+
+// handles below this are registered as fixed files, the rest are passed as plain fds
+static const unsigned FIXED_FILE_SLOTS = 1024;
+
+static int uringSetup(unsigned entries, io_uring_params* params)
+{
+	return (int)syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uringEnter(int fd, unsigned toSubmit, unsigned minComplete, unsigned flags)
+{
+	return (int)syscall(__NR_io_uring_enter, fd, toSubmit, minComplete, flags, nullptr, 0);
+}
+
+static int uringRegister(int fd, unsigned opcode, const void* arg, unsigned nrArgs)
+{
+	return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nrArgs);
+}
+
+std::shared_ptr<UringIOEngine> UringIOEngine::create(uint32_t queueDepth)
+{
+	std::shared_ptr<UringIOEngine> engine(new UringIOEngine());
+	if (!engine->setup(std::max(queueDepth, 1u)))
+		return nullptr;
+	return engine;
+}
+
+UringIOEngine::UringIOEngine()
+	: m_ringFd(-1)
+	, m_sqRing(MAP_FAILED)
+	, m_sqRingSize(0)
+	, m_cqRing(MAP_FAILED)
+	, m_cqRingSize(0)
+	, m_sqes((io_uring_sqe*)MAP_FAILED)
+	, m_sqesSize(0)
+	, m_sqHead(nullptr)
+	, m_sqTail(nullptr)
+	, m_sqMask(nullptr)
+	, m_sqArray(nullptr)
+	, m_sqEntries(0)
+	, m_cqHead(nullptr)
+	, m_cqTail(nullptr)
+	, m_cqMask(nullptr)
+	, m_cqes(nullptr)
+	, m_cqEntries(0)
+	, m_fixedFiles(false)
+	, m_hasBuffers(false)
+{}
+
+UringIOEngine::~UringIOEngine()
+{
+	if (m_completionThread.joinable())
+	{
+		drain();
+
+		// a nop without user data stops the completion thread
+		{
+			std::lock_guard<std::mutex> lock(m_submitMutex);
+			auto sqe = nextSqe();
+			sqe->opcode = IORING_OP_NOP;
+			sqe->user_data = 0;
+			int error;
+			enter(1, error);
+		}
+		m_completionThread.join();
+	}
+
+	closeAllFiles();
+
+	if (m_sqes != MAP_FAILED)
+		munmap(m_sqes, m_sqesSize);
+	if (m_cqRing != MAP_FAILED && m_cqRing != m_sqRing)
+		munmap(m_cqRing, m_cqRingSize);
+	if (m_sqRing != MAP_FAILED)
+		munmap(m_sqRing, m_sqRingSize);
+	if (m_ringFd >= 0)
+		::close(m_ringFd);
+}
+
+bool UringIOEngine::setup(uint32_t queueDepth)
+{
+	io_uring_params params;
+	memset(&params, 0, sizeof(params));
+
+	// fails with ENOSYS on old kernels and EPERM when io_uring is disabled
+	m_ringFd = uringSetup(queueDepth, &params);
+	if (m_ringFd < 0)
+		return false;
+
+	// plain IORING_OP_READ needs 5.6
+	size_t probeSize = sizeof(io_uring_probe) + 256 * sizeof(io_uring_probe_op);
+	std::unique_ptr<uint8_t[]> probeBuf(new uint8_t[probeSize]);
+	memset(probeBuf.get(), 0, probeSize);
+	auto probe = reinterpret_cast<io_uring_probe*>(probeBuf.get());
+	if (uringRegister(m_ringFd, IORING_REGISTER_PROBE, probe, 256) < 0 || probe->ops_len <= IORING_OP_READ || !(probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED))
+		return false;
+
+	m_sqEntries = params.sq_entries;
+	m_cqEntries = params.cq_entries;
+	m_sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	m_cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+	bool singleMmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if (singleMmap)
+		m_sqRingSize = m_cqRingSize = std::max(m_sqRingSize, m_cqRingSize);
+
+	m_sqRing = mmap(nullptr, m_sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ringFd, IORING_OFF_SQ_RING);
+	if (m_sqRing == MAP_FAILED)
+		return false;
+
+	if (singleMmap)
+	{
+		m_cqRing = m_sqRing;
+	}
+	else
+	{
+		m_cqRing = mmap(nullptr, m_cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ringFd, IORING_OFF_CQ_RING);
+		if (m_cqRing == MAP_FAILED)
+			return false;
+	}
+
+	m_sqesSize = params.sq_entries * sizeof(io_uring_sqe);
+	m_sqes = (io_uring_sqe*)mmap(nullptr, m_sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, m_ringFd, IORING_OFF_SQES);
+	if (m_sqes == MAP_FAILED)
+		return false;
+
+	auto sq = (uint8_t*)m_sqRing;
+	m_sqHead = (unsigned*)(sq + params.sq_off.head);
+	m_sqTail = (unsigned*)(sq + params.sq_off.tail);
+	m_sqMask = (unsigned*)(sq + params.sq_off.ring_mask);
+	m_sqArray = (unsigned*)(sq + params.sq_off.array);
+
+	auto cq = (uint8_t*)m_cqRing;
+	m_cqHead = (unsigned*)(cq + params.cq_off.head);
+	m_cqTail = (unsigned*)(cq + params.cq_off.tail);
+	m_cqMask = (unsigned*)(cq + params.cq_off.ring_mask);
+	m_cqes = (io_uring_cqe*)(cq + params.cq_off.cqes);
+
+	// sparse table, slots are filled in as files are opened
+	std::vector<int> fds(FIXED_FILE_SLOTS, -1);
+	m_fixedFiles = uringRegister(m_ringFd, IORING_REGISTER_FILES, fds.data(), FIXED_FILE_SLOTS) == 0;
+
+	m_completionThread = std::thread(&UringIOEngine::completionLoop, this);
+	return true;
+}
+
+bool UringIOEngine::registerBuffers(const std::vector<IOBuffer>& buffers)
+{
+	// buffers can only be swapped while no fixed read is in flight. Draining under m_submitMutex would
+	// block a completion callback that resubmits, so drain first and recheck once no one can submit.
+	for (;;)
+	{
+		drain();
+
+		std::lock_guard<std::mutex> lock(m_submitMutex);
+		{
+			std::lock_guard<std::mutex> inflightLock(m_inflightMutex);
+			if (m_inflight != 0)
+				continue;
+		}
+
+		if (m_hasBuffers)
+		{
+			uringRegister(m_ringFd, IORING_UNREGISTER_BUFFERS, nullptr, 0);
+			m_hasBuffers = false;
+		}
+
+		if (buffers.empty())
+			return true;
+
+		std::vector<iovec> iovecs(buffers.size());
+		for (size_t i = 0; i < buffers.size(); ++i)
+		{
+			iovecs[i].iov_base = buffers[i].data;
+			iovecs[i].iov_len = buffers[i].size;
+		}
+
+		m_hasBuffers = uringRegister(m_ringFd, IORING_REGISTER_BUFFERS, iovecs.data(), (unsigned)iovecs.size()) == 0;
+		return m_hasBuffers;
+	}
+}
+
+void UringIOEngine::onFileOpened(int file, NativeHandle handle)
+{
+	if (!m_fixedFiles || file >= (int)FIXED_FILE_SLOTS)
+		return;
+
+	io_uring_files_update update;
+	memset(&update, 0, sizeof(update));
+	update.offset = (unsigned)file;
+	update.fds = (uint64_t)(uintptr_t)&handle;
+	uringRegister(m_ringFd, IORING_REGISTER_FILES_UPDATE, &update, 1);
+}
+
+void UringIOEngine::onFileClosed(int file, NativeHandle /*handle*/)
+{
+	if (!m_fixedFiles || file >= (int)FIXED_FILE_SLOTS)
+		return;
+
+	int fd = -1;
+	io_uring_files_update update;
+	memset(&update, 0, sizeof(update));
+	update.offset = (unsigned)file;
+	update.fds = (uint64_t)(uintptr_t)&fd;
+	uringRegister(m_ringFd, IORING_REGISTER_FILES_UPDATE, &update, 1);
+}
+
+io_uring_sqe* UringIOEngine::nextSqe()
+{
+	unsigned tail = *m_sqTail;
+	unsigned index = tail & *m_sqMask;
+	auto sqe = &m_sqes[index];
+	memset(sqe, 0, sizeof(io_uring_sqe));
+	m_sqArray[index] = index;
+	__atomic_store_n(m_sqTail, tail + 1, __ATOMIC_RELEASE);
+	return sqe;
+}
+
+void UringIOEngine::prepareRead(io_uring_sqe* sqe, PendingRead* read)
+{
+	auto& request = read->request;
+	int file = request.file;
+	int fd = (file >= 0 && file < (int)m_files.size()) ? m_files[file].handle : -1;
+
+	if (request.bufIndex >= 0 && m_hasBuffers)
+	{
+		sqe->opcode = IORING_OP_READ_FIXED;
+		sqe->buf_index = (uint16_t)request.bufIndex;
+	}
+	else
+	{
+		sqe->opcode = IORING_OP_READ;
+	}
+
+	if (m_fixedFiles && fd >= 0 && file < (int)FIXED_FILE_SLOTS)
+	{
+		sqe->fd = file;
+		sqe->flags |= IOSQE_FIXED_FILE;
+	}
+	else
+	{
+		sqe->fd = fd;
+	}
+
+	sqe->off = request.offset;
+	sqe->addr = (uint64_t)(uintptr_t)request.buf;
+	sqe->len = request.len;
+	sqe->user_data = (uint64_t)(uintptr_t)read;
+}
+
+uint32_t UringIOEngine::enter(uint32_t toSubmit, int& error)
+{
+	uint32_t submitted = 0;
+	error = 0;
+	while (submitted < toSubmit)
+	{
+		int ret = uringEnter(m_ringFd, toSubmit - submitted, 0, 0);
+		if (ret < 0)
+		{
+			if (errno == EINTR || errno == EAGAIN || errno == EBUSY)
+			{
+				std::this_thread::yield();
+				continue;
+			}
+			error = errno;
+			break;
+		}
+		if (ret == 0)
+		{
+			error = EIO;
+			break;
+		}
+		submitted += std::min((uint32_t)ret, toSubmit - submitted);
+	}
+
+	// without SQPOLL the kernel consumes entries only inside io_uring_enter, the rest are still the last ones queued
+	if (submitted < toSubmit)
+		__atomic_store_n(m_sqTail, *m_sqTail - (toSubmit - submitted), __ATOMIC_RELEASE);
+	return submitted;
+}
+
+void UringIOEngine::submit(std::vector<IORequest>& requests)
+{
+	// a callback resubmitting from the completion thread must not wait for its own completions
+	bool fromCompletionThread = std::this_thread::get_id() == m_completionThread.get_id();
+
+	size_t index = 0;
+	while (index < requests.size())
+	{
+		uint32_t batch = (uint32_t)std::min<size_t>(requests.size() - index, m_sqEntries);
+		{
+			// never queue more requests than the CQ can hold
+			std::unique_lock<std::mutex> inflightLock(m_inflightMutex);
+			if (!fromCompletionThread)
+				m_inflightCond.wait(inflightLock, [this, batch]() { return m_inflight + batch <= m_cqEntries; });
+			m_inflight += batch;
+		}
+
+		std::vector<PendingRead*> reads(batch);
+		uint32_t submitted;
+		int error;
+		{
+			std::lock_guard<std::mutex> lock(m_submitMutex);
+			{
+				std::lock_guard<std::mutex> fileLock(m_fileMutex);
+				for (uint32_t i = 0; i < batch; ++i, ++index)
+				{
+					reads[i] = new PendingRead{ std::move(requests[index]), 0 };
+					prepareRead(nextSqe(), reads[i]);
+				}
+			}
+			submitted = enter(batch, error);
+		}
+
+		// requests the kernel never saw fail here, they will not get a completion
+		for (uint32_t i = submitted; i < batch; ++i)
+		{
+			if (reads[i]->request.callback)
+				reads[i]->request.callback(-error);
+			delete reads[i];
+		}
+		if (submitted < batch)
+			endRequests(batch - submitted);
+	}
+	requests.clear();
+}
+
+bool UringIOEngine::resubmit(PendingRead* read)
+{
+	std::lock_guard<std::mutex> lock(m_submitMutex);
+	{
+		std::lock_guard<std::mutex> fileLock(m_fileMutex);
+		prepareRead(nextSqe(), read);
+	}
+	int error;
+	return enter(1, error) == 1;
+}
+
+void UringIOEngine::completionLoop()
+{
+	bool stop = false;
+	while (!stop)
+	{
+		unsigned head = *m_cqHead;
+		unsigned tail = __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE);
+		if (head == tail)
+		{
+			uringEnter(m_ringFd, 0, 1, IORING_ENTER_GETEVENTS);
+			continue;
+		}
+
+		size_t completed = 0;
+		for (; head != tail; ++head)
+		{
+			auto cqe = &m_cqes[head & *m_cqMask];
+			uint64_t userData = cqe->user_data;
+			int64_t res = cqe->res;
+			// the slot is free before a short read is requeued, its new completion may need it
+			__atomic_store_n(m_cqHead, head + 1, __ATOMIC_RELEASE);
+
+			if (userData == 0)
+			{
+				stop = true;
+				continue;
+			}
+
+			// short reads are continued like pread loops do, only end of file or an error stops them
+			auto read = (PendingRead*)(uintptr_t)userData;
+			auto& request = read->request;
+			if (res > 0 && (uint64_t)res < request.len)
+			{
+				read->done += (uint32_t)res;
+				request.offset += (uint64_t)res;
+				request.buf = (uint8_t*)request.buf + res;
+				request.len -= (uint32_t)res;
+				if (resubmit(read))
+					continue;
+				res = 0;
+			}
+
+			int64_t result = res < 0 ? (read->done > 0 ? (int64_t)read->done : res) : read->done + res;
+			if (request.callback)
+				request.callback(result);
+			delete read;
+			++completed;
+		}
+
+		if (completed > 0)
+			endRequests(completed);
+	}
+}
+
+NS_VFS_END
+
+#endif
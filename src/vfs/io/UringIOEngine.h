@@ -0,0 +1,100 @@
+#pragma once
+
+#include "IOEngine.h"
+
+#if defined(__linux__) && defined(__has_include)
+#    if __has_include(<linux/io_uring.h>)
+#        define VFS_HAS_IO_URING 1
+#    endif
+#endif
+
+#if VFS_HAS_IO_URING
+
+#include <thread>
+#include <atomic>
+
+struct io_uring_sqe;
+struct io_uring_cqe;
+
+NS_VFS_BEGIN
+
+// Reads submitted in batches to an io_uring, using fixed files and registered buffers when available
+class UringIOEngine : public IOEngine
+{
+public:
+
+    // Returns nullptr if the kernel does not support io_uring
+    static std::shared_ptr<UringIOEngine> create(uint32_t queueDepth);
+
+    virtual ~UringIOEngine();
+
+    virtual const char* name() const override { return "io_uring"; }
+
+    virtual bool registerBuffers(const std::vector<IOBuffer>& buffers) override;
+
+    virtual void submit(std::vector<IORequest>& requests) override;
+
+private:
+
+    // a request plus what its earlier short reads already returned
+    struct PendingRead
+    {
+        IORequest request;
+        uint32_t done;
+    };
+
+    UringIOEngine();
+
+    bool setup(uint32_t queueDepth);
+
+    void completionLoop();
+
+    io_uring_sqe* nextSqe();
+
+    // m_fileMutex held
+    void prepareRead(io_uring_sqe* sqe, PendingRead* read);
+
+    // Returns how many of the queued entries the kernel consumed, error is set when it is short.
+    // m_submitMutex held, entries not consumed are taken back off the ring.
+    uint32_t enter(uint32_t toSubmit, int& error);
+
+    // Queues the rest of a short read, false if it could not be submitted
+    bool resubmit(PendingRead* read);
+
+    virtual void onFileOpened(int file, NativeHandle handle) override;
+
+    virtual void onFileClosed(int file, NativeHandle handle) override;
+
+private:
+    int m_ringFd;
+
+    void* m_sqRing;
+    size_t m_sqRingSize;
+    void* m_cqRing;
+    size_t m_cqRingSize;
+    io_uring_sqe* m_sqes;
+    size_t m_sqesSize;
+
+    unsigned* m_sqHead;
+    unsigned* m_sqTail;
+    unsigned* m_sqMask;
+    unsigned* m_sqArray;
+    unsigned m_sqEntries;
+
+    unsigned* m_cqHead;
+    unsigned* m_cqTail;
+    unsigned* m_cqMask;
+    io_uring_cqe* m_cqes;
+    unsigned m_cqEntries;
+
+    bool m_fixedFiles;
+    bool m_hasBuffers;
+
+    // serializes SQ producers
+    std::mutex m_submitMutex;
+    std::thread m_completionThread;
+};
+
+NS_VFS_END
+
+#endif
@@ -0,0 +1,79 @@
+#include "ChunkIndex.h"
+#include <string.h>
+
+NS_VFS_BEGIN
+
+static const uint64_t PRIME1 = 0x9E3779B185EBCA87ULL;
+static const uint64_t PRIME2 = 0xC2B2AE3D27D4EB4FULL;
+static const uint64_t PRIME3 = 0x165667B19E3779F9ULL;
+
+static inline uint64_t rotl(uint64_t x, int r)
+{
+	return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t load64(const uint8_t* p)
+{
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static inline uint64_t round64(uint64_t acc, uint64_t input)
+{
+	acc += input * PRIME2;
+	acc = rotl(acc, 31);
+	return acc * PRIME1;
+}
+
+uint64_t ChunkIndex::hash(const uint8_t* data, size_t len)
+{
+	uint64_t lanes[4] = { PRIME1 + PRIME2, PRIME2, 0, 0 - PRIME1 };
+	size_t i = 0;
+	for (; i + 32 <= len; i += 32)
+	{
+		for (int lane = 0; lane < 4; ++lane)
+			lanes[lane] = round64(lanes[lane], load64(data + i + lane * 8));
+	}
+
+	uint64_t h = rotl(lanes[0], 1) + rotl(lanes[1], 7) + rotl(lanes[2], 12) + rotl(lanes[3], 18) + len;
+	for (; i + 8 <= len; i += 8)
+		h = rotl(h ^ round64(0, load64(data + i)), 27) * PRIME1 + PRIME3;
+	for (; i < len; ++i)
+		h = rotl(h ^ (data[i] * PRIME3), 11) * PRIME1;
+
+	h ^= h >> 33;
+	h *= PRIME2;
+	h ^= h >> 29;
+	h *= PRIME3;
+	h ^= h >> 32;
+	return h;
+}
+
+void ChunkIndex::forget(uint64_t hash, const uint8_t* data)
+{
+	auto range = m_entries.equal_range(hash);
+	for (auto it = range.first; it != range.second; ++it)
+	{
+		if (it->second.chunk.data == data)
+		{
+			m_entries.erase(it);
+			return;
+		}
+	}
+}
+
+size_t ChunkIndex::size()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_entries.size();
+}
+
+uint64_t ChunkIndex::bytes()
+{
+	// a node holds the link to the next one, the key and the entry, the buckets add about a pointer per entry
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_entries.size() * (sizeof(uint64_t) + sizeof(Entry) + 2 * sizeof(void*));
+}
+
+NS_VFS_END
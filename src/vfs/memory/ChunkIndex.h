@@ -0,0 +1,49 @@
+#pragma once
+
+#include "../Common.h"
+#include "MemoryData.h"
+#include <unordered_map>
+#include <mutex>
+
+NS_VFS_BEGIN
+
+// Content addressed table of MemoryData chunks. MemoryData::dedupe() replaces a chunk by an indexed one
+// with the same bytes, so identical content is stored once and copied again only when written to.
+// The index holds no reference on the chunks it lists: a chunk leaves it when the last file using it lets go,
+// or when the only file using it writes to it in place. Listed chunks keep the index alive.
+class ChunkIndex : public std::enable_shared_from_this<ChunkIndex>
+{
+public:
+
+    ChunkIndex() = default;
+
+    ChunkIndex(const ChunkIndex&) = delete;
+
+    ChunkIndex& operator=(const ChunkIndex&) = delete;
+
+    size_t size();
+
+    // Memory of the table itself, the chunks belong to the files
+    uint64_t bytes();
+
+    // 64-bit hash of len bytes, four independent lanes so the multiplies overlap
+    static uint64_t hash(const uint8_t* data, size_t len);
+
+private:
+    friend class MemoryData;
+
+    // Takes the chunk at data off the table, called with m_mutex held
+    void forget(uint64_t hash, const uint8_t* data);
+
+    struct Entry
+    {
+        MemoryData::Chunk chunk;
+        // bytes of the chunk that belong to content, the tail of a file's last chunk is unused
+        uint32_t used;
+    };
+
+    std::mutex m_mutex;
+    std::unordered_multimap<uint64_t, Entry> m_entries;
+};
+
+NS_VFS_END
@@ -0,0 +1,166 @@
+#include "MemoryArena.h"
+#include "MemoryData.h"
+#include "MemoryPool.h"
+#include "MemoryResidency.h"
+#include <algorithm>
+
+NS_VFS_BEGIN
+
+// allocations above this size get their own block instead of wasting a page tail
+static const size_t LARGE_ALLOCATION = MemoryPool::PAGE_SIZE / 4;
+
+// an empty file system only needs a few hundred bytes
+static const size_t FIRST_PAGE_SIZE = 4096;
+
+MemoryArena::MemoryArena(std::shared_ptr<MemoryResidency> residency)
+	: m_residency(std::move(residency))
+	, m_cursor(nullptr)
+	, m_left(0)
+	, m_allocated(0)
+	, m_adoptedCount(0)
+	, m_refs(0)
+{}
+
+MemoryArena::~MemoryArena()
+{
+	charge(-(int64_t)m_allocated);
+	auto& pool = MemoryPool::instance();
+	for (auto& page : m_pages)
+		pool.release(page.first, page.second);
+	for (auto block : m_large)
+		::operator delete(block);
+}
+
+void* MemoryArena::do_allocate(size_t bytes, size_t alignment)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	if (bytes > LARGE_ALLOCATION)
+	{
+		// operator new aligns for any fundamental type, which is all the tree stores
+		void* block = ::operator new(bytes);
+		m_large.push_back(block);
+		charge(bytes);
+		return block;
+	}
+
+	size_t padding = (alignment - reinterpret_cast<uintptr_t>(m_cursor) % alignment) % alignment;
+	if (m_cursor == nullptr || padding + bytes > m_left)
+	{
+		size_t pageSize = m_pages.empty() ? FIRST_PAGE_SIZE : std::min<size_t>(m_pages.back().second * 2, MemoryPool::PAGE_SIZE);
+		while (pageSize < bytes)
+			pageSize *= 2;
+		m_cursor = MemoryPool::instance().allocate(pageSize);
+		m_left = pageSize;
+		m_pages.emplace_back(m_cursor, pageSize);
+		charge(pageSize);
+		padding = 0;
+	}
+
+	void* p = m_cursor + padding;
+	m_cursor += padding + bytes;
+	m_left -= padding + bytes;
+	return p;
+}
+
+void MemoryArena::own(const std::shared_ptr<MemoryData>& data)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	auto& file = m_files[data.get()];
+	if (file.second++ == 0)
+		file.first = data;
+}
+
+void MemoryArena::disown(MemoryData* data)
+{
+	std::shared_ptr<MemoryData> released;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto it = m_files.find(data);
+		if (it == m_files.end() || --it->second.second > 0)
+			return;
+		released = std::move(it->second.first);
+		m_files.erase(it);
+	}
+}
+
+void MemoryArena::keepAlive(std::shared_ptr<const void> owner)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_owners.push_back(std::move(owner));
+}
+
+void MemoryArena::adopt(std::shared_ptr<const void> owner, const uint8_t* bytes, uint64_t size)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (m_adopted.emplace(bytes, Adopted{ std::move(owner), size, 0 }).second)
+	{
+		charge(size);
+		++m_adoptedCount;
+	}
+}
+
+void MemoryArena::retain(const uint8_t* bytes)
+{
+	if (m_adoptedCount.load(std::memory_order_relaxed) == 0)
+		return;
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	auto it = m_adopted.find(bytes);
+	if (it != m_adopted.end())
+		++it->second.refs;
+}
+
+void MemoryArena::release(const uint8_t* bytes)
+{
+	if (m_adoptedCount.load(std::memory_order_relaxed) == 0)
+		return;
+
+	std::shared_ptr<const void> released;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto it = m_adopted.find(bytes);
+		if (it == m_adopted.end() || --it->second.refs > 0)
+			return;
+		released = std::move(it->second.owner);
+		charge(-(int64_t)it->second.size);
+		m_adopted.erase(it);
+		--m_adoptedCount;
+	}
+}
+
+std::shared_ptr<const void> MemoryArena::ownerOf(const uint8_t* bytes)
+{
+	if (m_adoptedCount.load(std::memory_order_relaxed) > 0)
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto it = m_adopted.find(bytes);
+		if (it != m_adopted.end())
+			return it->second.owner;
+	}
+	return shared_from_this();
+}
+
+void MemoryArena::forEachFile(const std::function<void(const std::shared_ptr<MemoryData>&)>& call)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	for (auto& it : m_files)
+		call(it.second.first);
+}
+
+void MemoryArena::charge(int64_t bytes)
+{
+	m_allocated += bytes;
+	if (m_residency && bytes > 0)
+		m_residency->addArena(bytes);
+	else if (m_residency)
+		m_residency->subArena(-bytes);
+}
+
+uint64_t MemoryArena::allocatedBytes()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_allocated;
+}
+
+NS_VFS_END
@@ -0,0 +1,98 @@
+#pragma once
+
+#include "../Common.h"
+#include <memory_resource>
+#include <unordered_map>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <functional>
+
+NS_VFS_BEGIN
+
+class MemoryData;
+class MemoryResidency;
+
+// Bump allocator over MemoryPool pages that a MemoryFileSystem keeps its directory nodes and small files in.
+// Nothing is freed individually, dropping the arena returns its pages at once without visiting what was
+// built in them. Regular MemoryData objects referenced from the arena are kept alive by it, once per
+// file entry that references them, so entries shared by copies of a file system are released one by one.
+class MemoryArena : public std::pmr::memory_resource, public std::enable_shared_from_this<MemoryArena>
+{
+public:
+
+    // Counts the allocated bytes in residency as well while the arena lives, if there is one
+    explicit MemoryArena(std::shared_ptr<MemoryResidency> residency = nullptr);
+
+    virtual ~MemoryArena();
+
+    // Takes a reference on data, disown drops it and the last one releases data
+    void own(const std::shared_ptr<MemoryData>& data);
+
+    void disown(MemoryData* data);
+
+    // Keeps owner alive as long as the arena, for bytes the tree points into without copying
+    void keepAlive(std::shared_ptr<const void> owner);
+
+    // Keeps owner alive for the file whose bytes it holds, and counts size in allocatedBytes. References are
+    // taken with retain(bytes), the last release(bytes) drops owner. Both ignore bytes that were not adopted.
+    void adopt(std::shared_ptr<const void> owner, const uint8_t* bytes, uint64_t size);
+
+    void retain(const uint8_t* bytes);
+
+    void release(const uint8_t* bytes);
+
+    // Directory nodes and file entries of live trees that point into the arena. A file system drops
+    // arenas nothing points into anymore.
+    void ref() { ++m_refs; }
+
+    void unref() { --m_refs; }
+
+    uint64_t refs() const { return m_refs.load(); }
+
+    // What keeps bytes alive, the adopted owner or else the arena itself
+    std::shared_ptr<const void> ownerOf(const uint8_t* bytes);
+
+    void forEachFile(const std::function<void(const std::shared_ptr<MemoryData>&)>& call);
+
+    // Bytes taken from the pool and the system, including unused page tails
+    uint64_t allocatedBytes();
+
+protected:
+
+    virtual void* do_allocate(size_t bytes, size_t alignment) override;
+
+    virtual void do_deallocate(void* /*p*/, size_t /*bytes*/, size_t /*alignment*/) override {}
+
+    virtual bool do_is_equal(const std::pmr::memory_resource& other) const noexcept override { return this == &other; }
+
+private:
+    // m_mutex held
+    void charge(int64_t bytes);
+
+private:
+    std::mutex m_mutex;
+    std::shared_ptr<MemoryResidency> m_residency;
+    // pages start small and double up to the pool page size
+    std::vector<std::pair<uint8_t*, size_t>> m_pages;
+    // allocations too large to share a page
+    std::vector<void*> m_large;
+    uint8_t* m_cursor;
+    size_t m_left;
+    uint64_t m_allocated;
+    std::unordered_map<MemoryData*, std::pair<std::shared_ptr<MemoryData>, uint32_t>> m_files;
+    std::vector<std::shared_ptr<const void>> m_owners;
+
+    struct Adopted
+    {
+        std::shared_ptr<const void> owner;
+        uint64_t size;
+        uint32_t refs;
+    };
+    std::unordered_map<const uint8_t*, Adopted> m_adopted;
+    // lets ownerOf skip the lookup while nothing is adopted
+    std::atomic<size_t> m_adoptedCount;
+    std::atomic<uint64_t> m_refs;
+};
+
+NS_VFS_END
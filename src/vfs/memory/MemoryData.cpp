@@ -1,5 +1,17 @@
 #include "MemoryData.h"
+#include "MemoryPool.h"
+#include "ChunkIndex.h"
 #include <assert.h>
+#include <string.h>
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <stdio.h>
+#include <chrono>
+
+#ifdef VFS_HAS_ZLIB
+#include "zlib.h"
+#endif
 
 #undef LIKELY
 #undef UNLIKELY
@@ -14,29 +26,326 @@
 
 NS_VFS_BEGIN
 
-MemoryData::MemoryData()
+// optimistic copies attempted before a reader falls back to the writer mutex
+static const int READ_RETRIES = 4;
+
+static inline int64_t steadyNow()
+{
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+static inline uint64_t packLayout(uint64_t smallCount, uint64_t smallBytes)
+{
+	return (smallCount << 32) | smallBytes;
+}
+
+MemoryData::MemoryData(std::shared_ptr<MemoryResidency> residency)
+	: m_table(nullptr)
+	, m_layout(0)
+	, m_size(0)
+	, m_sequence(0)
+	, m_attached(0)
+	, m_storage((uint8_t)Storage::Resident)
+	, m_lastAccess(steadyNow())
+	, m_residency(std::move(residency))
+	, m_chunkCount(0)
+	, m_capacity(0)
+	, m_incompressible(false)
 {
-	m_data.reserve(8192);
 	m_wirteNum.store(0, std::memory_order_relaxed);
+	if (m_residency)
+		m_residencyPos = m_residency->link(this);
 }
 
 MemoryData::~MemoryData()
-{}
+{
+	if (m_residency)
+		m_residency->unlink(m_residencyPos);
+	releaseAll();
+	if (storage() == Storage::Spilled)
+		::remove(m_spillPath.c_str());
+	else if (storage() == Storage::Compressed && m_residency)
+		m_residency->sub(m_deflated.size());
+}
 
-uint64_t MemoryData::write(uint8_t* data, uint64_t len, uint64_t offset)
+void MemoryData::releaseAll()
+{
+	freeRetired();
+
+	auto table = m_table.load(std::memory_order_relaxed);
+	if (table)
+	{
+		for (size_t i = 0; i < m_chunkCount; ++i)
+			releaseChunk(table->chunks[i], m_residency.get());
+		delete table;
+	}
+	m_table.store(nullptr, std::memory_order_relaxed);
+	m_layout.store(0, std::memory_order_relaxed);
+	m_chunkCount = 0;
+	m_capacity = 0;
+}
+
+void MemoryData::reserve(uint64_t size)
+{
+	if (m_capacity >= size)
+		return;
+
+	auto& pool = MemoryPool::instance();
+	auto table = m_table.load(std::memory_order_relaxed);
+	uint64_t layout = m_layout.load(std::memory_order_relaxed);
+	uint64_t smallCount = layout >> 32;
+	uint64_t smallBytes = layout & 0xFFFFFFFF;
+
+	while (m_capacity < size)
+	{
+		// small chunks at least double, so a file has only a handful of them before the pages start
+		uint32_t blockSize = MemoryPool::blockSize(size - m_capacity);
+		if (m_chunkCount > 0)
+			blockSize = std::max(blockSize, std::min<uint32_t>(table->chunks[m_chunkCount - 1].capacity * 2, MemoryPool::PAGE_SIZE));
+
+		if (table == nullptr || m_chunkCount == table->capacity)
+		{
+			// readers may still walk the old table, it is retired instead of freed
+			auto grown = new ChunkTable{ table ? table->capacity * 2 : 4, nullptr };
+			grown->chunks.reset(new Chunk[grown->capacity]);
+			if (table)
+			{
+				std::copy(table->chunks.get(), table->chunks.get() + m_chunkCount, grown->chunks.get());
+				m_retired.push_back(table);
+			}
+			table = grown;
+			m_table.store(table, std::memory_order_release);
+		}
+
+		// slots past m_chunkCount are invisible to readers until the size covering them is published
+		table->chunks[m_chunkCount++] = Chunk{ pool.allocate(blockSize), blockSize, nullptr };
+		m_capacity += blockSize;
+		if (m_residency)
+			m_residency->add(blockSize);
+		if (blockSize < MemoryPool::PAGE_SIZE)
+		{
+			++smallCount;
+			smallBytes += blockSize;
+		}
+	}
+	m_layout.store(packLayout(smallCount, smallBytes), std::memory_order_release);
+}
+
+template<typename F>
+void MemoryData::forEachPiece(const ChunkTable* table, uint64_t layout, uint64_t offset, uint64_t len, F&& call)
+{
+	uint64_t smallCount = layout >> 32;
+	uint64_t smallBytes = layout & 0xFFFFFFFF;
+
+	size_t index;
+	uint64_t chunkOffset;
+	if (offset >= smallBytes)
+	{
+		index = smallCount + (offset - smallBytes) / MemoryPool::PAGE_SIZE;
+		chunkOffset = (offset - smallBytes) % MemoryPool::PAGE_SIZE;
+	}
+	else
+	{
+		index = 0;
+		chunkOffset = offset;
+		while (chunkOffset >= table->chunks[index].capacity)
+			chunkOffset -= table->chunks[index++].capacity;
+	}
+
+	while (len > 0)
+	{
+		auto& chunk = table->chunks[index++];
+		uint64_t n = std::min<uint64_t>(len, chunk.capacity - chunkOffset);
+		// unshare() swaps in private copies while readers walk the table
+		uint8_t* data = std::atomic_ref<uint8_t*>(chunk.data).load(std::memory_order_acquire);
+		call(data + chunkOffset, n);
+		len -= n;
+		chunkOffset = 0;
+	}
+}
+
+void MemoryData::unshare(ChunkTable* table, uint64_t layout, uint64_t offset, uint64_t len)
+{
+	uint64_t smallCount = layout >> 32;
+	uint64_t smallBytes = layout & 0xFFFFFFFF;
+
+	size_t first = 0;
+	size_t last;
+	if (offset >= smallBytes)
+	{
+		first = smallCount + (offset - smallBytes) / MemoryPool::PAGE_SIZE;
+	}
+	else
+	{
+		for (uint64_t start = 0; start + table->chunks[first].capacity <= offset; ++first)
+			start += table->chunks[first].capacity;
+	}
+	uint64_t end = offset + len - 1;
+	if (end >= smallBytes)
+	{
+		last = smallCount + (end - smallBytes) / MemoryPool::PAGE_SIZE;
+	}
+	else
+	{
+		last = 0;
+		for (uint64_t start = 0; start + table->chunks[last].capacity <= end; ++last)
+			start += table->chunks[last].capacity;
+	}
+
+	auto& pool = MemoryPool::instance();
+	for (size_t i = first; i <= last; ++i)
+	{
+		auto& chunk = table->chunks[i];
+		if (chunk.shared == nullptr)
+			continue;
+
+		if (chunk.shared->refs.load(std::memory_order_acquire) == 1)
+		{
+			// only owner, but a listed chunk can gain owners through its index until it is taken off
+			auto index = chunk.shared->index;
+			if (index == nullptr)
+				continue;
+
+			std::lock_guard<std::mutex> indexLock(index->m_mutex);
+			if (chunk.shared->refs.load(std::memory_order_acquire) == 1)
+			{
+				index->forget(chunk.shared->hash, chunk.data);
+				chunk.shared->index = nullptr;
+				chunk.shared->listed.store(false, std::memory_order_release);
+				continue;
+			}
+		}
+
+		uint8_t* copy = pool.allocate(chunk.capacity);
+		::memcpy(copy, chunk.data, chunk.capacity);
+		if (m_residency)
+			m_residency->add(chunk.capacity);
+
+		// readers of the old pointer keep it valid until they detach
+		m_retiredChunks.push_back(chunk);
+		chunk.shared = nullptr;
+		std::atomic_ref<uint8_t*>(chunk.data).store(copy, std::memory_order_release);
+	}
+}
+
+void MemoryData::releaseChunk(const Chunk& chunk, MemoryResidency* residency)
+{
+	if (chunk.shared)
+	{
+		if (chunk.shared->refs.fetch_sub(1, std::memory_order_acq_rel) != 1)
+			return;
+
+		// dedupe() does not take references on a chunk that has none left
+		if (chunk.shared->index)
+		{
+			std::lock_guard<std::mutex> indexLock(chunk.shared->index->m_mutex);
+			chunk.shared->index->forget(chunk.shared->hash, chunk.data);
+		}
+		delete chunk.shared;
+	}
+	MemoryPool::instance().release(chunk.data, chunk.capacity);
+	if (residency)
+		residency->sub(chunk.capacity);
+}
+
+uint64_t MemoryData::privateBytes() const
+{
+	uint64_t bytes = 0;
+	auto table = m_table.load(std::memory_order_relaxed);
+	for (size_t i = 0; i < m_chunkCount; ++i)
+	{
+		auto& chunk = table->chunks[i];
+		if (chunk.shared == nullptr || chunk.shared->refs.load(std::memory_order_acquire) == 1)
+			bytes += chunk.capacity;
+	}
+	return bytes;
+}
+
+std::shared_ptr<MemoryData> MemoryData::clone()
+{
+	auto copy = std::make_shared<MemoryData>(m_residency);
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (storage() != Storage::Resident && !restore())
+		return nullptr;
+
+	auto table = m_table.load(std::memory_order_relaxed);
+	if (table == nullptr)
+		return copy;
+
+	auto copyTable = new ChunkTable{ table->capacity, nullptr };
+	copyTable->chunks.reset(new Chunk[copyTable->capacity]);
+	for (size_t i = 0; i < m_chunkCount; ++i)
+	{
+		auto& chunk = table->chunks[i];
+		// readers never look at the count, it can be created in place
+		if (chunk.shared == nullptr)
+			chunk.shared = new SharedChunk{ 1, false, nullptr, 0 };
+		chunk.shared->refs.fetch_add(1, std::memory_order_relaxed);
+		copyTable->chunks[i] = chunk;
+	}
+
+	copy->m_table.store(copyTable, std::memory_order_relaxed);
+	copy->m_layout.store(m_layout.load(std::memory_order_relaxed), std::memory_order_relaxed);
+	copy->m_size.store(m_size.load(std::memory_order_relaxed), std::memory_order_relaxed);
+	copy->m_chunkCount = m_chunkCount;
+	copy->m_capacity = m_capacity;
+	return copy;
+}
+
+uint64_t MemoryData::write(uint8_t* data, uint64_t len, uint64_t offset, const std::function<void(uint64_t len)>& written)
 {
 	if (len == 0)
 		return 0;
 
 	std::lock_guard<std::mutex> lock(m_mutex);
+	if (storage() != Storage::Resident && !restore())
+		return 0;
+	m_incompressible = false;
 
+	uint64_t size = m_size.load(std::memory_order_relaxed);
 	uint64_t totalLen = len + offset;
-	if (totalLen > m_data.size())
+	reserve(totalLen);
+
+	auto table = m_table.load(std::memory_order_relaxed);
+	uint64_t layout = m_layout.load(std::memory_order_relaxed);
+
+	// chunks shared with a clone are copied before they are modified, that includes the free room
+	// of the last chunk an append fills
+	if (offset < size)
+		unshare(table, layout, offset, std::min(len, size - offset));
+	else if (size > 0)
+		unshare(table, layout, size - 1, 1);
+
+	// appending is invisible to readers until the size is published, only overwrites need the sequence
+	bool overwrite = offset < size;
+	uint64_t sequence = m_sequence.load(std::memory_order_relaxed);
+	if (overwrite)
 	{
-		m_data.resize(totalLen);
+		m_sequence.store(sequence + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
 	}
 
-	::memcpy(&m_data[offset], data, len);
+	// pooled blocks are not cleared, a gap left by seeking past the end must read as zeros
+	if (offset > size)
+	{
+		forEachPiece(table, layout, size, offset - size, [](uint8_t* piece, uint64_t n) {
+			::memset(piece, 0, n);
+		});
+	}
+
+	forEachPiece(table, layout, offset, len, [&data](uint8_t* piece, uint64_t n) {
+		::memcpy(piece, data, n);
+		data += n;
+	});
+
+	if (totalLen > size)
+		m_size.store(totalLen, std::memory_order_release);
+
+	if (overwrite)
+		m_sequence.store(sequence + 2, std::memory_order_release);
+	if (written)
+		written(len);
 	return len;
 }
 
@@ -45,42 +354,352 @@ uint64_t MemoryData::read(uint8_t* data, uint64_t len, uint64_t offset)
 	if (len == 0)
 		return 0;
 
-	if (UNLIKELY(m_wirteNum.load(std::memory_order_relaxed) > 0))
+	for (int attempt = 0; attempt < READ_RETRIES; ++attempt)
+	{
+		uint64_t sequence = m_sequence.load(std::memory_order_acquire);
+		if (UNLIKELY(sequence & 1))
+			continue;
+
+		uint64_t size = m_size.load(std::memory_order_acquire);
+		if (offset >= size)
+			return 0;
+
+		uint64_t readLen = std::min(len, size - offset);
+		uint8_t* out = data;
+		forEachPiece(m_table.load(std::memory_order_acquire), m_layout.load(std::memory_order_acquire), offset, readLen, [&out](uint8_t* piece, uint64_t n) {
+			::memcpy(out, piece, n);
+			out += n;
+		});
+
+		std::atomic_thread_fence(std::memory_order_acquire);
+		if (LIKELY(m_sequence.load(std::memory_order_relaxed) == sequence))
+			return readLen;
+	}
+
+	// keeps colliding with overwrites, wait for the writer instead
+	std::lock_guard<std::mutex> lock(m_mutex);
+	uint64_t size = m_size.load(std::memory_order_relaxed);
+	if (offset >= size)
+		return 0;
+
+	uint64_t readLen = std::min(len, size - offset);
+	forEachPiece(m_table.load(std::memory_order_relaxed), m_layout.load(std::memory_order_relaxed), offset, readLen, [&data](uint8_t* piece, uint64_t n) {
+		::memcpy(data, piece, n);
+		data += n;
+	});
+	return readLen;
+}
+
+uint64_t MemoryData::len()
+{
+	return m_size.load(std::memory_order_acquire);
+}
+
+uint64_t MemoryData::capacity()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_capacity;
+}
+
+bool MemoryData::attach()
+{
+	// pairs with beginOffload(): either it sees this stream attached or the stream sees the new storage
+	m_attached.fetch_add(1, std::memory_order_seq_cst);
+	m_lastAccess.store(steadyNow(), std::memory_order_relaxed);
+	if (m_residency)
+		m_residency->touch(m_residencyPos);
+	if (UNLIKELY(m_storage.load(std::memory_order_seq_cst) != (uint8_t)Storage::Resident))
 	{
 		std::lock_guard<std::mutex> lock(m_mutex);
-		return read_impl(data, len, offset);
+		if (storage() != Storage::Resident && !restore())
+		{
+			m_attached.fetch_sub(1, std::memory_order_acq_rel);
+			return false;
+		}
 	}
-	else
+	return true;
+}
+
+void MemoryData::detach()
+{
+	if (m_attached.fetch_sub(1, std::memory_order_acq_rel) == 1)
 	{
-		return read_impl(data, len, offset);
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			// a stream attached meanwhile can only have seen the current table
+			if (m_attached.load(std::memory_order_acquire) == 0)
+				freeRetired();
+		}
+		if (m_residency)
+			m_residency->idle();
 	}
 }
 
-uint64_t MemoryData::read_impl(uint8_t* data, uint64_t len, uint64_t offset)
+void MemoryData::freeRetired()
 {
-	if (offset >= m_data.size())
-		return 0;
+	for (auto table : m_retired)
+		delete table;
+	m_retired.clear();
 
-	uint64_t readLen = std::min(len, static_cast<uint64_t>(m_data.size()) - offset);
-	if (readLen > 0)
+	for (auto& chunk : m_retiredChunks)
+		releaseChunk(chunk, m_residency.get());
+	m_retiredChunks.clear();
+}
+
+bool MemoryData::beginOffload(Storage storage)
+{
+	if (this->storage() != Storage::Resident || m_size.load(std::memory_order_relaxed) == 0 || m_attached.load(std::memory_order_seq_cst) > 0)
+		return false;
+
+	// a stream attaching from now on waits for the mutex and restores the content
+	m_storage.store((uint8_t)storage, std::memory_order_seq_cst);
+	if (m_attached.load(std::memory_order_seq_cst) > 0)
 	{
-		::memcpy(data, &m_data[offset], readLen);
-		return readLen;
+		m_storage.store((uint8_t)Storage::Resident, std::memory_order_relaxed);
+		return false;
 	}
-	return 0;
+	return true;
 }
 
-uint64_t MemoryData::len()
+bool MemoryData::spill(const std::string& path)
 {
-	if (UNLIKELY(m_wirteNum.load(std::memory_order_relaxed) > 0))
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (!beginOffload(Storage::Spilled))
+		return false;
+
+	uint64_t size = m_size.load(std::memory_order_relaxed);
+	bool ok;
 	{
-		std::lock_guard<std::mutex> lock(m_mutex);
-		return static_cast<uint64_t>(m_data.size());
+		std::ofstream file(path, std::ios::binary | std::ios::trunc);
+		ok = file.is_open();
+		if (ok)
+		{
+			forEachPiece(m_table.load(std::memory_order_relaxed), m_layout.load(std::memory_order_relaxed), 0, size, [&file](uint8_t* piece, uint64_t n) {
+				file.write(reinterpret_cast<const char*>(piece), (std::streamsize)n);
+			});
+			file.flush();
+			ok = file.good();
+		}
+	}
+
+	if (!ok)
+	{
+		::remove(path.c_str());
+		m_storage.store((uint8_t)Storage::Resident, std::memory_order_relaxed);
+		return false;
+	}
+
+	releaseAll();
+	m_spillPath = path;
+	if (m_residency)
+		m_residency->touch(m_residencyPos);
+	return true;
+}
+
+bool MemoryData::compress(int level)
+{
+#ifdef VFS_HAS_ZLIB
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (m_incompressible || !beginOffload(Storage::Compressed))
+		return false;
+
+	uint64_t size = m_size.load(std::memory_order_relaxed);
+	z_stream strm;
+	memset(&strm, 0, sizeof(strm));
+	bool ok = deflateInit(&strm, level) == Z_OK;
+	if (ok)
+	{
+		// anything saving less than an eighth is not worth the inflate on the next open
+		uint64_t limit = size - size / 8;
+		std::vector<uint8_t> deflated(std::min<uint64_t>(deflateBound(&strm, (uLong)std::min<uint64_t>(size, UINT32_MAX)), limit));
+		strm.next_out = deflated.data();
+		strm.avail_out = (uInt)deflated.size();
+
+		uint64_t left = size;
+		forEachPiece(m_table.load(std::memory_order_relaxed), m_layout.load(std::memory_order_relaxed), 0, size, [&](uint8_t* piece, uint64_t n) {
+			left -= n;
+			strm.next_in = piece;
+			strm.avail_in = (uInt)n;
+			while (ok && (strm.avail_in > 0 || left == 0))
+			{
+				int ret = deflate(&strm, left == 0 ? Z_FINISH : Z_NO_FLUSH);
+				if (ret == Z_STREAM_END)
+					break;
+				ok = ret == Z_OK && strm.avail_out > 0;
+			}
+		});
+		ok = ok && strm.total_out < limit;
+		deflated.resize(strm.total_out);
+		deflateEnd(&strm);
+		if (ok)
+		{
+			deflated.shrink_to_fit();
+			m_deflated = std::move(deflated);
+			if (m_residency)
+				m_residency->add(m_deflated.size());
+		}
+	}
+
+	if (!ok)
+	{
+		m_incompressible = true;
+		m_storage.store((uint8_t)Storage::Resident, std::memory_order_relaxed);
+		return false;
+	}
+
+	releaseAll();
+	if (m_residency)
+		m_residency->touch(m_residencyPos);
+	return true;
+#else
+	return false;
+#endif
+}
+
+uint64_t MemoryData::compressedSize()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return storage() == Storage::Compressed ? m_deflated.size() : 0;
+}
+
+bool MemoryData::restore()
+{
+	uint64_t size = m_size.load(std::memory_order_relaxed);
+	reserve(size);
+
+	bool ok = true;
+	auto table = m_table.load(std::memory_order_relaxed);
+	uint64_t layout = m_layout.load(std::memory_order_relaxed);
+	if (storage() == Storage::Spilled)
+	{
+		std::ifstream file(m_spillPath, std::ios::binary);
+		forEachPiece(table, layout, 0, size, [&file](uint8_t* piece, uint64_t n) {
+			file.read(reinterpret_cast<char*>(piece), (std::streamsize)n);
+		});
+		ok = file.good();
+	}
+#ifdef VFS_HAS_ZLIB
+	else
+	{
+		z_stream strm;
+		memset(&strm, 0, sizeof(strm));
+		ok = inflateInit(&strm) == Z_OK;
+		strm.next_in = m_deflated.data();
+		strm.avail_in = (uInt)m_deflated.size();
+		forEachPiece(table, layout, 0, size, [&](uint8_t* piece, uint64_t n) {
+			strm.next_out = piece;
+			strm.avail_out = (uInt)n;
+			while (ok && strm.avail_out > 0)
+			{
+				int ret = inflate(&strm, Z_NO_FLUSH);
+				ok = ret == Z_OK || (ret == Z_STREAM_END && strm.avail_out == 0);
+			}
+		});
+		inflateEnd(&strm);
+	}
+#endif
+
+	// the spill file or the deflated bytes stay, the content is not lost to a failed read
+	if (!ok)
+	{
+		std::cerr << "MemoryData: can not read back " << (storage() == Storage::Spilled ? m_spillPath : std::string("compressed content")) << std::endl;
+		releaseAll();
+		return false;
+	}
+
+	if (storage() == Storage::Spilled)
+	{
+		::remove(m_spillPath.c_str());
+		m_spillPath.clear();
 	}
 	else
 	{
-		return static_cast<uint64_t>(m_data.size());
+		if (m_residency)
+			m_residency->sub(m_deflated.size());
+		std::vector<uint8_t>().swap(m_deflated);
+	}
+	m_storage.store((uint8_t)Storage::Resident, std::memory_order_release);
+	return true;
+}
+
+uint64_t MemoryData::dedupe(const std::shared_ptr<ChunkIndex>& index)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (storage() != Storage::Resident)
+		return 0;
+
+	auto table = m_table.load(std::memory_order_relaxed);
+	uint64_t size = m_size.load(std::memory_order_relaxed);
+	uint64_t start = 0;
+	uint64_t released = 0;
+
+	// a listed chunk whose last owner is letting go may still be found, it is not taken
+	auto retain = [](SharedChunk* shared) {
+		uint32_t refs = shared->refs.load(std::memory_order_relaxed);
+		while (refs > 0 && !shared->refs.compare_exchange_weak(refs, refs + 1, std::memory_order_acq_rel))
+			;
+		return refs > 0;
+	};
+
+	{
+		std::lock_guard<std::mutex> indexLock(index->m_mutex);
+		for (size_t i = 0; i < m_chunkCount && start < size; ++i)
+		{
+			auto& chunk = table->chunks[i];
+			uint32_t used = (uint32_t)std::min<uint64_t>(chunk.capacity, size - start);
+			start += chunk.capacity;
+
+			uint64_t hash = ChunkIndex::hash(chunk.data, used);
+			auto range = index->m_entries.equal_range(hash);
+			auto match = range.first;
+			for (; match != range.second; ++match)
+			{
+				const auto& entry = match->second;
+				if (entry.chunk.data == chunk.data)
+					break;
+				if (entry.chunk.capacity == chunk.capacity && entry.used == used
+					&& ::memcmp(entry.chunk.data, chunk.data, used) == 0 && retain(entry.chunk.shared))
+					break;
+			}
+
+			if (match == range.second)
+			{
+				// a chunk shared with a clone may be indexed too, the clones then dedupe against it.
+				// A clone in a file system with an index of its own may have listed it there already.
+				if (chunk.shared == nullptr)
+					chunk.shared = new SharedChunk{ 1, false, nullptr, 0 };
+				bool listed = false;
+				if (chunk.shared->listed.compare_exchange_strong(listed, true, std::memory_order_acq_rel))
+				{
+					chunk.shared->index = index;
+					chunk.shared->hash = hash;
+					index->m_entries.emplace(hash, ChunkIndex::Entry{ chunk, used });
+				}
+			}
+			else if (match->second.chunk.data != chunk.data)
+			{
+				// same bytes, readers of the old pointer keep it valid until they detach
+				auto& shared = match->second.chunk;
+				m_retiredChunks.push_back(chunk);
+				released += chunk.capacity;
+				chunk.shared = shared.shared;
+				std::atomic_ref<uint8_t*>(chunk.data).store(shared.data, std::memory_order_release);
+			}
+		}
 	}
+
+	// a stream attached meanwhile can only have seen the new pointers. Released chunks take the index mutex.
+	if (m_attached.load(std::memory_order_seq_cst) == 0)
+		freeRetired();
+	return released;
+}
+
+void MemoryData::forEachChunk(const std::function<void(const uint8_t* data, uint32_t capacity)>& call)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	auto table = m_table.load(std::memory_order_relaxed);
+	for (size_t i = 0; i < m_chunkCount; ++i)
+		call(table->chunks[i].data, table->chunks[i].capacity);
 }
 
 void MemoryData::acquireWriteLock()
@@ -1,39 +1,170 @@
 #pragma once
 
 #include "../Common.h"
+#include "MemoryResidency.h"
 #include <vector>
 #include <mutex>
+#include <atomic>
+#include <string>
+#include <functional>
 
 NS_VFS_BEGIN
 
-class MemoryData
+class ChunkIndex;
+
+// File content stored as a list of chunks from the MemoryPool. The leading chunks grow through the
+// small size classes, everything past them is made of full pages, so growing never moves data.
+//
+// Writers are serialized by a mutex. Readers never lock: the chunk table is published with release
+// stores and replaced tables are only freed once no stream is attached, overwrites of published bytes
+// are bracketed by a sequence counter so a reader retries (and finally locks) instead of returning a torn copy.
+class MemoryData : public std::enable_shared_from_this<MemoryData>
 {
 public:
 
-    MemoryData();
+    // Chunks and deflated content are counted in residency, which also tracks the last attach
+    explicit MemoryData(std::shared_ptr<MemoryResidency> residency = nullptr);
 
     virtual ~MemoryData();
 
-    uint64_t write(uint8_t* data, uint64_t len, uint64_t offset);
+    // Copy of the current content sharing every chunk, a chunk is copied once either side writes to it.
+    // nullptr if spilled or compressed content can not be read back.
+    std::shared_ptr<MemoryData> clone();
+
+    // 0 if spilled or compressed content can not be read back. written is called before the writer lock is
+    // released, so whatever it records is ordered like the writes themselves.
+    uint64_t write(uint8_t* data, uint64_t len, uint64_t offset, const std::function<void(uint64_t len)>& written = nullptr);
 
+    // Safe against concurrent writers as long as the caller is attached
     uint64_t read(uint8_t* data, uint64_t len, uint64_t offset);
 
     uint64_t len();
 
+    // Bytes allocated for the content, including the unused tail of the last chunk
+    uint64_t capacity();
+
+    // Streams attach for their lifetime, memory retired by writers is freed once nobody is attached.
+    // Fails and stays detached if spilled or compressed content can not be read back, the content is kept
+    // where it is and the next attach tries again.
+    bool attach();
+
+    void detach();
+
+    int attached() const { return m_attached.load(std::memory_order_acquire); }
+
     void acquireWriteLock();
 
     void releaseWriteLock();
 
     int wirteNum() { return m_wirteNum.load(std::memory_order_relaxed); }
 
+    enum class Storage : uint8_t
+    {
+        Resident,
+        Spilled,
+        Compressed,
+    };
+
+    // Writes the content to path and returns its chunks to the pool, fails while a stream is attached.
+    // The next attach, clone or write reads it back and deletes the file.
+    bool spill(const std::string& path);
+
+    // Like spill, but keeps the content deflated in memory. Fails without zlib or when it saves less than an eighth.
+    bool compress(int level);
+
+    Storage storage() const { return (Storage)m_storage.load(std::memory_order_acquire); }
+
+    bool spilled() const { return storage() == Storage::Spilled; }
+
+    // Size of the deflated content while compressed
+    uint64_t compressedSize();
+
+    // Swaps every chunk whose content is already in index for the indexed one and adds the others.
+    // Returns the bytes of chunks given up.
+    uint64_t dedupe(const std::shared_ptr<ChunkIndex>& index);
+
+    // Calls back with every chunk of resident content, chunks shared with other files included
+    void forEachChunk(const std::function<void(const uint8_t* data, uint32_t capacity)>& call);
+
+    // Steady clock time of the last attach in nanoseconds
+    int64_t lastAccess() const { return m_lastAccess.load(std::memory_order_relaxed); }
+
 private:
+    friend class ChunkIndex;
+    friend class MemoryResidency;
+
+    // Reference count of a chunk shared with clones, the last owner returns the chunk to the pool.
+    // A chunk is listed in one index at a time, the owner claiming listed sets index and hash.
+    struct SharedChunk
+    {
+        std::atomic<uint32_t> refs;
+        std::atomic<bool> listed;
+        std::shared_ptr<ChunkIndex> index;
+        uint64_t hash;
+    };
+
+    struct Chunk
+    {
+        uint8_t* data;
+        uint32_t capacity;
+        SharedChunk* shared;
+    };
+
+    struct ChunkTable
+    {
+        size_t capacity;
+        std::unique_ptr<Chunk[]> chunks;
+    };
+
+    void reserve(uint64_t size);
+
+    void freeRetired();
+
+    void releaseAll();
 
-    uint64_t read_impl(uint8_t* data, uint64_t len, uint64_t offset);
+    // Switches a resident, detached content to storage, which the caller then fills. Called with m_mutex held.
+    bool beginOffload(Storage storage);
+
+    // Called with m_mutex held
+    bool restore();
+
+    // Bytes of the chunks no other file or index shares, what spilling or compressing frees. Called with m_mutex held.
+    uint64_t privateBytes() const;
+
+    // The last owner takes the chunk off its index, returns it to the pool and takes it off residency
+    static void releaseChunk(const Chunk& chunk, MemoryResidency* residency);
+
+    // Gives the chunks covering [offset, offset + len) a private copy where they are shared
+    void unshare(ChunkTable* table, uint64_t layout, uint64_t offset, uint64_t len);
+
+    // Calls back with consecutive pieces of [offset, offset + len), which must be within the published chunks.
+    // layout packs the count of the leading small chunks and their total size.
+    template<typename F>
+    static void forEachPiece(const ChunkTable* table, uint64_t layout, uint64_t offset, uint64_t len, F&& call);
 
 protected:
     std::mutex m_mutex;
-    std::vector<uint8_t> m_data;   
+    std::atomic<ChunkTable*> m_table;
+    std::atomic<uint64_t> m_layout;
+    std::atomic<uint64_t> m_size;
+    // odd while a writer modifies bytes readers can already see
+    std::atomic<uint64_t> m_sequence;
+    std::atomic<int> m_attached;
     std::atomic<int> m_wirteNum;
+    std::atomic<uint8_t> m_storage;
+    std::atomic<int64_t> m_lastAccess;
+    std::shared_ptr<MemoryResidency> m_residency;
+    MemoryResidency::List::iterator m_residencyPos;
+
+    // guarded by m_mutex
+    size_t m_chunkCount;
+    uint64_t m_capacity;
+    std::vector<ChunkTable*> m_retired;
+    std::vector<Chunk> m_retiredChunks;
+    std::string m_spillPath;
+    std::vector<uint8_t> m_deflated;
+    // set when compressing did not pay off, cleared by the next write
+    bool m_incompressible;
 };
 
 NS_VFS_END
@@ -34,6 +34,13 @@ bool MemoryFileStream::open(std::shared_ptr<MemoryData> data, FileStream::Mode m
 		data->acquireWriteLock();
 	}
 
+	// spilled or compressed content that can not be read back
+	if (!data->attach())
+	{
+		if (mode != FileStream::Mode::READ)
+			data->releaseWriteLock();
+		return false;
+	}
 	m_offset = 0;
 	m_data = data;
 	m_mode = mode;
@@ -45,14 +52,23 @@ bool MemoryFileStream::open(std::shared_ptr<MemoryData> data, FileStream::Mode m
 	return true;
 }
 
+void MemoryFileStream::setJournal(std::shared_ptr<MemoryJournal> journal, const std::string& path)
+{
+	m_journal = std::move(journal);
+	m_path = path;
+}
+
 void MemoryFileStream::close()
 {
 	if (m_data && m_mode != FileStream::Mode::READ)
 	{
 		m_data->releaseWriteLock();
 	}
+	if (m_data)
+		m_data->detach();
 	m_offset = 0;
 	m_data = nullptr;
+	m_journal = nullptr;
 }
 
 uint64_t MemoryFileStream::seek(uint64_t offset, SeekOrigin origin)
@@ -96,7 +112,20 @@ uint64_t MemoryFileStream::write(const void* buf, uint64_t size)
 	if (m_data == nullptr || m_mode == FileStream::Mode::READ)
 		return 0;
 
-	uint64_t result = m_data->write((uint8_t*)buf, size, m_offset);
+	if (m_journal == nullptr)
+	{
+		uint64_t result = m_data->write((uint8_t*)buf, size, m_offset);
+		m_offset += result;
+		return result;
+	}
+
+	// two streams writing the same bytes are logged in the order their writes landed
+	uint64_t record = 0;
+	uint64_t result = m_data->write((uint8_t*)buf, size, m_offset, [&](uint64_t len) {
+		record = m_journal->append(MemoryJournal::RecordType::Write, m_path, m_offset, buf, len);
+	});
+	if (record > 0)
+		m_journal->wait(record);
 	m_offset += result;
 	return result;
 }
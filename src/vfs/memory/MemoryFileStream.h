@@ -2,6 +2,7 @@
 
 #include "../FileStream.h"
 #include "MemoryData.h"
+#include "MemoryJournal.h"
 
 NS_VFS_BEGIN
 
@@ -17,6 +18,9 @@ public:
 
     bool open(std::shared_ptr<MemoryData> data, FileStream::Mode mode);
 
+    // Every write is appended to journal as a record for path
+    void setJournal(std::shared_ptr<MemoryJournal> journal, const std::string& path);
+
     virtual void close() override;
 
     virtual uint64_t seek(uint64_t offset, SeekOrigin origin) override;
@@ -35,6 +39,8 @@ protected:
     int64_t m_offset;
     FileStream::Mode m_mode;
     std::shared_ptr<MemoryData> m_data;
+    std::shared_ptr<MemoryJournal> m_journal;
+    std::string m_path;
 };
 
 NS_VFS_END
@@ -1,25 +1,209 @@
 #include "MemoryFileSystem.h"
 #include "MemoryFileStream.h"
-#include <filesystem>
+#include "ViewFileStream.h"
+#include "../native/MappedFile.h"
 #include <algorithm>
+#include <filesystem>
+#include <unordered_set>
+#include <stdio.h>
+#include <chrono>
+#include <string.h>
 
-namespace fs = std::filesystem;
+#ifdef VFS_HAS_ZLIB
+#include "zlib.h"
+#endif
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
 
 NS_VFS_BEGIN
 
+// Takes the next non-empty component off the front of path
+static bool nextComponent(std::string_view& path, std::string_view& name)
+{
+	auto begin = path.find_first_not_of('/');
+	if (begin == std::string_view::npos)
+		return false;
+
+	auto end = path.find('/', begin);
+	if (end == std::string_view::npos)
+		end = path.size();
+
+	name = path.substr(begin, end - begin);
+	path.remove_prefix(end);
+	return true;
+}
+
+static void splitFilePath(std::string_view filePath, std::string_view& dirPath, std::string_view& name)
+{
+	auto pos = filePath.rfind('/');
+	if (pos == std::string_view::npos)
+	{
+		dirPath = std::string_view();
+		name = filePath;
+	}
+	else
+	{
+		dirPath = filePath.substr(0, pos);
+		name = filePath.substr(pos + 1);
+	}
+}
+
+static const char IMAGE_MAGIC[8] = { 'V', 'F', 'S', 'M', 'E', 'M', 'I', 'G' };
+static const uint32_t IMAGE_VERSION = 1;
+
+// file blobs start on this boundary, so a mapped image hands out aligned content
+static const uint64_t IMAGE_ALIGNMENT = 16;
+
+struct ImageHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t entryCount;
+	uint64_t namesSize;
+	// total image size, a truncated image is rejected up front
+	uint64_t imageSize;
+};
+
+// Entries are in breadth first order, every entry follows its parent. Entry 0 is the root.
+struct ImageEntry
+{
+	uint32_t parent;
+	uint32_t nameOffset;
+	uint32_t nameLen;
+	uint8_t isDir;
+	uint8_t compressed;
+	uint16_t reserved;
+	uint64_t offset;
+	uint64_t storedSize;
+	uint64_t size;
+};
+
 MemoryFileSystem::MemoryFileSystem(const std::string& archiveLocation, const std::string& mntpoint)
 	: FileSystem(archiveLocation, mntpoint)
+	, m_arena(nullptr)
+	, m_root(nullptr)
+	, m_inlineThreshold(1024)
+	, m_residency(std::make_shared<MemoryResidency>())
+	, m_budget(0)
+	, m_spillCount(0)
+	, m_compressThreshold(0)
+	, m_compressIdleMs(0)
+	, m_compressLevel(6)
+	, m_compressStop(false)
+	, m_sharedFd(-1)
 {
 	m_fileSystemType = FileSystemType::Memory;
-	m_dirs.insert("/");
+	m_arenas.push_back(std::make_shared<MemoryArena>(m_residency));
+	m_arena = m_arenas.back().get();
+	m_root = newDir(nullptr);
 }
 
 MemoryFileSystem::~MemoryFileSystem()
-{}
+{
+	// streams may outlive the file system, the journal must not call back into it
+	if (m_journal)
+		m_journal->close();
+	stopCompression();
+
+	// copies keep using the parts of the tree they share
+	dropTree();
+#ifndef _WIN32
+	if (m_sharedFd >= 0)
+		::close(m_sharedFd);
+#endif
+}
 
 bool MemoryFileSystem::init()
 {
-	return !m_mntpoint.empty();
+	if (m_mntpoint.empty())
+		return false;
+
+	if (m_journalPath.empty() || m_journal)
+		return true;
+
+	if (!replayJournal())
+		return false;
+
+	m_journal = std::make_shared<MemoryJournal>(m_journalPath, m_journalPolicy, [this](const std::string& path) { return save(path); });
+	if (!m_journal->open())
+	{
+		std::cerr << "MemoryFileSystem: can not open journal " << m_journalPath << std::endl;
+		m_journal = nullptr;
+		return false;
+	}
+	return true;
+}
+
+bool MemoryFileSystem::replayJournal()
+{
+	// the snapshot holds everything up to the log it was written for, the logs hold the rest
+	auto snapshotPath = MemoryJournal::snapshotPath(m_journalPath);
+	std::error_code ec;
+	if (std::filesystem::exists(snapshotPath, ec) && !load(snapshotPath))
+	{
+		std::cerr << "MemoryFileSystem: can not load journal snapshot " << snapshotPath << std::endl;
+		return false;
+	}
+
+	// consecutive writes usually go to the same file
+	std::string streamPath;
+	std::unique_ptr<FileStream> stream;
+	MemoryJournal::replay(m_journalPath, [&](const MemoryJournal::Record& record) {
+		if (record.type != MemoryJournal::RecordType::Write || record.path != streamPath)
+		{
+			stream = nullptr;
+			streamPath.clear();
+		}
+
+		switch (record.type)
+		{
+		case MemoryJournal::RecordType::CreateDir:
+			createDir(std::string(record.path));
+			break;
+		case MemoryJournal::RecordType::CreateFile:
+			openFileStream(std::string(record.path), FileStream::Mode::WRITE);
+			break;
+		case MemoryJournal::RecordType::Write:
+			// a stream may still write to a file after it is gone from the tree
+			if (stream == nullptr && isFile(std::string(record.path)))
+			{
+				streamPath = record.path;
+				stream = openFileStream(streamPath, FileStream::Mode::WRITE);
+			}
+			if (stream)
+			{
+				stream->seek(record.offset, FileStream::SeekOrigin::SET);
+				stream->write(record.data, record.len);
+			}
+			break;
+		case MemoryJournal::RecordType::Remove:
+			removeFile(std::string(record.path));
+			break;
+		case MemoryJournal::RecordType::Reset:
+			reset();
+			break;
+		}
+	});
+	return true;
+}
+
+void MemoryFileSystem::setJournal(const std::string& logPath, const JournalPolicy& policy)
+{
+	m_journalPath = logPath;
+	m_journalPolicy = policy;
+}
+
+bool MemoryFileSystem::flush()
+{
+	return m_journal == nullptr || m_journal->flush();
+}
+
+bool MemoryFileSystem::sync()
+{
+	return m_journal == nullptr || m_journal->sync();
 }
 
 void MemoryFileSystem::enumerate(const std::string& dir, const std::function<bool(const FileInfo&)>& call)
@@ -28,134 +212,316 @@ void MemoryFileSystem::enumerate(const std::string& dir, const std::function<boo
 	if (!isReadonly())
 		defaultFlgs |= FileFlags::Write;
 
-	FileInfo info;
+	// the callback runs without the tree lock, it may open, create or remove files itself
+	std::vector<std::string> dirs;
+	std::vector<std::string> files;
 	{
-		std::lock_guard<std::recursive_mutex> lock(m_dirMutex);
-		if (m_dirs.count(dir) == 0)
+		std::shared_lock<ShardedMutex> lock(m_treeMutex);
+		auto node = findDir(dir);
+		if (node == nullptr)
 			return;
 
-		for (auto& it : m_dirs)
+		dirs.reserve(node->dirs.size());
+		for (auto& it : node->dirs)
 		{
-			if (it.size() > dir.size())
-			{
-				auto p1 = it.substr(dir.size());
-				if (p1.find('/') == p1.size() - 1)
-				{
-					info.flags = defaultFlgs | FileFlags::Dir;
-					info.filePath = m_mntpoint + p1.substr(0, p1.size() - 1);
-					if (call(info))
-						break;
-				}
-			}
+			dirs.emplace_back(it.first);
 		}
+		files.reserve(node->files.size());
+		for (auto& it : node->files)
+		{
+			files.emplace_back(it.first);
+		}
+	}
+
+	// virtual paths of all entries share this prefix, only the name part is rewritten per entry
+	FileInfo info;
+	info.filePath = m_mntpoint;
+	info.filePath.append(dir, std::min(dir.size(), basePath().size()), std::string::npos);
+	formatDirPath(info.filePath);
+	const size_t prefixLen = info.filePath.size();
+
+	for (auto& name : dirs)
+	{
+		info.flags = defaultFlgs | FileFlags::Dir;
+		info.filePath.resize(prefixLen);
+		info.filePath.append(name);
+		if (call(info))
+			return;
 	}
 
+	for (auto& name : files)
 	{
-		std::lock_guard<std::recursive_mutex> lock(m_fileMutex);
-		for (auto& it : m_files)
-		{
-			if (it.first.starts_with(dir))
-			{
-				auto p1 = it.first.substr(dir.size());
-				if (!p1.empty() && p1.find("/") == std::string::npos)
-				{
-					info.flags = defaultFlgs | FileFlags::File;
-					info.filePath = m_mntpoint + p1;
-					if (call(info))
-						break;
-				}
-			}
-		}
+		info.flags = defaultFlgs | FileFlags::File;
+		info.filePath.resize(prefixLen);
+		info.filePath.append(name);
+		if (call(info))
+			return;
 	}
 }
 
 std::unique_ptr<FileStream> MemoryFileSystem::openFileStream(const std::string& filePath, FileStream::Mode mode)
 {
-	std::lock_guard<std::recursive_mutex> lock(m_fileMutex);
+	std::string_view dirPath, name;
+	splitFilePath(filePath, dirPath, name);
+	if (name.empty())
+		return nullptr;
+
+	// spilling writes files, it is done before the tree is locked
+	spillLeastRecentlyUsed();
 
-	auto it = m_files.find(filePath);
-	if (it != m_files.end())
+	// reads only need the shared lock unless there is housekeeping to do first
+	if (mode == FileStream::Mode::READ)
 	{
-		auto fs = std::make_unique<MemoryFileStream>();
-		return fs->open(it->second, mode) ? std::move(fs) : nullptr;
+		std::shared_lock<ShardedMutex> lock(m_treeMutex);
+		if (!hasClosedWriters())
+			return openForRead(dirPath, name);
 	}
 
+	std::unique_lock<ShardedMutex> lock(m_treeMutex);
+	settleClosedWriters();
+
 	if (mode == FileStream::Mode::READ)
+		return openForRead(dirPath, name);
+
+	auto dir = findDir(dirPath);
+	if (dir == nullptr)
 		return nullptr;
 
-	
-	auto dirName(getFileDir(filePath));
-	if (!isDir(dirName))
+	std::shared_ptr<MemoryData> data;
+	uint64_t record = 0;
+	auto it = dir->files.find(name);
+	if (it != dir->files.end())
 	{
+		data = writableData(mutableDir(dirPath, false)->files.find(name)->second);
+		if (data == nullptr)
+			return nullptr;
+	}
+	else
+	{
+		data = std::make_shared<MemoryData>(m_residency);
+		FileEntry entry{ m_arena, data.get(), nullptr, 0 };
+		retainEntry(entry);
+		mutableDir(dirPath, false)->files.emplace(std::pmr::string(name, m_arena), entry);
+		if (m_journal)
+			record = m_journal->append(MemoryJournal::RecordType::CreateFile, filePath);
+	}
+	m_writers[filePath] = data;
+	pruneArenas();
+
+	auto fs = std::make_unique<MemoryFileStream>();
+	if (!fs->open(data, mode))
 		return nullptr;
+
+	lock.unlock();
+	if (m_journal)
+	{
+		if (record > 0)
+			m_journal->wait(record);
+		fs->setJournal(m_journal, filePath);
 	}
+	return fs;
+}
 
-	auto data = std::make_shared<MemoryData>();
-	m_files.insert(std::make_pair(filePath, data));
+std::unique_ptr<FileStream> MemoryFileSystem::openForRead(std::string_view dirPath, std::string_view name) const
+{
+	auto dir = findDir(dirPath);
+	if (dir == nullptr)
+		return nullptr;
+
+	auto it = dir->files.find(name);
+	if (it == dir->files.end())
+		return nullptr;
+
+	const auto& entry = it->second;
+	if (entry.data == nullptr)
+	{
+		auto fs = std::make_unique<ViewFileStream>();
+		return fs->open(entry.arena->ownerOf(entry.bytes), entry.bytes, entry.size) ? std::move(fs) : nullptr;
+	}
 
 	auto fs = std::make_unique<MemoryFileStream>();
-	return fs->open(data, mode) ? std::move(fs) : nullptr;
+	return fs->open(entry.data->shared_from_this(), FileStream::Mode::READ) ? std::move(fs) : nullptr;
+}
+
+bool MemoryFileSystem::hasClosedWriters() const
+{
+	for (auto& it : m_writers)
+	{
+		auto data = it.second.lock();
+		if (data == nullptr || data->wirteNum() == 0)
+			return true;
+	}
+	return false;
 }
 
 bool MemoryFileSystem::removeFile(const std::string& filePath)
 {
-	std::lock_guard<std::recursive_mutex> lock(m_fileMutex);
+	std::string_view dirPath, name;
+	splitFilePath(filePath, dirPath, name);
 
-	auto it = m_files.find(filePath);
-	if (it == m_files.end())
+	std::unique_lock<ShardedMutex> lock(m_treeMutex);
+
+	auto dir = findDir(dirPath);
+	if (dir == nullptr)
+		return false;
+
+	auto it = dir->files.find(name);
+	if (it == dir->files.end())
+		return false;
+
+	// in use
+	if (it->second.data && it->second.data->attached() > 0)
 		return false;
 
-	// unused
-	if (it->second.use_count() == 1)
+	auto node = mutableDir(dirPath, false);
+	auto entry = node->files.find(name);
+	releaseEntry(entry->second);
+	node->files.erase(entry);
+	m_writers.erase(filePath);
+	pruneArenas();
+
+	if (m_journal)
 	{
-		m_files.erase(it);
-		return true;
+		uint64_t record = m_journal->append(MemoryJournal::RecordType::Remove, filePath);
+		lock.unlock();
+		m_journal->wait(record);
 	}
-	// in use
-	return false;
+	return true;
 }
 
 bool MemoryFileSystem::isFile(const std::string& filePath) const
 {
-	std::lock_guard<std::recursive_mutex> lock(m_fileMutex);
-	return m_files.find(filePath) != m_files.end();
+	std::string_view dirPath, name;
+	splitFilePath(filePath, dirPath, name);
+
+	std::shared_lock<ShardedMutex> lock(m_treeMutex);
+	auto dir = findDir(dirPath);
+	return dir != nullptr && !name.empty() && dir->files.find(name) != dir->files.end();
 }
 
 bool MemoryFileSystem::isDir(const std::string& dirPath) const
 {
-	std::lock_guard<std::recursive_mutex> lock(m_dirMutex);
-	return m_dirs.count(dirPath) > 0;
+	std::shared_lock<ShardedMutex> lock(m_treeMutex);
+	return findDir(dirPath) != nullptr;
 }
 
 bool MemoryFileSystem::createDir(const std::string& dirPath)
 {
-	std::lock_guard<std::recursive_mutex> lock(m_dirMutex);
+	std::unique_lock<ShardedMutex> lock(m_treeMutex);
 
-	if (m_dirs.count(dirPath) > 0)
+	if (findDir(dirPath) != nullptr || mutableDir(dirPath, true) == nullptr)
 		return false;
+	pruneArenas();
 
-	std::string path = "/";
-	for (auto& part : splitString(dirPath, "/"))
+	if (m_journal)
 	{
-		if (!part.empty())
-		{
-			//if (part == "." || part == "..")
-			//{
-			//	return false;
-			//}
-			//else
-			{
-				path += part;
-				path += "/";
+		uint64_t record = m_journal->append(MemoryJournal::RecordType::CreateDir, dirPath);
+		lock.unlock();
+		m_journal->wait(record);
+	}
+	return true;
+}
 
-				if (m_dirs.count(path) == 0)
-				{
-					m_dirs.insert(path);
-				}
-			}
+bool MemoryFileSystem::writeFile(const std::string& filePath, std::vector<uint8_t>&& data)
+{
+	uint64_t record = 0;
+	{
+		std::lock_guard<ShardedMutex> lock(m_treeMutex);
+		if (!placeFile(filePath, data, false, record))
+			return false;
+	}
+
+	if (record > 0)
+		m_journal->wait(record);
+	return true;
+}
+
+size_t MemoryFileSystem::writeFiles(std::vector<std::pair<std::string, std::vector<uint8_t>>>&& files)
+{
+	size_t written = 0;
+	uint64_t record = 0;
+	{
+		std::lock_guard<ShardedMutex> lock(m_treeMutex);
+		for (auto& file : files)
+		{
+			if (placeFile(file.first, file.second, true, record))
+				++written;
 		}
 	}
 
+	// one wait covers every record appended before
+	if (record > 0)
+		m_journal->wait(record);
+	return written;
+}
+
+bool MemoryFileSystem::placeFile(const std::string& filePath, std::vector<uint8_t>& data, bool createDirs, uint64_t& record)
+{
+	std::string_view dirPath, name;
+	splitFilePath(filePath, dirPath, name);
+	if (name.empty())
+		return false;
+
+	auto dir = findDir(dirPath);
+	if (dir == nullptr && !createDirs)
+		return false;
+
+	bool exists = false;
+	if (dir)
+	{
+		auto it = dir->files.find(name);
+		exists = it != dir->files.end();
+
+		// in use
+		if (exists && it->second.data && it->second.data->attached() > 0)
+			return false;
+	}
+
+	if (dir == nullptr && m_journal)
+		record = m_journal->append(MemoryJournal::RecordType::CreateDir, dirPath);
+	auto node = mutableDir(dirPath, true);
+
+	FileEntry entry{ m_arena, nullptr, nullptr, data.size() };
+	if (data.size() <= m_inlineThreshold)
+	{
+		auto bytes = static_cast<uint8_t*>(m_arena->allocate(std::max<size_t>(data.size(), 1), 1));
+		if (!data.empty())
+			memcpy(bytes, data.data(), data.size());
+		entry.bytes = bytes;
+	}
+	else
+	{
+		auto owner = std::make_shared<std::vector<uint8_t>>(std::move(data));
+		entry.bytes = owner->data();
+		m_arena->adopt(owner, entry.bytes, entry.size);
+	}
+	retainEntry(entry);
+
+	// the journal has no truncation, a replaced file is removed and written again
+	if (m_journal)
+	{
+		if (exists)
+			m_journal->append(MemoryJournal::RecordType::Remove, filePath);
+		record = m_journal->append(MemoryJournal::RecordType::CreateFile, filePath);
+		if (entry.size > 0)
+			record = m_journal->append(MemoryJournal::RecordType::Write, filePath, 0, entry.bytes, entry.size);
+	}
+
+	if (exists)
+	{
+		auto& old = node->files.find(name)->second;
+		releaseEntry(old);
+		old = entry;
+	}
+	else
+	{
+		node->files.emplace(std::pmr::string(name, m_arena), entry);
+	}
+
+	// a closed writer of the replaced file must not be settled into the new entry
+	m_writers.erase(filePath);
+	pruneArenas();
+	data.clear();
 	return true;
 }
 
@@ -165,4 +531,829 @@ const std::string& MemoryFileSystem::basePath() const
 	return basePath;
 }
 
+const MemoryFileSystem::DirNode* MemoryFileSystem::findDir(std::string_view dirPath) const
+{
+	const DirNode* node = m_root;
+	std::string_view name;
+	while (nextComponent(dirPath, name))
+	{
+		auto it = node->dirs.find(name);
+		if (it == node->dirs.end())
+			return nullptr;
+		node = it->second;
+	}
+	return node;
+}
+
+MemoryFileSystem::DirNode* MemoryFileSystem::mutableDir(std::string_view dirPath, bool create)
+{
+	if (!create && findDir(dirPath) == nullptr)
+		return nullptr;
+
+	// nodes of older arenas are shared with copies, copying one only copies its child tables
+	if (m_root->arena != m_arena)
+	{
+		auto shared = m_root;
+		m_root = newDir(shared);
+		releaseNode(shared);
+	}
+
+	DirNode* node = m_root;
+	std::string_view name;
+	while (nextComponent(dirPath, name))
+	{
+		auto it = node->dirs.find(name);
+		if (it == node->dirs.end())
+		{
+			it = node->dirs.emplace(std::pmr::string(name, m_arena), newDir(nullptr)).first;
+		}
+		else if (it->second->arena != m_arena)
+		{
+			auto shared = it->second;
+			it->second = newDir(shared);
+			releaseNode(shared);
+		}
+		node = it->second;
+	}
+	return node;
+}
+
+MemoryFileSystem::DirNode* MemoryFileSystem::newDir(const DirNode* copyOf)
+{
+	void* p = m_arena->allocate(sizeof(DirNode), alignof(DirNode));
+	m_arena->ref();
+	if (copyOf == nullptr)
+		return new (p) DirNode(m_arena);
+
+	auto node = new (p) DirNode(*copyOf, m_arena);
+	for (auto& it : node->dirs)
+		++it.second->refs;
+	for (auto& it : node->files)
+		retainEntry(it.second);
+	return node;
+}
+
+void MemoryFileSystem::releaseNode(DirNode* node)
+{
+	// nodes are not destroyed, their arena releases the memory once nothing points into it
+	std::vector<DirNode*> pending = { node };
+	while (!pending.empty())
+	{
+		node = pending.back();
+		pending.pop_back();
+		if (--node->refs > 0)
+			continue;
+
+		for (auto& it : node->dirs)
+			pending.push_back(it.second);
+		for (auto& it : node->files)
+			releaseEntry(it.second);
+		node->arena->unref();
+	}
+}
+
+void MemoryFileSystem::retainEntry(const FileEntry& entry)
+{
+	entry.arena->ref();
+	if (entry.data)
+		entry.arena->own(entry.data->shared_from_this());
+	else
+		entry.arena->retain(entry.bytes);
+}
+
+void MemoryFileSystem::releaseEntry(const FileEntry& entry)
+{
+	if (entry.data)
+		entry.arena->disown(entry.data);
+	else
+		entry.arena->release(entry.bytes);
+	entry.arena->unref();
+}
+
+void MemoryFileSystem::dropTree()
+{
+	// without copies nothing outside these arenas points into them, they go at once without a walk
+	bool shared = false;
+	for (auto& arena : m_arenas)
+	{
+		if (arena.use_count() > 1)
+			shared = true;
+	}
+	if (shared && m_root)
+		releaseNode(m_root);
+
+	m_root = nullptr;
+	m_arena = nullptr;
+	m_arenas.clear();
+}
+
+void MemoryFileSystem::pruneArenas()
+{
+	m_arenas.erase(std::remove_if(m_arenas.begin(), m_arenas.end(), [this](const std::shared_ptr<MemoryArena>& arena) {
+		return arena.get() != m_arena && arena->refs() == 0;
+	}), m_arenas.end());
+}
+
+std::shared_ptr<MemoryData> MemoryFileSystem::writableData(FileEntry& entry)
+{
+	if (entry.data && entry.arena == m_arena)
+		return entry.data->shared_from_this();
+
+	std::shared_ptr<MemoryData> data;
+	if (entry.data)
+	{
+		// the data may be shared with a copy of this file system
+		data = entry.data->clone();
+		if (data == nullptr)
+			return nullptr;
+	}
+	else
+	{
+		// the file outgrows its inline bytes
+		data = std::make_shared<MemoryData>(m_residency);
+		data->write(const_cast<uint8_t*>(entry.bytes), entry.size, 0);
+	}
+
+	FileEntry writable{ m_arena, data.get(), nullptr, 0 };
+	retainEntry(writable);
+	releaseEntry(entry);
+	entry = writable;
+	return data;
+}
+
+void MemoryFileSystem::settleClosedWriters()
+{
+	for (auto it = m_writers.begin(); it != m_writers.end();)
+	{
+		auto data = it->second.lock();
+		if (data && data->wirteNum() > 0)
+		{
+			++it;
+			continue;
+		}
+
+		if (data && m_inlineThreshold > 0 && data->attached() == 0 && data->len() <= m_inlineThreshold)
+		{
+			std::string_view dirPath, name;
+			splitFilePath(it->first, dirPath, name);
+
+			auto dir = findDir(dirPath);
+			auto entry = dir ? dir->files.find(name) : decltype(dir->files.end())();
+			FileEntry inlined;
+			if (dir && entry != dir->files.end() && entry->second.data == data.get() && entry->second.arena == m_arena && inlineEntry(data.get(), inlined))
+			{
+				retainEntry(inlined);
+				auto& settled = mutableDir(dirPath, false)->files.find(name)->second;
+				releaseEntry(settled);
+				settled = inlined;
+				data = nullptr;
+			}
+		}
+
+		if (data && m_chunkIndex)
+			data->dedupe(m_chunkIndex);
+		it = m_writers.erase(it);
+	}
+	pruneArenas();
+}
+
+bool MemoryFileSystem::inlineEntry(MemoryData* data, FileEntry& entry)
+{
+	// attaching reads a spilled file back
+	if (!data->attach())
+		return false;
+	uint64_t size = data->len();
+	auto bytes = static_cast<uint8_t*>(m_arena->allocate(std::max<uint64_t>(size, 1), 1));
+	size = data->read(bytes, size, 0);
+	data->detach();
+	entry = FileEntry{ m_arena, nullptr, bytes, size };
+	return true;
+}
+
+void MemoryFileSystem::compact()
+{
+	std::lock_guard<ShardedMutex> lock(m_treeMutex);
+	settleClosedWriters();
+	if (m_inlineThreshold == 0)
+		return;
+
+	// subtrees of older arenas are shared with copies, which keep their data alive anyway
+	std::vector<DirNode*> pending = { m_root };
+	while (!pending.empty())
+	{
+		auto node = pending.back();
+		pending.pop_back();
+		if (node->arena != m_arena)
+			continue;
+
+		for (auto& it : node->dirs)
+			pending.push_back(it.second);
+
+		for (auto& it : node->files)
+		{
+			auto& entry = it.second;
+			if (entry.data == nullptr || entry.arena != m_arena || entry.data->attached() > 0 || entry.data->wirteNum() > 0)
+				continue;
+
+			FileEntry inlined;
+			if (entry.data->len() > m_inlineThreshold || !inlineEntry(entry.data, inlined))
+				continue;
+
+			retainEntry(inlined);
+			releaseEntry(entry);
+			entry = inlined;
+		}
+	}
+}
+
+void MemoryFileSystem::reset()
+{
+	std::unique_lock<ShardedMutex> lock(m_treeMutex);
+	m_writers.clear();
+
+	// the tree is not walked unless copies share it, dropping the arenas releases it page by page
+	dropTree();
+	m_arenas.push_back(std::make_shared<MemoryArena>(m_residency));
+	m_arena = m_arenas.back().get();
+	m_root = newDir(nullptr);
+
+	if (m_journal)
+	{
+		uint64_t record = m_journal->append(MemoryJournal::RecordType::Reset, std::string_view());
+		lock.unlock();
+		m_journal->wait(record);
+	}
+}
+
+bool MemoryFileSystem::save(const std::string& imagePath, bool compress)
+{
+	// readers never see a partially written image
+	std::string tmpPath = imagePath + ".tmp";
+	std::error_code ec;
+	std::filesystem::remove(tmpPath, ec);
+	NativeHandle handle = native::openHandle(tmpPath, true);
+	if (handle == native::invalidHandle())
+		return false;
+
+	// the image is on disk before its name is, and the name before the caller drops what the image replaces
+	bool ok = writeImage(handle, compress) && native::syncHandle(handle);
+	native::closeHandle(handle);
+	if (ok)
+		std::filesystem::rename(tmpPath, imagePath, ec);
+	if (!ok || ec)
+	{
+		std::filesystem::remove(tmpPath, ec);
+		return false;
+	}
+	return native::syncDir(std::filesystem::path(imagePath).parent_path().string());
+}
+
+bool MemoryFileSystem::writeImage(NativeHandle handle, bool compress)
+{
+	std::vector<ImageEntry> entries;
+	std::string names;
+	// file entries and the content they are written from
+	std::vector<std::pair<uint32_t, FileEntry>> files;
+
+	std::shared_lock<ShardedMutex> lock(m_treeMutex);
+
+	// dirs[i] is the node of entry dirEntry[i]
+	std::vector<const DirNode*> dirs = { m_root };
+	std::vector<uint32_t> dirEntry = { 0 };
+	entries.push_back(ImageEntry{ 0, 0, 0, 1, 0, 0, 0, 0, 0 });
+	for (size_t i = 0; i < dirs.size(); ++i)
+	{
+		for (auto& it : dirs[i]->dirs)
+		{
+			entries.push_back(ImageEntry{ dirEntry[i], (uint32_t)names.size(), (uint32_t)it.first.size(), 1, 0, 0, 0, 0, 0 });
+			names.append(it.first);
+			dirs.push_back(it.second);
+			dirEntry.push_back((uint32_t)entries.size() - 1);
+		}
+		for (auto& it : dirs[i]->files)
+		{
+			entries.push_back(ImageEntry{ dirEntry[i], (uint32_t)names.size(), (uint32_t)it.first.size(), 0, 0, 0, 0, 0, 0 });
+			names.append(it.first);
+			files.emplace_back((uint32_t)entries.size() - 1, it.second);
+		}
+	}
+
+	auto align = [](uint64_t offset) { return (offset + IMAGE_ALIGNMENT - 1) / IMAGE_ALIGNMENT * IMAGE_ALIGNMENT; };
+
+	// the table is written last, once the blob sizes are known
+	auto write = [handle](const void* buf, uint64_t len, uint64_t offset) {
+		return native::writeAt(handle, buf, len, offset) == (int64_t)len;
+	};
+
+	uint64_t offset = align(sizeof(ImageHeader) + entries.size() * sizeof(ImageEntry) + names.size());
+	uint64_t written = 0;
+	std::vector<uint8_t> content;
+	for (auto& it : files)
+	{
+		auto& entry = entries[it.first];
+		const FileEntry& source = it.second;
+		const uint8_t* bytes = source.bytes;
+		uint64_t size = source.size;
+		if (source.data)
+		{
+			// attaching reads spilled or compressed content back
+			if (!source.data->attach())
+				return false;
+			content.resize(source.data->len());
+			size = source.data->read(content.data(), content.size(), 0);
+			source.data->detach();
+			bytes = content.data();
+		}
+
+		entry.offset = offset;
+		entry.size = size;
+		entry.storedSize = size;
+
+#ifdef VFS_HAS_ZLIB
+		std::vector<uint8_t> deflated;
+		if (compress && size > 0)
+		{
+			uLongf deflatedSize = compressBound((uLong)size);
+			deflated.resize(deflatedSize);
+			if (compress2(deflated.data(), &deflatedSize, bytes, (uLong)size, Z_DEFAULT_COMPRESSION) == Z_OK && deflatedSize < size)
+			{
+				entry.compressed = 1;
+				entry.storedSize = deflatedSize;
+				bytes = deflated.data();
+			}
+		}
+#endif
+
+		if (!write(bytes, entry.storedSize, offset))
+			return false;
+		written = offset + entry.storedSize;
+		offset = align(written);
+	}
+
+	ImageHeader header;
+	memcpy(header.magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC));
+	header.version = IMAGE_VERSION;
+	header.entryCount = (uint32_t)entries.size();
+	header.namesSize = names.size();
+	header.imageSize = offset;
+
+	// pads the last blob, so the image ends at imageSize
+	static const uint8_t zeros[IMAGE_ALIGNMENT] = {};
+	if (written < offset && !write(zeros, offset - written, written))
+		return false;
+
+	uint64_t tableOffset = sizeof(header) + entries.size() * sizeof(ImageEntry);
+	return write(&header, sizeof(header), 0)
+		&& write(entries.data(), entries.size() * sizeof(ImageEntry), sizeof(header))
+		&& write(names.data(), names.size(), tableOffset);
+}
+
+bool MemoryFileSystem::load(const std::string& imagePath)
+{
+	auto mapped = MappedFile::open(imagePath);
+	if (mapped == nullptr || !loadImage(mapped))
+		return false;
+
+	// the log can not express a load, the loaded content becomes the next snapshot
+	if (m_journal)
+		m_journal->checkpoint();
+	return true;
+}
+
+#ifndef _WIN32
+int MemoryFileSystem::share(bool compress)
+{
+	int fd = native::createSharedMemory("vfs-memory");
+	if (fd < 0)
+		return -1;
+
+	// sealed, attached processes can rely on the content never changing under their mappings
+	if (!writeImage(fd, compress) || !native::sealSharedMemory(fd))
+	{
+		::close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+bool MemoryFileSystem::attach(int fd)
+{
+	int sharedFd = ::fcntl(fd, F_DUPFD_CLOEXEC, 0);
+	if (sharedFd < 0)
+		return false;
+
+	auto mapped = MappedFile::openFd(sharedFd);
+	if (mapped == nullptr || !loadImage(mapped))
+	{
+		::close(sharedFd);
+		return false;
+	}
+
+	std::lock_guard<ShardedMutex> lock(m_treeMutex);
+	if (m_sharedFd >= 0)
+		::close(m_sharedFd);
+	m_sharedFd = sharedFd;
+	m_sharedImage = mapped;
+	setReadonly(true);
+	return true;
+}
+
+bool MemoryFileSystem::sharedExtent(const std::string& filePath, int& fd, uint64_t& offset, uint64_t& length) const
+{
+	std::string_view dirPath, name;
+	splitFilePath(filePath, dirPath, name);
+
+	std::shared_lock<ShardedMutex> lock(m_treeMutex);
+	if (m_sharedImage == nullptr)
+		return false;
+
+	auto dir = findDir(dirPath);
+	auto it = dir ? dir->files.find(name) : decltype(dir->files.end())();
+	if (dir == nullptr || it == dir->files.end() || it->second.data)
+		return false;
+
+	// bytes outside the image belong to files written since the attach
+	const uint8_t* base = m_sharedImage->data();
+	const auto& entry = it->second;
+	if (base == nullptr || entry.bytes < base || entry.bytes + entry.size > base + m_sharedImage->size())
+		return false;
+
+	fd = m_sharedFd;
+	offset = uint64_t(entry.bytes - base);
+	length = entry.size;
+	return true;
+}
+#endif
+
+bool MemoryFileSystem::loadImage(const std::shared_ptr<MappedFile>& mapped)
+{
+	if (mapped->size() < sizeof(ImageHeader))
+		return false;
+
+	const uint8_t* image = mapped->data();
+	ImageHeader header;
+	memcpy(&header, image, sizeof(header));
+	if (memcmp(header.magic, IMAGE_MAGIC, sizeof(IMAGE_MAGIC)) != 0 || header.version != IMAGE_VERSION || header.imageSize != mapped->size()
+		|| header.entryCount == 0 || sizeof(ImageHeader) + uint64_t(header.entryCount) * sizeof(ImageEntry) + header.namesSize > mapped->size())
+		return false;
+
+	std::vector<ImageEntry> entries(header.entryCount);
+	memcpy(entries.data(), image + sizeof(ImageHeader), entries.size() * sizeof(ImageEntry));
+	const char* names = reinterpret_cast<const char*>(image + sizeof(ImageHeader) + entries.size() * sizeof(ImageEntry));
+
+	// the image is built into arenas of its own and swapped in only if it is valid
+	auto arena = std::make_shared<MemoryArena>(m_residency);
+	arena->keepAlive(mapped);
+	auto allocDir = [&arena]() {
+		arena->ref();
+		return new (arena->allocate(sizeof(DirNode), alignof(DirNode))) DirNode(arena.get());
+	};
+
+	std::vector<DirNode*> nodes(entries.size(), nullptr);
+	nodes[0] = allocDir();
+	for (size_t i = 1; i < entries.size(); ++i)
+	{
+		const auto& entry = entries[i];
+		if (entry.parent >= i || nodes[entry.parent] == nullptr || uint64_t(entry.nameOffset) + entry.nameLen > header.namesSize || entry.nameLen == 0)
+			return false;
+
+		// a name with a separator could not be looked up, a second entry of the same name would be dropped
+		auto parent = nodes[entry.parent];
+		std::string_view nameView(names + entry.nameOffset, entry.nameLen);
+		if (nameView.find('/') != std::string_view::npos || parent->dirs.find(nameView) != parent->dirs.end()
+			|| parent->files.find(nameView) != parent->files.end())
+			return false;
+
+		std::pmr::string name(nameView, arena.get());
+		if (entry.isDir)
+		{
+			nodes[i] = allocDir();
+			parent->dirs.emplace(std::move(name), nodes[i]);
+			continue;
+		}
+
+		if (entry.offset > mapped->size() || entry.storedSize > mapped->size() - entry.offset)
+			return false;
+
+		const uint8_t* stored = image + entry.offset;
+		if (!entry.compressed)
+		{
+			if (entry.storedSize != entry.size)
+				return false;
+			FileEntry file{ arena.get(), nullptr, stored, entry.size };
+			retainEntry(file);
+			parent->files.emplace(std::move(name), file);
+			continue;
+		}
+
+#ifdef VFS_HAS_ZLIB
+		std::vector<uint8_t> inflated(entry.size);
+		uLongf inflatedSize = (uLongf)entry.size;
+		if (uncompress(inflated.data(), &inflatedSize, stored, (uLong)entry.storedSize) != Z_OK || inflatedSize != entry.size)
+			return false;
+
+		auto data = std::make_shared<MemoryData>(m_residency);
+		data->write(inflated.data(), inflated.size(), 0);
+		FileEntry file{ arena.get(), data.get(), nullptr, 0 };
+		retainEntry(file);
+		parent->files.emplace(std::move(name), file);
+#else
+		return false;
+#endif
+	}
+
+	{
+		std::lock_guard<ShardedMutex> lock(m_treeMutex);
+		m_writers.clear();
+		dropTree();
+		m_arenas.push_back(arena);
+		m_arena = arena.get();
+		m_root = nodes[0];
+	}
+	return true;
+}
+
+uint64_t MemoryFileSystem::arenaBytes() const
+{
+	std::shared_lock<ShardedMutex> lock(m_treeMutex);
+	return arenaBytes_impl();
+}
+
+uint64_t MemoryFileSystem::arenaBytes_impl() const
+{
+	// a copy may have released the last references into an arena this file system has not pruned yet
+	uint64_t bytes = 0;
+	for (auto& arena : m_arenas)
+	{
+		if (arena.get() == m_arena || arena->refs() > 0)
+			bytes += arena->allocatedBytes();
+	}
+	return bytes;
+}
+
+void MemoryFileSystem::setBudget(uint64_t budget, const std::string& spillDir)
+{
+	std::lock_guard<ShardedMutex> lock(m_treeMutex);
+	m_budget = budget;
+	m_spillDir = spillDir;
+	if (m_spillDir.empty())
+	{
+		std::error_code ec;
+		m_spillDir = std::filesystem::temp_directory_path(ec).string();
+	}
+}
+
+void MemoryFileSystem::enforceBudget()
+{
+	{
+		std::lock_guard<ShardedMutex> lock(m_treeMutex);
+		settleClosedWriters();
+	}
+	spillLeastRecentlyUsed();
+}
+
+std::vector<std::shared_ptr<MemoryData>> MemoryFileSystem::allData() const
+{
+	// a file open for writing while a copy was made is owned by two arenas
+	std::unordered_set<MemoryData*> seen;
+	std::vector<std::shared_ptr<MemoryData>> result;
+	for (auto& arena : m_arenas)
+	{
+		arena->forEachFile([&](const std::shared_ptr<MemoryData>& data) {
+			if (seen.insert(data.get()).second)
+				result.push_back(data);
+		});
+	}
+	return result;
+}
+
+void MemoryFileSystem::spillLeastRecentlyUsed()
+{
+	// checked before the tree is locked, every open passes here while a budget is set. The arenas of copies
+	// that share the residency are counted, so are arenas not pruned yet.
+	uint64_t budget = m_budget.load(std::memory_order_relaxed);
+	uint64_t excess = budget == 0 ? 0 : m_residency->excess(budget);
+	if (excess == 0)
+		return;
+
+	auto victims = m_residency->leastRecentlyUsed(excess);
+	if (victims.empty())
+		return;
+
+	std::string spillDir;
+	{
+		std::shared_lock<ShardedMutex> lock(m_treeMutex);
+		spillDir = m_spillDir;
+	}
+
+	// the tree is not locked while the files are written, a victim opened meanwhile refuses to spill
+	std::error_code ec;
+	std::filesystem::create_directories(spillDir, ec);
+
+	char name[64];
+	for (auto& data : victims)
+	{
+		snprintf(name, sizeof(name), "/vfs_%p_%llu.spill", (void*)this, (unsigned long long)m_spillCount.fetch_add(1, std::memory_order_relaxed));
+		data->spill(spillDir + name);
+	}
+}
+
+MemoryFileSystem::Usage MemoryFileSystem::usage() const
+{
+	std::shared_lock<ShardedMutex> lock(m_treeMutex);
+	Usage usage = { 0, 0, 0, 0, 0, 0, 0, 0, 1.0 };
+	// chunks shared by deduplicated or copied files are counted once
+	std::unordered_set<const uint8_t*> chunks;
+	uint64_t referencedBytes = 0;
+	uint64_t chunkBytes = 0;
+	usage.residentBytes += arenaBytes_impl();
+	for (auto& data : allData())
+	{
+		switch (data->storage())
+		{
+		case MemoryData::Storage::Spilled:
+			usage.spilledBytes += data->len();
+			++usage.spilledFiles;
+			break;
+		case MemoryData::Storage::Compressed:
+		{
+			uint64_t compressed = data->compressedSize();
+			usage.residentBytes += compressed;
+			usage.compressedBytes += compressed;
+			usage.uncompressedBytes += data->len();
+			++usage.compressedFiles;
+			break;
+		}
+		default:
+			data->forEachChunk([&](const uint8_t* chunk, uint32_t capacity) {
+				referencedBytes += capacity;
+				if (chunks.insert(chunk).second)
+					chunkBytes += capacity;
+			});
+			break;
+		}
+	}
+	usage.residentBytes += chunkBytes;
+	if (m_chunkIndex)
+	{
+		usage.indexBytes = m_chunkIndex->bytes();
+		usage.residentBytes += usage.indexBytes;
+	}
+	if (chunkBytes > 0)
+		usage.dedupRatio = double(referencedBytes) / chunkBytes;
+	usage.totalBytes = usage.residentBytes + usage.spilledBytes;
+	return usage;
+}
+
+void MemoryFileSystem::setCompression(uint64_t sizeThreshold, uint32_t idleMs, int level)
+{
+	stopCompression();
+
+	{
+		std::lock_guard<ShardedMutex> lock(m_treeMutex);
+		m_compressThreshold = sizeThreshold;
+		m_compressIdleMs = idleMs;
+		m_compressLevel = level;
+	}
+	if (sizeThreshold == 0 && idleMs == 0)
+		return;
+
+	// checks a few times per idle period, so files are compressed soon after they turn cold
+	auto interval = std::chrono::milliseconds(idleMs > 0 ? std::clamp<uint32_t>(idleMs / 4, 10, 1000) : 100);
+	m_compressStop = false;
+	m_compressThread = std::thread([this, interval]() {
+		std::unique_lock<std::mutex> lock(m_compressMutex);
+		while (!m_compressCond.wait_for(lock, interval, [this]() { return m_compressStop; }))
+		{
+			lock.unlock();
+			compressCold();
+			lock.lock();
+		}
+	});
+}
+
+void MemoryFileSystem::stopCompression()
+{
+	if (!m_compressThread.joinable())
+		return;
+
+	{
+		std::lock_guard<std::mutex> lock(m_compressMutex);
+		m_compressStop = true;
+	}
+	m_compressCond.notify_all();
+	m_compressThread.join();
+}
+
+void MemoryFileSystem::setDedup(bool enable)
+{
+	std::lock_guard<ShardedMutex> lock(m_treeMutex);
+	if (!enable)
+		m_chunkIndex = nullptr;
+	else if (m_chunkIndex == nullptr)
+		m_chunkIndex = std::make_shared<ChunkIndex>();
+}
+
+uint64_t MemoryFileSystem::dedupe()
+{
+	std::lock_guard<ShardedMutex> lock(m_treeMutex);
+	settleClosedWriters();
+	if (m_chunkIndex == nullptr)
+		return 0;
+
+	uint64_t released = 0;
+	for (auto& data : allData())
+		released += data->dedupe(m_chunkIndex);
+	return released;
+}
+
+size_t MemoryFileSystem::compressCold()
+{
+	std::vector<std::shared_ptr<MemoryData>> candidates;
+	int level;
+	{
+		std::shared_lock<ShardedMutex> lock(m_treeMutex);
+		if (m_compressThreshold == 0 && m_compressIdleMs == 0)
+			return 0;
+
+		int64_t coldBefore = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count()
+			- int64_t(m_compressIdleMs) * 1000000;
+		for (auto& data : allData())
+		{
+			if (data->storage() != MemoryData::Storage::Resident || data->attached() > 0)
+				continue;
+			if ((m_compressThreshold > 0 && data->len() >= m_compressThreshold) || (m_compressIdleMs > 0 && data->lastAccess() <= coldBefore))
+				candidates.push_back(data);
+		}
+		level = m_compressLevel;
+	}
+
+	// deflating takes a while, opens are not held up meanwhile; a file opened in between stays resident
+	size_t compressed = 0;
+	for (auto& data : candidates)
+	{
+		if (data->compress(level))
+			++compressed;
+	}
+	return compressed;
+}
+
+MemoryFileSystem* MemoryFileSystem::snapshot(const std::string& mntpoint)
+{
+	return copy(mntpoint, true);
+}
+
+MemoryFileSystem* MemoryFileSystem::fork(const std::string& mntpoint)
+{
+	return copy(mntpoint, false);
+}
+
+MemoryFileSystem* MemoryFileSystem::copy(const std::string& mntpoint, bool readonly)
+{
+	auto fs = new MemoryFileSystem(m_archiveLocation, mntpoint);
+	fs->setReadonly(readonly);
+	fs->m_inlineThreshold = m_inlineThreshold;
+	fs->m_budget = m_budget.load(std::memory_order_relaxed);
+	fs->m_spillDir = m_spillDir;
+	// the copy shares the memory, it is counted against the budget together
+	fs->m_residency = m_residency;
+	fs->m_chunkIndex = m_chunkIndex;
+
+	std::lock_guard<ShardedMutex> lock(m_treeMutex);
+	settleClosedWriters();
+
+	// both sides continue in a new arena, everything built so far is shared and never modified again.
+	// The arena the copy was constructed with counts against a residency of its own, it is replaced.
+	releaseNode(fs->m_root);
+	fs->m_arenas = m_arenas;
+	fs->m_arenas.push_back(std::make_shared<MemoryArena>(m_residency));
+	fs->m_arena = fs->m_arenas.back().get();
+	fs->m_root = m_root;
+	++m_root->refs;
+	m_arenas.push_back(std::make_shared<MemoryArena>(m_residency));
+	m_arena = m_arenas.back().get();
+
+	// streams that are open for writing keep writing to their data, so the copy gets a clone of it instead
+	for (auto& it : m_writers)
+	{
+		auto data = it.second.lock();
+		std::string_view dirPath, name;
+		splitFilePath(it.first, dirPath, name);
+
+		FileEntry writing{ m_arena, data.get(), nullptr, 0 };
+		retainEntry(writing);
+		auto& entry = mutableDir(dirPath, false)->files.find(name)->second;
+		releaseEntry(entry);
+		entry = writing;
+
+		auto clone = data->clone();
+		FileEntry cloned{ fs->m_arena, clone.get(), nullptr, 0 };
+		retainEntry(cloned);
+		auto& fsEntry = fs->mutableDir(dirPath, false)->files.find(name)->second;
+		releaseEntry(fsEntry);
+		fsEntry = cloned;
+	}
+	return fs;
+}
+
 NS_VFS_END
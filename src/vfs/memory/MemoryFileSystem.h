@@ -2,8 +2,17 @@
 
 #include "../FileSystem.h"
 #include "MemoryData.h"
+#include "MemoryArena.h"
+#include "ChunkIndex.h"
+#include "MemoryJournal.h"
+#include "../native/MappedFile.h"
+#include "ShardedMutex.h"
 #include <unordered_map>
-#include <set>
+#include <string_view>
+#include <memory_resource>
+#include <vector>
+#include <thread>
+#include <condition_variable>
 
 NS_VFS_BEGIN
 
@@ -31,12 +40,241 @@ public:
 
     virtual const std::string& basePath() const override;
 
+    // Commits the journal records of the changes made so far, false once a journal write has failed
+    virtual bool flush() override;
+
+    // flush() and fsync the journal
+    virtual bool sync() override;
+
+    // Replaces the content of filePath with data, creating the file if needed. Buffers above the inline
+    // threshold are taken over without copying, smaller ones are copied into the arena. Fails and leaves data
+    // as it was if the directory does not exist or the file is open.
+    virtual bool writeFile(const std::string& filePath, std::vector<uint8_t>&& data) override;
+
+    // writeFile for many files under a single lock, creating missing directories. Returns the number of
+    // files written, the buffers of the others are left as they were.
+    size_t writeFiles(std::vector<std::pair<std::string, std::vector<uint8_t>>>&& files);
+
+    // Read-only copy of the current content mounted at mntpoint. Directories and file data are shared,
+    // nothing is copied until either side writes and then only the chunks written to.
+    MemoryFileSystem* snapshot(const std::string& mntpoint);
+
+    // Like snapshot, but the copy is writable
+    MemoryFileSystem* fork(const std::string& mntpoint);
+
+    // Files up to this size are kept as plain bytes in the arena once no stream has them open,
+    // larger ones and files opened for writing use a MemoryData. 0 disables inline files.
+    void setInlineThreshold(uint64_t size) { m_inlineThreshold = size; }
+
+    // Moves every closed file at or below the inline threshold into the arena
+    void compact();
+
+    // Discards all files and directories. The cost does not depend on the number of small files and
+    // directories, only on the files held in a MemoryData, unless the content is shared with a snapshot
+    // or fork, whose references are then dropped node by node. Open streams stay readable.
+    void reset();
+
+    // Writes every file and directory to a versioned image, file content deflated with zlib if compress is set
+    // and it helps. Files open for writing are saved with the content they have at that moment. The image and
+    // its directory are fsync'ed before save returns.
+    bool save(const std::string& imagePath, bool compress = false);
+
+    // Replaces the content with the image at imagePath. The image is mapped and uncompressed files read
+    // straight from the mapping until they are first written. Returns false and keeps the current content
+    // if the image is missing or invalid.
+    bool load(const std::string& imagePath);
+
+#ifndef _WIN32
+    // Writes the image into sealed shared memory and returns its fd, -1 on failure or where memfd_create is
+    // missing. The fd is owned by the caller, who passes it to other processes.
+    int share(bool compress = false);
+
+    // Replaces the content with the image in the shared memory fd, as load() does. The file system becomes
+    // read-only and its uncompressed files are read from the shared pages without copies. fd is duplicated.
+    bool attach(int fd);
+
+    // Shared memory fd and byte range of a file stored uncompressed in the attached image, for sendfile or splice
+    bool sharedExtent(const std::string& filePath, int& fd, uint64_t& offset, uint64_t& length) const;
+#endif
+
+    // Bytes held by the arenas of this file system
+    uint64_t arenaBytes() const;
+
+    struct Usage
+    {
+        // arena bytes plus the chunks of files held in memory
+        uint64_t residentBytes;
+        // content of files moved to the spill directory
+        uint64_t spilledBytes;
+        uint64_t totalBytes;
+        uint32_t spilledFiles;
+        // deflated size of compressed files, part of residentBytes
+        uint64_t compressedBytes;
+        // uncompressed size of the same files
+        uint64_t uncompressedBytes;
+        uint32_t compressedFiles;
+        // table of the dedup index, part of residentBytes. The chunks it lists belong to the files.
+        uint64_t indexBytes;
+        // chunk bytes referenced by resident files divided by the bytes of distinct chunks
+        double dedupRatio;
+    };
+
+    // Once resident memory exceeds budget bytes, the least recently opened closed files are written to
+    // spillDir (the system temp directory if empty) and read back when opened again. 0 disables the budget.
+    // Snapshots and forks share their memory with this file system and are counted against it together.
+    void setBudget(uint64_t budget, const std::string& spillDir = std::string());
+
+    // Spills files until the budget is met, also done whenever a stream is opened
+    void enforceBudget();
+
+    Usage usage() const;
+
+    // Files are deduplicated when their writers close: chunks with the same content are stored once and
+    // copied when one of the files writes to them. The index is shared with snapshots and forks.
+    void setDedup(bool enable);
+
+    // Dedupes every resident file, returns the bytes released
+    uint64_t dedupe();
+
+    // Closed files of at least sizeThreshold bytes, or not opened for idleMs milliseconds, are deflated by a
+    // background thread and inflated on the next open. 0 disables either condition, both 0 stop the thread.
+    // Without VFS_HAS_ZLIB nothing is ever compressed.
+    void setCompression(uint64_t sizeThreshold, uint32_t idleMs, int level = 6);
+
+    // One pass of the background thread, returns the number of files compressed
+    size_t compressCold();
+
+    // Must be called before init(). init() loads the last snapshot and replays the log at logPath, then every
+    // write, created file or directory, remove and reset is appended to the log. A background thread compacts
+    // the log into a snapshot once it outgrows the policy. Snapshots and forks are not journaled.
+    void setJournal(const std::string& logPath, const JournalPolicy& policy = JournalPolicy());
+
+protected:
+
+    // A file is either a MemoryData or, when small and closed, bytes stored inline in the arena.
+    // Every entry in a live tree holds a reference on its data or adopted bytes, see retainEntry.
+    struct FileEntry
+    {
+        // the arena that owns the data or bytes, files owned by an older arena may be shared with a copy
+        MemoryArena* arena;
+        MemoryData* data;
+        const uint8_t* bytes;
+        uint64_t size;
+    };
+
+    // lets the child maps be searched with a string_view of a path component
+    struct NameHash
+    {
+        using is_transparent = void;
+
+        size_t operator()(std::string_view name) const { return std::hash<std::string_view>()(name); }
+    };
+
+    // A directory stores the names of its children once, full paths are never kept. Nodes live in an arena
+    // and are never destroyed one by one. Nodes of an older arena are shared with copies of the file system
+    // and are copied into the current arena along the path to a modification. refs counts the parents and
+    // roots pointing to a node, the last one to let go releases what the node references.
+    struct DirNode
+    {
+        typedef std::pmr::unordered_map<std::pmr::string, DirNode*, NameHash, std::equal_to<>> DirMap;
+        typedef std::pmr::unordered_map<std::pmr::string, FileEntry, NameHash, std::equal_to<>> FileMap;
+
+        explicit DirNode(MemoryArena* owner) : arena(owner), refs(1), dirs(owner), files(owner) {}
+
+        DirNode(const DirNode& other, MemoryArena* owner) : arena(owner), refs(1), dirs(other.dirs, owner), files(other.files, owner) {}
+
+        MemoryArena* arena;
+        std::atomic<uint32_t> refs;
+        DirMap dirs;
+        FileMap files;
+    };
+
+    MemoryFileSystem* copy(const std::string& mntpoint, bool readonly);
+
+    const DirNode* findDir(std::string_view dirPath) const;
+
+    // The directory at dirPath made private to this file system, nullptr if it does not exist and create is false
+    DirNode* mutableDir(std::string_view dirPath, bool create);
+
+    // A node in the current arena with one reference, copyOf's children gain a reference each
+    DirNode* newDir(const DirNode* copyOf);
+
+    static void releaseNode(DirNode* node);
+
+    static void retainEntry(const FileEntry& entry);
+
+    static void releaseEntry(const FileEntry& entry);
+
+    // Drops the tree, node by node where copies share parts of it
+    void dropTree();
+
+    // Forgets arenas nothing points into anymore, copies holding them drop them in turn
+    void pruneArenas();
+
+    uint64_t arenaBytes_impl() const;
+
+    // Gives a file a MemoryData owned by the current arena, cloning or promoting what it had
+    std::shared_ptr<MemoryData> writableData(FileEntry& entry);
+
+    std::unique_ptr<FileStream> openForRead(std::string_view dirPath, std::string_view name) const;
+
+    bool hasClosedWriters() const;
+
+    // Moves closed small files that were open for writing into the arena, dedupes the others
+    void settleClosedWriters();
+
+    // Every MemoryData reachable from the arenas, once
+    std::vector<std::shared_ptr<MemoryData>> allData() const;
+
+    // Picks the coldest files over the budget without the tree lock and spills them, returns at once while
+    // the residency is within the budget or nothing became idle since a search found nothing to spill
+    void spillLeastRecentlyUsed();
+
+    void stopCompression();
+
+    // Copies a closed file into the arena, the entry is not retained yet. Fails if the content can not be read back.
+    bool inlineEntry(MemoryData* data, FileEntry& entry);
+
+    bool replayJournal();
+
+    bool writeImage(NativeHandle handle, bool compress);
+
+    bool loadImage(const std::shared_ptr<MappedFile>& mapped);
+
+    // Puts data into the tree as the content of filePath, record is set to its last journal record
+    bool placeFile(const std::string& filePath, std::vector<uint8_t>& data, bool createDirs, uint64_t& record);
+
 protected:
-    mutable std::recursive_mutex m_dirMutex;
-    std::set<std::string> m_dirs;
+    // lookups and reads share it, anything that changes the tree or the writers takes it exclusively
+    mutable ShardedMutex m_treeMutex;
+    // the last arena is the one new nodes and files go to, the others are shared with copies
+    std::vector<std::shared_ptr<MemoryArena>> m_arenas;
+    MemoryArena* m_arena;
+    DirNode* m_root;
+    uint64_t m_inlineThreshold;
+    // shared with snapshots and forks
+    std::shared_ptr<MemoryResidency> m_residency;
+    std::atomic<uint64_t> m_budget;
+    std::string m_spillDir;
+    std::atomic<uint64_t> m_spillCount;
+    std::shared_ptr<ChunkIndex> m_chunkIndex;
 
-    mutable std::recursive_mutex m_fileMutex;
-    std::unordered_map<std::string, std::shared_ptr<MemoryData>> m_files;
+    uint64_t m_compressThreshold;
+    uint32_t m_compressIdleMs;
+    int m_compressLevel;
+    std::thread m_compressThread;
+    std::mutex m_compressMutex;
+    std::condition_variable m_compressCond;
+    bool m_compressStop;
+    std::string m_journalPath;
+    JournalPolicy m_journalPolicy;
+    // shared with the streams open for writing
+    std::shared_ptr<MemoryJournal> m_journal;
+    // the attached shared memory and its mapping
+    int m_sharedFd;
+    std::shared_ptr<MappedFile> m_sharedImage;
+    // files opened for writing, their streams keep writing to the same data after a copy is made
+    std::unordered_map<std::string, std::weak_ptr<MemoryData>> m_writers;
 };
 
 NS_VFS_END
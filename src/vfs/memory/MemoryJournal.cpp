@@ -0,0 +1,317 @@
+#include "MemoryJournal.h"
+#include "ChunkIndex.h"
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <string.h>
+
+NS_VFS_BEGIN
+
+static const char JOURNAL_MAGIC[8] = { 'V', 'F', 'S', 'J', 'R', 'N', 'L', '1' };
+
+// payload length, checksum, type
+static const size_t RECORD_HEADER_SIZE = 4 + 4 + 1;
+
+static uint32_t recordChecksum(uint8_t type, const uint8_t* payload, size_t len)
+{
+	return (uint32_t)(ChunkIndex::hash(payload, len) * 31 + type);
+}
+
+template<typename T>
+static void putValue(std::vector<uint8_t>& out, T value)
+{
+	auto p = reinterpret_cast<const uint8_t*>(&value);
+	out.insert(out.end(), p, p + sizeof(T));
+}
+
+template<typename T>
+static T getValue(const uint8_t* in)
+{
+	T value;
+	memcpy(&value, in, sizeof(T));
+	return value;
+}
+
+static void replayLog(const std::string& path, const std::function<void(const MemoryJournal::Record& record)>& apply)
+{
+	std::ifstream file(path, std::ios::binary);
+	if (!file.is_open())
+		return;
+
+	std::string log((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+	file.close();
+	if (log.size() < sizeof(JOURNAL_MAGIC) || memcmp(log.data(), JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC)) != 0)
+		return;
+
+	auto data = reinterpret_cast<const uint8_t*>(log.data());
+	size_t pos = sizeof(JOURNAL_MAGIC);
+	while (pos + RECORD_HEADER_SIZE <= log.size())
+	{
+		uint32_t len = getValue<uint32_t>(data + pos);
+		uint32_t checksum = getValue<uint32_t>(data + pos + 4);
+		uint8_t type = data[pos + 8];
+		const uint8_t* payload = data + pos + RECORD_HEADER_SIZE;
+		if (len < 4 + 8 || len > log.size() - pos - RECORD_HEADER_SIZE || recordChecksum(type, payload, len) != checksum)
+			break;
+
+		uint32_t pathLen = getValue<uint32_t>(payload);
+		if (pathLen > len - 4 - 8)
+			break;
+
+		MemoryJournal::Record record;
+		record.type = (MemoryJournal::RecordType)type;
+		record.path = std::string_view(reinterpret_cast<const char*>(payload + 4), pathLen);
+		record.offset = getValue<uint64_t>(payload + 4 + pathLen);
+		record.data = payload + 4 + pathLen + 8;
+		record.len = len - 4 - pathLen - 8;
+		apply(record);
+		pos += RECORD_HEADER_SIZE + len;
+	}
+
+	// appends continue right after the last complete record
+	if (pos != log.size())
+	{
+		std::error_code ec;
+		std::filesystem::resize_file(path, pos, ec);
+	}
+}
+
+void MemoryJournal::replay(const std::string& logPath, const std::function<void(const Record& record)>& apply)
+{
+	replayLog(logPath + ".old", apply);
+	replayLog(logPath, apply);
+}
+
+MemoryJournal::MemoryJournal(const std::string& logPath, const JournalPolicy& policy, const std::function<bool(const std::string& path)>& saveSnapshot)
+	: m_logPath(logPath)
+	, m_policy(policy)
+	, m_saveSnapshot(saveSnapshot)
+	, m_handle(native::invalidHandle())
+	, m_appended(0)
+	, m_committed(0)
+	, m_committing(false)
+	, m_unsynced(false)
+	, m_failed(false)
+	, m_logSize(0)
+	, m_snapshotSize(0)
+	, m_stop(false)
+{}
+
+MemoryJournal::~MemoryJournal()
+{
+	close();
+}
+
+void MemoryJournal::close()
+{
+	if (m_committer.joinable())
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_stop = true;
+		}
+		m_cond.notify_all();
+		m_committer.join();
+	}
+
+	std::unique_lock<std::mutex> lock(m_mutex);
+	if (m_handle == native::invalidHandle())
+		return;
+
+	commit(lock, m_appended, m_policy.durability == JournalDurability::GroupCommit);
+	while (m_committing)
+		m_cond.wait(lock);
+	native::closeHandle(m_handle);
+	m_handle = native::invalidHandle();
+}
+
+bool MemoryJournal::open()
+{
+	std::error_code ec;
+	auto snapshotSize = std::filesystem::file_size(snapshotPath(m_logPath), ec);
+	m_snapshotSize = ec ? 0 : snapshotSize;
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (!openLog())
+		return false;
+
+	m_committer = std::thread(&MemoryJournal::committerLoop, this);
+	return true;
+}
+
+bool MemoryJournal::openLog()
+{
+	m_handle = native::openHandle(m_logPath, true);
+	if (m_handle == native::invalidHandle())
+		return false;
+
+	int64_t size = native::handleSize(m_handle);
+	if (size < (int64_t)sizeof(JOURNAL_MAGIC))
+	{
+		if (native::writeAt(m_handle, JOURNAL_MAGIC, sizeof(JOURNAL_MAGIC), 0) != (int64_t)sizeof(JOURNAL_MAGIC))
+			return false;
+		size = sizeof(JOURNAL_MAGIC);
+	}
+	m_logSize = (uint64_t)size;
+	return true;
+}
+
+uint64_t MemoryJournal::append(RecordType type, std::string_view path, uint64_t offset, const void* data, uint64_t len)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	uint32_t payloadLen = (uint32_t)(4 + path.size() + 8 + len);
+	size_t start = m_pending.size();
+	m_pending.reserve(start + RECORD_HEADER_SIZE + payloadLen);
+	putValue<uint32_t>(m_pending, payloadLen);
+	putValue<uint32_t>(m_pending, 0);
+	putValue<uint8_t>(m_pending, (uint8_t)type);
+	putValue<uint32_t>(m_pending, (uint32_t)path.size());
+	m_pending.insert(m_pending.end(), path.begin(), path.end());
+	putValue<uint64_t>(m_pending, offset);
+	if (len > 0)
+		m_pending.insert(m_pending.end(), (const uint8_t*)data, (const uint8_t*)data + len);
+
+	uint32_t checksum = recordChecksum((uint8_t)type, m_pending.data() + start + RECORD_HEADER_SIZE, payloadLen);
+	memcpy(m_pending.data() + start + 4, &checksum, sizeof(checksum));
+
+	return ++m_appended;
+}
+
+bool MemoryJournal::wait(uint64_t record)
+{
+	if (m_policy.durability != JournalDurability::GroupCommit)
+		return !m_failed.load(std::memory_order_relaxed);
+
+	std::unique_lock<std::mutex> lock(m_mutex);
+	return commit(lock, record, true);
+}
+
+bool MemoryJournal::commit(std::unique_lock<std::mutex>& lock, uint64_t upTo, bool fsync)
+{
+	while (!m_failed && (m_committed < upTo || (fsync && m_unsynced)))
+	{
+		if (m_committing)
+		{
+			m_cond.wait(lock);
+			continue;
+		}
+
+		// this thread commits everything appended so far, the others wait for it
+		m_committing = true;
+		std::vector<uint8_t> records;
+		records.swap(m_pending);
+		uint64_t last = m_appended;
+		uint64_t offset = m_logSize;
+		NativeHandle handle = m_handle;
+		// records appended after close() are dropped
+		bool ok = m_stop;
+		lock.unlock();
+
+		if (handle != native::invalidHandle())
+		{
+			ok = records.empty() || native::writeAt(handle, records.data(), records.size(), offset) == (int64_t)records.size();
+			if (ok && fsync)
+				ok = native::syncHandle(handle);
+		}
+
+		lock.lock();
+		m_committing = false;
+		if (ok)
+		{
+			m_committed = last;
+			m_logSize += records.size();
+			m_unsynced = !fsync && (m_unsynced || !records.empty());
+		}
+		else
+		{
+			// the next commit after a checkpoint writes them again from the end of the last complete record,
+			// a partial one is overwritten or cut off by the replay
+			std::cerr << "MemoryJournal: can not write " << m_logPath << std::endl;
+			records.insert(records.end(), m_pending.begin(), m_pending.end());
+			m_pending.swap(records);
+			m_failed = true;
+		}
+		m_cond.notify_all();
+	}
+	return !m_failed;
+}
+
+bool MemoryJournal::flush()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	return commit(lock, m_appended, false);
+}
+
+bool MemoryJournal::sync()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	return commit(lock, m_appended, true);
+}
+
+bool MemoryJournal::checkpoint()
+{
+	std::lock_guard<std::mutex> checkpointLock(m_checkpointMutex);
+	std::string oldPath = m_logPath + ".old";
+	std::error_code ec;
+
+	// a log left over from a failed snapshot is covered by the next one, it is not rotated again
+	if (!std::filesystem::exists(oldPath, ec))
+	{
+		// records a failed log could not take stay queued for the new one
+		std::unique_lock<std::mutex> lock(m_mutex);
+		commit(lock, m_appended, true);
+		while (m_committing)
+			m_cond.wait(lock);
+
+		native::closeHandle(m_handle);
+		m_handle = native::invalidHandle();
+		std::filesystem::rename(m_logPath, oldPath, ec);
+		if (!openLog())
+			return false;
+	}
+
+	// changes made from here on are in the new log, whether or not the snapshot sees them
+	if (!m_saveSnapshot(snapshotPath(m_logPath)))
+		return false;
+
+	std::filesystem::remove(oldPath, ec);
+	auto snapshotSize = std::filesystem::file_size(snapshotPath(m_logPath), ec);
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_snapshotSize = ec ? 0 : snapshotSize;
+	// whatever a failed commit left out of the log is in the snapshot, the queued records are written again
+	m_failed = false;
+	return true;
+}
+
+uint64_t MemoryJournal::logSize()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_logSize + m_pending.size();
+}
+
+void MemoryJournal::committerLoop()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (!m_stop)
+	{
+		// commits wake the condition too, only the interval or stopping ends the wait
+		auto deadline = std::chrono::steady_clock::now() + m_policy.commitInterval;
+		while (!m_stop && m_cond.wait_until(lock, deadline) != std::cv_status::timeout)
+			;
+		if (m_stop)
+			break;
+
+		commit(lock, m_appended, m_policy.durability == JournalDurability::GroupCommit);
+
+		uint64_t threshold = std::max<uint64_t>(m_policy.compactMinBytes, uint64_t(m_snapshotSize * m_policy.compactRatio));
+		if (m_logSize > threshold)
+		{
+			lock.unlock();
+			checkpoint();
+			lock.lock();
+		}
+	}
+}
+
+NS_VFS_END
@@ -0,0 +1,129 @@
+#pragma once
+
+#include "../Common.h"
+#include "../native/NativeUtils.h"
+#include <string_view>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <condition_variable>
+
+NS_VFS_BEGIN
+
+enum class JournalDurability : uint8_t
+{
+    // records are written by the background thread every commitInterval and never fsync'ed
+    Async,
+    // a change returns once its record is fsync'ed, changes arriving meanwhile share the next fsync
+    GroupCommit,
+};
+
+struct JournalPolicy
+{
+    JournalDurability durability = JournalDurability::GroupCommit;
+    // period of the background thread, which also checks whether the log needs compacting
+    std::chrono::milliseconds commitInterval = std::chrono::milliseconds(10);
+    // the log is compacted into a snapshot once it is this many times larger than the last snapshot
+    double compactRatio = 2.0;
+    // and at least this large
+    uint64_t compactMinBytes = 1024 * 1024;
+};
+
+// Append-only log of the changes made to a MemoryFileSystem. Compaction writes a snapshot image and starts
+// a new log; the previous log is kept as logPath.old until the snapshot is complete. Replaying a record
+// twice leaves the same content, so records that also made it into a snapshot do no harm.
+//
+// A failed write or fsync is latched: the log ends at the last record committed before it, wait, flush and
+// sync return false, and the records are kept in memory until a checkpoint succeeds.
+class MemoryJournal
+{
+public:
+
+    enum class RecordType : uint8_t
+    {
+        CreateDir = 1,
+        CreateFile,
+        Write,
+        Remove,
+        Reset,
+    };
+
+    struct Record
+    {
+        RecordType type;
+        std::string_view path;
+        uint64_t offset;
+        const uint8_t* data;
+        uint64_t len;
+    };
+
+    // Applies the records of logPath.old and logPath in order. A torn record at the end of a log, left by
+    // a crash during an append, is cut off together with everything after it.
+    static void replay(const std::string& logPath, const std::function<void(const Record& record)>& apply);
+
+    static std::string snapshotPath(const std::string& logPath) { return logPath + ".snapshot"; }
+
+    // saveSnapshot writes the complete current content to the path it is given
+    MemoryJournal(const std::string& logPath, const JournalPolicy& policy, const std::function<bool(const std::string& path)>& saveSnapshot);
+
+    // close()
+    ~MemoryJournal();
+
+    bool open();
+
+    // Stops the background thread and commits what is left. Records appended afterwards are dropped.
+    void close();
+
+    // Queues a record and returns its number. Callers append while holding the lock that orders their changes
+    // and wait for the record after releasing it, so concurrent changes share one fsync.
+    uint64_t append(RecordType type, std::string_view path, uint64_t offset = 0, const void* data = nullptr, uint64_t len = 0);
+
+    // Returns once the record is as durable as the policy asks for, at once for Async
+    bool wait(uint64_t record);
+
+    // Writes every appended record to the log
+    bool flush();
+
+    // flush() and fsync the log
+    bool sync();
+
+    // Starts a new log and writes a snapshot of everything before it
+    bool checkpoint();
+
+    uint64_t logSize();
+
+private:
+
+    // Returns once the first upTo records are committed, the caller either commits them or waits for the
+    // thread already doing so. False once a commit has failed.
+    bool commit(std::unique_lock<std::mutex>& lock, uint64_t upTo, bool fsync);
+
+    bool openLog();
+
+    void committerLoop();
+
+private:
+    std::string m_logPath;
+    JournalPolicy m_policy;
+    std::function<bool(const std::string& path)> m_saveSnapshot;
+
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    NativeHandle m_handle;
+    std::vector<uint8_t> m_pending;
+    uint64_t m_appended;
+    uint64_t m_committed;
+    bool m_committing;
+    bool m_unsynced;
+    std::atomic<bool> m_failed;
+    uint64_t m_logSize;
+    uint64_t m_snapshotSize;
+
+    std::mutex m_checkpointMutex;
+    std::thread m_committer;
+    bool m_stop;
+};
+
+NS_VFS_END
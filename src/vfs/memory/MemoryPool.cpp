@@ -0,0 +1,102 @@
+#include "MemoryPool.h"
+#include <assert.h>
+
+NS_VFS_BEGIN
+
+MemoryPool& MemoryPool::instance()
+{
+	// never destroyed, memory files owned by static objects may release blocks during exit
+	static MemoryPool* pool = new MemoryPool();
+	return *pool;
+}
+
+MemoryPool::MemoryPool()
+	: m_cachedBytes(0)
+	, m_cacheLimit(64 * 1024 * 1024)
+{}
+
+uint32_t MemoryPool::blockSize(uint64_t size)
+{
+	if (size >= PAGE_SIZE)
+		return PAGE_SIZE;
+
+	uint32_t block = MIN_BLOCK_SIZE;
+	while (block < size)
+		block <<= 1;
+	return block;
+}
+
+int MemoryPool::sizeClass(uint32_t size)
+{
+	int index = 0;
+	for (uint32_t block = MIN_BLOCK_SIZE; block < size; block <<= 1)
+		++index;
+	assert(index < CLASS_COUNT && (MIN_BLOCK_SIZE << index) == size);
+	return index;
+}
+
+uint8_t* MemoryPool::allocate(uint32_t size)
+{
+	int index = sizeClass(size);
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		auto& freeList = m_free[index];
+		if (!freeList.empty())
+		{
+			uint8_t* block = freeList.back();
+			freeList.pop_back();
+			m_cachedBytes -= size;
+			return block;
+		}
+	}
+	return static_cast<uint8_t*>(::operator new(size));
+}
+
+void MemoryPool::release(uint8_t* block, uint32_t size)
+{
+	if (block == nullptr)
+		return;
+
+	int index = sizeClass(size);
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (m_cachedBytes + size <= m_cacheLimit)
+		{
+			m_free[index].push_back(block);
+			m_cachedBytes += size;
+			return;
+		}
+	}
+	::operator delete(block);
+}
+
+void MemoryPool::setCacheLimit(uint64_t bytes)
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_cacheLimit = bytes;
+		if (m_cachedBytes <= m_cacheLimit)
+			return;
+	}
+	trim();
+}
+
+void MemoryPool::trim()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	for (auto& freeList : m_free)
+	{
+		for (auto block : freeList)
+			::operator delete(block);
+		freeList.clear();
+	}
+	m_cachedBytes = 0;
+}
+
+uint64_t MemoryPool::cachedBytes()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_cachedBytes;
+}
+
+NS_VFS_END
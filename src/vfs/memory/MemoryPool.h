@@ -0,0 +1,53 @@
+#pragma once
+
+#include "../Common.h"
+#include <stdint.h>
+#include <vector>
+#include <mutex>
+
+NS_VFS_BEGIN
+
+// Recycles the blocks memory files are built from: power of two size classes for small files and
+// fixed size pages for everything past the first page
+class MemoryPool
+{
+public:
+
+    static constexpr uint32_t PAGE_SIZE = 64 * 1024;
+
+    static constexpr uint32_t MIN_BLOCK_SIZE = 64;
+
+    static MemoryPool& instance();
+
+    // Smallest size class holding size bytes, PAGE_SIZE at most
+    static uint32_t blockSize(uint64_t size);
+
+    // size must be a size class returned by blockSize
+    uint8_t* allocate(uint32_t size);
+
+    void release(uint8_t* block, uint32_t size);
+
+    // Bytes of free blocks kept for reuse before they are returned to the system
+    void setCacheLimit(uint64_t bytes);
+
+    // Returns every cached block to the system
+    void trim();
+
+    uint64_t cachedBytes();
+
+private:
+
+    MemoryPool();
+
+    static int sizeClass(uint32_t size);
+
+private:
+    static constexpr int CLASS_COUNT = 11;
+
+    std::mutex m_mutex;
+    std::vector<uint8_t*> m_free[CLASS_COUNT];
+    uint64_t m_cachedBytes;
+    uint64_t m_cacheLimit;
+};
+
+NS_VFS_END
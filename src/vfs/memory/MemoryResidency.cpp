@@ -0,0 +1,87 @@
+#include "MemoryResidency.h"
+#include "MemoryData.h"
+
+NS_VFS_BEGIN
+
+MemoryResidency::MemoryResidency()
+	: m_bytes(0)
+	, m_arenaBytes(0)
+	, m_idle(0)
+	, m_fruitless(UINT64_MAX)
+{}
+
+uint64_t MemoryResidency::excess(uint64_t budget) const
+{
+	uint64_t resident = bytes() + arenaBytes();
+	if (resident <= budget || m_fruitless.load(std::memory_order_relaxed) == m_idle.load(std::memory_order_acquire))
+		return 0;
+	return resident - budget;
+}
+
+std::vector<std::shared_ptr<MemoryData>> MemoryResidency::leastRecentlyUsed(uint64_t bytes)
+{
+	std::vector<std::shared_ptr<MemoryData>> victims;
+	// the last reference to a skipped file may be dropped here, its destructor unlinks it after the lock is released
+	std::vector<std::shared_ptr<MemoryData>> skipped;
+	uint64_t found = 0;
+	// a file busy in another thread may be free on the next search, the search is not remembered
+	bool busy = false;
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+	uint64_t idle = m_idle.load(std::memory_order_acquire);
+	for (auto data : m_files)
+	{
+		if (found >= bytes)
+			break;
+
+		// a file being destroyed is skipped, so is one being written
+		auto owner = data->weak_from_this().lock();
+		if (owner == nullptr)
+			continue;
+		if (data->attached() > 0 || data->len() == 0 || data->storage() != MemoryData::Storage::Resident)
+		{
+			skipped.push_back(std::move(owner));
+			continue;
+		}
+		if (!data->m_mutex.try_lock())
+		{
+			busy = true;
+			skipped.push_back(std::move(owner));
+			continue;
+		}
+		uint64_t freed = data->privateBytes();
+		data->m_mutex.unlock();
+
+		if (freed == 0)
+		{
+			skipped.push_back(std::move(owner));
+			continue;
+		}
+		found += freed;
+		victims.push_back(std::move(owner));
+	}
+	m_fruitless.store(victims.empty() && !busy ? idle : UINT64_MAX, std::memory_order_relaxed);
+	return victims;
+}
+
+MemoryResidency::List::iterator MemoryResidency::link(MemoryData* data)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	idle();
+	return m_files.insert(m_files.end(), data);
+}
+
+void MemoryResidency::unlink(List::iterator pos)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	idle();
+	m_files.erase(pos);
+}
+
+void MemoryResidency::touch(List::iterator pos)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_files.splice(m_files.end(), m_files, pos);
+}
+
+NS_VFS_END
@@ -0,0 +1,82 @@
+#pragma once
+
+#include "../Common.h"
+#include <stdint.h>
+#include <list>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <memory>
+
+NS_VFS_BEGIN
+
+class MemoryData;
+class MemoryArena;
+
+// Memory held by the MemoryData of a file system, its snapshots and its forks. Chunks are counted once however
+// many files share them, deflated content is counted too, arena pages are counted apart. Resident files are kept in order of their last attach,
+// so the coldest ones are found without looking at the others.
+class MemoryResidency
+{
+public:
+
+    MemoryResidency();
+
+    MemoryResidency(const MemoryResidency&) = delete;
+
+    MemoryResidency& operator=(const MemoryResidency&) = delete;
+
+    uint64_t bytes() const { return m_bytes.load(std::memory_order_relaxed); }
+
+    // Bytes held by the arenas created for this residency, until they are dropped
+    uint64_t arenaBytes() const { return m_arenaBytes.load(std::memory_order_relaxed); }
+
+    // Bytes over budget worth searching for, 0 also when the last search found nothing to spill and no file
+    // went idle since. Takes no lock, it is checked on every open.
+    uint64_t excess(uint64_t budget) const;
+
+    // Least recently attached resident files no stream has open, whose private chunks add up to at least bytes.
+    // Files whose chunks are all shared with others are left out, spilling them would free nothing.
+    // A search that finds nothing is remembered until a file is closed, added or dropped.
+    std::vector<std::shared_ptr<MemoryData>> leastRecentlyUsed(uint64_t bytes);
+
+private:
+    friend class MemoryData;
+    friend class MemoryArena;
+
+    typedef std::list<MemoryData*> List;
+
+    void add(uint64_t bytes) { m_bytes.fetch_add(bytes, std::memory_order_relaxed); }
+
+    void sub(uint64_t bytes) { m_bytes.fetch_sub(bytes, std::memory_order_relaxed); }
+
+    void addArena(uint64_t bytes) { m_arenaBytes.fetch_add(bytes, std::memory_order_relaxed); }
+
+    void subArena(uint64_t bytes) { m_arenaBytes.fetch_sub(bytes, std::memory_order_relaxed); }
+
+    // The last stream of a file was closed, it may be spilled again
+    void idle() { m_idle.fetch_add(1, std::memory_order_release); }
+
+    // Links a new data as the most recently used
+    List::iterator link(MemoryData* data);
+
+    void unlink(List::iterator pos);
+
+    // Moves data to the most recently used end, also done once its content is spilled or compressed to keep it
+    // out of the way of the search
+    void touch(List::iterator pos);
+
+private:
+    std::atomic<uint64_t> m_bytes;
+    std::atomic<uint64_t> m_arenaBytes;
+    // counts the events that can give a search something new to find
+    std::atomic<uint64_t> m_idle;
+    // m_idle when a search last found nothing, UINT64_MAX when it found something
+    std::atomic<uint64_t> m_fruitless;
+    // never held while a MemoryData mutex is waited for
+    std::mutex m_mutex;
+    // least recently used first
+    List m_files;
+};
+
+NS_VFS_END
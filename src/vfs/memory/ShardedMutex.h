@@ -0,0 +1,52 @@
+#pragma once
+
+#include "../Common.h"
+#include <shared_mutex>
+#include <atomic>
+
+NS_VFS_BEGIN
+
+// Reader-writer lock split into shards on separate cache lines. A reader only locks the shard of its
+// thread, so readers on different cores never touch the same line; a writer locks every shard.
+// Meets the SharedMutex requirements, use it with std::shared_lock and std::unique_lock.
+class ShardedMutex
+{
+public:
+
+    static constexpr size_t SHARD_COUNT = 16;
+
+    void lock()
+    {
+        for (auto& shard : m_shards)
+            shard.mutex.lock();
+    }
+
+    void unlock()
+    {
+        for (auto& shard : m_shards)
+            shard.mutex.unlock();
+    }
+
+    void lock_shared() { m_shards[shardIndex()].mutex.lock_shared(); }
+
+    void unlock_shared() { m_shards[shardIndex()].mutex.unlock_shared(); }
+
+private:
+
+    // threads are spread round robin, a thread keeps its shard for its lifetime
+    static size_t shardIndex()
+    {
+        static std::atomic<size_t> nextShard(0);
+        thread_local size_t shard = nextShard.fetch_add(1, std::memory_order_relaxed) % SHARD_COUNT;
+        return shard;
+    }
+
+    struct alignas(64) Shard
+    {
+        std::shared_mutex mutex;
+    };
+
+    Shard m_shards[SHARD_COUNT];
+};
+
+NS_VFS_END
@@ -0,0 +1,39 @@
+#include "ViewFileStream.h"
+
+NS_VFS_BEGIN
+
+ViewFileStream::ViewFileStream()
+	: m_open(false)
+{}
+
+ViewFileStream::~ViewFileStream()
+{
+	close();
+}
+
+bool ViewFileStream::open(const std::string& /*path*/, FileStream::Mode /*mode*/)
+{
+	return false;
+}
+
+bool ViewFileStream::open(std::shared_ptr<const void> owner, const uint8_t* data, uint64_t length)
+{
+	m_owner = std::move(owner);
+	setSpan(data, length);
+	m_open = true;
+	return true;
+}
+
+void ViewFileStream::close()
+{
+	m_owner = nullptr;
+	setSpan(nullptr, 0);
+	m_open = false;
+}
+
+bool ViewFileStream::isOpen() const
+{
+	return m_open;
+}
+
+NS_VFS_END
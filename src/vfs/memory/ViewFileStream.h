@@ -0,0 +1,29 @@
+#pragma once
+
+#include "../SpanFileStream.h"
+
+NS_VFS_BEGIN
+
+// Read-only stream over bytes that stay valid as long as owner is alive
+class ViewFileStream : public SpanFileStream
+{
+public:
+
+    ViewFileStream();
+
+    virtual ~ViewFileStream();
+
+    virtual bool open(const std::string& path, FileStream::Mode mode) override;
+
+    bool open(std::shared_ptr<const void> owner, const uint8_t* data, uint64_t length);
+
+    virtual void close() override;
+
+    virtual bool isOpen() const override;
+
+protected:
+    std::shared_ptr<const void> m_owner;
+    bool m_open;
+};
+
+NS_VFS_END
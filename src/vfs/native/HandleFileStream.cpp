@@ -0,0 +1,125 @@
+#include "HandleFileStream.h"
+
+NS_VFS_BEGIN
+
+HandleFileStream::HandleFileStream()
+	: m_handle(native::invalidHandle())
+	, m_mode(FileStream::Mode::READ)
+	, m_offset(0)
+{}
+
+HandleFileStream::~HandleFileStream()
+{
+	close();
+}
+
+bool HandleFileStream::open(const std::string& path, FileStream::Mode mode)
+{
+	return open(native::openHandle(path, mode != FileStream::Mode::READ), mode);
+}
+
+bool HandleFileStream::open(NativeHandle handle, FileStream::Mode mode)
+{
+	close();
+	if (handle == native::invalidHandle())
+		return false;
+
+	m_handle = handle;
+	m_mode = mode;
+	m_offset = 0;
+
+	if (mode == FileStream::Mode::APPEND)
+		seek(0, FileStream::SeekOrigin::END);
+
+	return true;
+}
+
+void HandleFileStream::close()
+{
+	if (m_handle != native::invalidHandle())
+		native::closeHandle(m_handle);
+	m_handle = native::invalidHandle();
+	m_offset = 0;
+}
+
+uint64_t HandleFileStream::seek(uint64_t offset, SeekOrigin origin)
+{
+	if (m_handle == native::invalidHandle())
+		return 0;
+
+	if (origin == SeekOrigin::CUR)
+	{
+		m_offset += offset;
+	}
+	else if (origin == SeekOrigin::END)
+	{
+		auto dataLen = size();
+
+		if (dataLen < offset)
+			return 0;
+
+		m_offset = dataLen - offset;
+	}
+	else if (origin == SeekOrigin::SET)
+	{
+		m_offset = offset;
+	}
+
+	return m_offset;
+}
+
+uint64_t HandleFileStream::read(void* buf, uint64_t size)
+{
+	if (size == 0 || m_handle == native::invalidHandle())
+		return 0;
+
+	int64_t result = native::readAt(m_handle, buf, size, m_offset);
+	if (result <= 0)
+		return 0;
+
+	m_offset += result;
+	return uint64_t(result);
+}
+
+uint64_t HandleFileStream::write(const void* buf, uint64_t size)
+{
+	if (size == 0 || m_handle == native::invalidHandle() || m_mode == FileStream::Mode::READ)
+		return 0;
+
+	if (m_mode == FileStream::Mode::APPEND)
+		m_offset = (int64_t)this->size();
+
+	int64_t result = native::writeAt(m_handle, buf, size, m_offset);
+	if (result <= 0)
+		return 0;
+
+	m_offset += result;
+	return uint64_t(result);
+}
+
+uint64_t HandleFileStream::tell()
+{
+	if (m_handle == native::invalidHandle() || m_offset >= (int64_t)size())
+		return uint64_t(-1);
+	return m_offset;
+}
+
+uint64_t HandleFileStream::size()
+{
+	int64_t result = m_handle == native::invalidHandle() ? -1 : native::handleSize(m_handle);
+	return result < 0 ? 0 : uint64_t(result);
+}
+
+bool HandleFileStream::truncate(uint64_t size)
+{
+	if (m_handle == native::invalidHandle() || m_mode == FileStream::Mode::READ)
+		return false;
+	return native::truncateHandle(m_handle, size);
+}
+
+bool HandleFileStream::isOpen() const
+{
+	return m_handle != native::invalidHandle();
+}
+
+NS_VFS_END
@@ -0,0 +1,44 @@
+#pragma once
+
+#include "../FileStream.h"
+#include "NativeUtils.h"
+
+NS_VFS_BEGIN
+
+// Unbuffered stream over a native handle, every read and write is a single positional call
+class HandleFileStream : public FileStream
+{
+public:
+
+    HandleFileStream();
+
+    virtual ~HandleFileStream();
+
+    virtual bool open(const std::string& path, FileStream::Mode mode) override;
+
+    // Takes ownership of handle, which must have been opened writable for the WRITE and APPEND modes
+    bool open(NativeHandle handle, FileStream::Mode mode);
+
+    virtual void close() override;
+
+    virtual uint64_t seek(uint64_t offset, SeekOrigin origin) override;
+
+    virtual uint64_t read(void* buf, uint64_t size) override;
+
+    virtual uint64_t write(const void* buf, uint64_t size) override;
+
+    virtual uint64_t tell() override;
+
+    virtual uint64_t size() override;
+
+    virtual bool truncate(uint64_t size) override;
+
+    virtual bool isOpen() const override;
+
+protected:
+    NativeHandle m_handle;
+    FileStream::Mode m_mode;
+    int64_t m_offset;
+};
+
+NS_VFS_END
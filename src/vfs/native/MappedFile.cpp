@@ -0,0 +1,238 @@
+#include "MappedFile.h"
+#include <mutex>
+#include <unordered_map>
+
+#ifdef _WIN32
+#    ifndef NOMINMAX
+#        define NOMINMAX
+#    endif
+#    ifndef WIN32_LEAN_AND_MEAN
+#        define WIN32_LEAN_AND_MEAN
+#    endif
+#    include <windows.h>
+#else
+#    include <fcntl.h>
+#    include <sys/mman.h>
+#    include <sys/stat.h>
+#    include <unistd.h>
+#endif
+
+NS_VFS_BEGIN
+
+namespace
+{
+#ifdef _WIN32
+	using MappingKey = std::string;
+	using MappingKeyHash = std::hash<std::string>;
+#else
+	struct MappingKey
+	{
+		uint64_t dev;
+		uint64_t ino;
+
+		bool operator==(const MappingKey& other) const { return dev == other.dev && ino == other.ino; }
+	};
+
+	struct MappingKeyHash
+	{
+		size_t operator()(const MappingKey& key) const { return std::hash<uint64_t>()(key.ino ^ (key.dev << 32)); }
+	};
+#endif
+
+	std::mutex g_mappingMutex;
+	std::unordered_map<MappingKey, std::weak_ptr<MappedFile>, MappingKeyHash> g_mappings;
+
+	void purgeExpiredMappings()
+	{
+		for (auto it = g_mappings.begin(); it != g_mappings.end();)
+		{
+			if (it->second.expired())
+				it = g_mappings.erase(it);
+			else
+				++it;
+		}
+	}
+}
+
+MappedFile::MappedFile()
+	: m_data(nullptr)
+	, m_size(0)
+#ifdef _WIN32
+	, m_file(INVALID_HANDLE_VALUE)
+	, m_mapping(nullptr)
+#else
+	, m_mtime(0)
+#endif
+{}
+
+MappedFile::~MappedFile()
+{
+#ifdef _WIN32
+	if (m_data)
+		UnmapViewOfFile(m_data);
+	if (m_mapping)
+		CloseHandle(m_mapping);
+	if (m_file != INVALID_HANDLE_VALUE)
+		CloseHandle(m_file);
+#else
+	if (m_data)
+		munmap(m_data, m_size);
+#endif
+}
+
+std::shared_ptr<MappedFile> MappedFile::open(const std::string& path)
+{
+#ifdef _WIN32
+	MappingKey key = path;
+	WIN32_FILE_ATTRIBUTE_DATA attr;
+	if (!GetFileAttributesExA(path.c_str(), GetFileExInfoStandard, &attr))
+		return nullptr;
+	uint64_t fileSize = (uint64_t(attr.nFileSizeHigh) << 32) | attr.nFileSizeLow;
+
+	std::lock_guard<std::mutex> lock(g_mappingMutex);
+	auto it = g_mappings.find(key);
+	if (it != g_mappings.end())
+	{
+		auto mapped = it->second.lock();
+		if (mapped && mapped->m_size == fileSize)
+			return mapped;
+	}
+
+	std::shared_ptr<MappedFile> mapped(new MappedFile());
+	if (!mapped->map(path))
+		return nullptr;
+
+	purgeExpiredMappings();
+	g_mappings[key] = mapped;
+	return mapped;
+#else
+	return openAt(AT_FDCWD, path.c_str());
+#endif
+}
+
+#ifndef _WIN32
+std::shared_ptr<MappedFile> MappedFile::openAt(int dirfd, const char* path)
+{
+	int fd = ::openat(dirfd, path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return nullptr;
+
+	struct stat st;
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode))
+	{
+		::close(fd);
+		return nullptr;
+	}
+	MappingKey key = { uint64_t(st.st_dev), uint64_t(st.st_ino) };
+
+	std::lock_guard<std::mutex> lock(g_mappingMutex);
+	auto it = g_mappings.find(key);
+	if (it != g_mappings.end())
+	{
+		// the file may have been rewritten since it was mapped
+		auto mapped = it->second.lock();
+		if (mapped && mapped->m_size == uint64_t(st.st_size) && mapped->m_mtime == int64_t(st.st_mtime))
+		{
+			::close(fd);
+			return mapped;
+		}
+	}
+
+	std::shared_ptr<MappedFile> mapped(new MappedFile());
+	bool ok = mapped->map(fd);
+	// the mapping keeps its own reference to the file
+	::close(fd);
+	if (!ok)
+		return nullptr;
+
+	purgeExpiredMappings();
+	g_mappings[key] = mapped;
+	return mapped;
+}
+
+std::shared_ptr<MappedFile> MappedFile::openFd(int fd)
+{
+	std::shared_ptr<MappedFile> mapped(new MappedFile());
+	return mapped->map(fd) ? mapped : nullptr;
+}
+#endif
+
+#ifdef _WIN32
+bool MappedFile::map(const std::string& path)
+{
+	m_file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (m_file == INVALID_HANDLE_VALUE)
+		return false;
+
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(m_file, &fileSize))
+		return false;
+
+	m_size = static_cast<uint64_t>(fileSize.QuadPart);
+	if (m_size == 0)
+		return true;
+
+	m_mapping = CreateFileMappingA(m_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (m_mapping == nullptr)
+		return false;
+
+	m_data = (uint8_t*)MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0);
+	return m_data != nullptr;
+}
+#else
+bool MappedFile::map(int fd)
+{
+	struct stat st;
+	if (fstat(fd, &st) != 0)
+		return false;
+
+	m_mtime = int64_t(st.st_mtime);
+	m_size = uint64_t(st.st_size);
+	if (m_size == 0)
+		return true;
+
+	void* addr = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (addr == MAP_FAILED)
+	{
+		m_size = 0;
+		return false;
+	}
+
+	m_data = (uint8_t*)addr;
+	return true;
+}
+#endif
+
+void MappedFile::advise(uint8_t advice, uint64_t offset, uint64_t len)
+{
+	if (m_data == nullptr || offset >= m_size)
+		return;
+
+	if (len == 0 || len > m_size - offset)
+		len = m_size - offset;
+
+#ifdef _WIN32
+	if (advice & MmapAdvice::WillNeed)
+	{
+		WIN32_MEMORY_RANGE_ENTRY range = { m_data + offset, (SIZE_T)len };
+		PrefetchVirtualMemory(GetCurrentProcess(), 1, &range, 0);
+	}
+#else
+	// madvise wants a page aligned start address
+	static const uint64_t pageSize = (uint64_t)sysconf(_SC_PAGESIZE);
+	uint64_t alignedOffset = offset - offset % pageSize;
+	uint8_t* addr = m_data + alignedOffset;
+	len += offset - alignedOffset;
+
+	if (advice & MmapAdvice::Sequential)
+		madvise(addr, len, MADV_SEQUENTIAL);
+	if (advice & MmapAdvice::WillNeed)
+		madvise(addr, len, MADV_WILLNEED);
+#ifdef MADV_HUGEPAGE
+	if (advice & MmapAdvice::HugePage)
+		madvise(addr, len, MADV_HUGEPAGE);
+#endif
+#endif
+}
+
+NS_VFS_END
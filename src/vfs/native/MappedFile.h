@@ -0,0 +1,60 @@
+#pragma once
+
+#include "../Common.h"
+#include <stdint.h>
+
+NS_VFS_BEGIN
+
+enum MmapAdvice : uint8_t
+{
+    Normal = 0x00,
+    Sequential = 0x01,
+    WillNeed = 0x02,
+    HugePage = 0x04,
+};
+
+// Read-only mapping of a whole native file, shared by every opener of the same file
+class MappedFile
+{
+public:
+
+    static std::shared_ptr<MappedFile> open(const std::string& path);
+
+#ifndef _WIN32
+    // Maps path resolved relative to the directory fd dirfd
+    static std::shared_ptr<MappedFile> openAt(int dirfd, const char* path);
+
+    // Maps an open file, such as shared memory received from another process. The fd stays owned by the caller.
+    static std::shared_ptr<MappedFile> openFd(int fd);
+#endif
+
+    ~MappedFile();
+
+    void advise(uint8_t advice, uint64_t offset = 0, uint64_t len = 0);
+
+    const uint8_t* data() const { return m_data; }
+
+    uint64_t size() const { return m_size; }
+
+private:
+
+    MappedFile();
+
+#ifdef _WIN32
+    bool map(const std::string& path);
+#else
+    bool map(int fd);
+#endif
+
+private:
+    uint8_t* m_data;
+    uint64_t m_size;
+#ifdef _WIN32
+    void* m_file;
+    void* m_mapping;
+#else
+    int64_t m_mtime;
+#endif
+};
+
+NS_VFS_END
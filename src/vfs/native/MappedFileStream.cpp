@@ -0,0 +1,54 @@
+#include "MappedFileStream.h"
+
+NS_VFS_BEGIN
+
+MappedFileStream::MappedFileStream()
+{}
+
+MappedFileStream::~MappedFileStream()
+{
+	close();
+}
+
+bool MappedFileStream::open(const std::string& path, FileStream::Mode mode)
+{
+	if (mode != FileStream::Mode::READ)
+		return false;
+
+	return open(path, MmapAdvice::Normal);
+}
+
+bool MappedFileStream::open(const std::string& path, uint8_t advice)
+{
+	auto file = MappedFile::open(path);
+	if (file == nullptr)
+		return false;
+
+	if (advice != MmapAdvice::Normal)
+		file->advise(advice);
+
+	return open(file, 0, file->size());
+}
+
+bool MappedFileStream::open(std::shared_ptr<MappedFile> file, uint64_t offset, uint64_t length)
+{
+	if (file == nullptr || offset > file->size() || length > file->size() - offset)
+		return false;
+
+	m_file = file;
+	setSpan(file->data() ? file->data() + offset : nullptr, length);
+	return true;
+}
+
+void MappedFileStream::close()
+{
+	m_file = nullptr;
+	setSpan(nullptr, 0);
+}
+
+bool MappedFileStream::isOpen() const
+{
+	return m_file != nullptr;
+}
+
+NS_VFS_END
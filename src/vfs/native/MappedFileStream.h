@@ -0,0 +1,31 @@
+#pragma once
+
+#include "../SpanFileStream.h"
+#include "MappedFile.h"
+
+NS_VFS_BEGIN
+
+class MappedFileStream : public SpanFileStream
+{
+public:
+
+    MappedFileStream();
+
+    virtual ~MappedFileStream();
+
+    virtual bool open(const std::string& path, FileStream::Mode mode) override;
+
+    bool open(const std::string& path, uint8_t advice);
+
+    // Serves [offset, offset + length) of an existing mapping
+    bool open(std::shared_ptr<MappedFile> file, uint64_t offset, uint64_t length);
+
+    virtual void close() override;
+
+    virtual bool isOpen() const override;
+
+protected:
+    std::shared_ptr<MappedFile> m_file;
+};
+
+NS_VFS_END
@@ -30,6 +30,8 @@ bool NativeFileStream::open(const std::string& path, FileStream::Mode mode)
 		open_mode |= std::fstream::app;
 	}
 	m_fs.open(path, open_mode);
+	m_path = path;
+	m_mode = mode;
 	return m_fs.is_open();
 }
 
@@ -86,6 +88,22 @@ uint64_t NativeFileStream::size()
 	return size;
 }
 
+bool NativeFileStream::truncate(uint64_t size)
+{
+	if (!m_fs.is_open() || m_mode == Mode::READ)
+		return false;
+
+	m_fs.clear();
+	auto pos = m_fs.tellp();
+	m_fs.flush();
+	std::error_code ec;
+	fs::resize_file(m_path, size, ec);
+
+	// seeking drops what the file buffer still holds of the old content
+	m_fs.seekp(pos);
+	return !ec && !m_fs.fail();
+}
+
 bool NativeFileStream::isOpen() const
 {
 	return m_fs.is_open();
@@ -23,10 +23,14 @@ public:
 
     virtual uint64_t size() override;
 
+    virtual bool truncate(uint64_t size) override;
+
     virtual bool isOpen() const override;
 
 protected:
     std::fstream m_fs;
+    std::string m_path;
+    FileStream::Mode m_mode;
 };
 
 NS_VFS_END
@@ -1,76 +1,322 @@
 #include "NativeFileSystem.h"
 #include "NativeFileStream.h"
+#include "MappedFileStream.h"
+#include "WriteBackFileStream.h"
+#include "HandleFileStream.h"
 #include <filesystem>
+#include <algorithm>
+
+#ifndef _WIN32
+#    include <errno.h>
+#    include <string.h>
+#    include <fcntl.h>
+#    include <sys/stat.h>
+#    include <unistd.h>
+#endif
 
 namespace fs = std::filesystem;
 
 NS_VFS_BEGIN
 
+// expired entries are swept once the cache grows past this size
+static const size_t STAT_CACHE_SWEEP_SIZE = 1024 * 64;
+
+static std::string statCacheKey(const std::string& path)
+{
+	auto end = path.find_last_not_of('/');
+	return end == std::string::npos ? path : path.substr(0, end + 1);
+}
+
 NativeFileSystem::NativeFileSystem(const std::string& archiveLocation, const std::string& mntpoint)
 	: FileSystem(convertDirPath(archiveLocation), mntpoint)
+#ifndef _WIN32
+	, m_rootFd(-1)
+#endif
+	, m_mmapThreshold(0)
+	, m_mmapAdvice(MmapAdvice::Normal)
+	, m_statCacheTTL(0)
+	, m_statCacheGeneration(0)
+	, m_indexed(false)
 {
 	m_fileSystemType = FileSystemType::Native;
 }
 
 NativeFileSystem::~NativeFileSystem()
-{}
+{
+	if (m_writeBack)
+	{
+		if (m_writeBack->policy().durability == WriteBackDurability::None)
+			m_writeBack->flush();
+		else
+			m_writeBack->sync();
+	}
+
+#ifndef _WIN32
+	if (m_rootFd >= 0)
+		::close(m_rootFd);
+#endif
+}
 
 bool NativeFileSystem::init()
 { 
-	return !m_archiveLocation.empty() && !m_mntpoint.empty();
+	if (m_archiveLocation.empty() || m_mntpoint.empty())
+		return false;
+
+#ifndef _WIN32
+	if (m_rootFd < 0)
+	{
+#ifdef O_PATH
+		int flags = O_PATH | O_DIRECTORY | O_CLOEXEC;
+#else
+		int flags = O_RDONLY | O_DIRECTORY | O_CLOEXEC;
+#endif
+		// a missing root is not an error, paths then resolve from the working directory as before
+		m_rootFd = ::open(m_archiveLocation.c_str(), flags);
+	}
+#endif
+
+	if (m_indexed && !currentIndex())
+	{
+		auto manifest = m_indexManifest;
+		if (manifest.empty())
+			manifest = m_archiveLocation.substr(0, m_archiveLocation.find_last_not_of('/') + 1) + ".vfsindex";
+		std::shared_ptr<const NativeIndex> index(NativeIndex::open(m_archiveLocation, manifest));
+
+		std::lock_guard<std::mutex> lock(m_indexMutex);
+		m_index = index;
+	}
+	return true;
 }
 
-void NativeFileSystem::enumerate(const std::string& dir, const std::function<bool(const FileInfo&)>& call)
+void NativeFileSystem::setIndexed(bool enable, const std::string& manifestPath)
 {
-	if (!fs::exists(dir) || !fs::is_directory(dir))
-		return;
+	m_indexed = enable;
+	m_indexManifest = manifestPath;
+	if (!enable)
+		dropIndex();
+}
+
+void NativeFileSystem::dropIndex()
+{
+	std::shared_ptr<const NativeIndex> index;
+	{
+		std::lock_guard<std::mutex> lock(m_indexMutex);
+		index.swap(m_index);
+	}
+}
 
+std::shared_ptr<const NativeIndex> NativeFileSystem::currentIndex() const
+{
+	std::lock_guard<std::mutex> lock(m_indexMutex);
+	return m_index;
+}
+
+void NativeFileSystem::enumerate(const std::string& dir, const std::function<bool(const FileInfo&)>& call)
+{
 	uint8_t defaultFlgs = FileFlags::Read;
 	if (!isReadonly())
 		defaultFlgs |= FileFlags::Write;
 
+	// virtual paths of all entries share this prefix, only the name part is rewritten per entry
 	FileInfo info;
-	for (const auto& entry : fs::directory_iterator(dir))
-	{
+	info.filePath = m_mntpoint;
+	info.filePath.append(dir, std::min(dir.size(), m_archiveLocation.size()), std::string::npos);
+	formatDirPath(info.filePath);
+	const size_t prefixLen = info.filePath.size();
 
+	auto onEntry = [&](const char* name, size_t nameLen, NativeFileType type) -> bool {
 		info.flags = defaultFlgs;
-		if (entry.is_directory())
+		if (type == NativeFileType::Dir)
 			info.flags |= FileFlags::Dir;
 		else
 			info.flags |= FileFlags::File;
 
-		std::string filePath = entry.path().string().substr(m_archiveLocation.size());
-		info.filePath = m_mntpoint + filePath;
-		if (call(info))
-			break;
+		info.filePath.resize(prefixLen);
+		info.filePath.append(name, nameLen);
+		return call(info);
+	};
+
+	auto index = currentIndex();
+	if (index && dir.starts_with(m_archiveLocation))
+	{
+		index->enumerate(dir.substr(m_archiveLocation.size()), onEntry);
+		return;
 	}
+
+#ifndef _WIN32
+	if (auto rel = rootRelative(dir))
+	{
+		native::enumerateDirAt(m_rootFd, rel, onEntry);
+		return;
+	}
+#endif
+	native::enumerateDir(dir, onEntry);
 }
 
 std::unique_ptr<FileStream> NativeFileSystem::openFileStream(const std::string& filePath, FileStream::Mode mode)
 {
-	auto fs = std::make_unique<NativeFileStream>();
-	return fs->open(filePath, mode) ? std::move(fs) : nullptr;
+	// the index only holds names and types, writing over a file it knows leaves it valid
+	if (mode != FileStream::Mode::READ && currentIndex() && fileType(filePath) != NativeFileType::File)
+		dropIndex();
+
+	if (m_writeBack)
+	{
+		// reads of a file with buffered writes must see them
+		auto file = mode == FileStream::Mode::READ ? m_writeBack->find(filePath) : m_writeBack->open(filePath);
+		if (mode != FileStream::Mode::READ)
+			invalidateNative(filePath);
+
+		if (file)
+		{
+			auto wbFs = std::make_unique<WriteBackFileStream>();
+			return wbFs->open(m_writeBack, file, mode) ? std::move(wbFs) : nullptr;
+		}
+		else if (mode != FileStream::Mode::READ)
+		{
+			return nullptr;
+		}
+	}
+
+	if (mode == FileStream::Mode::READ && (m_mmapThreshold > 0 || !m_mmapHints.empty()))
+	{
+		bool useMmap = false;
+		uint8_t advice = m_mmapAdvice;
+
+		auto it = filePath.starts_with(m_archiveLocation) ? m_mmapHints.find(filePath.substr(m_archiveLocation.size())) : m_mmapHints.end();
+		if (it != m_mmapHints.end())
+		{
+			useMmap = true;
+			advice = it->second;
+		}
+		else if (m_mmapThreshold > 0)
+		{
+			uint64_t fileSize;
+			useMmap = nativeFileSize(filePath, fileSize) && fileSize >= m_mmapThreshold;
+		}
+
+		if (useMmap)
+		{
+#ifndef _WIN32
+			if (auto rel = rootRelative(filePath))
+			{
+				auto mappedFile = MappedFile::openAt(m_rootFd, rel);
+				auto mappedFs = std::make_unique<MappedFileStream>();
+				if (mappedFile && advice != MmapAdvice::Normal)
+					mappedFile->advise(advice);
+				if (mappedFile && mappedFs->open(mappedFile, 0, mappedFile->size()))
+					return mappedFs;
+			}
+			else
+#endif
+			{
+				auto mappedFs = std::make_unique<MappedFileStream>();
+				if (mappedFs->open(filePath, advice))
+					return mappedFs;
+			}
+		}
+	}
+
+	std::unique_ptr<FileStream> fs;
+#ifndef _WIN32
+	if (auto rel = rootRelative(filePath))
+	{
+		// fstream can only open by name, the descriptor resolved through the root fd is used as it is
+		auto handleFs = std::make_unique<HandleFileStream>();
+		if (handleFs->open(native::openHandleAt(m_rootFd, rel, mode != FileStream::Mode::READ), mode))
+			fs = std::move(handleFs);
+	}
+	else
+#endif
+	{
+		auto nativeFs = std::make_unique<NativeFileStream>();
+		if (nativeFs->open(filePath, mode))
+			fs = std::move(nativeFs);
+	}
+
+	// a write stream may have just created the file
+	if (mode != FileStream::Mode::READ)
+		invalidateNative(filePath);
+
+	return fs;
 }
 
 bool NativeFileSystem::removeFile(const std::string& filePath)
 {
-	return fs::remove(filePath);
+	dropIndex();
+
+	if (m_writeBack)
+		m_writeBack->remove(filePath);
+
+	bool ok;
+#ifndef _WIN32
+	if (auto rel = rootRelative(filePath))
+	{
+		ok = unlinkat(m_rootFd, rel, 0) == 0;
+		// fs::remove also removes empty directories
+		if (!ok && (errno == EISDIR || errno == EPERM))
+			ok = unlinkat(m_rootFd, rel, AT_REMOVEDIR) == 0;
+	}
+	else
+#endif
+	{
+		ok = fs::remove(filePath);
+	}
+	invalidateNative(filePath);
+	return ok;
 }
 
 bool NativeFileSystem::isFile(const std::string& filePath) const
 {
-	return fs::exists(filePath) && fs::is_regular_file(filePath);
+	return fileType(filePath) == NativeFileType::File;
 }
 
 bool NativeFileSystem::isDir(const std::string& dirPath) const
 {
-	return fs::exists(dirPath) && fs::is_directory(dirPath);
+	return fileType(dirPath) == NativeFileType::Dir;
 }
 
 bool NativeFileSystem::createDir(const std::string& dirPath)
 {
+	dropIndex();
+
+#ifndef _WIN32
+	if (auto rel = rootRelative(dirPath))
+	{
+		// create every missing component like create_directories
+		std::string path(rel);
+		bool created = false;
+		size_t pos = 0;
+		while (pos < path.size())
+		{
+			auto end = path.find('/', pos);
+			if (end == std::string::npos)
+				end = path.size();
+
+			if (end > pos)
+			{
+				auto component = path.substr(0, end);
+				if (mkdirat(m_rootFd, component.c_str(), 0755) == 0)
+				{
+					created = true;
+				}
+				else if (errno != EEXIST || native::statTypeAt(m_rootFd, component.c_str()) != NativeFileType::Dir)
+				{
+					std::cerr << "createDir error: " << dirPath << ": " << strerror(errno) << std::endl;
+					invalidateParents(dirPath);
+					return false;
+				}
+			}
+			pos = end + 1;
+		}
+		invalidateParents(dirPath);
+		return created;
+	}
+#endif
+
 	try {
-		if (fs::create_directories(dirPath)) {
+		bool created = fs::create_directories(dirPath);
+		invalidateParents(dirPath);
+		if (created) {
 			//std::cout << "createDir: " << dirPath << std::endl;
 			return true;
 		}
@@ -91,4 +337,177 @@ const std::string& NativeFileSystem::basePath() const
 	return m_archiveLocation;
 }
 
+bool NativeFileSystem::getRawExtent(const std::string& filePath, std::string& nativePath, uint64_t& offset, uint64_t& length) const
+{
+	// the disk content may be stale
+	if (m_writeBack && m_writeBack->find(filePath))
+		return false;
+
+	uint64_t fileSize;
+	if (!nativeFileSize(filePath, fileSize))
+		return false;
+
+	nativePath = filePath;
+	offset = 0;
+	length = fileSize;
+	return true;
+}
+
+bool NativeFileSystem::nativeFileSize(const std::string& filePath, uint64_t& size) const
+{
+#ifndef _WIN32
+	if (auto rel = rootRelative(filePath))
+	{
+		auto result = native::fileSizeAt(m_rootFd, rel);
+		if (result < 0)
+			return false;
+		size = uint64_t(result);
+		return true;
+	}
+#endif
+
+	std::error_code ec;
+	size = fs::file_size(filePath, ec);
+	return !ec;
+}
+
+const char* NativeFileSystem::rootRelative(const std::string& path) const
+{
+#ifndef _WIN32
+	if (m_rootFd < 0 || !path.starts_with(m_archiveLocation))
+		return nullptr;
+
+	const char* rel = path.c_str() + m_archiveLocation.size();
+	while (*rel == '/')
+		++rel;
+	return *rel ? rel : ".";
+#else
+	return nullptr;
+#endif
+}
+
+bool NativeFileSystem::flush()
+{
+	return m_writeBack == nullptr || m_writeBack->flush();
+}
+
+bool NativeFileSystem::sync()
+{
+	return m_writeBack == nullptr || m_writeBack->sync();
+}
+
+void NativeFileSystem::setWriteBack(const WriteBackPolicy& policy)
+{
+	if (m_writeBack)
+		m_writeBack->sync();
+	m_writeBack = std::make_shared<WriteBackCache>(policy);
+}
+
+void NativeFileSystem::setStatCacheTTL(std::chrono::milliseconds ttl)
+{
+	std::lock_guard<std::mutex> lock(m_statCacheMutex);
+	m_statCacheTTL = ttl;
+	m_statCache.clear();
+	++m_statCacheGeneration;
+}
+
+void NativeFileSystem::invalidate(const std::string& path)
+{
+	if (path.empty())
+	{
+		std::lock_guard<std::mutex> lock(m_statCacheMutex);
+		m_statCache.clear();
+		++m_statCacheGeneration;
+		return;
+	}
+
+	auto rel = convertPathFormatToUnixStyle(path);
+	if (rel.starts_with(m_mntpoint))
+		rel.erase(0, m_mntpoint.size());
+	else if (rel + "/" == m_mntpoint)
+		rel.clear();
+	while (rel.starts_with("/"))
+		rel.erase(0, 1);
+	invalidateNative(m_archiveLocation + rel);
+}
+
+void NativeFileSystem::invalidateNative(const std::string& nativePath)
+{
+	std::lock_guard<std::mutex> lock(m_statCacheMutex);
+	m_statCache.erase(statCacheKey(nativePath));
+	++m_statCacheGeneration;
+}
+
+void NativeFileSystem::invalidateParents(const std::string& path)
+{
+	std::lock_guard<std::mutex> lock(m_statCacheMutex);
+	++m_statCacheGeneration;
+	if (m_statCache.empty())
+		return;
+
+	// create_directories may create every missing parent
+	auto key = statCacheKey(path);
+	while (key.size() > m_archiveLocation.size())
+	{
+		m_statCache.erase(key);
+		auto pos = key.rfind('/');
+		if (pos == std::string::npos)
+			break;
+		key.resize(pos);
+	}
+}
+
+NativeFileType NativeFileSystem::statType(const std::string& path) const
+{
+#ifndef _WIN32
+	if (auto rel = rootRelative(path))
+		return native::statTypeAt(m_rootFd, rel);
+#endif
+	return native::statType(path);
+}
+
+NativeFileType NativeFileSystem::fileType(const std::string& path) const
+{
+	auto index = currentIndex();
+	if (index && path.starts_with(m_archiveLocation))
+		return index->type(path.substr(m_archiveLocation.size()));
+
+	std::unique_lock<std::mutex> lock(m_statCacheMutex);
+	if (m_statCacheTTL.count() == 0)
+	{
+		lock.unlock();
+		return statType(path);
+	}
+
+	auto key = statCacheKey(path);
+	auto now = std::chrono::steady_clock::now();
+	auto it = m_statCache.find(key);
+	if (it != m_statCache.end() && it->second.expire > now)
+		return it->second.type;
+
+	auto generation = m_statCacheGeneration;
+	lock.unlock();
+	auto type = statType(path);
+	lock.lock();
+
+	// an invalidation while the lock was released may have seen the path change after the stat
+	if (generation != m_statCacheGeneration)
+		return type;
+
+	if (m_statCache.size() >= STAT_CACHE_SWEEP_SIZE)
+	{
+		std::erase_if(m_statCache, [now](const auto& entry) { return entry.second.expire <= now; });
+	}
+	m_statCache[key] = StatCacheEntry{ type, now + m_statCacheTTL };
+	return type;
+}
+
+void NativeFileSystem::setMmapHint(const std::string& filePath, uint8_t advice)
+{
+	auto path = convertPathFormatToUnixStyle(filePath);
+	if (path.starts_with("/"))
+		path.erase(0, 1);
+	m_mmapHints[path] = advice;
+}
+
 NS_VFS_END
@@ -1,6 +1,12 @@
 #pragma once
 
 #include "../FileSystem.h"
+#include "NativeUtils.h"
+#include "WriteBackCache.h"
+#include "NativeIndex.h"
+#include <unordered_map>
+#include <chrono>
+#include <mutex>
 
 NS_VFS_BEGIN
 
@@ -27,6 +33,86 @@ public:
     virtual bool createDir(const std::string& dirPath) override;
 
     virtual const std::string& basePath() const override;
+
+    virtual bool getRawExtent(const std::string& filePath, std::string& nativePath, uint64_t& offset, uint64_t& length) const override;
+
+    virtual bool flush() override;
+
+    virtual bool sync() override;
+
+    // READ streams of files at least this large are served from a shared mapping, 0 disables it.
+    // Only for files nobody truncates while they are open: reading a mapped page past the new end of the file
+    // raises SIGBUS, mapping privately would not prevent it.
+    void setMmapThreshold(uint64_t size) { m_mmapThreshold = size; }
+
+    // MmapAdvice flags applied to mappings selected by the threshold
+    void setMmapAdvice(uint8_t advice) { m_mmapAdvice = advice; }
+
+    // Always map this file (relative to the mount root) when it is opened for reading
+    void setMmapHint(const std::string& filePath, uint8_t advice);
+
+    // Caches isFile/isDir results (positive and negative) for ttl, zero disables the cache
+    void setStatCacheTTL(std::chrono::milliseconds ttl);
+
+    // Drops the cached stat result of a path, or of every path when empty. path is a VFS path below the
+    // mount point, or relative to the mount root.
+    void invalidate(const std::string& path = "");
+
+    // Buffers writes in memory, visible to reads through this mount, and writes them back in the background
+    void setWriteBack(const WriteBackPolicy& policy);
+
+    // Answers isFile/isDir/enumerate from an in-memory index of the mount built at init(). The index is persisted
+    // to manifestPath (default: a ".vfsindex" file next to the mount root) and reused while no directory changed.
+    // Modifications through this mount drop the index. Must be called before mounting.
+    void setIndexed(bool enable, const std::string& manifestPath = "");
+
+protected:
+
+    NativeFileType fileType(const std::string& path) const;
+
+    NativeFileType statType(const std::string& path) const;
+
+    bool nativeFileSize(const std::string& filePath, uint64_t& size) const;
+
+    void dropIndex();
+
+    std::shared_ptr<const NativeIndex> currentIndex() const;
+
+    void invalidateNative(const std::string& nativePath);
+
+    void invalidateParents(const std::string& path);
+
+    // path relative to the mount root directory fd, nullptr when it can not be resolved through it
+    const char* rootRelative(const std::string& path) const;
+
+protected:
+#ifndef _WIN32
+    // the mount root stays reachable through this fd even if it is renamed or replaced
+    int m_rootFd;
+#endif
+
+    uint64_t m_mmapThreshold;
+    uint8_t m_mmapAdvice;
+    std::unordered_map<std::string, uint8_t> m_mmapHints;
+
+    struct StatCacheEntry
+    {
+        NativeFileType type;
+        std::chrono::steady_clock::time_point expire;
+    };
+    std::chrono::steady_clock::duration m_statCacheTTL;
+    mutable std::mutex m_statCacheMutex;
+    mutable std::unordered_map<std::string, StatCacheEntry> m_statCache;
+    // bumped by every invalidation, so a stat that raced with one is not cached
+    uint64_t m_statCacheGeneration;
+
+    std::shared_ptr<WriteBackCache> m_writeBack;
+
+    bool m_indexed;
+    std::string m_indexManifest;
+    // readers copy the pointer out, dropIndex may reset it concurrently
+    mutable std::mutex m_indexMutex;
+    std::shared_ptr<const NativeIndex> m_index;
 };
 
 NS_VFS_END
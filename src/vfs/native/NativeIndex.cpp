@@ -0,0 +1,258 @@
+#include "NativeIndex.h"
+#include <filesystem>
+#include <fstream>
+#include <unordered_set>
+#include <string.h>
+
+namespace fs = std::filesystem;
+
+NS_VFS_BEGIN
+
+static const char MANIFEST_MAGIC[8] = { 'V', 'F', 'S', 'I', 'D', 'X', '0', '1' };
+
+// serialized size of one entry
+static const size_t MANIFEST_ENTRY_SIZE = 4 + 4 + 1 + 4 + 4 + 8 + 8;
+
+template<typename T>
+static void putValue(std::string& out, T value)
+{
+	out.append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template<typename T>
+static T getValue(const char*& in)
+{
+	T value;
+	memcpy(&value, in, sizeof(T));
+	in += sizeof(T);
+	return value;
+}
+
+static std::string joinPath(const std::string& parent, const char* name, size_t nameLen)
+{
+	std::string path;
+	path.reserve(parent.size() + nameLen + 1);
+	path = parent;
+	if (!path.empty())
+		path.push_back('/');
+	path.append(name, nameLen);
+	return path;
+}
+
+static std::string trimPath(const std::string& path)
+{
+	auto begin = path.find_first_not_of('/');
+	if (begin == std::string::npos)
+		return std::string();
+	auto end = path.find_last_not_of('/');
+	return path.substr(begin, end - begin + 1);
+}
+
+std::shared_ptr<NativeIndex> NativeIndex::open(const std::string& root, const std::string& manifestPath)
+{
+	auto index = load(root, manifestPath);
+	if (index)
+		return index;
+
+	index = build(root);
+	if (index && !index->save(manifestPath))
+		std::cerr << "NativeIndex: can not write manifest " << manifestPath << std::endl;
+	return index;
+}
+
+std::shared_ptr<NativeIndex> NativeIndex::build(const std::string& root)
+{
+	NativeStat rootStat;
+	if (!native::statPath(root, rootStat) || rootStat.type != NativeFileType::Dir)
+		return nullptr;
+
+	std::shared_ptr<NativeIndex> index(new NativeIndex());
+	index->m_entries.push_back(Entry{ 0, 0, NativeFileType::Dir, 0, 0, 0, 0 });
+	index->m_dirs.emplace_back(0, std::string());
+
+	// symlinked directories may form cycles, every directory is scanned once
+	std::unordered_set<uint64_t> visited;
+
+	// breadth first, so the children of each directory end up next to each other
+	for (size_t i = 0; i < index->m_dirs.size(); ++i)
+	{
+		uint32_t dirIndex = index->m_dirs[i].first;
+		std::string dirPath = root + index->m_dirs[i].second;
+
+		NativeStat st;
+		if (!native::statPath(dirPath, st))
+			continue;
+		index->m_entries[dirIndex].mtime = st.mtime;
+		index->m_entries[dirIndex].dirSize = st.size;
+
+		if (st.ino != 0 && !visited.insert(st.ino ^ (st.dev << 40)).second)
+			continue;
+
+		uint32_t firstChild = (uint32_t)index->m_entries.size();
+		native::enumerateDir(dirPath, [&](const char* name, size_t nameLen, NativeFileType type) -> bool {
+			index->m_entries.push_back(Entry{ (uint32_t)index->m_names.size(), (uint32_t)nameLen, type, 0, 0, 0, 0 });
+			index->m_names.append(name, nameLen);
+			return false;
+		});
+
+		auto& dir = index->m_entries[dirIndex];
+		dir.firstChild = firstChild;
+		dir.childCount = (uint32_t)index->m_entries.size() - firstChild;
+
+		std::string parent = index->m_dirs[i].second;
+		for (uint32_t child = firstChild; child < index->m_entries.size(); ++child)
+		{
+			const auto& entry = index->m_entries[child];
+			if (entry.type == NativeFileType::Dir)
+				index->m_dirs.emplace_back(child, joinPath(parent, index->m_names.data() + entry.nameOffset, entry.nameLen));
+		}
+	}
+
+	index->buildLookup();
+	return index;
+}
+
+std::shared_ptr<NativeIndex> NativeIndex::load(const std::string& root, const std::string& manifestPath)
+{
+	std::ifstream file(manifestPath, std::ios::binary);
+	if (!file.is_open())
+		return nullptr;
+
+	std::string data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+	const size_t headerSize = sizeof(MANIFEST_MAGIC) + 4 + 4;
+	if (data.size() < headerSize || memcmp(data.data(), MANIFEST_MAGIC, sizeof(MANIFEST_MAGIC)) != 0)
+		return nullptr;
+
+	const char* in = data.data() + sizeof(MANIFEST_MAGIC);
+	uint32_t entryCount = getValue<uint32_t>(in);
+	uint32_t namesSize = getValue<uint32_t>(in);
+	if (entryCount == 0 || data.size() != headerSize + uint64_t(entryCount) * MANIFEST_ENTRY_SIZE + namesSize)
+		return nullptr;
+
+	std::shared_ptr<NativeIndex> index(new NativeIndex());
+	index->m_entries.resize(entryCount);
+	for (uint32_t i = 0; i < entryCount; ++i)
+	{
+		auto& entry = index->m_entries[i];
+		entry.nameOffset = getValue<uint32_t>(in);
+		entry.nameLen = getValue<uint32_t>(in);
+		entry.type = (NativeFileType)getValue<uint8_t>(in);
+		entry.firstChild = getValue<uint32_t>(in);
+		entry.childCount = getValue<uint32_t>(in);
+		entry.mtime = getValue<int64_t>(in);
+		entry.dirSize = getValue<uint64_t>(in);
+
+		// children always follow their parent, which also rules out cycles
+		if (uint64_t(entry.nameOffset) + entry.nameLen > namesSize
+			|| (entry.childCount > 0 && (entry.firstChild <= i || uint64_t(entry.firstChild) + entry.childCount > entryCount)))
+			return nullptr;
+	}
+	index->m_names.assign(in, namesSize);
+
+	index->m_dirs.emplace_back(0, std::string());
+	for (size_t i = 0; i < index->m_dirs.size(); ++i)
+	{
+		const auto& dir = index->m_entries[index->m_dirs[i].first];
+		for (uint32_t child = dir.firstChild; child < dir.firstChild + dir.childCount; ++child)
+		{
+			const auto& entry = index->m_entries[child];
+			if (entry.type == NativeFileType::Dir)
+				index->m_dirs.emplace_back(child, joinPath(index->m_dirs[i].second, index->m_names.data() + entry.nameOffset, entry.nameLen));
+		}
+	}
+
+	if (!index->validate(root))
+		return nullptr;
+
+	index->buildLookup();
+	return index;
+}
+
+bool NativeIndex::validate(const std::string& root) const
+{
+	// adding, removing or renaming an entry updates the mtime of its directory
+	NativeStat st;
+	for (const auto& dir : m_dirs)
+	{
+		const auto& entry = m_entries[dir.first];
+		if (!native::statPath(root + dir.second, st) || st.type != NativeFileType::Dir || st.mtime != entry.mtime || st.size != entry.dirSize)
+			return false;
+	}
+	return true;
+}
+
+void NativeIndex::buildLookup()
+{
+	m_lookup.clear();
+	m_lookup.reserve(m_entries.size());
+	m_lookup.emplace(std::string(), 0);
+	for (const auto& dir : m_dirs)
+	{
+		const auto& entry = m_entries[dir.first];
+		for (uint32_t child = entry.firstChild; child < entry.firstChild + entry.childCount; ++child)
+		{
+			m_lookup.emplace(joinPath(dir.second, m_names.data() + m_entries[child].nameOffset, m_entries[child].nameLen), child);
+		}
+	}
+}
+
+bool NativeIndex::save(const std::string& manifestPath) const
+{
+	std::string data;
+	data.reserve(sizeof(MANIFEST_MAGIC) + 8 + m_entries.size() * MANIFEST_ENTRY_SIZE + m_names.size());
+	data.append(MANIFEST_MAGIC, sizeof(MANIFEST_MAGIC));
+	putValue<uint32_t>(data, (uint32_t)m_entries.size());
+	putValue<uint32_t>(data, (uint32_t)m_names.size());
+	for (const auto& entry : m_entries)
+	{
+		putValue<uint32_t>(data, entry.nameOffset);
+		putValue<uint32_t>(data, entry.nameLen);
+		putValue<uint8_t>(data, (uint8_t)entry.type);
+		putValue<uint32_t>(data, entry.firstChild);
+		putValue<uint32_t>(data, entry.childCount);
+		putValue<int64_t>(data, entry.mtime);
+		putValue<uint64_t>(data, entry.dirSize);
+	}
+	data.append(m_names);
+
+	// readers never see a partially written manifest
+	std::string tmpPath = manifestPath + ".tmp";
+	{
+		std::ofstream file(tmpPath, std::ios::binary | std::ios::trunc);
+		if (!file.is_open())
+			return false;
+		file.write(data.data(), (std::streamsize)data.size());
+		if (!file.good())
+			return false;
+	}
+
+	std::error_code ec;
+	fs::rename(tmpPath, manifestPath, ec);
+	if (ec)
+		fs::remove(tmpPath, ec);
+	return !ec;
+}
+
+NativeFileType NativeIndex::type(const std::string& path) const
+{
+	auto it = m_lookup.find(trimPath(path));
+	return it == m_lookup.end() ? NativeFileType::None : m_entries[it->second].type;
+}
+
+bool NativeIndex::enumerate(const std::string& path, const std::function<bool(const char* name, size_t nameLen, NativeFileType type)>& call) const
+{
+	auto it = m_lookup.find(trimPath(path));
+	if (it == m_lookup.end() || m_entries[it->second].type != NativeFileType::Dir)
+		return false;
+
+	const auto& dir = m_entries[it->second];
+	for (uint32_t child = dir.firstChild; child < dir.firstChild + dir.childCount; ++child)
+	{
+		const auto& entry = m_entries[child];
+		if (call(m_names.data() + entry.nameOffset, entry.nameLen, entry.type))
+			break;
+	}
+	return true;
+}
+
+NS_VFS_END
@@ -0,0 +1,62 @@
+#pragma once
+
+#include "../Common.h"
+#include "NativeUtils.h"
+#include <unordered_map>
+#include <vector>
+
+NS_VFS_BEGIN
+
+// In-memory snapshot of the file tree below a native directory.
+// Paths are relative to the root, without leading or trailing '/', the root itself is "".
+class NativeIndex
+{
+public:
+
+    // Loads the manifest if it is still valid for root, otherwise scans root and rewrites the manifest
+    static std::shared_ptr<NativeIndex> open(const std::string& root, const std::string& manifestPath);
+
+    static std::shared_ptr<NativeIndex> build(const std::string& root);
+
+    // nullptr if the manifest is missing, corrupt or any directory changed since it was written
+    static std::shared_ptr<NativeIndex> load(const std::string& root, const std::string& manifestPath);
+
+    bool save(const std::string& manifestPath) const;
+
+    NativeFileType type(const std::string& path) const;
+
+    // Same contract as native::enumerateDir, returns false if path is not an indexed directory
+    bool enumerate(const std::string& path, const std::function<bool(const char* name, size_t nameLen, NativeFileType type)>& call) const;
+
+    size_t size() const { return m_entries.size(); }
+
+private:
+
+    NativeIndex() = default;
+
+    bool validate(const std::string& root) const;
+
+    void buildLookup();
+
+private:
+    struct Entry
+    {
+        uint32_t nameOffset;
+        uint32_t nameLen;
+        NativeFileType type;
+        // children of a directory are stored next to each other
+        uint32_t firstChild;
+        uint32_t childCount;
+        // directory stamp the manifest is validated with
+        int64_t mtime;
+        uint64_t dirSize;
+    };
+
+    std::vector<Entry> m_entries;
+    std::string m_names;
+    std::unordered_map<std::string, uint32_t> m_lookup;
+    // directories in m_entries order, for validation
+    std::vector<std::pair<uint32_t, std::string>> m_dirs;
+};
+
+NS_VFS_END
@@ -0,0 +1,500 @@
+#include "NativeUtils.h"
+#include <stddef.h>
+#include <string.h>
+#include <errno.h>
+#include <algorithm>
+
+#ifdef _WIN32
+#    ifndef NOMINMAX
+#        define NOMINMAX
+#    endif
+#    ifndef WIN32_LEAN_AND_MEAN
+#        define WIN32_LEAN_AND_MEAN
+#    endif
+#    include <windows.h>
+#else
+#    include <fcntl.h>
+#    include <sys/stat.h>
+#    include <unistd.h>
+#endif
+
+#if defined(_WIN32)
+#    include <filesystem>
+#elif defined(__linux__)
+#    include <dirent.h>
+#    include <sys/mman.h>
+#    include <sys/syscall.h>
+#    define VFS_HAS_GETDENTS64 1
+#else
+#    include <dirent.h>
+#endif
+
+NS_VFS_BEGIN
+
+namespace native
+{
+	NativeFileType statType(const std::string& path)
+	{
+#if defined(_WIN32)
+		DWORD attr = GetFileAttributesA(path.c_str());
+		if (attr == INVALID_FILE_ATTRIBUTES)
+			return NativeFileType::None;
+		if (attr & FILE_ATTRIBUTE_DIRECTORY)
+			return NativeFileType::Dir;
+		if (attr & FILE_ATTRIBUTE_DEVICE)
+			return NativeFileType::Other;
+		return NativeFileType::File;
+#else
+		mode_t mode;
+#if defined(__linux__) && defined(STATX_TYPE)
+		// only ask for the file type, the kernel can skip filling in the rest
+		struct statx stx;
+		if (statx(AT_FDCWD, path.c_str(), 0, STATX_TYPE, &stx) != 0)
+			return NativeFileType::None;
+		mode = stx.stx_mode;
+#else
+		struct stat st;
+		if (::stat(path.c_str(), &st) != 0)
+			return NativeFileType::None;
+		mode = st.st_mode;
+#endif
+		if (S_ISREG(mode))
+			return NativeFileType::File;
+		if (S_ISDIR(mode))
+			return NativeFileType::Dir;
+		return NativeFileType::Other;
+#endif
+	}
+
+#ifndef _WIN32
+	static NativeFileType typeFromMode(mode_t mode)
+	{
+		if (S_ISREG(mode))
+			return NativeFileType::File;
+		if (S_ISDIR(mode))
+			return NativeFileType::Dir;
+		return NativeFileType::Other;
+	}
+
+	bool statPath(const std::string& path, NativeStat& info)
+	{
+		struct stat st;
+		if (::stat(path.c_str(), &st) != 0)
+			return false;
+
+		info.type = typeFromMode(st.st_mode);
+		info.size = uint64_t(st.st_size);
+#if defined(__APPLE__)
+		info.mtime = int64_t(st.st_mtimespec.tv_sec) * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+		info.mtime = int64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+		info.dev = uint64_t(st.st_dev);
+		info.ino = uint64_t(st.st_ino);
+		return true;
+	}
+#else
+	bool statPath(const std::string& path, NativeStat& info)
+	{
+		WIN32_FILE_ATTRIBUTE_DATA attr;
+		if (!GetFileAttributesExA(path.c_str(), GetFileExInfoStandard, &attr))
+			return false;
+
+		if (attr.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+			info.type = NativeFileType::Dir;
+		else if (attr.dwFileAttributes & FILE_ATTRIBUTE_DEVICE)
+			info.type = NativeFileType::Other;
+		else
+			info.type = NativeFileType::File;
+		info.size = (uint64_t(attr.nFileSizeHigh) << 32) | attr.nFileSizeLow;
+		// FILETIME counts 100ns intervals
+		info.mtime = int64_t((uint64_t(attr.ftLastWriteTime.dwHighDateTime) << 32) | attr.ftLastWriteTime.dwLowDateTime) * 100;
+		info.dev = 0;
+		info.ino = 0;
+		return true;
+	}
+#endif
+
+#ifndef _WIN32
+	NativeFileType statTypeAt(int dirfd, const char* path)
+	{
+#if defined(__linux__) && defined(STATX_TYPE)
+		struct statx stx;
+		if (statx(dirfd, path, 0, STATX_TYPE, &stx) != 0)
+			return NativeFileType::None;
+		return typeFromMode(stx.stx_mode);
+#else
+		struct stat st;
+		if (fstatat(dirfd, path, &st, 0) != 0)
+			return NativeFileType::None;
+		return typeFromMode(st.st_mode);
+#endif
+	}
+
+	int64_t fileSizeAt(int dirfd, const char* path)
+	{
+#if defined(__linux__) && defined(STATX_SIZE)
+		struct statx stx;
+		if (statx(dirfd, path, 0, STATX_TYPE | STATX_SIZE, &stx) != 0)
+			return -errno;
+		if (!S_ISREG(stx.stx_mode))
+			return -EISDIR;
+		return (int64_t)stx.stx_size;
+#else
+		struct stat st;
+		if (fstatat(dirfd, path, &st, 0) != 0)
+			return -errno;
+		if (!S_ISREG(st.st_mode))
+			return -EISDIR;
+		return (int64_t)st.st_size;
+#endif
+	}
+
+	NativeHandle openHandleAt(int dirfd, const char* path, bool writable)
+	{
+		int flags = O_CLOEXEC | (writable ? (O_RDWR | O_CREAT) : O_RDONLY);
+		return ::openat(dirfd, path, flags, 0644);
+	}
+
+	static NativeFileType direntType(int dirfd, const char* name, unsigned char type)
+	{
+		switch (type)
+		{
+		case DT_REG:
+			return NativeFileType::File;
+		case DT_DIR:
+			return NativeFileType::Dir;
+		case DT_LNK:
+		case DT_UNKNOWN:
+			// the file system did not report a type or the entry is a symlink
+			return statTypeAt(dirfd, name);
+		default:
+			return NativeFileType::Other;
+		}
+	}
+
+	static bool isDotEntry(const char* name)
+	{
+		return name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
+	}
+
+#if VFS_HAS_GETDENTS64
+	// fixed part of a getdents64 record, the NUL terminated and padded name follows d_type
+	struct LinuxDirent64
+	{
+		uint64_t d_ino;
+		int64_t d_off;
+		unsigned short d_reclen;
+		unsigned char d_type;
+	};
+	static const size_t DIRENT64_NAME_OFFSET = offsetof(LinuxDirent64, d_type) + 1;
+
+	bool enumerateDirAt(int dirfd, const char* path, const std::function<bool(const char* name, size_t nameLen, NativeFileType type)>& call)
+	{
+		int fd = ::openat(dirfd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (fd < 0)
+			return false;
+
+		// one getdents64 call returns as many entries as fit in the buffer
+		const size_t bufSize = 1024 * 64;
+		std::unique_ptr<char[]> buf(new char[bufSize]);
+
+		bool stop = false;
+		while (!stop)
+		{
+			long nread = syscall(SYS_getdents64, fd, buf.get(), bufSize);
+			if (nread <= 0)
+				break;
+
+			for (long pos = 0; pos < nread && !stop;)
+			{
+				auto entry = reinterpret_cast<const LinuxDirent64*>(buf.get() + pos);
+				pos += entry->d_reclen;
+
+				// the name is padded with NULs up to the end of the record
+				const char* name = reinterpret_cast<const char*>(entry) + DIRENT64_NAME_OFFSET;
+				size_t nameLen = strnlen(name, entry->d_reclen - DIRENT64_NAME_OFFSET);
+				if (isDotEntry(name))
+					continue;
+
+				stop = call(name, nameLen, direntType(fd, name, entry->d_type));
+			}
+		}
+
+		::close(fd);
+		return true;
+	}
+#else
+	bool enumerateDirAt(int dirfd, const char* path, const std::function<bool(const char* name, size_t nameLen, NativeFileType type)>& call)
+	{
+		int fd = ::openat(dirfd, path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (fd < 0)
+			return false;
+
+		DIR* dir = fdopendir(fd);
+		if (dir == nullptr)
+		{
+			::close(fd);
+			return false;
+		}
+
+		while (auto entry = readdir(dir))
+		{
+			if (isDotEntry(entry->d_name))
+				continue;
+
+			if (call(entry->d_name, strlen(entry->d_name), direntType(fd, entry->d_name, entry->d_type)))
+				break;
+		}
+
+		closedir(dir);
+		return true;
+	}
+#endif
+
+	bool enumerateDir(const std::string& dir, const std::function<bool(const char* name, size_t nameLen, NativeFileType type)>& call)
+	{
+		return enumerateDirAt(AT_FDCWD, dir.c_str(), call);
+	}
+#else
+	bool enumerateDir(const std::string& dir, const std::function<bool(const char* name, size_t nameLen, NativeFileType type)>& call)
+	{
+		std::error_code ec;
+		std::filesystem::directory_iterator it(dir, ec);
+		if (ec)
+			return false;
+
+		std::string name;
+		for (; it != std::filesystem::directory_iterator(); it.increment(ec))
+		{
+			if (ec)
+				break;
+
+			NativeFileType type = NativeFileType::Other;
+			if (it->is_directory(ec))
+				type = NativeFileType::Dir;
+			else if (it->is_regular_file(ec))
+				type = NativeFileType::File;
+
+			name = it->path().filename().string();
+			if (call(name.c_str(), name.size(), type))
+				break;
+		}
+		return true;
+	}
+#endif
+
+#ifdef _WIN32
+	NativeHandle openHandle(const std::string& path, bool writable)
+	{
+		DWORD access = writable ? (GENERIC_READ | GENERIC_WRITE) : GENERIC_READ;
+		DWORD disposition = writable ? OPEN_ALWAYS : OPEN_EXISTING;
+		return CreateFileA(path.c_str(), access, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr, disposition, FILE_ATTRIBUTE_NORMAL, nullptr);
+	}
+
+	void closeHandle(NativeHandle handle)
+	{
+		CloseHandle(handle);
+	}
+
+	int64_t readAt(NativeHandle handle, void* buf, uint64_t len, uint64_t offset)
+	{
+		if (handle == invalidHandle())
+			return -EBADF;
+
+		uint64_t total = 0;
+		while (total < len)
+		{
+			OVERLAPPED overlapped = {};
+			overlapped.Offset = (DWORD)((offset + total) & 0xFFFFFFFF);
+			overlapped.OffsetHigh = (DWORD)((offset + total) >> 32);
+			DWORD chunk = (DWORD)std::min<uint64_t>(len - total, 0x40000000);
+			DWORD n = 0;
+			if (!ReadFile(handle, (uint8_t*)buf + total, chunk, &n, &overlapped))
+			{
+				if (GetLastError() == ERROR_HANDLE_EOF)
+					break;
+				return total > 0 ? (int64_t)total : -EIO;
+			}
+			if (n == 0)
+				break;
+			total += n;
+		}
+		return (int64_t)total;
+	}
+
+	int64_t writeAt(NativeHandle handle, const void* buf, uint64_t len, uint64_t offset)
+	{
+		if (handle == invalidHandle())
+			return -EBADF;
+
+		uint64_t total = 0;
+		while (total < len)
+		{
+			OVERLAPPED overlapped = {};
+			overlapped.Offset = (DWORD)((offset + total) & 0xFFFFFFFF);
+			overlapped.OffsetHigh = (DWORD)((offset + total) >> 32);
+			DWORD chunk = (DWORD)std::min<uint64_t>(len - total, 0x40000000);
+			DWORD n = 0;
+			if (!WriteFile(handle, (const uint8_t*)buf + total, chunk, &n, &overlapped))
+				return total > 0 ? (int64_t)total : -EIO;
+			total += n;
+		}
+		return (int64_t)total;
+	}
+
+	bool syncHandle(NativeHandle handle)
+	{
+		return FlushFileBuffers(handle) != 0;
+	}
+
+	bool syncDir(const std::string& /*dir*/)
+	{
+		// NTFS journals its metadata, a rename is durable without flushing the directory
+		return true;
+	}
+
+	int64_t handleSize(NativeHandle handle)
+	{
+		LARGE_INTEGER size;
+		if (!GetFileSizeEx(handle, &size))
+			return -EIO;
+		return (int64_t)size.QuadPart;
+	}
+
+	bool truncateHandle(NativeHandle handle, uint64_t size)
+	{
+		FILE_END_OF_FILE_INFO info;
+		info.EndOfFile.QuadPart = (LONGLONG)size;
+		return SetFileInformationByHandle(handle, FileEndOfFileInfo, &info, sizeof(info)) != 0;
+	}
+
+	bool handleIdentity(NativeHandle handle, uint64_t& dev, uint64_t& ino)
+	{
+		// statPath has no inode numbers here, both sides report zero
+		dev = 0;
+		ino = 0;
+		return handle != invalidHandle();
+	}
+#else
+	NativeHandle openHandle(const std::string& path, bool writable)
+	{
+		int flags = O_CLOEXEC | (writable ? (O_RDWR | O_CREAT) : O_RDONLY);
+		return ::open(path.c_str(), flags, 0644);
+	}
+
+	void closeHandle(NativeHandle handle)
+	{
+		::close(handle);
+	}
+
+	int64_t readAt(NativeHandle handle, void* buf, uint64_t len, uint64_t offset)
+	{
+		if (handle < 0)
+			return -EBADF;
+
+		uint64_t total = 0;
+		while (total < len)
+		{
+			ssize_t n = ::pread(handle, (uint8_t*)buf + total, len - total, offset + total);
+			if (n < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				return total > 0 ? (int64_t)total : -errno;
+			}
+			if (n == 0)
+				break;
+			total += (uint64_t)n;
+		}
+		return (int64_t)total;
+	}
+
+	int64_t writeAt(NativeHandle handle, const void* buf, uint64_t len, uint64_t offset)
+	{
+		if (handle < 0)
+			return -EBADF;
+
+		uint64_t total = 0;
+		while (total < len)
+		{
+			ssize_t n = ::pwrite(handle, (const uint8_t*)buf + total, len - total, offset + total);
+			if (n < 0)
+			{
+				if (errno == EINTR)
+					continue;
+				return total > 0 ? (int64_t)total : -errno;
+			}
+			total += (uint64_t)n;
+		}
+		return (int64_t)total;
+	}
+
+	bool syncHandle(NativeHandle handle)
+	{
+#if defined(__linux__)
+		return ::fdatasync(handle) == 0;
+#else
+		return ::fsync(handle) == 0;
+#endif
+	}
+
+	bool syncDir(const std::string& dir)
+	{
+		int fd = ::open(dir.empty() ? "." : dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (fd < 0)
+			return false;
+		bool ok = ::fsync(fd) == 0;
+		::close(fd);
+		return ok;
+	}
+
+	int64_t handleSize(NativeHandle handle)
+	{
+		struct stat st;
+		if (fstat(handle, &st) != 0)
+			return -errno;
+		return (int64_t)st.st_size;
+	}
+
+	bool truncateHandle(NativeHandle handle, uint64_t size)
+	{
+		while (::ftruncate(handle, (off_t)size) != 0)
+		{
+			if (errno != EINTR)
+				return false;
+		}
+		return true;
+	}
+
+	bool handleIdentity(NativeHandle handle, uint64_t& dev, uint64_t& ino)
+	{
+		struct stat st;
+		if (fstat(handle, &st) != 0)
+			return false;
+		dev = uint64_t(st.st_dev);
+		ino = uint64_t(st.st_ino);
+		return true;
+	}
+
+	int createSharedMemory(const char* name)
+	{
+#if defined(__linux__) && defined(MFD_ALLOW_SEALING)
+		return ::memfd_create(name, MFD_CLOEXEC | MFD_ALLOW_SEALING);
+#else
+		return -1;
+#endif
+	}
+
+	bool sealSharedMemory(int fd)
+	{
+#if defined(__linux__) && defined(F_ADD_SEALS)
+		return ::fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) == 0;
+#else
+		return false;
+#endif
+	}
+#endif
+}
+
+NS_VFS_END
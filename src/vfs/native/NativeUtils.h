@@ -0,0 +1,95 @@
+#pragma once
+
+#include "../Common.h"
+#include <stdint.h>
+
+NS_VFS_BEGIN
+
+#ifdef _WIN32
+typedef void* NativeHandle;
+#else
+typedef int NativeHandle;
+#endif
+
+enum class NativeFileType : uint8_t
+{
+    None,
+    File,
+    Dir,
+    Other,
+};
+
+struct NativeStat
+{
+    NativeFileType type;
+    uint64_t size;
+    // last modification time in nanoseconds
+    int64_t mtime;
+    // identity of the file, zero where the platform has no inode numbers
+    uint64_t dev;
+    uint64_t ino;
+};
+
+namespace native
+{
+    // Type of the file at path, costs a single stat call
+    NativeFileType statType(const std::string& path);
+
+    bool statPath(const std::string& path, NativeStat& st);
+
+    // Calls back with the name and type of every entry of dir, symlinks are resolved.
+    // Returning true from the callback stops the enumeration, returns false if dir can not be opened.
+    bool enumerateDir(const std::string& dir, const std::function<bool(const char* name, size_t nameLen, NativeFileType type)>& call);
+
+#ifndef _WIN32
+    // Variants resolving path relative to the directory fd dirfd, as the *at() system calls do
+
+    NativeFileType statTypeAt(int dirfd, const char* path);
+
+    // Size of a regular file, negative errno otherwise
+    int64_t fileSizeAt(int dirfd, const char* path);
+
+    bool enumerateDirAt(int dirfd, const char* path, const std::function<bool(const char* name, size_t nameLen, NativeFileType type)>& call);
+#endif
+
+    inline NativeHandle invalidHandle() { return (NativeHandle)(intptr_t)-1; }
+
+    // Opens for reading, or for reading and writing creating the file if it does not exist
+    NativeHandle openHandle(const std::string& path, bool writable);
+
+#ifndef _WIN32
+    NativeHandle openHandleAt(int dirfd, const char* path, bool writable);
+#endif
+
+    void closeHandle(NativeHandle handle);
+
+    // Positional IO that retries short transfers, returns the byte count or a negative errno
+    int64_t readAt(NativeHandle handle, void* buf, uint64_t len, uint64_t offset);
+
+    int64_t writeAt(NativeHandle handle, const void* buf, uint64_t len, uint64_t offset);
+
+    bool syncHandle(NativeHandle handle);
+
+    // Makes the entries created, renamed or removed in dir durable, the current directory if dir is empty
+    bool syncDir(const std::string& dir);
+
+    // Size of the open file, negative errno on failure
+    int64_t handleSize(NativeHandle handle);
+
+    // Cuts the open file to size, or extends it with zeros
+    bool truncateHandle(NativeHandle handle, uint64_t size);
+
+    // Identity of the open file, to tell whether a path still names it
+    bool handleIdentity(NativeHandle handle, uint64_t& dev, uint64_t& ino);
+
+#ifndef _WIN32
+    // Anonymous file in memory that can be sealed and passed to other processes, -1 where memfd_create
+    // is not available
+    int createSharedMemory(const char* name);
+
+    // Makes a shared memory file immutable for every holder of it
+    bool sealSharedMemory(int fd);
+#endif
+}
+
+NS_VFS_END
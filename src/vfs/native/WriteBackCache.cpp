@@ -0,0 +1,377 @@
+#include "WriteBackCache.h"
+#include <algorithm>
+#include <string.h>
+
+NS_VFS_BEGIN
+
+WriteBackFile::WriteBackFile(NativeHandle handle, uint64_t diskSize, std::shared_ptr<std::atomic<uint64_t>> cacheDirtyBytes)
+	: m_handle(handle)
+	, m_diskSize(diskSize)
+	, m_size(diskSize)
+	, m_dirtyBytes(0)
+	, m_cacheDirtyBytes(cacheDirtyBytes)
+	, m_unsynced(false)
+	, m_streams(0)
+{}
+
+WriteBackFile::~WriteBackFile()
+{
+	flush_impl();
+	native::closeHandle(m_handle);
+}
+
+uint64_t WriteBackFile::write(const void* buf, uint64_t len, uint64_t offset)
+{
+	if (len == 0)
+		return 0;
+
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	uint64_t end = offset + len;
+	uint64_t dirtyBefore = m_dirtyBytes;
+
+	// first extent overlapping or touching [offset, end)
+	auto first = m_dirty.upper_bound(offset);
+	if (first != m_dirty.begin())
+	{
+		auto prev = std::prev(first);
+		if (prev->first + prev->second.size() >= offset)
+			first = prev;
+	}
+
+	auto last = first;
+	uint64_t mergedStart = offset;
+	uint64_t mergedEnd = end;
+	while (last != m_dirty.end() && last->first <= end)
+	{
+		mergedStart = std::min(mergedStart, last->first);
+		mergedEnd = std::max(mergedEnd, last->first + last->second.size());
+		++last;
+	}
+
+	if (first == last)
+	{
+		m_dirty.emplace(offset, std::vector<uint8_t>((const uint8_t*)buf, (const uint8_t*)buf + len));
+		m_dirtyBytes += len;
+	}
+	else
+	{
+		// grow the leading extent in place, sequential writes keep appending to it
+		std::vector<uint8_t> merged;
+		if (first->first == mergedStart)
+			merged = std::move(first->second);
+		merged.resize(mergedEnd - mergedStart);
+
+		for (auto it = first; it != last; ++it)
+		{
+			m_dirtyBytes -= it->second.size();
+			if (!it->second.empty())
+				::memcpy(&merged[it->first - mergedStart], it->second.data(), it->second.size());
+		}
+		::memcpy(&merged[offset - mergedStart], buf, len);
+		m_dirtyBytes += merged.size();
+
+		m_dirty.erase(first, last);
+		m_dirty.emplace(mergedStart, std::move(merged));
+	}
+
+	*m_cacheDirtyBytes += m_dirtyBytes - dirtyBefore;
+	m_size = std::max(m_size, end);
+	return len;
+}
+
+uint64_t WriteBackFile::read(void* buf, uint64_t len, uint64_t offset)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	if (len == 0 || offset >= m_size)
+		return 0;
+
+	uint64_t readLen = std::min(len, m_size - offset);
+	uint64_t diskLen = offset < m_diskSize ? std::min(readLen, m_diskSize - offset) : 0;
+
+	int64_t result = diskLen > 0 ? native::readAt(m_handle, buf, diskLen, offset) : 0;
+	uint64_t fromDisk = result > 0 ? (uint64_t)result : 0;
+	if (fromDisk < readLen)
+		::memset((uint8_t*)buf + fromDisk, 0, readLen - fromDisk);
+
+	uint64_t end = offset + readLen;
+	auto it = m_dirty.upper_bound(offset);
+	if (it != m_dirty.begin())
+		--it;
+
+	for (; it != m_dirty.end() && it->first < end; ++it)
+	{
+		uint64_t extentEnd = it->first + it->second.size();
+		if (extentEnd <= offset)
+			continue;
+
+		uint64_t from = std::max(offset, it->first);
+		uint64_t to = std::min(end, extentEnd);
+		::memcpy((uint8_t*)buf + (from - offset), it->second.data() + (from - it->first), to - from);
+	}
+	return readLen;
+}
+
+uint64_t WriteBackFile::size()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_size;
+}
+
+bool WriteBackFile::truncate(uint64_t size)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	if (size != m_diskSize)
+	{
+		if (!native::truncateHandle(m_handle, size))
+			return false;
+		m_diskSize = size;
+		m_unsynced = true;
+	}
+
+	uint64_t dirtyBefore = m_dirtyBytes;
+	auto first = m_dirty.lower_bound(size);
+	if (first != m_dirty.begin())
+	{
+		// the extent across size keeps its head
+		auto prev = std::prev(first);
+		uint64_t keep = size - prev->first;
+		if (prev->second.size() > keep)
+		{
+			m_dirtyBytes -= prev->second.size() - keep;
+			prev->second.resize(keep);
+		}
+	}
+	for (auto it = first; it != m_dirty.end(); ++it)
+		m_dirtyBytes -= it->second.size();
+	m_dirty.erase(first, m_dirty.end());
+
+	*m_cacheDirtyBytes -= dirtyBefore - m_dirtyBytes;
+	m_size = size;
+	return true;
+}
+
+bool WriteBackFile::flush()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return flush_impl();
+}
+
+bool WriteBackFile::flush_impl()
+{
+	while (!m_dirty.empty())
+	{
+		auto it = m_dirty.begin();
+		int64_t result = native::writeAt(m_handle, it->second.data(), it->second.size(), it->first);
+		if (result != (int64_t)it->second.size())
+			return false;
+
+		m_diskSize = std::max(m_diskSize, it->first + it->second.size());
+		m_dirtyBytes -= it->second.size();
+		*m_cacheDirtyBytes -= it->second.size();
+		m_dirty.erase(it);
+		m_unsynced = true;
+	}
+	return true;
+}
+
+bool WriteBackFile::sync()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	if (!flush_impl())
+		return false;
+
+	if (m_unsynced)
+	{
+		if (!native::syncHandle(m_handle))
+			return false;
+		m_unsynced = false;
+	}
+	return true;
+}
+
+void WriteBackFile::discard()
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	*m_cacheDirtyBytes -= m_dirtyBytes;
+	m_dirty.clear();
+	m_dirtyBytes = 0;
+	m_unsynced = false;
+}
+
+bool WriteBackFile::isClean(bool requireSynced)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_dirty.empty() && (!requireSynced || !m_unsynced);
+}
+
+WriteBackCache::WriteBackCache(const WriteBackPolicy& policy)
+	: m_policy(policy)
+	, m_pendingBytes(0)
+	, m_dirtyBytes(std::make_shared<std::atomic<uint64_t>>(0))
+	, m_failed(false)
+	, m_rounds(0)
+	, m_blockedWriters(0)
+	, m_stop(false)
+{
+	m_flusher = std::thread(&WriteBackCache::flusherLoop, this);
+}
+
+WriteBackCache::~WriteBackCache()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stop = true;
+	}
+	m_cond.notify_all();
+	m_roundCond.notify_all();
+	m_flusher.join();
+
+	if (m_policy.durability == WriteBackDurability::None)
+		flush();
+	else
+		sync();
+}
+
+std::shared_ptr<WriteBackFile> WriteBackCache::open(const std::string& path)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	auto it = m_files.find(path);
+	if (it != m_files.end())
+		return it->second;
+
+	// the file is created right away so it shows up in isFile and enumerate
+	NativeHandle handle = native::openHandle(path, true);
+	if (handle == native::invalidHandle())
+		return nullptr;
+
+	int64_t diskSize = native::handleSize(handle);
+	auto file = std::make_shared<WriteBackFile>(handle, diskSize > 0 ? (uint64_t)diskSize : 0, m_dirtyBytes);
+	m_files.insert(std::make_pair(path, file));
+	return file;
+}
+
+std::shared_ptr<WriteBackFile> WriteBackCache::find(const std::string& path)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	auto it = m_files.find(path);
+	return it != m_files.end() ? it->second : nullptr;
+}
+
+void WriteBackCache::remove(const std::string& path)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	auto it = m_files.find(path);
+	if (it != m_files.end())
+	{
+		it->second->discard();
+		m_files.erase(it);
+	}
+}
+
+void WriteBackCache::noteWrite(uint64_t len)
+{
+	if ((m_pendingBytes += len) >= m_policy.maxDirtyBytes)
+		m_cond.notify_all();
+
+	if (m_policy.blockDirtyBytes == 0 || *m_dirtyBytes < m_policy.blockDirtyBytes)
+		return;
+
+	// a writer outpacing the disk waits for the flusher instead of growing the buffer. One round is
+	// enough, a round that could not write back must not block writers forever.
+	std::unique_lock<std::mutex> lock(m_mutex);
+	uint64_t round = m_rounds;
+	++m_blockedWriters;
+	m_cond.notify_all();
+	m_roundCond.wait(lock, [this, round]() { return m_stop || m_rounds != round || *m_dirtyBytes < m_policy.blockDirtyBytes; });
+	--m_blockedWriters;
+}
+
+void WriteBackCache::onStreamClosed(const std::shared_ptr<WriteBackFile>& file)
+{
+	if (file->closeStream() && m_policy.durability == WriteBackDurability::FsyncOnClose && !file->sync())
+		m_failed = true;
+}
+
+bool WriteBackCache::flush()
+{
+	bool result = flushRound(false);
+	return !m_failed.exchange(false) && result;
+}
+
+bool WriteBackCache::sync()
+{
+	bool result = flushRound(true);
+	return !m_failed.exchange(false) && result;
+}
+
+bool WriteBackCache::flushRound(bool syncFiles)
+{
+	std::vector<std::shared_ptr<WriteBackFile>> files;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		files.reserve(m_files.size());
+		for (auto& it : m_files)
+		{
+			files.push_back(it.second);
+		}
+	}
+	m_pendingBytes = 0;
+
+	// write everything back first, then fsync the whole group. Failed files keep their dirty extents.
+	bool result = true;
+	for (auto& file : files)
+	{
+		if (!file->flush())
+			result = false;
+	}
+	if (syncFiles)
+	{
+		for (auto& file : files)
+		{
+			if (!file->sync())
+				result = false;
+		}
+	}
+	files.clear();
+
+	// clean files nobody has open are closed
+	bool requireSynced = m_policy.durability != WriteBackDurability::None;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		for (auto it = m_files.begin(); it != m_files.end();)
+		{
+			if (it->second.use_count() == 1 && it->second->streams() == 0 && it->second->isClean(requireSynced))
+				it = m_files.erase(it);
+			else
+				++it;
+		}
+		++m_rounds;
+	}
+	m_roundCond.notify_all();
+	return result;
+}
+
+void WriteBackCache::flusherLoop()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (!m_stop)
+	{
+		m_cond.wait_for(lock, m_policy.flushInterval, [this]() { return m_stop || m_pendingBytes >= m_policy.maxDirtyBytes || m_blockedWriters > 0; });
+		if (m_stop)
+			break;
+
+		lock.unlock();
+		if (!flushRound(m_policy.durability == WriteBackDurability::GroupCommit))
+			m_failed = true;
+		lock.lock();
+	}
+}
+
+NS_VFS_END
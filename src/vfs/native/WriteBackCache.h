@@ -0,0 +1,144 @@
+#pragma once
+
+#include "../Common.h"
+#include "NativeUtils.h"
+#include <map>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <condition_variable>
+#include <unordered_map>
+
+NS_VFS_BEGIN
+
+enum class WriteBackDurability : uint8_t
+{
+    // buffered data reaches the OS on the next flush, nothing is fsync'ed
+    None,
+    // closing the last stream of a file writes it back and fsyncs it
+    FsyncOnClose,
+    // every flusher round fsyncs the files it wrote back as one group
+    GroupCommit,
+};
+
+struct WriteBackPolicy
+{
+    WriteBackDurability durability = WriteBackDurability::None;
+    // period of the background flusher, and of group commits
+    std::chrono::milliseconds flushInterval = std::chrono::milliseconds(100);
+    // the flusher wakes up early once this much data is buffered
+    uint64_t maxDirtyBytes = 64 * 1024 * 1024;
+    // writers wait for a flusher round once this much data is buffered, 0 never blocks them
+    uint64_t blockDirtyBytes = 256 * 1024 * 1024;
+};
+
+// A native file whose writes are kept as coalesced dirty extents until written back
+class WriteBackFile
+{
+public:
+
+    // cacheDirtyBytes is shared by the files of a cache and follows their dirty extents
+    WriteBackFile(NativeHandle handle, uint64_t diskSize, std::shared_ptr<std::atomic<uint64_t>> cacheDirtyBytes);
+
+    // writes back what is left and closes the file
+    ~WriteBackFile();
+
+    uint64_t write(const void* buf, uint64_t len, uint64_t offset);
+
+    // disk content with the dirty extents laid over it
+    uint64_t read(void* buf, uint64_t len, uint64_t offset);
+
+    uint64_t size();
+
+    // Drops the dirty data past size and resizes the native file right away
+    bool truncate(uint64_t size);
+
+    bool flush();
+
+    bool sync();
+
+    // drops buffered data, used when the file is removed
+    void discard();
+
+    bool isClean(bool requireSynced);
+
+    void openStream() { ++m_streams; }
+
+    // returns true when the last stream was closed
+    bool closeStream() { return --m_streams == 0; }
+
+    int streams() const { return m_streams.load(); }
+
+private:
+
+    bool flush_impl();
+
+private:
+    std::mutex m_mutex;
+    NativeHandle m_handle;
+    uint64_t m_diskSize;
+    uint64_t m_size;
+    std::map<uint64_t, std::vector<uint8_t>> m_dirty;
+    uint64_t m_dirtyBytes;
+    std::shared_ptr<std::atomic<uint64_t>> m_cacheDirtyBytes;
+    bool m_unsynced;
+    std::atomic<int> m_streams;
+};
+
+class WriteBackCache
+{
+public:
+
+    WriteBackCache(const WriteBackPolicy& policy);
+
+    ~WriteBackCache();
+
+    const WriteBackPolicy& policy() const { return m_policy; }
+
+    // Opens for writing, creating the native file if it does not exist
+    std::shared_ptr<WriteBackFile> open(const std::string& path);
+
+    std::shared_ptr<WriteBackFile> find(const std::string& path);
+
+    void remove(const std::string& path);
+
+    // Wakes the flusher, and blocks the writer for a flusher round while too much data is buffered
+    void noteWrite(uint64_t len);
+
+    void onStreamClosed(const std::shared_ptr<WriteBackFile>& file);
+
+    // Writes back every buffered byte. Returns false if that failed, or if a background write back or
+    // an fsync on close failed since the last flush or sync.
+    bool flush();
+
+    // flush() and fsync every file written back since the last sync
+    bool sync();
+
+private:
+
+    void flusherLoop();
+
+    bool flushRound(bool syncFiles);
+
+private:
+    WriteBackPolicy m_policy;
+
+    std::mutex m_mutex;
+    std::unordered_map<std::string, std::shared_ptr<WriteBackFile>> m_files;
+
+    std::atomic<uint64_t> m_pendingBytes;
+    std::shared_ptr<std::atomic<uint64_t>> m_dirtyBytes;
+    // failures nobody could be told about yet
+    std::atomic<bool> m_failed;
+    std::condition_variable m_cond;
+    // flusher rounds finished, writers blocked by noteWrite wait for the next one
+    uint64_t m_rounds;
+    uint32_t m_blockedWriters;
+    std::condition_variable m_roundCond;
+    bool m_stop;
+    std::thread m_flusher;
+};
+
+NS_VFS_END
@@ -0,0 +1,124 @@
+#include "WriteBackFileStream.h"
+
+NS_VFS_BEGIN
+
+WriteBackFileStream::WriteBackFileStream()
+	: m_offset(0)
+	, m_mode(FileStream::Mode::READ)
+{}
+
+WriteBackFileStream::~WriteBackFileStream()
+{
+	close();
+}
+
+bool WriteBackFileStream::open(const std::string& /*path*/, FileStream::Mode /*mode*/)
+{
+	return false;
+}
+
+bool WriteBackFileStream::open(std::shared_ptr<WriteBackCache> cache, std::shared_ptr<WriteBackFile> file, FileStream::Mode mode)
+{
+	if (cache == nullptr || file == nullptr)
+		return false;
+
+	file->openStream();
+	m_cache = cache;
+	m_file = file;
+	m_mode = mode;
+	m_offset = 0;
+
+	if (mode == FileStream::Mode::APPEND)
+		seek(0, FileStream::SeekOrigin::END);
+
+	return true;
+}
+
+void WriteBackFileStream::close()
+{
+	if (m_file)
+	{
+		m_cache->onStreamClosed(m_file);
+	}
+	m_offset = 0;
+	m_file = nullptr;
+	m_cache = nullptr;
+}
+
+uint64_t WriteBackFileStream::seek(uint64_t offset, SeekOrigin origin)
+{
+	if (m_file == nullptr)
+		return 0;
+
+	if (origin == SeekOrigin::CUR)
+	{
+		m_offset += offset;
+	}
+	else if (origin == SeekOrigin::END)
+	{
+		auto dataLen = m_file->size();
+
+		if (dataLen < offset)
+			return 0;
+
+		m_offset = dataLen - offset;
+	}
+	else if (origin == SeekOrigin::SET)
+	{
+		m_offset = offset;
+	}
+
+	return m_offset;
+}
+
+uint64_t WriteBackFileStream::read(void* buf, uint64_t size)
+{
+	if (m_file == nullptr)
+		return 0;
+
+	uint64_t result = m_file->read(buf, size, m_offset);
+	m_offset += result;
+	return result;
+}
+
+uint64_t WriteBackFileStream::write(const void* buf, uint64_t size)
+{
+	if (m_file == nullptr || m_mode == FileStream::Mode::READ)
+		return 0;
+
+	if (m_mode == FileStream::Mode::APPEND)
+		m_offset = m_file->size();
+
+	uint64_t result = m_file->write(buf, size, m_offset);
+	m_offset += result;
+	m_cache->noteWrite(result);
+	return result;
+}
+
+uint64_t WriteBackFileStream::tell()
+{
+	if (m_file == nullptr || m_offset >= (int64_t)m_file->size())
+		return uint64_t(-1);
+	return m_offset;
+}
+
+uint64_t WriteBackFileStream::size()
+{
+	if (m_file == nullptr)
+		return 0;
+	return m_file->size();
+}
+
+bool WriteBackFileStream::truncate(uint64_t size)
+{
+	if (m_file == nullptr || m_mode == FileStream::Mode::READ)
+		return false;
+	return m_file->truncate(size);
+}
+
+bool WriteBackFileStream::isOpen() const
+{
+	return m_file != nullptr;
+}
+
+NS_VFS_END
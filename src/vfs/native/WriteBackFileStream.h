@@ -0,0 +1,43 @@
+#pragma once
+
+#include "../FileStream.h"
+#include "WriteBackCache.h"
+
+NS_VFS_BEGIN
+
+class WriteBackFileStream : public FileStream
+{
+public:
+
+    WriteBackFileStream();
+
+    virtual ~WriteBackFileStream();
+
+    virtual bool open(const std::string& path, FileStream::Mode mode) override;
+
+    bool open(std::shared_ptr<WriteBackCache> cache, std::shared_ptr<WriteBackFile> file, FileStream::Mode mode);
+
+    virtual void close() override;
+
+    virtual uint64_t seek(uint64_t offset, SeekOrigin origin) override;
+
+    virtual uint64_t read(void* buf, uint64_t size) override;
+
+    virtual uint64_t write(const void* buf, uint64_t size) override;
+
+    virtual uint64_t tell() override;
+
+    virtual uint64_t size() override;
+
+    virtual bool truncate(uint64_t size) override;
+
+    virtual bool isOpen() const override;
+
+protected:
+    int64_t m_offset;
+    FileStream::Mode m_mode;
+    std::shared_ptr<WriteBackCache> m_cache;
+    std::shared_ptr<WriteBackFile> m_file;
+};
+
+NS_VFS_END
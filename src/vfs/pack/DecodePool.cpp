@@ -0,0 +1,98 @@
+#include "DecodePool.h"
+#include <system_error>
+
+NS_VFS_BEGIN
+
+DecodePool::DecodePool(uint32_t threads)
+	: m_stop(false)
+{
+	for (uint32_t i = 0; i < threads; ++i)
+	{
+		try
+		{
+			m_workers.emplace_back(&DecodePool::workerLoop, this);
+		}
+		catch (const std::system_error& e)
+		{
+			std::cerr << "DecodePool: can not start worker " << i << ": " << e.what() << std::endl;
+			break;
+		}
+	}
+}
+
+DecodePool::~DecodePool()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_queueMutex);
+		m_stop = true;
+	}
+	m_queueCond.notify_all();
+
+	for (auto& worker : m_workers)
+	{
+		worker.join();
+	}
+}
+
+void DecodePool::run(uint32_t count, const std::function<void(uint32_t)>& task)
+{
+	if (m_workers.empty())
+	{
+		for (uint32_t i = 0; i < count; ++i)
+			task(i);
+		return;
+	}
+
+	std::mutex doneMutex;
+	std::condition_variable doneCond;
+	uint32_t remaining = count;
+	auto finish = [&]() {
+		std::lock_guard<std::mutex> lock(doneMutex);
+		if (--remaining == 0)
+			doneCond.notify_all();
+	};
+
+	// the first call is made on this thread, which then waits for the others
+	{
+		std::lock_guard<std::mutex> lock(m_queueMutex);
+		for (uint32_t i = 1; i < count; ++i)
+		{
+			m_queue.push_back([&task, &finish, i]() {
+				task(i);
+				finish();
+			});
+		}
+	}
+	m_queueCond.notify_all();
+
+	if (count > 0)
+	{
+		task(0);
+		finish();
+	}
+
+	std::unique_lock<std::mutex> lock(doneMutex);
+	doneCond.wait(lock, [&remaining]() { return remaining == 0; });
+}
+
+void DecodePool::workerLoop()
+{
+	while (true)
+	{
+		std::function<void()> job;
+		{
+			std::unique_lock<std::mutex> lock(m_queueMutex);
+			m_queueCond.wait(lock, [this]() { return m_stop || !m_queue.empty(); });
+
+			// queued jobs are still run on shutdown, their callers are waiting for them
+			if (m_queue.empty())
+				break;
+
+			job = std::move(m_queue.front());
+			m_queue.pop_front();
+		}
+		job();
+	}
+}
+
+NS_VFS_END
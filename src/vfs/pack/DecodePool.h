@@ -0,0 +1,45 @@
+#pragma once
+
+#include "../Common.h"
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+NS_VFS_BEGIN
+
+// Worker threads started once and shared by the streams of a pack file system, so large reads split their
+// blocks over them without starting threads of their own
+class DecodePool
+{
+public:
+
+    // Starts up to threads workers, fewer if the system refuses to start more
+    explicit DecodePool(uint32_t threads);
+
+    ~DecodePool();
+
+    DecodePool(const DecodePool&) = delete;
+
+    DecodePool& operator=(const DecodePool&) = delete;
+
+    uint32_t threads() const { return uint32_t(m_workers.size()); }
+
+    // Calls task with 0 to count - 1, spread over the workers and the calling thread, and returns once every
+    // call returned. Runs them all on the calling thread when no worker could be started.
+    void run(uint32_t count, const std::function<void(uint32_t)>& task);
+
+private:
+
+    void workerLoop();
+
+private:
+    std::mutex m_queueMutex;
+    std::condition_variable m_queueCond;
+    std::deque<std::function<void()>> m_queue;
+    std::vector<std::thread> m_workers;
+    bool m_stop;
+};
+
+NS_VFS_END
@@ -0,0 +1,133 @@
+#include "InflateIndex.h"
+#include <algorithm>
+#include <string.h>
+
+NS_VFS_BEGIN
+
+template<typename T>
+static void putValue(std::string& out, T value)
+{
+	out.append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template<typename T>
+static bool getValue(const char*& in, const char* end, T& value)
+{
+	if (end - in < (ptrdiff_t)sizeof(T))
+		return false;
+	memcpy(&value, in, sizeof(T));
+	in += sizeof(T);
+	return true;
+}
+
+InflateIndex::InflateIndex(uint64_t spacing)
+	: m_spacing(std::max<uint64_t>(spacing, 1))
+	, m_complete(false)
+	, m_size(UINT64_MAX)
+{
+}
+
+bool InflateIndex::wants(uint64_t out) const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	if (m_complete)
+		return false;
+	uint64_t last = m_checkpoints.empty() ? 0 : m_checkpoints.back().out;
+	return out >= last + m_spacing;
+}
+
+void InflateIndex::add(Checkpoint&& checkpoint)
+{
+	// another stream may have added one in the meantime
+	std::lock_guard<std::mutex> lock(m_mutex);
+	uint64_t last = m_checkpoints.empty() ? 0 : m_checkpoints.back().out;
+	if (checkpoint.out >= last + m_spacing)
+		m_checkpoints.push_back(std::move(checkpoint));
+}
+
+const InflateIndex::Checkpoint* InflateIndex::find(uint64_t out) const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	auto it = std::upper_bound(m_checkpoints.begin(), m_checkpoints.end(), out, [](uint64_t out, const Checkpoint& checkpoint) {
+		return out < checkpoint.out;
+	});
+	return it == m_checkpoints.begin() ? nullptr : &*(it - 1);
+}
+
+size_t InflateIndex::size() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_checkpoints.size();
+}
+
+void InflateIndex::setComplete(uint64_t size)
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	m_complete = true;
+	m_size = size;
+}
+
+bool InflateIndex::isComplete() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_complete;
+}
+
+uint64_t InflateIndex::inflatedSize() const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	return m_size;
+}
+
+void InflateIndex::write(std::string& out) const
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+	putValue<uint64_t>(out, m_spacing);
+	putValue<uint8_t>(out, m_complete ? 1 : 0);
+	putValue<uint64_t>(out, m_size);
+	putValue<uint32_t>(out, (uint32_t)m_checkpoints.size());
+	for (const auto& checkpoint : m_checkpoints)
+	{
+		putValue<uint64_t>(out, checkpoint.in);
+		putValue<uint64_t>(out, checkpoint.out);
+		putValue<uint8_t>(out, checkpoint.bits);
+		putValue<uint8_t>(out, checkpoint.lastByte);
+		putValue<uint32_t>(out, (uint32_t)checkpoint.window.size());
+		out.append(checkpoint.window.data(), checkpoint.window.size());
+	}
+}
+
+std::shared_ptr<InflateIndex> InflateIndex::read(const char*& in, const char* end)
+{
+	uint64_t spacing;
+	uint8_t complete;
+	uint64_t size;
+	uint32_t count;
+	if (!getValue(in, end, spacing) || !getValue(in, end, complete) || !getValue(in, end, size) || !getValue(in, end, count))
+		return nullptr;
+
+	if (complete != 0 && size == UINT64_MAX)
+		return nullptr;
+
+	auto index = std::make_shared<InflateIndex>(spacing);
+	index->m_complete = complete != 0;
+	index->m_size = size;
+	for (uint32_t i = 0; i < count; ++i)
+	{
+		Checkpoint checkpoint;
+		uint32_t windowLen;
+		if (!getValue(in, end, checkpoint.in) || !getValue(in, end, checkpoint.out) || !getValue(in, end, checkpoint.bits)
+			|| !getValue(in, end, checkpoint.lastByte) || !getValue(in, end, windowLen))
+			return nullptr;
+
+		uint64_t last = index->m_checkpoints.empty() ? 0 : index->m_checkpoints.back().out;
+		if (checkpoint.bits > 7 || checkpoint.out < last || windowLen > 32768 || end - in < (ptrdiff_t)windowLen)
+			return nullptr;
+		checkpoint.window.assign(in, in + windowLen);
+		in += windowLen;
+		index->m_checkpoints.push_back(std::move(checkpoint));
+	}
+	return index;
+}
+
+NS_VFS_END
@@ -0,0 +1,66 @@
+#pragma once
+
+#include "../Common.h"
+#include <deque>
+#include <mutex>
+#include <vector>
+
+NS_VFS_BEGIN
+
+// Access points into one gzip entry, so a seek resumes inflating close to its target
+// instead of at the start. Filled in while the entry is first inflated.
+class InflateIndex
+{
+public:
+
+    struct Checkpoint
+    {
+        // compressed and inflated offsets of a deflate block boundary
+        uint64_t in;
+        uint64_t out;
+        // unread bits of the byte at in - 1
+        uint8_t bits;
+        uint8_t lastByte;
+        // inflated bytes preceding out
+        std::vector<char> window;
+    };
+
+    // spacing is the least distance in inflated bytes between two checkpoints
+    explicit InflateIndex(uint64_t spacing);
+
+    uint64_t spacing() const { return m_spacing; }
+
+    // Whether a block boundary at out should become a checkpoint
+    bool wants(uint64_t out) const;
+
+    void add(Checkpoint&& checkpoint);
+
+    // The last checkpoint at or before out, nullptr if there is none. Checkpoints are never removed.
+    const Checkpoint* find(uint64_t out) const;
+
+    size_t size() const;
+
+    // Set once the entry was inflated to its end, no checkpoints are missing after that. size is the
+    // inflated size, which the gzip trailer only holds modulo 4GB.
+    void setComplete(uint64_t size);
+
+    bool isComplete() const;
+
+    // UINT64_MAX until complete
+    uint64_t inflatedSize() const;
+
+    void write(std::string& out) const;
+
+    // nullptr if the data at in is truncated or malformed, in is advanced past the index otherwise
+    static std::shared_ptr<InflateIndex> read(const char*& in, const char* end);
+
+private:
+    mutable std::mutex m_mutex;
+    // deque, so pointers returned by find() stay valid while checkpoints are added
+    std::deque<Checkpoint> m_checkpoints;
+    uint64_t m_spacing;
+    bool m_complete;
+    uint64_t m_size;
+};
+
+NS_VFS_END
@@ -1,15 +1,41 @@
 #include "PackFileStream.h"
 #include <algorithm>
+#include <string.h>
 #include "PackUtils.h"
 #include "PackFileSystem.h"
 
 NS_VFS_BEGIN
 
+// decoded bytes kept around the read position
+static const size_t WINDOW_SIZE = 64 * 1024;
+static const size_t INPUT_CHUNK_SIZE = 64 * 1024;
+// entries at least this long get a reader thread, which stays at most PIPELINE_DEPTH chunks ahead
+static const uint64_t PIPELINE_THRESHOLD = 4 * 1024 * 1024;
+static const size_t PIPELINE_CHUNK_SIZE = 256 * 1024;
+static const size_t PIPELINE_DEPTH = 4;
+// a read is split over the decode pool only in parts of at least this many blocks
+static const uint64_t PARALLEL_MIN_BLOCKS = 4;
+
 PackFileStream::PackFileStream()
-	: m_offset(0)
-	, m_realData(0)
-	, m_realDataLen(0)
+	: m_realData(0)
 	, m_rawOffset(0)
+	, m_rawLen(0)
+	, m_dataSecret(0)
+	, m_windowStart(0)
+	, m_windowLen(0)
+	, m_inflateEnd(false)
+	, m_sizeExact(true)
+	, m_sizeMismatch(false)
+	, m_inputData(nullptr)
+	, m_inputLen(0)
+	, m_inputPos(0)
+	, m_lastInputByte(0)
+	, m_rawRead(0)
+	, m_blockSize(0)
+	, m_cachedBlock(UINT64_MAX)
+	, m_handle(native::invalidHandle())
+	, m_readerDone(false)
+	, m_stopReader(false)
 {
 }
 
@@ -23,33 +49,38 @@ bool PackFileStream::open(const std::string& path, FileStream::Mode mode)
 	return false;
 }
 
-bool PackFileStream::open(const std::string& path, const PackFileInfo& fileInfo, uint32_t dataSecret)
+bool PackFileStream::open(const std::string& path, const PackFileInfo& fileInfo, uint32_t dataSecret,
+	uint64_t inflateThreshold, std::shared_ptr<MappedFile> mapped, std::shared_ptr<InflateIndex> index)
 {
 	if (fileInfo.length <= 0)
 	{
 		m_realData = (uint8_t*)malloc(1);
-		m_realDataLen = 0;
+		setSpan(m_realData, 0);
 		return true;
 	}
 
+	if (fileInfo.blockSize > 0)
+		return openBlocks(path, fileInfo, dataSecret, mapped);
+
 	if (!m_fs.open(path, FileStream::Mode::READ))
 		return false;
 
 	if (fileInfo.compressionType == PackFileCompressionType::None)
 	{
-		m_realDataLen = fileInfo.length;
+		m_length = fileInfo.length;
 		m_rawOffset = fileInfo.offset;
 		if (dataSecret == 0)
 		{
 			return true;
 		}
 
-		m_realData = (uint8_t*)malloc(m_realDataLen);
+		m_realData = (uint8_t*)malloc(m_length);
 		m_fs.seek(fileInfo.offset, FileStream::SeekOrigin::SET);
 		if (m_fs.read(m_realData, fileInfo.length) == fileInfo.length)
 		{
 			m_fs.close();
-			pack::xorContent(dataSecret, (char*)m_realData, m_realDataLen);
+			pack::xorContent(dataSecret, (char*)m_realData, m_length);
+			setSpan(m_realData, m_length);
 			return true;
 		}
 		else
@@ -58,6 +89,11 @@ bool PackFileStream::open(const std::string& path, const PackFileInfo& fileInfo,
 			return false;
 		}
 	}
+	else if (fileInfo.compressionType == PackFileCompressionType::Gzip && fileInfo.length > inflateThreshold)
+	{
+		m_fs.close();
+		return openStreaming(path, fileInfo, dataSecret, mapped, index);
+	}
 	// unzip
 	else if (fileInfo.compressionType == PackFileCompressionType::Gzip)
 	{
@@ -73,92 +109,516 @@ bool PackFileStream::open(const std::string& path, const PackFileInfo& fileInfo,
 		pack::xorContent(dataSecret, &data[0], fileInfo.length);
 
 		int errCode = 0;
-		m_realData = (uint8_t*)pack::decompressData(&data[0], fileInfo.length, m_realDataLen, &errCode);
+		uint64_t dataLen = 0;
+		m_realData = (uint8_t*)pack::decompressData(&data[0], fileInfo.length, dataLen, &errCode);
 		if (m_realData)
+		{
+			setSpan(m_realData, dataLen);
 			return true;
+		}
 		
 		printf("unzip error code: %d\n", errCode);
 	}
 	return false;
 }
 
-void PackFileStream::close()
+bool PackFileStream::openStreaming(const std::string& path, const PackFileInfo& fileInfo, uint32_t dataSecret, std::shared_ptr<MappedFile> mapped,
+	std::shared_ptr<InflateIndex> index)
 {
-	if (m_realData)
+	// the smallest gzip member is 18 bytes
+	if (fileInfo.length < 18)
+		return false;
+
+	m_rawOffset = fileInfo.offset;
+	m_rawLen = fileInfo.length;
+	m_dataSecret = dataSecret;
+	m_index = index;
+	if (mapped && mapped->size() >= fileInfo.offset + fileInfo.length)
+		m_mapped = mapped;
+	else if (!m_fs.open(path, FileStream::Mode::READ))
+		return false;
+
+	// the gzip trailer ends with the inflated size modulo 4GB, which is the size unless the entry could inflate
+	// past 4GB. Deflate expands at most 1032 times. A complete index knows the size of any entry.
+	char trailer[4];
+	if (!readRaw(m_rawLen - 4, trailer, 4))
 	{
-		free(m_realData);
-		m_realData = nullptr;
+		close();
+		return false;
 	}
-	m_realDataLen = 0;
-	m_fs.close();
+	pack::xorContent(dataSecret, trailer, 4, m_rawLen - 4);
+	m_length = uint64_t((uint8_t)trailer[0]) | (uint64_t((uint8_t)trailer[1]) << 8)
+		| (uint64_t((uint8_t)trailer[2]) << 16) | (uint64_t((uint8_t)trailer[3]) << 24);
+	m_sizeExact = m_rawLen <= (uint64_t(1) << 32) / 1032;
+	if (m_index && m_index->isComplete())
+	{
+		m_length = m_index->inflatedSize();
+		m_sizeExact = true;
+	}
+
+	m_inflater = std::make_unique<pack::Inflater>();
+	m_window.resize(WINDOW_SIZE);
+	if (!restart())
+	{
+		close();
+		return false;
+	}
+	return true;
 }
 
-uint64_t PackFileStream::seek(uint64_t offset, SeekOrigin origin)
+bool PackFileStream::openBlocks(const std::string& path, const PackFileInfo& fileInfo, uint32_t dataSecret, std::shared_ptr<MappedFile> mapped)
+{
+	if (!fileInfo.blocks)
+		return false;
+
+	m_rawOffset = fileInfo.offset;
+	m_rawLen = fileInfo.length;
+	m_length = fileInfo.size;
+	m_dataSecret = dataSecret;
+	m_blockSize = fileInfo.blockSize;
+	m_cachedBlock = UINT64_MAX;
+	// positional reads, so blocks can be read from several threads
+	if (mapped && mapped->size() >= fileInfo.offset + fileInfo.length)
+		m_mapped = mapped;
+	else if ((m_handle = native::openHandle(path, false)) == native::invalidHandle())
+		return false;
+
+	m_blocks = fileInfo.blocks;
+	return true;
+}
+
+bool PackFileStream::decodeBlock(uint64_t block, char* out) const
 {
-	if (origin == SeekOrigin::CUR)
+	uint64_t storedBegin = block > 0 ? (*m_blocks)[block - 1] : 0;
+	uint64_t storedLen = (*m_blocks)[block] - storedBegin;
+	uint64_t outLen = std::min<uint64_t>(m_blockSize, m_length - block * m_blockSize);
+
+	const char* stored = nullptr;
+	std::vector<char> buffer;
+	if (m_mapped && m_dataSecret == 0)
 	{
-		m_offset += offset;
+		stored = (const char*)m_mapped->data() + m_rawOffset + storedBegin;
 	}
-	else if (origin == SeekOrigin::END)
+	else
 	{
-		if (m_realDataLen < offset)
-			return 0;
+		buffer.resize(storedLen);
+		if (m_mapped)
+			memcpy(buffer.data(), m_mapped->data() + m_rawOffset + storedBegin, storedLen);
+		else if (native::readAt(m_handle, buffer.data(), storedLen, m_rawOffset + storedBegin) != (int64_t)storedLen)
+			return false;
+		pack::xorContent(m_dataSecret, buffer.data(), storedLen, storedBegin);
+		stored = buffer.data();
+	}
 
-		m_offset = m_realDataLen - offset;
+	// blocks compression did not shrink are stored as they are
+	if (storedLen == outLen)
+	{
+		memcpy(out, stored, outLen);
+		return true;
 	}
-	else if (origin == SeekOrigin::SET)
+	return pack::decompressBlock(stored, storedLen, out, outLen);
+}
+
+uint64_t PackFileStream::decodeBlocks(uint64_t first, uint64_t last, char* out) const
+{
+	uint64_t count = last - first;
+	uint64_t partCount = m_decodePool ? std::min<uint64_t>(m_decodePool->threads() + 1, count / PARALLEL_MIN_BLOCKS) : 1;
+	if (partCount <= 1)
 	{
-		m_offset = offset;
+		for (uint64_t block = first; block < last; ++block)
+		{
+			if (!decodeBlock(block, out + (block - first) * m_blockSize))
+				return block;
+		}
+		return last;
 	}
 
-	return m_offset;
+	// each part is a contiguous run of blocks
+	uint64_t perPart = (count + partCount - 1) / partCount;
+	std::vector<uint64_t> failed(partCount, last);
+	m_decodePool->run(uint32_t(partCount), [&](uint32_t part) {
+		uint64_t end = std::min(last, first + (part + 1) * perPart);
+		for (uint64_t block = first + part * perPart; block < end; ++block)
+		{
+			if (!decodeBlock(block, out + (block - first) * m_blockSize))
+			{
+				failed[part] = block;
+				break;
+			}
+		}
+	});
+	return *std::min_element(failed.begin(), failed.end());
 }
 
-uint64_t PackFileStream::read(void* buf, uint64_t size)
+bool PackFileStream::cacheBlock(uint64_t block)
+{
+	if (m_cachedBlock == block)
+		return true;
+
+	m_window.resize(m_blockSize);
+	m_cachedBlock = decodeBlock(block, m_window.data()) ? block : UINT64_MAX;
+	return m_cachedBlock == block;
+}
+
+uint64_t PackFileStream::readBlocks(void* buf, uint64_t size)
 {
-	if (size == 0 || m_offset >= static_cast<int64_t>(m_realDataLen))
+	if (size == 0 || m_offset >= static_cast<int64_t>(m_length))
 		return 0;
 
-	uint64_t readLen = std::min(size, m_realDataLen - m_offset);
-	if (readLen > 0)
+	uint64_t begin = m_offset;
+	uint64_t end = begin + std::min<uint64_t>(size, m_length - begin);
+	uint64_t last = (end - 1) / m_blockSize;
+	// only the first and the last block can be partly read, whole blocks are decoded straight into buf
+	uint64_t wholeEnd = end == std::min<uint64_t>((last + 1) * m_blockSize, m_length) ? last + 1 : last;
+
+	uint64_t copied = 0;
+	for (uint64_t block = begin / m_blockSize; block <= last;)
 	{
-		if (m_realData)
+		uint64_t blockBegin = block * m_blockSize;
+		uint64_t blockEnd = std::min<uint64_t>(blockBegin + m_blockSize, m_length);
+		if (blockBegin >= begin && block < wholeEnd)
 		{
-			::memcpy(buf, m_realData + m_offset, readLen);
-			m_offset += readLen;
-			return readLen;
+			uint64_t decoded = decodeBlocks(block, wholeEnd, (char*)buf + (blockBegin - begin));
+			copied = std::min<uint64_t>(decoded * m_blockSize, end) - begin;
+			if (decoded != wholeEnd)
+				break;
+			block = wholeEnd;
 		}
 		else
 		{
-			m_fs.seek(m_offset + m_rawOffset, FileStream::SeekOrigin::SET);
-			uint64_t result = m_fs.read(buf, readLen);
-			m_offset += result;
-			return result;
+			if (!cacheBlock(block))
+				break;
+			uint64_t from = std::max(begin, blockBegin);
+			uint64_t to = std::min(end, blockEnd);
+			::memcpy((char*)buf + (from - begin), m_window.data() + (from - blockBegin), to - from);
+			copied = to - begin;
+			++block;
+		}
+	}
+
+	m_offset += copied;
+	return copied;
+}
+
+bool PackFileStream::readRaw(uint64_t pos, char* buf, uint64_t len)
+{
+	if (m_mapped)
+	{
+		memcpy(buf, m_mapped->data() + m_rawOffset + pos, len);
+		return true;
+	}
+	m_fs.seek(m_rawOffset + pos, FileStream::SeekOrigin::SET);
+	return m_fs.read(buf, len) == len;
+}
+
+bool PackFileStream::restart(const InflateIndex::Checkpoint* checkpoint)
+{
+	stopReader();
+	m_chunks.clear();
+	m_windowStart = checkpoint ? checkpoint->out : 0;
+	m_windowLen = 0;
+	m_inflateEnd = false;
+	m_inputData = nullptr;
+	m_inputLen = 0;
+	m_inputPos = checkpoint ? checkpoint->in : 0;
+	m_rawRead = m_inputPos;
+	if (checkpoint ? !m_inflater->resume(checkpoint->bits, checkpoint->lastByte, checkpoint->window.data(), checkpoint->window.size()) : !m_inflater->init())
+		return false;
+
+	// an unencrypted mapping is inflated in place, there is nothing to read ahead
+	if (m_rawLen >= PIPELINE_THRESHOLD && !(m_mapped && m_dataSecret == 0))
+	{
+		m_readerDone = false;
+		m_stopReader = false;
+		m_reader = std::thread(&PackFileStream::readerLoop, this, m_rawRead);
+	}
+	return true;
+}
+
+void PackFileStream::readerLoop(uint64_t pos)
+{
+	while (pos < m_rawLen)
+	{
+		{
+			std::unique_lock<std::mutex> lock(m_readerMutex);
+			m_readerCond.wait(lock, [this]() { return m_stopReader || m_chunks.size() < PIPELINE_DEPTH; });
+			if (m_stopReader)
+				break;
+		}
+
+		std::vector<char> chunk((size_t)std::min<uint64_t>(PIPELINE_CHUNK_SIZE, m_rawLen - pos));
+		if (!readRaw(pos, chunk.data(), chunk.size()))
+			break;
+		pack::xorContent(m_dataSecret, chunk.data(), chunk.size(), pos);
+		pos += chunk.size();
+
+		std::lock_guard<std::mutex> lock(m_readerMutex);
+		m_chunks.push_back(std::move(chunk));
+		m_readerCond.notify_all();
+	}
+
+	std::lock_guard<std::mutex> lock(m_readerMutex);
+	m_readerDone = true;
+	m_readerCond.notify_all();
+}
+
+void PackFileStream::stopReader()
+{
+	if (!m_reader.joinable())
+		return;
+
+	{
+		std::lock_guard<std::mutex> lock(m_readerMutex);
+		m_stopReader = true;
+		m_readerCond.notify_all();
+	}
+	m_reader.join();
+}
+
+bool PackFileStream::nextInput()
+{
+	m_inputPos = m_rawRead;
+	if (m_reader.joinable())
+	{
+		std::unique_lock<std::mutex> lock(m_readerMutex);
+		m_readerCond.wait(lock, [this]() { return m_readerDone || !m_chunks.empty(); });
+		if (m_chunks.empty())
+			return false;
+		m_input.swap(m_chunks.front());
+		m_chunks.pop_front();
+		m_readerCond.notify_all();
+		m_rawRead += m_input.size();
+	}
+	else if (m_rawRead >= m_rawLen)
+	{
+		return false;
+	}
+	else if (m_mapped && m_dataSecret == 0)
+	{
+		m_inputData = (const char*)m_mapped->data() + m_rawOffset + m_rawRead;
+		m_inputLen = (size_t)(m_rawLen - m_rawRead);
+		m_rawRead = m_rawLen;
+		return true;
+	}
+	else
+	{
+		m_input.resize((size_t)std::min<uint64_t>(INPUT_CHUNK_SIZE, m_rawLen - m_rawRead));
+		if (!readRaw(m_rawRead, m_input.data(), m_input.size()))
+			return false;
+		pack::xorContent(m_dataSecret, m_input.data(), m_input.size(), m_rawRead);
+		m_rawRead += m_input.size();
+	}
+
+	m_inputData = m_input.data();
+	m_inputLen = m_input.size();
+	return true;
+}
+
+void PackFileStream::addCheckpoint(uint8_t bits)
+{
+	InflateIndex::Checkpoint checkpoint;
+	checkpoint.in = m_inputPos;
+	checkpoint.out = m_windowStart + m_windowLen;
+	checkpoint.bits = bits;
+	checkpoint.lastByte = m_lastInputByte;
+	checkpoint.window.resize(pack::INFLATE_WINDOW_SIZE);
+	checkpoint.window.resize(m_inflater->dictionary(checkpoint.window.data()));
+	m_index->add(std::move(checkpoint));
+}
+
+bool PackFileStream::inflateTo(uint64_t offset)
+{
+	// the entry is corrupt or its index wrong, none of it can be trusted
+	if (m_sizeMismatch)
+		return false;
+
+	// going back, or further forward than the next checkpoint, resumes at the checkpoint before offset
+	if (offset < m_windowStart || (m_index && offset >= m_windowStart + m_windowLen + m_index->spacing()))
+	{
+		auto checkpoint = m_index ? m_index->find(offset) : nullptr;
+		if (checkpoint && (checkpoint->in > m_rawLen || (checkpoint->bits && checkpoint->in == 0)))
+			checkpoint = nullptr;
+
+		if (checkpoint && (offset < m_windowStart || checkpoint->out > m_windowStart + m_windowLen))
+		{
+			if (!restart(checkpoint))
+				return false;
+		}
+		else if (offset < m_windowStart && !restart())
+		{
+			return false;
+		}
+	}
+
+	// checkpoints are only taken while the index still has gaps, stopping at every block costs a little
+	bool indexing = m_index && !m_index->isComplete();
+
+	// windows passed over by a forward seek are inflated but never copied out
+	while (offset >= m_windowStart + m_windowLen)
+	{
+		if (m_inflateEnd)
+			return false;
+
+		m_windowStart += m_windowLen;
+		char* out = m_window.data();
+		size_t outLen = m_window.size();
+		while (outLen > 0 && !m_inflateEnd)
+		{
+			if (m_inputLen == 0 && !nextInput())
+			{
+				printf("unzip error: truncated entry\n");
+				m_inflateEnd = true;
+				break;
+			}
+
+			const char* input = m_inputData;
+			auto result = m_inflater->inflate(m_inputData, m_inputLen, out, outLen, indexing);
+			if (m_inputData != input)
+			{
+				m_inputPos += m_inputData - input;
+				m_lastInputByte = (uint8_t)m_inputData[-1];
+			}
+
+			uint8_t bits;
+			if (indexing && result == pack::Inflater::Result::Ok && m_inflater->atBlockBoundary(bits))
+			{
+				m_windowLen = m_window.size() - outLen;
+				if (m_index->wants(m_windowStart + m_windowLen))
+					addCheckpoint(bits);
+			}
+
+			if (result == pack::Inflater::Result::Error)
+			{
+				printf("unzip error: corrupt entry\n");
+				m_inflateEnd = true;
+			}
+			else if (result == pack::Inflater::Result::End)
+			{
+				m_inflateEnd = true;
+				uint64_t inflated = m_windowStart + m_window.size() - outLen;
+				if (m_sizeExact && inflated != m_length)
+				{
+					printf("unzip error: entry inflates to %llu bytes instead of %llu\n", (unsigned long long)inflated, (unsigned long long)m_length);
+					m_sizeMismatch = true;
+					break;
+				}
+				m_length = inflated;
+				m_sizeExact = true;
+				if (m_index)
+					m_index->setComplete(inflated);
+			}
 		}
+		if (m_sizeMismatch)
+			return false;
+		m_windowLen = m_window.size() - outLen;
+	}
+	return true;
+}
+
+void PackFileStream::settleSize()
+{
+	if (m_sizeExact || !m_inflater)
+		return;
+
+	// only inflating to the end tells the size, which completes the index too
+	inflateTo(UINT64_MAX);
+	m_sizeExact = true;
+}
+
+void PackFileStream::close()
+{
+	if (m_inflater)
+	{
+		stopReader();
+		m_chunks.clear();
+		m_inflater.reset();
+		m_mapped.reset();
+		m_index.reset();
+		m_window.clear();
+		m_input.clear();
+		m_windowStart = 0;
+		m_windowLen = 0;
+		m_inputLen = 0;
+		m_sizeExact = true;
+		m_sizeMismatch = false;
+	}
+
+	if (m_blocks)
+	{
+		if (m_handle != native::invalidHandle())
+			native::closeHandle(m_handle);
+		m_handle = native::invalidHandle();
+		m_blocks.reset();
+		m_mapped.reset();
+		m_window.clear();
+		m_cachedBlock = UINT64_MAX;
+	}
+
+	if (m_realData)
+	{
+		free(m_realData);
+		m_realData = nullptr;
 	}
-	return 0;
+	setSpan(nullptr, 0);
+	m_fs.close();
 }
 
-uint64_t PackFileStream::write(const void* buf, uint64_t size)
+uint64_t PackFileStream::seek(uint64_t offset, SeekOrigin origin)
+{
+	if (origin == SeekOrigin::END)
+		settleSize();
+	return SpanFileStream::seek(offset, origin);
+}
+
+uint64_t PackFileStream::read(void* buf, uint64_t size)
 {
-	return 0;
+	if (m_blocks)
+		return readBlocks(buf, size);
+
+	// the trailer size wraps at 4GB, the end of a streamed entry is where inflate ends
+	if (m_inflater)
+	{
+		uint64_t total = 0;
+		while (total < size && inflateTo(m_offset))
+		{
+			size_t pos = (size_t)(m_offset - m_windowStart);
+			size_t len = (size_t)std::min<uint64_t>(size - total, m_windowLen - pos);
+			::memcpy((char*)buf + total, m_window.data() + pos, len);
+			total += len;
+			m_offset += len;
+		}
+		return total;
+	}
+
+	if (m_realData)
+		return SpanFileStream::read(buf, size);
+
+	// plain entries without a secret are read from the pack as they are
+	if (size == 0 || m_offset >= static_cast<int64_t>(m_length))
+		return 0;
+
+	uint64_t readLen = std::min(size, m_length - m_offset);
+	m_fs.seek(m_offset + m_rawOffset, FileStream::SeekOrigin::SET);
+	uint64_t result = m_fs.read(buf, readLen);
+	m_offset += result;
+	return result;
 }
 
 uint64_t PackFileStream::tell()
 {
-	if (m_offset >= m_realDataLen)
-		return uint64_t(-1);
-	return m_offset;
+	settleSize();
+	return SpanFileStream::tell();
 }
 
 uint64_t PackFileStream::size()
 {
-	return m_realDataLen;
+	settleSize();
+	return SpanFileStream::size();
 }
 
 bool PackFileStream::isOpen() const
 {
-	return m_realData != nullptr || m_fs.isOpen();
+	return m_realData != nullptr || m_inflater != nullptr || m_blocks != nullptr || m_fs.isOpen();
 }
 
 NS_VFS_END
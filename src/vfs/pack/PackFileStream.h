@@ -1,11 +1,24 @@
 #pragma once
 
+#include "../SpanFileStream.h"
 #include "../native/NativeFileStream.h"
+#include "../native/MappedFile.h"
+#include "../native/NativeUtils.h"
+#include "InflateIndex.h"
+#include "DecodePool.h"
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
 
 NS_VFS_BEGIN
 
 struct PackFileInfo;
-class PackFileStream : public FileStream
+namespace pack { class Inflater; }
+
+// Entries read into memory on open are served by SpanFileStream, the others decode or read as they go
+class PackFileStream : public SpanFileStream
 {
 public:
 
@@ -15,7 +28,13 @@ public:
 
     virtual bool open(const std::string& path, FileStream::Mode mode) override;
 
-    bool open(const std::string& path, const PackFileInfo& fileInfo, uint32_t dataSecret);
+    // Entries compressed in blocks only decode the blocks a read touches, spread over several threads
+    // for large reads. Gzip entries longer than inflateThreshold are inflated as read() advances instead of on open,
+    // their raw bytes come from mapped when it is the mapping of path. Seeks resume at the
+    // checkpoints of index, which is extended as the entry is inflated.
+    bool open(const std::string& path, const PackFileInfo& fileInfo, uint32_t dataSecret,
+        uint64_t inflateThreshold = UINT64_MAX, std::shared_ptr<MappedFile> mapped = nullptr,
+        std::shared_ptr<InflateIndex> index = nullptr);
 
     virtual void close() override;
 
@@ -23,20 +42,96 @@ public:
 
     virtual uint64_t read(void* buf, uint64_t size) override;
 
-    virtual uint64_t write(const void* buf, uint64_t size) override;
-
     virtual uint64_t tell() override;
 
     virtual uint64_t size() override;
 
     virtual bool isOpen() const override;
 
+    // Decoded content is private to the stream, only stored entries of a mapped pack are views
+    virtual const uint8_t* view() const override { return nullptr; }
+
+    // Workers large reads of blocks are spread over, they are decoded on the reading thread alone without one
+    void setDecodePool(std::shared_ptr<DecodePool> pool) { m_decodePool = std::move(pool); }
+
+protected:
+
+    bool openStreaming(const std::string& path, const PackFileInfo& fileInfo, uint32_t dataSecret, std::shared_ptr<MappedFile> mapped,
+        std::shared_ptr<InflateIndex> index);
+
+    bool openBlocks(const std::string& path, const PackFileInfo& fileInfo, uint32_t dataSecret, std::shared_ptr<MappedFile> mapped);
+
+    uint64_t readBlocks(void* buf, uint64_t size);
+
+    // Safe to call from several threads at once
+    bool decodeBlock(uint64_t block, char* out) const;
+
+    // Decodes the blocks [first, last) into out, returns the first block that failed or last
+    uint64_t decodeBlocks(uint64_t first, uint64_t last, char* out) const;
+
+    bool cacheBlock(uint64_t block);
+
+    bool readRaw(uint64_t pos, char* buf, uint64_t len);
+
+    // Starts inflating over at the beginning of the entry, or at checkpoint
+    bool restart(const InflateIndex::Checkpoint* checkpoint = nullptr);
+
+    bool nextInput();
+
+    // Inflates until offset is inside the window, false past the end
+    bool inflateTo(uint64_t offset);
+
+    // Inflates to the end once if the size the entry was opened with may be wrong
+    void settleSize();
+
+    void readerLoop(uint64_t pos);
+
+    void addCheckpoint(uint8_t bits);
+
+    void stopReader();
+
 protected:
     NativeFileStream m_fs;
-    int64_t m_offset;
+    // owns the span of entries read into memory, m_length is the entry size in every mode
     uint8_t* m_realData;
-    uint64_t m_realDataLen;
     uint64_t m_rawOffset;
+
+    // streaming inflate, decoded bytes [m_windowStart, m_windowStart + m_windowLen) are in m_window
+    std::unique_ptr<pack::Inflater> m_inflater;
+    std::shared_ptr<MappedFile> m_mapped;
+    uint64_t m_rawLen;
+    uint32_t m_dataSecret;
+    std::vector<char> m_window;
+    uint64_t m_windowStart;
+    size_t m_windowLen;
+    bool m_inflateEnd;
+    // false while m_length is the trailer size of an entry that may inflate past 4GB
+    bool m_sizeExact;
+    // the end of the entry was not where its size said
+    bool m_sizeMismatch;
+    std::vector<char> m_input;
+    const char* m_inputData;
+    size_t m_inputLen;
+    // raw offset of m_inputData
+    uint64_t m_inputPos;
+    uint8_t m_lastInputByte;
+    uint64_t m_rawRead;
+    std::shared_ptr<InflateIndex> m_index;
+
+    // entries compressed in blocks, the last decoded block is kept in m_window
+    std::shared_ptr<const std::vector<uint64_t>> m_blocks;
+    uint32_t m_blockSize;
+    uint64_t m_cachedBlock;
+    NativeHandle m_handle;
+    std::shared_ptr<DecodePool> m_decodePool;
+
+    // large entries are read and decrypted by m_reader while the caller inflates
+    std::thread m_reader;
+    std::mutex m_readerMutex;
+    std::condition_variable m_readerCond;
+    std::deque<std::vector<char>> m_chunks;
+    bool m_readerDone;
+    bool m_stopReader;
 };
 
 NS_VFS_END
@@ -1,17 +1,23 @@
 ﻿#include "PackFileSystem.h"
 #include "PackUtils.h"
+#include <filesystem>
 #include <fstream>
 #include <set>
+#include <algorithm>
+#include <string.h>
 #include "../native/NativeFileStream.h"
 #include "PackFileStream.h"
+#include "../native/MappedFileStream.h"
 
 NS_VFS_BEGIN
 
-static const char signature[] = { 'P', 'A', 'C', 'K' };
-
 PackFileSystem::PackFileSystem(const std::string& archiveLocation, const std::string& mntpoint)
 	: FileSystem(archiveLocation, mntpoint)
     , m_dataSecret(0)
+    , m_mmapLimit(sizeof(void*) >= 8 ? UINT64_MAX : 0)
+    , m_inflateThreshold(256 * 1024)
+    , m_checkpointSpacing(1024 * 1024)
+    , m_decodeThreads(0)
 {
     m_fileSystemType = FileSystemType::PackFile;
     setReadonly(true);
@@ -34,55 +40,29 @@ bool PackFileSystem::init()
     auto fileSize = static_cast<uint64_t>(fs.size());
 
     // 头部信息读取
-    const std::streamsize header_length = 28;
-    char headBuffer[header_length];
+    char headBuffer[pack::HEADER_LENGTH];
 
     fs.seek(0, FileStream::SeekOrigin::SET);
-    if (fs.read(headBuffer, header_length) != header_length)
+    if (fs.read(headBuffer, pack::HEADER_LENGTH) != pack::HEADER_LENGTH)
     {
         printf("mount error: failed to read head data");
         return false;
     }
 
     // 头部信息校验
-    if (fileSize < header_length || memcmp(headBuffer, signature, sizeof(signature)) != 0)
-    {
-        printf("mount error: not a pack file");
+    PackHeader header;
+    if (!pack::readHeader(headBuffer, fileSize, header))
         return false;
-    }
-
-    uint64_t offset = sizeof(signature);
-
-    // version
-    auto version = pack::readUint32InBigEndian(&headBuffer[offset]);
-    offset += 4;
-
-    // 索引加密秘钥
-    auto indexSecret = pack::readUint32InBigEndian(&headBuffer[offset]);
-    offset += 4;
-
-    // 数据加密秘钥
-    auto dataSecret = pack::readUint32InBigEndian(&headBuffer[offset]);
-    offset += 4;
-
-    // 索引偏移
-    auto indexOffset = pack::readUint64InBigEndian(&headBuffer[offset]);
-    offset += 8;
 
-    // crc32校验码
-    auto crc32 = pack::readUint32InBigEndian(&headBuffer[offset]);
-    offset += 4;
-
-    if (version != 0)
+    if (header.version > pack::MAX_VERSION)
     {
-        printf("mount error: unsupported version %d", version);
+        printf("mount error: unsupported version %d", header.version);
         return false;
     }
 
-    m_dataSecret = dataSecret;
+    auto indexOffset = header.indexOffset;
+    m_dataSecret = header.dataSecret;
 
-    // 重置偏移值
-    offset = indexOffset;
     uint64_t length = fileSize;
 
     // 索引下标越界
@@ -123,39 +103,19 @@ bool PackFileSystem::init()
         return false;
     }
 
-    PackFileInfo fileInfo;
-    std::string filename;
-
-#define CHECK_SIZE(num) if(offset + num > indexBufLength) { printf("mount error: not a pack file"); return false; }
-    // 读取文件索引数据
-    offset = 0;
-    while (offset < indexBufLength)
-    {
-        CHECK_SIZE(8);
-        fileInfo.offset = pack::readUint64InBigEndian(&indexBuffer[offset]);
-        offset += 8;
-
-        CHECK_SIZE(4);
-        fileInfo.length = pack::readUint32InBigEndian(&indexBuffer[offset]);
-        offset += 4;
-
-        CHECK_SIZE(1);
-        auto nameLength = (uint8_t)indexBuffer[offset];
-        offset += 1;
-
-        CHECK_SIZE(1);
-        fileInfo.compressionType = (uint8_t)(indexBuffer[offset]);
-        offset += 1;
-
-        CHECK_SIZE(nameLength);
-        pack::xorContent(indexSecret, &indexBuffer[offset], nameLength);
-        filename.assign(&indexBuffer[offset], nameLength);
-        offset += nameLength;
+    if (!pack::readIndex(&indexBuffer[0], indexBufLength, header.version, header.indexSecret, [this](const std::string& name, const PackFileInfo& info) {
+        m_packFiles.insert(std::make_pair(name, info));
+    }))
+        return false;
 
-        m_packFiles.insert(std::make_pair(filename, fileInfo));
-    }
-#undef CHECK_SIZE
+    // streams of stored entries then share one mapping instead of opening the archive each
+    if (fileSize <= m_mmapLimit)
+        m_mapped = MappedFile::open(m_archiveLocation);
 
+    uint32_t decodeThreads = m_decodeThreads > 0 ? m_decodeThreads : std::thread::hardware_concurrency();
+    bool hasBlocks = std::any_of(m_packFiles.begin(), m_packFiles.end(), [](const auto& item) { return item.second.blockSize > 0; });
+    if (hasBlocks && decodeThreads > 1 && m_decodePool == nullptr)
+        m_decodePool = std::make_shared<DecodePool>(decodeThreads - 1);
     return true;
 }
 
@@ -207,8 +167,132 @@ std::unique_ptr<FileStream> PackFileSystem::openFileStream(const std::string& fi
         return nullptr;
     }
     
+    if (m_mapped && it->second.compressionType == PackFileCompressionType::None && m_dataSecret == 0)
+    {
+        auto mappedFs = std::make_unique<MappedFileStream>();
+        return mappedFs->open(m_mapped, it->second.offset, it->second.length) ? std::move(mappedFs) : nullptr;
+    }
+
+    // entries inflated as they are read share one index across their streams
+    std::shared_ptr<InflateIndex> index;
+    if (it->second.compressionType == PackFileCompressionType::Gzip && it->second.blockSize == 0
+        && it->second.length > m_inflateThreshold && m_checkpointSpacing > 0)
+    {
+        std::lock_guard<std::mutex> lock(m_indexMutex);
+        auto& slot = m_inflateIndexes[filePath];
+        if (!slot)
+            slot = std::make_shared<InflateIndex>(m_checkpointSpacing);
+        index = slot;
+    }
+
     auto fs = std::make_unique<PackFileStream>();
-    return fs->open(m_archiveLocation, it->second, m_dataSecret) ? std::move(fs) : nullptr;
+    fs->setDecodePool(m_decodePool);
+    return fs->open(m_archiveLocation, it->second, m_dataSecret, m_inflateThreshold, m_mapped, index) ? std::move(fs) : nullptr;
+}
+
+// version 2 records the inflated size of complete entries
+static const char INFLATE_INDEX_MAGIC[8] = { 'V', 'F', 'S', 'Z', 'I', 'D', 'X', '2' };
+
+bool PackFileSystem::saveInflateIndex(const std::string& path) const
+{
+    std::error_code ec;
+    uint64_t archiveSize = std::filesystem::file_size(m_archiveLocation, ec);
+    if (ec)
+        return false;
+
+    // entries are matched by name, position and length, the archive by its size
+    std::string data(INFLATE_INDEX_MAGIC, sizeof(INFLATE_INDEX_MAGIC));
+    data.append(reinterpret_cast<const char*>(&archiveSize), sizeof(archiveSize));
+    {
+        std::lock_guard<std::mutex> lock(m_indexMutex);
+        for (const auto& item : m_inflateIndexes)
+        {
+            const auto& info = m_packFiles.at(item.first);
+            uint32_t nameLen = (uint32_t)item.first.size();
+            data.append(reinterpret_cast<const char*>(&nameLen), sizeof(nameLen));
+            data.append(item.first);
+            data.append(reinterpret_cast<const char*>(&info.offset), sizeof(info.offset));
+            data.append(reinterpret_cast<const char*>(&info.length), sizeof(info.length));
+            item.second->write(data);
+        }
+    }
+
+    std::string tmpPath = path + ".tmp";
+    {
+        std::ofstream file(tmpPath, std::ios::binary | std::ios::trunc);
+        if (!file.is_open())
+            return false;
+        file.write(data.data(), (std::streamsize)data.size());
+        if (!file.good())
+            return false;
+    }
+
+    std::filesystem::rename(tmpPath, path, ec);
+    if (ec)
+        std::filesystem::remove(tmpPath, ec);
+    return !ec;
+}
+
+bool PackFileSystem::loadInflateIndex(const std::string& path)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open())
+        return false;
+    std::string data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+
+    std::error_code ec;
+    uint64_t archiveSize = std::filesystem::file_size(m_archiveLocation, ec);
+    const char* in = data.data() + sizeof(INFLATE_INDEX_MAGIC);
+    const char* end = data.data() + data.size();
+    if (ec || data.size() < sizeof(INFLATE_INDEX_MAGIC) + sizeof(archiveSize)
+        || memcmp(data.data(), INFLATE_INDEX_MAGIC, sizeof(INFLATE_INDEX_MAGIC)) != 0
+        || memcmp(in, &archiveSize, sizeof(archiveSize)) != 0)
+    {
+        std::cerr << "PackFileSystem: inflate index " << path << " does not belong to " << m_archiveLocation << std::endl;
+        return false;
+    }
+    in += sizeof(archiveSize);
+
+    std::unordered_map<std::string, std::shared_ptr<InflateIndex>> indexes;
+    while (in < end)
+    {
+        uint32_t nameLen;
+        PackFileInfo info;
+        if (end - in < (ptrdiff_t)sizeof(nameLen))
+            return false;
+        memcpy(&nameLen, in, sizeof(nameLen));
+        in += sizeof(nameLen);
+        if (end - in < (ptrdiff_t)(nameLen + sizeof(info.offset) + sizeof(info.length)))
+            return false;
+        std::string name(in, nameLen);
+        in += nameLen;
+        memcpy(&info.offset, in, sizeof(info.offset));
+        in += sizeof(info.offset);
+        memcpy(&info.length, in, sizeof(info.length));
+        in += sizeof(info.length);
+
+        auto index = InflateIndex::read(in, end);
+        if (!index)
+            return false;
+
+        // entries that moved keep no checkpoints
+        auto it = m_packFiles.find(name);
+        if (it != m_packFiles.end() && it->second.offset == info.offset && it->second.length == info.length
+            && it->second.compressionType == PackFileCompressionType::Gzip)
+            indexes[name] = index;
+    }
+
+    std::lock_guard<std::mutex> lock(m_indexMutex);
+    for (auto& item : indexes)
+        m_inflateIndexes[item.first] = item.second;
+    return true;
+}
+
+std::shared_ptr<InflateIndex> PackFileSystem::inflateIndex(const std::string& filePath) const
+{
+    std::lock_guard<std::mutex> lock(m_indexMutex);
+    auto it = m_inflateIndexes.find(filePath);
+    return it == m_inflateIndexes.end() ? nullptr : it->second;
 }
 
 bool PackFileSystem::removeFile(const std::string& filePath)
@@ -240,7 +324,21 @@ bool PackFileSystem::createDir(const std::string& dirPath)
 
 const std::string& PackFileSystem::basePath() const
 {
-    return "";
+    static std::string basePath("");
+    return basePath;
+}
+
+bool PackFileSystem::getRawExtent(const std::string& filePath, std::string& nativePath, uint64_t& offset, uint64_t& length) const
+{
+    // compressed or encrypted entries need decoding and can not be read in place
+    auto it = m_packFiles.find(filePath);
+    if (it == m_packFiles.end() || it->second.compressionType != PackFileCompressionType::None || m_dataSecret != 0)
+        return false;
+
+    nativePath = m_archiveLocation;
+    offset = it->second.offset;
+    length = it->second.length;
+    return true;
 }
 
 NS_VFS_END
@@ -1,24 +1,14 @@
 #pragma once
 
 #include "../FileSystem.h"
+#include "PackUtils.h"
+#include "../native/MappedFile.h"
+#include "InflateIndex.h"
+#include "DecodePool.h"
 #include <mutex>
 
 NS_VFS_BEGIN
 
-enum PackFileCompressionType
-{
-    None,
-    Gzip,
-    Unknown
-};
-
-struct PackFileInfo
-{
-    uint64_t offset;
-    uint32_t length;// file max size 4GB
-    uint8_t compressionType;
-};
-
 class PackFileSystem : public FileSystem
 {
 public:
@@ -45,9 +35,42 @@ public:
 
     virtual const std::string& basePath() const override;
 
+    virtual bool getRawExtent(const std::string& filePath, std::string& nativePath, uint64_t& offset, uint64_t& length) const override;
+
+    // Archives up to this size are mapped once by init() and their stored entries read from the mapping,
+    // 0 disables it. Unlimited on 64-bit builds, 0 on 32-bit ones where address space is short.
+    void setMmapLimit(uint64_t size) { m_mmapLimit = size; }
+
+    // Gzip entries with more compressed bytes than this are inflated as they are read rather than on open
+    void setInflateThreshold(uint64_t size) { m_inflateThreshold = size; }
+
+    // While such an entry is first inflated a checkpoint is kept every spacing inflated bytes,
+    // later seeks resume from the nearest one. 0 disables checkpoints.
+    void setCheckpointSpacing(uint64_t spacing) { m_checkpointSpacing = spacing; }
+
+    // Most threads a single read of an entry compressed in blocks decodes with, 0 uses one per hardware thread.
+    // The reading thread is one of them, the others are started by init() if the archive has such entries.
+    void setDecodeThreads(uint32_t count) { m_decodeThreads = count; }
+
+    // Persists the checkpoints gathered so far, loadInflateIndex() restores them for the same archive
+    bool saveInflateIndex(const std::string& path) const;
+
+    bool loadInflateIndex(const std::string& path);
+
+    // nullptr until the entry was opened for streaming or its checkpoints were loaded
+    std::shared_ptr<InflateIndex> inflateIndex(const std::string& filePath) const;
+
 private:
     std::unordered_map<std::string, PackFileInfo> m_packFiles;
     uint32_t m_dataSecret;
+    uint64_t m_mmapLimit;
+    uint64_t m_inflateThreshold;
+    std::shared_ptr<MappedFile> m_mapped;
+    uint64_t m_checkpointSpacing;
+    uint32_t m_decodeThreads;
+    std::shared_ptr<DecodePool> m_decodePool;
+    mutable std::mutex m_indexMutex;
+    std::unordered_map<std::string, std::shared_ptr<InflateIndex>> m_inflateIndexes;
 };
 
 NS_VFS_END
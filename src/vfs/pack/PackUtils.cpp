@@ -1,5 +1,7 @@
 #include "PackUtils.h"
 #include <assert.h>
+#include <string.h>
+#include <algorithm>
 
 #ifdef VFS_HAS_ZLIB
 #include "zlib.h"
@@ -12,6 +14,129 @@ NS_VFS_BEGIN
 
 namespace pack
 {
+	static const char signature[] = { 'P', 'A', 'C', 'K' };
+
+	bool readHeader(const char* buf, uint64_t len, PackHeader& header)
+	{
+		if (len < HEADER_LENGTH || memcmp(buf, signature, sizeof(signature)) != 0)
+		{
+			printf("mount error: not a pack file");
+			return false;
+		}
+
+		char headBuffer[HEADER_LENGTH];
+		memcpy(headBuffer, buf, HEADER_LENGTH);
+
+		uint64_t offset = sizeof(signature);
+
+		// version
+		header.version = readUint32InBigEndian(&headBuffer[offset]);
+		offset += 4;
+
+		// 索引加密秘钥
+		header.indexSecret = readUint32InBigEndian(&headBuffer[offset]);
+		offset += 4;
+
+		// 数据加密秘钥
+		header.dataSecret = readUint32InBigEndian(&headBuffer[offset]);
+		offset += 4;
+
+		// 索引偏移
+		header.indexOffset = readUint64InBigEndian(&headBuffer[offset]);
+		offset += 8;
+
+		// crc32校验码
+		header.crc32 = readUint32InBigEndian(&headBuffer[offset]);
+		return true;
+	}
+
+	bool readIndex(char* indexBuf, uint64_t len, uint32_t version, uint32_t indexSecret, const std::function<void(const std::string& name, const PackFileInfo& info)>& call)
+	{
+		std::string filename;
+
+#define CHECK_SIZE(num) if(offset + (num) > len) { printf("mount error: not a pack file"); return false; }
+		// 读取文件索引数据
+		uint64_t offset = 0;
+		while (offset < len)
+		{
+			PackFileInfo fileInfo;
+			uint32_t nameLength = 0;
+			if (version == 0)
+			{
+				CHECK_SIZE(8 + 4 + 1 + 1);
+				fileInfo.offset = readUint64InBigEndian(&indexBuf[offset]);
+				fileInfo.length = readUint32InBigEndian(&indexBuf[offset + 8]);
+				nameLength = (uint8_t)indexBuf[offset + 12];
+				fileInfo.compressionType = (uint8_t)(indexBuf[offset + 13]);
+				offset += 14;
+			}
+			else
+			{
+				CHECK_SIZE(8 + 8 + 8 + 1 + 4 + 2);
+				fileInfo.offset = readUint64InBigEndian(&indexBuf[offset]);
+				fileInfo.length = readUint64InBigEndian(&indexBuf[offset + 8]);
+				fileInfo.size = readUint64InBigEndian(&indexBuf[offset + 16]);
+				fileInfo.compressionType = (uint8_t)(indexBuf[offset + 24]);
+				fileInfo.blockSize = readUint32InBigEndian(&indexBuf[offset + 25]);
+				nameLength = ((uint32_t)(uint8_t)indexBuf[offset + 29] << 8) | (uint8_t)indexBuf[offset + 30];
+				offset += 31;
+			}
+
+			CHECK_SIZE(nameLength);
+			xorContent(indexSecret, &indexBuf[offset], nameLength);
+			filename.assign(&indexBuf[offset], nameLength);
+			offset += nameLength;
+
+			if (fileInfo.blockSize > 0)
+			{
+				// the block table has to add up to the stored length
+				uint64_t blockCount = fileInfo.size / fileInfo.blockSize + (fileInfo.size % fileInfo.blockSize != 0);
+				if (blockCount > (len - offset) / 4)
+				{
+					printf("mount error: not a pack file");
+					return false;
+				}
+				auto blocks = std::make_shared<std::vector<uint64_t>>(blockCount);
+				uint64_t end = 0;
+				for (uint64_t i = 0; i < blockCount; ++i)
+				{
+					end += readUint32InBigEndian(&indexBuf[offset]);
+					(*blocks)[i] = end;
+					offset += 4;
+				}
+				if (end != fileInfo.length || fileInfo.compressionType != PackFileCompressionType::Gzip)
+				{
+					printf("mount error: bad block table for %s", filename.c_str());
+					return false;
+				}
+				fileInfo.blocks = blocks;
+			}
+
+			call(filename, fileInfo);
+		}
+#undef CHECK_SIZE
+		return true;
+	}
+
+	bool decompressBlock(const char* inData, uint64_t inLen, char* out, uint64_t outLen)
+	{
+		Inflater inflater;
+		if (!inflater.init())
+			return false;
+
+		size_t in = (size_t)inLen;
+		size_t remaining = (size_t)outLen;
+		while (true)
+		{
+			size_t before = in + remaining;
+			auto result = inflater.inflate(inData, in, out, remaining);
+			if (result == Inflater::Result::End)
+				return remaining == 0;
+			if (result == Inflater::Result::Error || in + remaining == before)
+				return false;
+		}
+	}
+
 	char* decompressData(const char* inData, uint64_t inLen, uint64_t& outLen, int* errCode)
 	{
 		SET_ERR_CODE(0);
@@ -120,6 +245,161 @@ namespace pack
 		// Not implemented
 		assert(false);
 		return nullptr;
+#endif
+	}
+
+	char* compressData(const char* inData, uint64_t inLen, uint64_t& outLen, int level)
+	{
+		outLen = 0;
+
+#ifdef VFS_HAS_ZLIB
+		z_stream strm;
+		strm.zalloc = Z_NULL;
+		strm.zfree = Z_NULL;
+		strm.opaque = Z_NULL;
+		if (deflateInit2(&strm, level, Z_DEFLATED, MAX_WBITS + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+			return nullptr;
+
+		std::shared_ptr<z_stream> sp_strm(&strm, [](z_stream* strm) { (void)deflateEnd(strm); });
+
+		// avail_in is 32-bit, large inputs are fed in pieces
+		uint64_t bound = deflateBound(&strm, (uLong)std::min<uint64_t>(inLen, UINT32_MAX)) + inLen / UINT32_MAX * 64 + 64;
+		unsigned char* compressedData = (unsigned char*)malloc(bound);
+		if (compressedData == nullptr)
+			return nullptr;
+
+		strm.next_in = (Bytef*)inData;
+		strm.next_out = compressedData;
+		uint64_t remaining = inLen;
+		int ret = Z_OK;
+		do
+		{
+			strm.avail_in = (uInt)std::min<uint64_t>(remaining, UINT32_MAX);
+			remaining -= strm.avail_in;
+			strm.avail_out = (uInt)std::min<uint64_t>(bound - strm.total_out, UINT32_MAX);
+			ret = deflate(&strm, remaining == 0 ? Z_FINISH : Z_NO_FLUSH);
+		} while (ret == Z_OK);
+
+		if (ret != Z_STREAM_END)
+		{
+			free(compressedData);
+			return nullptr;
+		}
+		outLen = strm.total_out;
+		return (char*)compressedData;
+#else
+		// Not implemented
+		assert(false);
+		return nullptr;
+#endif
+	}
+
+	Inflater::Inflater()
+		: m_stream(nullptr)
+	{
+	}
+
+	Inflater::~Inflater()
+	{
+#ifdef VFS_HAS_ZLIB
+		if (m_stream)
+		{
+			inflateEnd((z_stream*)m_stream);
+			delete (z_stream*)m_stream;
+		}
+#endif
+	}
+
+	bool Inflater::init()
+	{
+#ifdef VFS_HAS_ZLIB
+		if (m_stream)
+			return inflateReset2((z_stream*)m_stream, MAX_WBITS + 16) == Z_OK;
+
+		auto strm = new z_stream();
+		strm->zalloc = Z_NULL;
+		strm->zfree = Z_NULL;
+		strm->opaque = Z_NULL;
+		strm->avail_in = 0;
+		strm->next_in = Z_NULL;
+		if (inflateInit2(strm, MAX_WBITS + 16) != Z_OK)
+		{
+			delete strm;
+			return false;
+		}
+		m_stream = strm;
+		return true;
+#else
+		return false;
+#endif
+	}
+
+	bool Inflater::resume(uint8_t bits, uint8_t lastByte, const char* dict, size_t dictLen)
+	{
+#ifdef VFS_HAS_ZLIB
+		if (!m_stream && !init())
+			return false;
+
+		auto strm = (z_stream*)m_stream;
+		if (inflateReset2(strm, -MAX_WBITS) != Z_OK)
+			return false;
+		if (bits && inflatePrime(strm, bits, lastByte >> (8 - bits)) != Z_OK)
+			return false;
+		return inflateSetDictionary(strm, (const Bytef*)dict, (uInt)dictLen) == Z_OK;
+#else
+		return false;
+#endif
+	}
+
+	bool Inflater::atBlockBoundary(uint8_t& bits) const
+	{
+#ifdef VFS_HAS_ZLIB
+		// 128: stopped at a block boundary, 64: that was the last block
+		auto strm = (const z_stream*)m_stream;
+		bits = strm->data_type & 7;
+		return (strm->data_type & 128) && !(strm->data_type & 64);
+#else
+		return false;
+#endif
+	}
+
+	size_t Inflater::dictionary(char* buf) const
+	{
+#ifdef VFS_HAS_ZLIB
+		uInt len = 0;
+		if (inflateGetDictionary((z_stream*)m_stream, (Bytef*)buf, &len) != Z_OK)
+			return 0;
+		return len;
+#else
+		return 0;
+#endif
+	}
+
+	Inflater::Result Inflater::inflate(const char*& in, size_t& inLen, char*& out, size_t& outLen, bool stopAtBlock)
+	{
+#ifdef VFS_HAS_ZLIB
+		auto strm = (z_stream*)m_stream;
+		strm->next_in = (Bytef*)in;
+		strm->avail_in = (uInt)std::min<size_t>(inLen, UINT32_MAX);
+		strm->next_out = (Bytef*)out;
+		strm->avail_out = (uInt)std::min<size_t>(outLen, UINT32_MAX);
+		int ret = ::inflate(strm, stopAtBlock ? Z_BLOCK : Z_NO_FLUSH);
+
+		size_t consumed = (const char*)strm->next_in - in;
+		size_t produced = (char*)strm->next_out - out;
+		in += consumed;
+		inLen -= consumed;
+		out += produced;
+		outLen -= produced;
+
+		if (ret == Z_STREAM_END)
+			return Result::End;
+		// Z_BUF_ERROR only means no progress was possible with the buffers given
+		if (ret == Z_OK || ret == Z_BUF_ERROR)
+			return Result::Ok;
+		return Result::Error;
+#else
+		return Result::Error;
 #endif
 	}
 }
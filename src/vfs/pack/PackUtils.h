@@ -2,9 +2,39 @@
 
 #include "../Common.h"
 #include <stdint.h>
+#include <vector>
 
 NS_VFS_BEGIN
 
+enum PackFileCompressionType
+{
+    None,
+    Gzip,
+    Unknown
+};
+
+struct PackFileInfo
+{
+    uint64_t offset;
+    // stored bytes, at most 4GB in version 0
+    uint64_t length;
+    uint8_t compressionType;
+    // version 1: inflated bytes, and for entries compressed in blocks of blockSize the end of each
+    // block relative to offset. A block stored as long as it inflates to is not compressed.
+    uint64_t size = 0;
+    uint32_t blockSize = 0;
+    std::shared_ptr<const std::vector<uint64_t>> blocks;
+};
+
+struct PackHeader
+{
+    uint32_t version;
+    uint32_t indexSecret;
+    uint32_t dataSecret;
+    uint64_t indexOffset;
+    uint32_t crc32;
+};
+
 namespace pack 
 {
     inline uint32_t readUint32InBigEndian(void* memory)
@@ -39,7 +69,8 @@ namespace pack
         return bint.c[0] == 1;
     }
 
-    inline void xorContent(uint32_t s, char* buf, size_t len)
+    // offset is the position of buf within the entry, so an entry can be decoded in pieces
+    inline void xorContent(uint32_t s, char* buf, size_t len, uint64_t offset = 0)
     {
         if (s == 0)
             return;
@@ -63,11 +94,70 @@ namespace pack
 
         for (size_t i = 0; i < len; ++i)
         {
-            buf[i] ^= sBuf[i % sizeof(s)];
+            buf[i] ^= sBuf[(offset + i) % sizeof(s)];
         }
     }
 
     char* decompressData(const char* inData, uint64_t inLen, uint64_t& outLen, int* errCode = nullptr);
+
+    // Gzip encodes inData, the result is released with free()
+    char* compressData(const char* inData, uint64_t inLen, uint64_t& outLen, int level = -1);
+
+    // Incremental gzip decoder, for entries inflated as they are read
+    class Inflater
+    {
+    public:
+
+        enum class Result
+        {
+            Ok,
+            End,
+            Error
+        };
+
+        Inflater();
+
+        ~Inflater();
+
+        bool init();
+
+        // Continues a gzip member from a deflate block boundary, without its header. bits of the
+        // byte before the resume point are still unread, dict is the output preceding it.
+        bool resume(uint8_t bits, uint8_t lastByte, const char* dict, size_t dictLen);
+
+        // Consumes input from in and fills out, both are advanced past the bytes used.
+        // stopAtBlock also returns at each deflate block boundary, see atBlockBoundary().
+        Result inflate(const char*& in, size_t& inLen, char*& out, size_t& outLen, bool stopAtBlock = false);
+
+        // True right after a block ended with more blocks to come, bits is the number of
+        // bits of the last consumed byte that belong to the next block
+        bool atBlockBoundary(uint8_t& bits) const;
+
+        // Copies up to 32KB of the most recent output, which the next blocks may refer back to
+        size_t dictionary(char* buf) const;
+
+    private:
+        void* m_stream;
+    };
+
+    static const size_t HEADER_LENGTH = 28;
+
+    // Version 0 index entries: offset u64, length u32, nameLen u8, compressionType u8, name.
+    // Version 1 index entries: offset u64, length u64, size u64, compressionType u8, blockSize u32,
+    // nameLen u16, name, then for blockSize > 0 the stored length u32 of each of its blocks.
+    static const uint32_t MAX_VERSION = 1;
+
+    // deflate refers back at most this far
+    static const size_t INFLATE_WINDOW_SIZE = 32768;
+
+    // Checks the signature and reads the header from the first HEADER_LENGTH bytes of buf
+    bool readHeader(const char* buf, uint64_t len, PackHeader& header);
+
+    // Calls call for every entry of the index, indexBuf is decrypted in place
+    bool readIndex(char* indexBuf, uint64_t len, uint32_t version, uint32_t indexSecret, const std::function<void(const std::string& name, const PackFileInfo& info)>& call);
+
+    // Inflates one gzip block of a version 1 entry, false unless it fills out exactly
+    bool decompressBlock(const char* inData, uint64_t inLen, char* out, uint64_t outLen);
 }
 
 NS_VFS_END